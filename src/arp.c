@@ -35,6 +35,9 @@
 #include <linux/if_packet.h>
 #include <linux/filter.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include "nk/log.h"
 #include "nk/io.h"
 #include "arp.h"
@@ -46,6 +49,9 @@
 #include "leasefile.h"
 #include "sockd.h"
 #include "netlink.h"
+#include "timer.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define ARP_MSG_SIZE 0x2a
 #define ARP_RETRANS_DELAY 5000 // ms
@@ -62,71 +68,99 @@ int arp_probe_max = 2000;          // maximum delay until repeated probe (ms)
 #define RATE_LIMIT_INTERVAL 60000  // delay between successive attempts
 #define DEFEND_INTERVAL 10000      // minimum interval between defensive ARPs
 
-static struct arp_data garp = {
-    .wake_ts = { -1, -1, -1, -1, -1 },
-    .send_stats = {{0,0},{0,0},{0,0}},
-    .last_conflict_ts = 0,
-    .gw_check_initpings = 0,
-    .arp_check_start_ts = 0,
-    .total_conflicts = 0,
-    .probe_wait_time = 0,
-    .reply_offset = 0,
-    .using_bpf = false,
-    .relentless_def = false,
-    .router_replied = false,
-    .server_replied = false,
-};
+static bool arp_relentless_def; // Don't give up defense no matter what.
 
-void set_arp_relentless_def(bool v) { garp.relentless_def = v; }
+void set_arp_relentless_def(bool v) { arp_relentless_def = v; }
 
-void arp_reply_clear(void)
+void arp_reply_clear(struct client_state_t cs[static 1])
 {
-    memset(&garp.reply, 0, sizeof garp.reply);
-    garp.reply_offset = 0;
+    memset(&cs->garp->reply, 0, sizeof cs->garp->reply);
 }
 
-void arp_reset_send_stats(void)
+void arp_reset_send_stats(struct client_state_t cs[static 1])
 {
     for (int i = 0; i < ASEND_MAX; ++i) {
-        garp.send_stats[i].ts = 0;
-        garp.send_stats[i].count = 0;
+        cs->garp->send_stats[i].ts = 0;
+        cs->garp->send_stats[i].count = 0;
     }
 }
 
 static int get_arp_basic_socket(struct client_state_t cs[static 1])
 {
     char resp;
-    int fd = request_sockd_fd("a", 1, &resp);
+    int fd = request_sockd_fd(cs, "a", 1, &resp);
     switch (resp) {
-        case 'A': garp.using_bpf = true; break;
-        case 'a': garp.using_bpf = false; break;
+        case 'A': cs->garp->using_bpf = true; break;
+        case 'a': cs->garp->using_bpf = false; break;
         default: suicide("%s: (%s) expected a or A sockd reply but got %c",
-                         client_config.interface, __func__, resp);
+                         cs->cfg->interface, __func__, resp);
     }
     cs->arp_is_defense = false;
     return fd;
 }
 
+#define ARP_RING_LEN (ARP_RING_BLOCK_SIZE * ARP_RING_BLOCK_NR)
+
+static void arp_ring_unmap(struct client_state_t cs[static 1])
+{
+    if (!cs->garp->ring)
+        return;
+    munmap(cs->garp->ring, ARP_RING_LEN);
+    cs->garp->ring = NULL;
+}
+
+static int arp_ring_map(struct client_state_t cs[static 1], int fd)
+{
+    void *p = mmap(NULL, ARP_RING_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    if (p == MAP_FAILED) {
+        log_warning("%s: (%s) Failed to map ARP receive ring: %s",
+                    cs->cfg->interface, __func__, strerror(errno));
+        return -1;
+    }
+    cs->garp->ring = p;
+    cs->garp->ring_block = 0;
+    cs->garp->ring_budget = 0;
+    cs->garp->ring_pkts_left = 0;
+    cs->garp->ring_pkt_off = 0;
+    return 0;
+}
+
+// sockd is asked to put a TPACKET_V3 receive ring on the defense socket so
+// that an ARP flood can be consumed without a syscall per frame.  If the
+// kernel does not support the ring or it cannot be mapped, we fall back to
+// a socket that is read with recvmmsg().
 static int get_arp_defense_socket(struct client_state_t cs[static 1])
 {
-    char buf[32];
-    size_t buflen = 0;
-    buf[0] = 'd';
-    buflen += 1;
-    memcpy(buf + buflen, &cs->clientAddr, sizeof cs->clientAddr);
-    buflen += sizeof cs->clientAddr;
-    memcpy(buf + buflen, client_config.arp, 6);
-    buflen += 6;
-    char resp;
-    int fd = request_sockd_fd(buf, buflen, &resp);
-    switch (resp) {
-        case 'D': garp.using_bpf = true; break;
-        case 'd': garp.using_bpf = false; break;
-        default: suicide("%s: (%s) expected d or D sockd reply but got %c",
-                         client_config.interface, __func__, resp);
+    for (bool want_ring = true;; want_ring = false) {
+        char buf[32];
+        size_t buflen = 0;
+        buf[0] = 'd';
+        buflen += 1;
+        memcpy(buf + buflen, &cs->clientAddr, sizeof cs->clientAddr);
+        buflen += sizeof cs->clientAddr;
+        memcpy(buf + buflen, cs->cfg->arp, 6);
+        buflen += 6;
+        buf[buflen] = want_ring;
+        buflen += 1;
+        char resp;
+        bool ring = false;
+        int fd = request_sockd_fd(cs, buf, buflen, &resp);
+        switch (resp) {
+            case 'R': cs->garp->using_bpf = true; ring = true; break;
+            case 'r': cs->garp->using_bpf = false; ring = true; break;
+            case 'D': cs->garp->using_bpf = true; break;
+            case 'd': cs->garp->using_bpf = false; break;
+            default: suicide("%s: (%s) expected d, D, r, or R sockd reply but got %c",
+                             cs->cfg->interface, __func__, resp);
+        }
+        if (ring && arp_ring_map(cs, fd) < 0) {
+            close(fd);
+            continue;
+        }
+        cs->arp_is_defense = true;
+        return fd;
     }
-    cs->arp_is_defense = true;
-    return fd;
 }
 
 static void arp_min_close_fd(struct client_state_t cs[static 1])
@@ -137,13 +171,17 @@ static void arp_min_close_fd(struct client_state_t cs[static 1])
     close(cs->arpFd);
     cs->arpFd = -1;
     cs->arp_is_defense = false;
+    cs->garp->rbatch_num = cs->garp->rbatch_next = 0;
+    arp_ring_unmap(cs);
+    cs->garp->tx_seq = cs->garp->tx_stamped = 0;
+    memset(cs->garp->pings, 0, sizeof cs->garp->pings);
 }
 
 void arp_close_fd(struct client_state_t cs[static 1])
 {
     arp_min_close_fd(cs);
     for (int i = 0; i < AS_MAX; ++i)
-        garp.wake_ts[i] = -1;
+        ntimer_disarm(&cs->garp->wake_ts[i]);
 }
 
 static int arp_open_fd(struct client_state_t cs[static 1], bool defense)
@@ -155,11 +193,11 @@ static int arp_open_fd(struct client_state_t cs[static 1], bool defense)
                         : get_arp_basic_socket(cs);
     if (cs->arpFd < 0) {
         log_error("%s: (%s) Failed to create socket: %s",
-                  client_config.interface, __func__, strerror(errno));
+                  cs->cfg->interface, __func__, strerror(errno));
         return -1;
     }
-    epoll_add(cs->epollFd, cs->arpFd);
-    arp_reply_clear();
+    epoll_add_tag(cs->epollFd, cs->arpFd, cs->slot);
+    arp_reply_clear(cs);
     return 0;
 }
 
@@ -169,20 +207,20 @@ static int arp_send(struct client_state_t cs[static 1],
     int ret = -1;
     struct sockaddr_ll addr = {
         .sll_family = AF_PACKET,
-        .sll_ifindex = client_config.ifindex,
+        .sll_ifindex = cs->cfg->ifindex,
         .sll_halen = 6,
     };
-    memcpy(addr.sll_addr, client_config.arp, 6);
+    memcpy(addr.sll_addr, cs->cfg->arp, 6);
 
     if (cs->arpFd < 0) {
         log_warning("%s: arp: Send attempted when no ARP fd is open.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return ret;
     }
 
-    if (check_carrier()) {
+    if (check_carrier(cs)) {
         log_error("%s: (%s) carrier down; sendto would fail",
-                  client_config.interface, __func__);
+                  cs->cfg->interface, __func__);
         ret = -99;
         goto carrier_down;
     }
@@ -191,16 +229,81 @@ static int arp_send(struct client_state_t cs[static 1],
     if (ret < 0 || (size_t)ret != sizeof *arp) {
         if (ret < 0)
             log_error("%s: (%s) sendto failed: %s",
-                      client_config.interface, __func__, strerror(errno));
+                      cs->cfg->interface, __func__, strerror(errno));
         else
             log_error("%s: (%s) sendto short write: %d < %zu",
-                      client_config.interface, __func__, ret, sizeof *arp);
+                      cs->cfg->interface, __func__, ret, sizeof *arp);
 carrier_down:
         return ret;
     }
+    cs->garp->tx_seq++;
     return 0;
 }
 
+// Remember a ping so that its reply can be timed.  The oldest ping that
+// is remembered is forgotten if there is no free slot.
+static void arp_ping_track(struct client_state_t cs[static 1], uint32_t dip)
+{
+    struct arp_ping *p = &cs->garp->pings[0];
+    for (size_t i = 1; i < ARP_PINGS_TIMED && p->dip; ++i) {
+        struct arp_ping *q = &cs->garp->pings[i];
+        if (!q->dip || (int32_t)(q->seq - p->seq) < 0)
+            p = q;
+    }
+    *p = (struct arp_ping){
+        .ns = rtt_now_ns(),
+        .seq = cs->garp->tx_seq - 1,
+        .dip = dip,
+    };
+}
+
+// Transmit timestamps are queued in the order that the frames were sent,
+// so the n-th one read belongs to the n-th frame sent on arpFd.  Returns
+// false if the error queue was empty.
+static bool arp_tx_stamps(struct client_state_t cs[static 1])
+{
+    bool any = false;
+    long long ts;
+    while (rtt_tx_ts_next(cs->arpFd, &ts)) {
+        any = true;
+        uint32_t seq = cs->garp->tx_stamped++;
+        if (ts < 0)
+            continue;
+        for (size_t i = 0; i < ARP_PINGS_TIMED; ++i) {
+            struct arp_ping *p = &cs->garp->pings[i];
+            if (p->dip && p->seq == seq) {
+                p->ns = ts;
+                break;
+            }
+        }
+    }
+    return any;
+}
+
+// Times a reply to one of our pings.  If more than one ping to the same
+// address is outstanding, the reply can't be matched to one of them, so
+// none of them are timed.
+static void arp_rtt_sample(struct client_state_t cs[static 1],
+                           long long rx_ns)
+{
+    if (cs->garp->reply.operation != htons(ARPOP_REPLY))
+        return;
+    uint32_t sip;
+    memcpy(&sip, cs->garp->reply.sip4, sizeof sip);
+    const struct arp_ping *hit = NULL;
+    int hits = 0;
+    for (size_t i = 0; i < ARP_PINGS_TIMED; ++i) {
+        struct arp_ping *p = &cs->garp->pings[i];
+        if (!p->dip || p->dip != sip)
+            continue;
+        hit = p;
+        ++hits;
+        p->dip = 0;
+    }
+    if (hits == 1)
+        rtt_sample(cs, RTT_ARP, sip, rx_ns - hit->ns);
+}
+
 #define BASE_ARPMSG() struct arpMsg arp = {                             \
         .h_proto = htons(ETH_P_ARP),                                    \
         .htype = htons(ARPHRD_ETHER),                                   \
@@ -209,9 +312,9 @@ carrier_down:
         .operation = htons(ARPOP_REQUEST),                              \
         .smac = {0},                                                    \
     };                                                                  \
-    memcpy(arp.h_source, client_config.arp, 6);                         \
+    memcpy(arp.h_source, cs->cfg->arp, 6);                         \
     memset(arp.h_dest, 0xff, 6);                                        \
-    memcpy(arp.smac, client_config.arp, 6)
+    memcpy(arp.smac, cs->cfg->arp, 6)
 
 // Returns 0 on success, -1 on failure.
 static int arp_ping(struct client_state_t cs[static 1], uint32_t test_ip)
@@ -222,8 +325,9 @@ static int arp_ping(struct client_state_t cs[static 1], uint32_t test_ip)
     int r = arp_send(cs, &arp);
     if (r < 0)
         return r;
-    garp.send_stats[ASEND_GW_PING].count++;
-    garp.send_stats[ASEND_GW_PING].ts = curms();
+    arp_ping_track(cs, test_ip);
+    cs->garp->send_stats[ASEND_GW_PING].count++;
+    cs->garp->send_stats[ASEND_GW_PING].ts = curms();
     return 0;
 }
 
@@ -234,12 +338,14 @@ static int arp_ip_anon_ping(struct client_state_t cs[static 1],
     BASE_ARPMSG();
     memcpy(arp.dip4, &test_ip, sizeof test_ip);
     log_line("%s: arp: Probing for hosts that may conflict with our lease...",
-             client_config.interface);
+             cs->cfg->interface);
     int r = arp_send(cs, &arp);
     if (r < 0)
         return r;
-    garp.send_stats[ASEND_COLLISION_CHECK].count++;
-    garp.send_stats[ASEND_COLLISION_CHECK].ts = curms();
+    cs->garp->send_stats[ASEND_COLLISION_CHECK].count++;
+    cs->garp->send_stats[ASEND_COLLISION_CHECK].ts = curms();
+    trace_event(cs, TEV_ARP_PROBE,
+                cs->garp->send_stats[ASEND_COLLISION_CHECK].count);
     return 0;
 }
 
@@ -251,25 +357,29 @@ static int arp_announcement(struct client_state_t cs[static 1])
     int r = arp_send(cs, &arp);
     if (r < 0)
         return r;
-    garp.send_stats[ASEND_ANNOUNCE].count++;
-    garp.send_stats[ASEND_ANNOUNCE].ts = curms();
+    cs->garp->send_stats[ASEND_ANNOUNCE].count++;
+    cs->garp->send_stats[ASEND_ANNOUNCE].ts = curms();
     return 0;
 }
 #undef BASE_ARPMSG
 
 // Checks to see if there is another host that has our assigned IP.
 int arp_check(struct client_state_t cs[static 1],
-              struct dhcpmsg packet[static 1])
+              const struct dhcp_optidx oi[static 1])
 {
-    memcpy(&garp.dhcp_packet, packet, sizeof (struct dhcpmsg));
+    // The packet is only a view into the receive buffer, so it must be
+    // kept for as long as the collision check runs.
+    dhcp_optidx_copy(&cs->garp->dhcp_optidx, &cs->garp->dhcp_packet, oi);
+    trace_event(cs, TEV_ARP_CHECK, 0);
     if (arp_open_fd(cs, false) < 0)
         return -1;
-    if (arp_ip_anon_ping(cs, garp.dhcp_packet.yiaddr) < 0)
+    if (arp_ip_anon_ping(cs, cs->garp->dhcp_packet.yiaddr) < 0)
         return -1;
-    garp.arp_check_start_ts = garp.send_stats[ASEND_COLLISION_CHECK].ts;
-    garp.probe_wait_time = arp_probe_wait;
-    garp.wake_ts[AS_COLLISION_CHECK] = garp.arp_check_start_ts
-                                       + garp.probe_wait_time;
+    cs->garp->arp_check_start_ts =
+        cs->garp->send_stats[ASEND_COLLISION_CHECK].ts;
+    cs->garp->probe_wait_time = arp_probe_wait;
+    ntimer_arm(&cs->garp->wake_ts[AS_COLLISION_CHECK],
+               cs->garp->arp_check_start_ts + cs->garp->probe_wait_time);
     return 0;
 }
 
@@ -278,20 +388,21 @@ int arp_gw_check(struct client_state_t cs[static 1])
 {
     if (arp_open_fd(cs, false) < 0)
         return -1;
-    garp.gw_check_initpings = garp.send_stats[ASEND_GW_PING].count;
-    garp.server_replied = false;
+    cs->garp->gw_check_initpings = cs->garp->send_stats[ASEND_GW_PING].count;
+    cs->garp->server_replied = false;
     cs->check_fingerprint = true;
     int r;
     if ((r = arp_ping(cs, cs->srcAddr)) < 0)
         return r;
     if (cs->routerAddr) {
-        garp.router_replied = false;
+        cs->garp->router_replied = false;
         if ((r = arp_ping(cs, cs->routerAddr)) < 0)
             return r;
     } else
-        garp.router_replied = true;
-    garp.wake_ts[AS_GW_CHECK] =
-        garp.send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY + 250;
+        cs->garp->router_replied = true;
+    ntimer_arm(&cs->garp->wake_ts[AS_GW_CHECK],
+               cs->garp->send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY
+               + 250);
     return 0;
 }
 
@@ -302,10 +413,10 @@ static int arp_get_gw_hwaddr(struct client_state_t cs[static 1])
         return -1;
     if (cs->routerAddr)
         log_line("%s: arp: Searching for dhcp server and gw addresses...",
-                 client_config.interface);
+                 cs->cfg->interface);
     else
         log_line("%s: arp: Searching for dhcp server address...",
-                 client_config.interface);
+                 cs->cfg->interface);
     cs->got_server_arp = 0;
     if (arp_ping(cs, cs->srcAddr) < 0)
         return -1;
@@ -315,8 +426,9 @@ static int arp_get_gw_hwaddr(struct client_state_t cs[static 1])
             return -1;
     } else
         cs->got_router_arp = 1;
-    garp.wake_ts[AS_GW_QUERY] =
-        garp.send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY + 250;
+    ntimer_arm(&cs->garp->wake_ts[AS_GW_QUERY],
+               cs->garp->send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY
+               + 250);
     return 0;
 }
 
@@ -328,10 +440,10 @@ int arp_set_defense_mode(struct client_state_t cs[static 1])
 static int arp_gw_success(struct client_state_t cs[static 1])
 {
     log_line("%s: arp: Network seems unchanged.  Resuming normal operation.",
-             client_config.interface);
+             cs->cfg->interface);
     if (arp_open_fd(cs, true) < 0)
         return ARPR_FAIL;
-    garp.wake_ts[AS_GW_CHECK] = -1;
+    ntimer_disarm(&cs->garp->wake_ts[AS_GW_CHECK]);
     if (arp_announcement(cs) < 0)
         return ARPR_FAIL;
     return ARPR_FREE;
@@ -339,31 +451,32 @@ static int arp_gw_success(struct client_state_t cs[static 1])
 
 // ARP validation functions that will be performed by the BPF if it is
 // installed.
-static int arp_validate_bpf(struct arpMsg *am)
+static int arp_validate_bpf(struct client_state_t cs[static 1],
+                            struct arpMsg *am)
 {
     if (am->h_proto != htons(ETH_P_ARP)) {
         log_warning("%s: arp: IP header does not indicate ARP protocol",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     if (am->htype != htons(ARPHRD_ETHER)) {
         log_warning("%s: arp: ARP hardware type field invalid",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     if (am->ptype != htons(ETH_P_IP)) {
         log_warning("%s: arp: ARP protocol type field invalid",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     if (am->hlen != 6) {
         log_warning("%s: arp: ARP hardware address length invalid",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     if (am->plen != 4) {
         log_warning("%s: arp: ARP protocol address length invalid",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     return 1;
@@ -376,18 +489,19 @@ static int arp_validate_bpf_defense(struct client_state_t cs[static 1],
 {
     if (memcmp(am->sip4, &cs->clientAddr, 4))
         return 0;
-    if (!memcmp(am->smac, client_config.arp, 6))
+    if (!memcmp(am->smac, cs->cfg->arp, 6))
         return 0;
     return 1;
 }
 
-static int arp_is_query_reply(struct arpMsg am[static 1])
+static int arp_is_query_reply(struct client_state_t cs[static 1],
+                              struct arpMsg am[static 1])
 {
     if (am->operation != htons(ARPOP_REPLY))
         return 0;
-    if (memcmp(am->h_dest, client_config.arp, 6))
+    if (memcmp(am->h_dest, cs->cfg->arp, 6))
         return 0;
-    if (memcmp(am->dmac, client_config.arp, 6))
+    if (memcmp(am->dmac, cs->cfg->arp, 6))
         return 0;
     return 1;
 }
@@ -403,9 +517,10 @@ int arp_defense_timeout(struct client_state_t cs[static 1], long long nowts)
 {
     (void)nowts; // Suppress warning; parameter necessary but unused.
     int ret = 0;
-    if (garp.wake_ts[AS_DEFENSE] != -1) {
-        log_line("%s: arp: Defending our lease IP.", client_config.interface);
-        garp.wake_ts[AS_DEFENSE] = -1;
+    if (cs->garp->wake_ts[AS_DEFENSE].ts != -1) {
+        log_line("%s: arp: Defending our lease IP.", cs->cfg->interface);
+        ntimer_disarm(&cs->garp->wake_ts[AS_DEFENSE]);
+        metrics_arp_defend(cs);
         ret = arp_announcement(cs);
     }
     return ret;
@@ -413,126 +528,138 @@ int arp_defense_timeout(struct client_state_t cs[static 1], long long nowts)
 
 int arp_gw_check_timeout(struct client_state_t cs[static 1], long long nowts)
 {
-    if (garp.send_stats[ASEND_GW_PING].count >= garp.gw_check_initpings + 6) {
-        if (garp.router_replied && !garp.server_replied)
+    if (cs->garp->send_stats[ASEND_GW_PING].count >=
+        cs->garp->gw_check_initpings + 6) {
+        if (cs->garp->router_replied && !cs->garp->server_replied)
             log_line("%s: arp: DHCP agent didn't reply.  Getting new lease.",
-                     client_config.interface);
-        else if (!garp.router_replied && garp.server_replied)
+                     cs->cfg->interface);
+        else if (!cs->garp->router_replied && cs->garp->server_replied)
             log_line("%s: arp: Gateway didn't reply.  Getting new lease.",
-                     client_config.interface);
+                     cs->cfg->interface);
         else
             log_line("%s: arp: DHCP agent and gateway didn't reply.  Getting new lease.",
-                     client_config.interface);
-        garp.wake_ts[AS_GW_CHECK] = -1;
+                     cs->cfg->interface);
+        ntimer_disarm(&cs->garp->wake_ts[AS_GW_CHECK]);
         return ARPR_CONFLICT;
     }
-    long long rtts = garp.send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY;
+    long long rtts = cs->garp->send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY;
     if (nowts < rtts) {
-        garp.wake_ts[AS_GW_CHECK] = rtts;
+        ntimer_arm(&cs->garp->wake_ts[AS_GW_CHECK], rtts);
         return ARPR_OK;
     }
-    if (!garp.router_replied) {
+    if (!cs->garp->router_replied) {
         log_line("%s: arp: Still waiting for gateway to reply to arp ping...",
-                 client_config.interface);
+                 cs->cfg->interface);
         if (arp_ping(cs, cs->routerAddr) < 0) {
             log_warning("%s: arp: Failed to send ARP ping in retransmission.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return ARPR_FAIL;
         }
     }
-    if (!garp.server_replied) {
+    if (!cs->garp->server_replied) {
         log_line("%s: arp: Still waiting for DHCP agent to reply to arp ping...",
-                 client_config.interface);
+                 cs->cfg->interface);
         if (arp_ping(cs, cs->srcAddr) < 0) {
             log_warning("%s: arp: Failed to send ARP ping in retransmission.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return ARPR_FAIL;
         }
     }
-    garp.wake_ts[AS_GW_CHECK] =
-        garp.send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY;
+    ntimer_arm(&cs->garp->wake_ts[AS_GW_CHECK],
+               cs->garp->send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY);
     return ARPR_OK;
 }
 
 int arp_gw_query_timeout(struct client_state_t cs[static 1], long long nowts)
 {
-    long long rtts = garp.send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY;
+    long long rtts = cs->garp->send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY;
     if (nowts < rtts) {
-        garp.wake_ts[AS_GW_QUERY] = rtts;
+        ntimer_arm(&cs->garp->wake_ts[AS_GW_QUERY], rtts);
         return ARPR_OK;
     }
     if (!cs->got_router_arp) {
         log_line("%s: arp: Still looking for gateway hardware address...",
-                 client_config.interface);
+                 cs->cfg->interface);
         if (arp_ping(cs, cs->routerAddr) < 0) {
             log_warning("%s: arp: Failed to send ARP ping in retransmission.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return ARPR_FAIL;
         }
     }
     if (!cs->got_server_arp) {
         log_line("%s: arp: Still looking for DHCP agent hardware address...",
-                 client_config.interface);
+                 cs->cfg->interface);
         if (arp_ping(cs, cs->srcAddr) < 0) {
             log_warning("%s: arp: Failed to send ARP ping in retransmission.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return ARPR_FAIL;
         }
     }
-    garp.wake_ts[AS_GW_QUERY] =
-        garp.send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY;
+    ntimer_arm(&cs->garp->wake_ts[AS_GW_QUERY],
+               cs->garp->send_stats[ASEND_GW_PING].ts + ARP_RETRANS_DELAY);
     return ARPR_OK;
 }
 
 int arp_collision_timeout(struct client_state_t cs[static 1], long long nowts)
 {
-    if (nowts >= garp.arp_check_start_ts + ANNOUNCE_WAIT ||
-        garp.send_stats[ASEND_COLLISION_CHECK].count >= arp_probe_num)
+    if (nowts >= cs->garp->arp_check_start_ts + ANNOUNCE_WAIT ||
+        cs->garp->send_stats[ASEND_COLLISION_CHECK].count >= arp_probe_num)
     {
         char clibuf[INET_ADDRSTRLEN];
-        struct in_addr temp_addr = {.s_addr = garp.dhcp_packet.yiaddr};
+        struct in_addr temp_addr = {.s_addr = cs->garp->dhcp_packet.yiaddr};
         inet_ntop(AF_INET, &temp_addr, clibuf, sizeof clibuf);
-        log_line("%s: Lease of %s obtained.  Lease time is %ld seconds.",
-                 client_config.interface, clibuf, cs->lease);
-        cs->clientAddr = garp.dhcp_packet.yiaddr;
+        log_line("%s: Lease of %s obtained.  Lease time is %ld seconds; renew at %lld, rebind at %lld.",
+                 cs->cfg->interface, clibuf, cs->lease, cs->renewTime,
+                 cs->rebindTime);
+        metrics_lease_bound(cs, nowts);
+        trace_event(cs, TEV_ARP_FREE, 0);
+        cs->clientAddr = cs->garp->dhcp_packet.yiaddr;
+        cs->prevAddr = cs->clientAddr;
+        cs->renews_sent = 0;
         cs->init = 0;
-        garp.last_conflict_ts = 0;
-        garp.wake_ts[AS_COLLISION_CHECK] = -1;
-        if (ifchange_bind(cs, &garp.dhcp_packet) < 0) {
+        cs->garp->last_conflict_ts = 0;
+        ntimer_disarm(&cs->garp->wake_ts[AS_COLLISION_CHECK]);
+        if (ifchange_bind(cs, &cs->garp->dhcp_optidx, false) < 0) {
             suicide("%s: Failed to set the interface IP address and properties!",
-                    client_config.interface);
+                    cs->cfg->interface);
         }
-        cs->routerAddr = get_option_router(&garp.dhcp_packet);
+        cs->routerAddr = get_option_router(&cs->garp->dhcp_optidx);
         if (arp_get_gw_hwaddr(cs) < 0) {
             log_warning("%s: (%s) Failed to send request to get gateway and agent hardware addresses: %s",
-                        client_config.interface, __func__, strerror(errno));
+                        cs->cfg->interface, __func__, strerror(errno));
             return ARPR_FAIL;
         }
         stop_dhcp_listen(cs);
-        write_leasefile(temp_addr);
+        write_leasefile(cs, temp_addr);
+        write_lease_record(cs, &cs->garp->dhcp_optidx);
+        rtt_flush(cs);
         int ret = ARPR_FREE;
         if (arp_announcement(cs) < 0)
             ret = ARPR_FAIL;
-        if (client_config.quit_after_lease)
-            exit(EXIT_SUCCESS);
-        if (!client_config.foreground)
+        // The bind was only queued to ifch.  Whatever waits for us to exit
+        // or to detach expects the interface to be configured by then.
+        if (cs->cfg->quit_after_lease || !cs->cfg->foreground)
+            ifchange_flush(cs);
+        client_lease_obtained(cs);
+        if (!cs->cfg->foreground)
             background();
         return ret;
     }
-    long long rtts = garp.send_stats[ASEND_COLLISION_CHECK].ts +
-        garp.probe_wait_time;
+    long long rtts = cs->garp->send_stats[ASEND_COLLISION_CHECK].ts +
+        cs->garp->probe_wait_time;
     if (nowts < rtts) {
-        garp.wake_ts[AS_COLLISION_CHECK] = rtts;
+        ntimer_arm(&cs->garp->wake_ts[AS_COLLISION_CHECK], rtts);
         return ARPR_OK;
     }
-    if (arp_ip_anon_ping(cs, garp.dhcp_packet.yiaddr) < 0) {
+    if (arp_ip_anon_ping(cs, cs->garp->dhcp_packet.yiaddr) < 0) {
         log_warning("%s: arp: Failed to send ARP ping in retransmission.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return ARPR_FAIL;
     }
-    garp.probe_wait_time = arp_gen_probe_wait(cs);
-    garp.wake_ts[AS_COLLISION_CHECK] =
-        garp.send_stats[ASEND_COLLISION_CHECK].ts + garp.probe_wait_time;
+    cs->garp->probe_wait_time = arp_gen_probe_wait(cs);
+    ntimer_arm(&cs->garp->wake_ts[AS_COLLISION_CHECK],
+               cs->garp->send_stats[ASEND_COLLISION_CHECK].ts
+               + cs->garp->probe_wait_time);
     return ARPR_OK;
 }
 
@@ -541,46 +668,52 @@ int arp_do_defense(struct client_state_t cs[static 1])
     // Even though the BPF will usually catch this case, sometimes there are
     // packets still in the socket buffer that arrived before the defense
     // BPF was installed, so it's necessary to check here.
-    if (!arp_validate_bpf_defense(cs, &garp.reply))
+    if (!arp_validate_bpf_defense(cs, &cs->garp->reply))
         return ARPR_OK;
 
-    log_warning("%s: arp: Detected a peer attempting to use our IP!", client_config.interface);
+    log_warning("%s: arp: Detected a peer attempting to use our IP!", cs->cfg->interface);
     long long nowts = curms();
-    garp.wake_ts[AS_DEFENSE] = -1;
-    if (!garp.last_conflict_ts ||
-        nowts - garp.last_conflict_ts < DEFEND_INTERVAL) {
-        log_warning("%s: arp: Defending our lease IP.", client_config.interface);
+    ntimer_disarm(&cs->garp->wake_ts[AS_DEFENSE]);
+    if (!cs->garp->last_conflict_ts ||
+        nowts - cs->garp->last_conflict_ts < DEFEND_INTERVAL) {
+        log_warning("%s: arp: Defending our lease IP.", cs->cfg->interface);
+        metrics_arp_defend(cs);
         if (arp_announcement(cs) < 0)
             return ARPR_FAIL;
-    } else if (!garp.relentless_def) {
+        // Measured to the return of the send rather than to its transmit
+        // timestamp, which would arrive only on a later pass.
+        metrics_arp_defense_latency(cs, rtt_now_ns() - cs->garp->reply_ts,
+                                    cs->ifchq->num > 0);
+    } else if (!arp_relentless_def) {
         log_warning("%s: arp: Conflicting peer is persistent.  Requesting new lease.",
-                    client_config.interface);
+                    cs->cfg->interface);
         send_release(cs);
         return ARPR_CONFLICT;
     } else {
-        garp.wake_ts[AS_DEFENSE] =
-            garp.send_stats[ASEND_ANNOUNCE].ts + DEFEND_INTERVAL;
+        ntimer_arm(&cs->garp->wake_ts[AS_DEFENSE],
+                   cs->garp->send_stats[ASEND_ANNOUNCE].ts + DEFEND_INTERVAL);
     }
-    garp.total_conflicts++;
-    garp.last_conflict_ts = nowts;
+    cs->garp->total_conflicts++;
+    cs->garp->last_conflict_ts = nowts;
+    metrics_touch(cs);
     return ARPR_OK;
 }
 
 int arp_do_gw_query(struct client_state_t cs[static 1])
 {
-    if (!arp_is_query_reply(&garp.reply))
+    if (!arp_is_query_reply(cs, &cs->garp->reply))
         return ARPR_OK;
-    if (!memcmp(garp.reply.sip4, &cs->routerAddr, 4)) {
-        memcpy(cs->routerArp, garp.reply.smac, 6);
+    if (!memcmp(cs->garp->reply.sip4, &cs->routerAddr, 4)) {
+        memcpy(cs->routerArp, cs->garp->reply.smac, 6);
         log_line("%s: arp: Gateway hardware address %02x:%02x:%02x:%02x:%02x:%02x",
-                 client_config.interface, cs->routerArp[0], cs->routerArp[1],
+                 cs->cfg->interface, cs->routerArp[0], cs->routerArp[1],
                  cs->routerArp[2], cs->routerArp[3],
                  cs->routerArp[4], cs->routerArp[5]);
         cs->got_router_arp = 1;
         if (cs->routerAddr == cs->srcAddr)
             goto server_is_router;
         if (cs->got_server_arp) {
-            garp.wake_ts[AS_GW_QUERY] = -1;
+            ntimer_disarm(&cs->garp->wake_ts[AS_GW_QUERY]);
             if (arp_open_fd(cs, true) < 0)
                 return ARPR_FAIL;
             // Do a second announcement.
@@ -590,16 +723,16 @@ int arp_do_gw_query(struct client_state_t cs[static 1])
         }
         return ARPR_OK;
     }
-    if (!memcmp(garp.reply.sip4, &cs->srcAddr, 4)) {
+    if (!memcmp(cs->garp->reply.sip4, &cs->srcAddr, 4)) {
 server_is_router:
-        memcpy(cs->serverArp, garp.reply.smac, 6);
+        memcpy(cs->serverArp, cs->garp->reply.smac, 6);
         log_line("%s: arp: DHCP agent hardware address %02x:%02x:%02x:%02x:%02x:%02x",
-                 client_config.interface, cs->serverArp[0], cs->serverArp[1],
+                 cs->cfg->interface, cs->serverArp[0], cs->serverArp[1],
                  cs->serverArp[2], cs->serverArp[3],
                  cs->serverArp[4], cs->serverArp[5]);
         cs->got_server_arp = 1;
         if (cs->got_router_arp) {
-            garp.wake_ts[AS_GW_QUERY] = -1;
+            ntimer_disarm(&cs->garp->wake_ts[AS_GW_QUERY]);
             if (arp_open_fd(cs, true) < 0)
                 return ARPR_FAIL;
             // Do a second announcement.
@@ -614,22 +747,24 @@ server_is_router:
 
 int arp_do_collision_check(struct client_state_t cs[static 1])
 {
-    if (!arp_is_query_reply(&garp.reply))
+    if (!arp_is_query_reply(cs, &cs->garp->reply))
         return ARPR_OK;
     // If this packet was sent from our lease IP, and does not have a
     // MAC address matching our own (the latter check guards against stupid
     // hubs or repeaters), then it's a conflict and thus a failure.
-    if (!memcmp(garp.reply.sip4, &garp.dhcp_packet.yiaddr, 4) &&
-        !memcmp(client_config.arp, garp.reply.smac, 6))
+    if (!memcmp(cs->garp->reply.sip4, &cs->garp->dhcp_packet.yiaddr, 4) &&
+        !memcmp(cs->cfg->arp, cs->garp->reply.smac, 6))
     {
-        garp.total_conflicts++;
-        garp.wake_ts[AS_COLLISION_CHECK] = -1;
+        cs->garp->total_conflicts++;
+        metrics_touch(cs);
+        trace_event(cs, TEV_ARP_CONFLICT, 0);
+        ntimer_disarm(&cs->garp->wake_ts[AS_COLLISION_CHECK]);
         log_line("%s: arp: Offered address is in use.  Declining.",
-                 client_config.interface);
-        int r = send_decline(cs, garp.dhcp_packet.yiaddr);
+                 cs->cfg->interface);
+        int r = send_decline(cs, cs->garp->dhcp_packet.yiaddr);
         if (r < 0) {
             log_warning("%s: Failed to send a decline notice packet.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return ARPR_FAIL;
         }
         return ARPR_CONFLICT;
@@ -639,84 +774,191 @@ int arp_do_collision_check(struct client_state_t cs[static 1])
 
 int arp_do_gw_check(struct client_state_t cs[static 1])
 {
-    if (!arp_is_query_reply(&garp.reply))
+    if (!arp_is_query_reply(cs, &cs->garp->reply))
         return ARPR_OK;
-    if (!memcmp(garp.reply.sip4, &cs->routerAddr, 4)) {
+    if (!memcmp(cs->garp->reply.sip4, &cs->routerAddr, 4)) {
         // Success only if the router/gw MAC matches stored value
-        if (!memcmp(cs->routerArp, garp.reply.smac, 6)) {
-            garp.router_replied = true;
+        if (!memcmp(cs->routerArp, cs->garp->reply.smac, 6)) {
+            cs->garp->router_replied = true;
             if (cs->routerAddr == cs->srcAddr)
                 goto server_is_router;
-            if (garp.server_replied)
+            if (cs->garp->server_replied)
                 return arp_gw_success(cs); // FREE or FAIL
             return ARPR_OK;
         }
         log_line("%s: arp: Gateway is different.  Getting a new lease.",
-                 client_config.interface);
-        garp.wake_ts[AS_GW_CHECK] = -1;
+                 cs->cfg->interface);
+        ntimer_disarm(&cs->garp->wake_ts[AS_GW_CHECK]);
         return ARPR_CONFLICT;
     }
-    if (!memcmp(garp.reply.sip4, &cs->srcAddr, 4)) {
+    if (!memcmp(cs->garp->reply.sip4, &cs->srcAddr, 4)) {
 server_is_router:
         // Success only if the server MAC matches stored value
-        if (!memcmp(cs->serverArp, garp.reply.smac, 6)) {
-            garp.server_replied = true;
-            if (garp.router_replied)
+        if (!memcmp(cs->serverArp, cs->garp->reply.smac, 6)) {
+            cs->garp->server_replied = true;
+            if (cs->garp->router_replied)
                 return arp_gw_success(cs); // FREE or FAIL
             return ARPR_OK;
         }
         log_line("%s: arp: DHCP agent is different.  Getting a new lease.",
-                 client_config.interface);
-        garp.wake_ts[AS_GW_CHECK] = -1;
+                 cs->cfg->interface);
+        ntimer_disarm(&cs->garp->wake_ts[AS_GW_CHECK]);
         return ARPR_CONFLICT;
     }
     return ARPR_OK;
 }
 
-bool arp_packet_get(struct client_state_t cs[static 1])
+// Read every frame that is ready on the ARP socket, up to ARP_RECV_BATCH,
+// with a single syscall.  Frames from an earlier batch that were never
+// consumed are dropped.
+void arp_packets_recv(struct client_state_t cs[static 1], bool err)
 {
-    ssize_t r = 0;
-    if (garp.reply_offset < sizeof garp.reply) {
-        r = safe_read(cs->arpFd, (char *)&garp.reply + garp.reply_offset,
-                      sizeof garp.reply - garp.reply_offset);
-        if (r == 0)
-            return false;
-        if (r < 0) {
-            log_error("%s: (%s) ARP response read failed: %s",
-                      client_config.interface, __func__, strerror(errno));
-            // Timeouts will trigger anyway without being forced.
-            arp_min_close_fd(cs);
-            if (arp_open_fd(cs, cs->arp_is_defense) < 0)
-                suicide("%s: (%s) Failed to reopen ARP fd: %s",
-                        client_config.interface, __func__, strerror(errno));
-            return false;
+    struct iovec iov[ARP_RECV_BATCH];
+    struct mmsghdr msgs[ARP_RECV_BATCH];
+    int r;
+
+    cs->garp->rbatch_num = cs->garp->rbatch_next = 0;
+    if (cs->arpFd < 0)
+        return;
+    // The socket is flagged with an error while transmit timestamps are
+    // queued.  If none are, there is a real socket error, which the read
+    // below will report even if a receive ring is in use.
+    bool sock_err = err && !arp_tx_stamps(cs);
+    if (cs->garp->ring) {
+        // Frames are already waiting in the mapped ring.  Bound how much
+        // of it is consumed before other fds get a turn.
+        cs->garp->ring_budget = ARP_RING_BLOCK_NR;
+        if (!sock_err)
+            return;
+    }
+    memset(msgs, 0, sizeof msgs);
+    for (size_t i = 0; i < ARP_RECV_BATCH; ++i) {
+        iov[i].iov_base = &cs->garp->rbatch[i];
+        iov[i].iov_len = sizeof cs->garp->rbatch[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = cs->garp->rbatch_cmsg[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof cs->garp->rbatch_cmsg[i].buf;
+    }
+    do {
+        r = recvmmsg(cs->arpFd, msgs, ARP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        log_error("%s: (%s) ARP response read failed: %s",
+                  cs->cfg->interface, __func__, strerror(errno));
+        // Timeouts will trigger anyway without being forced.
+        arp_min_close_fd(cs);
+        if (arp_open_fd(cs, cs->arp_is_defense) < 0)
+            suicide("%s: (%s) Failed to reopen ARP fd: %s",
+                    cs->cfg->interface, __func__, strerror(errno));
+        return;
+    }
+    long long nowns = rtt_now_ns();
+    for (int i = 0; i < r; ++i) {
+        cs->garp->rbatch_len[i] = msgs[i].msg_len;
+        long long ts = rtt_rx_ts(&msgs[i].msg_hdr);
+        cs->garp->rbatch_ts[i] = ts >= 0 ? ts : nowns;
+    }
+    cs->garp->rbatch_num = (unsigned)r;
+}
+
+// Find the next frame in the mapped receive ring.  A block is given back
+// to the kernel only when the following frame is requested, so *frame
+// remains valid until then.
+static bool arp_ring_next(struct client_state_t cs[static 1],
+                          const uint8_t **frame, size_t *len,
+                          long long ts[static 1])
+{
+    for (;;) {
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+            (cs->garp->ring + cs->garp->ring_block * ARP_RING_BLOCK_SIZE);
+        if (!cs->garp->ring_pkt_off) {
+            if (!cs->garp->ring_budget)
+                return false;
+            if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+                                  __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+                return false;
+            cs->garp->ring_pkts_left = bd->hdr.bh1.num_pkts;
+            cs->garp->ring_pkt_off = bd->hdr.bh1.offset_to_first_pkt;
+        }
+        if (!cs->garp->ring_pkts_left) {
+            __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                             __ATOMIC_RELEASE);
+            cs->garp->ring_block = (cs->garp->ring_block + 1)
+                                   % ARP_RING_BLOCK_NR;
+            cs->garp->ring_pkt_off = 0;
+            --cs->garp->ring_budget;
+            continue;
         }
-        garp.reply_offset += (size_t)r;
+        struct tpacket3_hdr *tp = (struct tpacket3_hdr *)
+            ((uint8_t *)bd + cs->garp->ring_pkt_off);
+        *frame = (const uint8_t *)tp + tp->tp_mac;
+        *len = tp->tp_snaplen;
+        *ts = tp->tp_sec * 1000000000LL + tp->tp_nsec;
+        cs->garp->ring_pkt_off += tp->tp_next_offset;
+        --cs->garp->ring_pkts_left;
+        return true;
     }
+}
 
-    if (garp.reply_offset < ARP_MSG_SIZE)
+// Find the next frame in the receive ring or batch.  Returns false once
+// neither has any more frames.
+static bool arp_frame_next(struct client_state_t cs[static 1],
+                           const uint8_t **frame, size_t *len,
+                           long long ts[static 1])
+{
+    if (cs->garp->ring)
+        return arp_ring_next(cs, frame, len, ts);
+    if (cs->garp->rbatch_next >= cs->garp->rbatch_num)
         return false;
+    unsigned i = cs->garp->rbatch_next++;
+    *frame = (const uint8_t *)&cs->garp->rbatch[i];
+    *len = cs->garp->rbatch_len[i];
+    *ts = cs->garp->rbatch_ts[i];
+    return true;
+}
 
-    // Emulate the BPF filters if they are not in use.
-    if (!garp.using_bpf &&
-        (!arp_validate_bpf(&garp.reply) ||
-         (cs->arp_is_defense &&
-          !arp_validate_bpf_defense(cs, &garp.reply)))) {
-        arp_reply_clear();
-        return false;
+// Move the next acceptable frame into cs->garp->reply.  Returns false once
+// there are no more frames to be handled.
+bool arp_packet_get(struct client_state_t cs[static 1])
+{
+    const uint8_t *frame;
+    size_t len;
+    long long ts;
+    while (arp_frame_next(cs, &frame, &len, &ts)) {
+        if (len < ARP_MSG_SIZE)
+            continue;
+        memcpy(&cs->garp->reply, frame,
+               min_size_t(len, sizeof cs->garp->reply));
+
+        // Emulate the BPF filters if they are not in use.
+        if (!cs->garp->using_bpf &&
+            (!arp_validate_bpf(cs, &cs->garp->reply) ||
+             (cs->arp_is_defense &&
+              !arp_validate_bpf_defense(cs, &cs->garp->reply)))) {
+            metrics_arp_rx(cs, true);
+            arp_reply_clear(cs);
+            continue;
+        }
+        metrics_arp_rx(cs, false);
+        cs->garp->reply_ts = ts;
+        arp_rtt_sample(cs, ts);
+        return true;
     }
-    return true;
+    return false;
 }
 
-// XXX: Move into client_state
-long long arp_get_wake_ts(void)
+long long arp_get_wake_ts(struct client_state_t cs[static 1])
 {
     long long mt = -1;
     for (int i = 0; i < AS_MAX; ++i) {
-        if (garp.wake_ts[i] < 0)
+        long long ts = cs->garp->wake_ts[i].ts;
+        if (ts < 0)
             continue;
-        if (mt < 0 || mt > garp.wake_ts[i])
-            mt = garp.wake_ts[i];
+        if (mt < 0 || mt > ts)
+            mt = ts;
     }
     return mt;
 }
@@ -33,6 +33,9 @@
 #include <net/if_arp.h>
 #include "ndhc.h"
 #include "dhcp.h"
+#include "options.h"
+#include "timer.h"
+#include "rtt.h"
 
 struct arpMsg {
     // Ethernet header
@@ -58,6 +61,22 @@ extern int arp_probe_num;
 extern int arp_probe_min;
 extern int arp_probe_max;
 
+// Maximum number of frames that are drained from the ARP socket with a
+// single recvmmsg() call.
+#define ARP_RECV_BATCH 16
+
+// Geometry of the TPACKET_V3 receive ring that sockd attaches to the ARP
+// defense socket.  ARP frames are tiny, so each one-page block holds dozens
+// of them.  A partially filled block is handed to us after
+// ARP_RING_RETIRE_MS even if no more frames arrive.
+#define ARP_RING_BLOCK_SIZE 4096
+#define ARP_RING_BLOCK_NR 8
+#define ARP_RING_FRAME_SIZE 128
+#define ARP_RING_RETIRE_MS 10
+
+// Number of recent gateway pings whose replies can be timed.
+#define ARP_PINGS_TIMED 4
+
 typedef enum {
     AS_NONE = 0,        // Nothing to react to wrt ARP
     AS_COLLISION_CHECK, // Checking to see if another host has our IP before
@@ -81,15 +100,38 @@ struct arp_stats {
     int count;
 };
 
+struct arp_ping {
+    long long ns;       // Send time, see rtt.c.
+    uint32_t seq;       // Index of the frame among those sent on arpFd.
+    uint32_t dip;       // Target; zero if the slot is unused.
+};
+
 struct arp_data {
     struct dhcpmsg dhcp_packet;   // Used only for AS_COLLISION_CHECK
+    struct dhcp_optidx dhcp_optidx; // Option index for dhcp_packet.
     struct arpMsg reply;
+    long long reply_ts;           // Receive time of reply, see rtt.c.
+    struct arpMsg rbatch[ARP_RECV_BATCH]; // Frames not yet moved to reply.
+    size_t rbatch_len[ARP_RECV_BATCH];
+    long long rbatch_ts[ARP_RECV_BATCH];  // Receive time, see rtt.c.
+    union rtt_cmsg rbatch_cmsg[ARP_RECV_BATCH];
+    struct arp_ping pings[ARP_PINGS_TIMED];
     struct arp_stats send_stats[ASEND_MAX];
-    long long wake_ts[AS_MAX];
+    struct ntimer wake_ts[AS_MAX];
     long long last_conflict_ts;   // TS of the last conflicting ARP seen.
     long long arp_check_start_ts; // TS of when we started the
                                   // AS_COLLISION_CHECK state.
-    size_t reply_offset;
+    unsigned rbatch_num;
+    unsigned rbatch_next;
+    uint8_t *ring;                // Mapped defense socket RX ring, or NULL.
+    unsigned ring_block;          // Ring block that is being consumed.
+    unsigned ring_budget;         // Blocks that may still be consumed
+                                  // before returning to epoll.
+    uint32_t ring_pkts_left;      // Frames not yet consumed in ring_block.
+    uint32_t ring_pkt_off;        // Offset of the next frame in ring_block,
+                                  // or zero if ring_block was not started.
+    uint32_t tx_seq;              // Frames sent on arpFd.
+    uint32_t tx_stamped;          // Transmit timestamps read for them.
     unsigned int total_conflicts; // Total number of address conflicts on
                                   // the interface.  Never decreases.
     int gw_check_initpings;       // Initial count of ASEND_GW_PING when
@@ -97,20 +139,20 @@ struct arp_data {
     uint16_t probe_wait_time;     // Time to wait for a COLLISION_CHECK reply
                                   // (in ms?).
     bool using_bpf:1;             // Is a BPF installed on the ARP socket?
-    bool relentless_def:1;        // Don't give up defense no matter what.
     bool router_replied:1;
     bool server_replied:1;
 };
 
-void arp_reply_clear(void);
+void arp_reply_clear(struct client_state_t cs[static 1]);
 
+void arp_packets_recv(struct client_state_t cs[static 1], bool err);
 bool arp_packet_get(struct client_state_t cs[static 1]);
 
 void set_arp_relentless_def(bool v);
-void arp_reset_send_stats(void);
+void arp_reset_send_stats(struct client_state_t cs[static 1]);
 void arp_close_fd(struct client_state_t cs[static 1]);
 int arp_check(struct client_state_t cs[static 1],
-              struct dhcpmsg packet[static 1]);
+              const struct dhcp_optidx oi[static 1]);
 int arp_gw_check(struct client_state_t cs[static 1]);
 int arp_set_defense_mode(struct client_state_t cs[static 1]);
 int arp_gw_failed(struct client_state_t cs[static 1]);
@@ -134,6 +176,6 @@ int arp_gw_check_timeout(struct client_state_t cs[static 1], long long nowts);
 #define ARPR_FAIL -2
 
 
-long long arp_get_wake_ts(void);
+long long arp_get_wake_ts(struct client_state_t cs[static 1]);
 
 #endif /* ARP_H_ */
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <arpa/inet.h>
 #include "ndhc-defines.h"
 #include "cfg.h"
 #include "arp.h"
@@ -68,10 +69,7 @@ struct cfgparse {
         copy_cmdarg(client_config.hostname, ccfg.buf,
                     sizeof client_config.hostname, "hostname");
     }
-    action interface {
-        copy_cmdarg(client_config.interface, ccfg.buf,
-                    sizeof client_config.interface, "interface");
-    }
+    action interface { add_client_interface(ccfg.buf); }
     action now {
         switch (ccfg.ternary) {
         case 1: client_config.abort_if_no_lease = 1; break;
@@ -168,6 +166,37 @@ struct cfgparse {
         case -1: allow_hostname = 0; default: break;
         }
     }
+    action rapid_commit {
+        switch (ccfg.ternary) {
+        case 1: client_config.rapid_commit = 1; break;
+        case -1: client_config.rapid_commit = 0; default: break;
+        }
+    }
+    action offer_wait {
+        int t = atoi(ccfg.buf);
+        if (t >= 0)
+            client_config.offer_wait = t;
+    }
+    action prefer_server {
+        struct in_addr a;
+        if (inet_pton(AF_INET, ccfg.buf, &a) != 1)
+            suicide("prefer-server arg '%s' isn't a valid IPv4 address",
+                    ccfg.buf);
+        client_config.prefer_server = a.s_addr;
+    }
+    action renew_jitter {
+        int t = atoi(ccfg.buf);
+        if (t < 0 || t > 50)
+            suicide("renew-jitter arg '%s' must be between 0 and 50",
+                    ccfg.buf);
+        client_config.renew_jitter = t;
+    }
+    action adaptive_retransmit {
+        switch (ccfg.ternary) {
+        case 1: client_config.adaptive_rexmit = 1; break;
+        case -1: client_config.adaptive_rexmit = 0; default: break;
+        }
+    }
     action rfkill_idx {
         uint32_t t = atoi(ccfg.buf);
         client_config.rfkillIdx = t;
@@ -217,13 +246,19 @@ struct cfgparse {
     resolv_conf = 'resolv-conf' value @resolv_conf;
     dhcp_set_hostname = 'dhcp-set-hostname' boolval @dhcp_set_hostname;
     rfkill_idx = 'rfkill-idx' value @rfkill_idx;
+    rapid_commit = 'rapid-commit' boolval @rapid_commit;
+    offer_wait = 'offer-wait' value @offer_wait;
+    prefer_server = 'prefer-server' value @prefer_server;
+    renew_jitter = 'renew-jitter' value @renew_jitter;
+    adaptive_retransmit = 'adaptive-retransmit' boolval @adaptive_retransmit;
 
     main := blankline |
         clientid | background | pidfile | hostname | interface | now | quit |
         request | vendorid | user | ifch_user | sockd_user | chroot |
         state_dir | seccomp_enforce | relentless_defense | arp_probe_wait |
         arp_probe_num | arp_probe_min | arp_probe_max | gw_metric |
-        resolv_conf | dhcp_set_hostname | rfkill_idx
+        resolv_conf | dhcp_set_hostname | rfkill_idx | rapid_commit |
+        offer_wait | prefer_server | renew_jitter | adaptive_retransmit
     ;
 }%%
 
@@ -322,6 +357,11 @@ static void parse_cfgfile(const char fname[static 1])
     resolv_conf = ('-R'|'--resolv-conf') argval @resolv_conf;
     dhcp_set_hostname = ('-H'|'--dhcp-set-hostname') tbv @dhcp_set_hostname;
     rfkill_idx = ('-K'|'--rfkill-idx') argval @rfkill_idx;
+    rapid_commit = '--rapid-commit' tbv @rapid_commit;
+    offer_wait = '--offer-wait' argval @offer_wait;
+    prefer_server = '--prefer-server' argval @prefer_server;
+    renew_jitter = '--renew-jitter' argval @renew_jitter;
+    adaptive_retransmit = '--adaptive-retransmit' tbv @adaptive_retransmit;
     version = ('-v'|'--version') 0 @version;
     help = ('-?'|'--help') 0 @help;
 
@@ -331,7 +371,8 @@ static void parse_cfgfile(const char fname[static 1])
         chroot | state_dir | seccomp_enforce | relentless_defense |
         arp_probe_wait | arp_probe_num | arp_probe_min | arp_probe_max |
         gw_metric | resolv_conf | dhcp_set_hostname | rfkill_idx |
-        version | help
+        rapid_commit | offer_wait | prefer_server | renew_jitter |
+        adaptive_retransmit | version | help
     )*;
 }%%
 
@@ -0,0 +1,232 @@
+/* checksum.c - Internet checksum (RFC1071) routines
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CSUM_NEON 1
+#endif
+#include "checksum.h"
+
+// Add len bytes of buf to sum eight bytes at a time.  The carry out of
+// each 64-bit addition is added back in (end-around carry), which keeps
+// the result congruent to the sum of the 16-bit words modulo 0xffff.
+static uint64_t csum_partial_scalar(const void *buf, size_t len, uint64_t sum)
+{
+    const uint8_t *p = buf;
+    uint64_t w;
+    for (; len >= sizeof w; p += sizeof w, len -= sizeof w) {
+        memcpy(&w, p, sizeof w);
+        sum += w;
+        sum += sum < w;
+    }
+    if (len) {
+        // An odd trailing byte is padded with a zero byte that follows
+        // it, as RFC1071 requires; the rest of w stays zero.
+        w = 0;
+        memcpy(&w, p, len);
+        sum += w;
+        sum += sum < w;
+    }
+    return sum;
+}
+
+// The vector variants widen each 32-bit word of the data into a 64-bit
+// lane and add it there, so the lanes can't carry out until 2^32 words
+// have been summed, far more than any packet holds.  The lanes are then
+// added into sum with end-around carry, and the tail that is shorter than
+// a vector is left to the scalar loop.  Every 32-bit word is congruent to
+// the sum of its two 16-bit words modulo 0xffff, as are the 64-bit words
+// of the scalar loop, so every variant folds to the same checksum.
+static uint64_t csum_add64(uint64_t sum, uint64_t w)
+{
+    sum += w;
+    return sum + (sum < w);
+}
+
+#ifdef CSUM_X86
+__attribute__((target("sse2")))
+static uint64_t csum_partial_sse2(const void *buf, size_t len, uint64_t sum)
+{
+    const uint8_t *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+    for (; len >= 32; p += 32, len -= 32) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i u = _mm_loadu_si128((const __m128i *)(p + 16));
+        a0 = _mm_add_epi64(a0, _mm_unpacklo_epi32(v, zero));
+        a1 = _mm_add_epi64(a1, _mm_unpackhi_epi32(v, zero));
+        a2 = _mm_add_epi64(a2, _mm_unpacklo_epi32(u, zero));
+        a3 = _mm_add_epi64(a3, _mm_unpackhi_epi32(u, zero));
+    }
+    uint64_t l[8];
+    _mm_storeu_si128((__m128i *)l, a0);
+    _mm_storeu_si128((__m128i *)(l + 2), a1);
+    _mm_storeu_si128((__m128i *)(l + 4), a2);
+    _mm_storeu_si128((__m128i *)(l + 6), a3);
+    for (size_t i = 0; i < 8; ++i)
+        sum = csum_add64(sum, l[i]);
+    return csum_partial_scalar(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static uint64_t csum_partial_avx2(const void *buf, size_t len, uint64_t sum)
+{
+    const uint8_t *p = buf;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+    for (; len >= 64; p += 64, len -= 64) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i u = _mm256_loadu_si256((const __m256i *)(p + 32));
+        a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v, zero));
+        a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v, zero));
+        a2 = _mm256_add_epi64(a2, _mm256_unpacklo_epi32(u, zero));
+        a3 = _mm256_add_epi64(a3, _mm256_unpackhi_epi32(u, zero));
+    }
+    if (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v, zero));
+        a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v, zero));
+        p += 32;
+        len -= 32;
+    }
+    a0 = _mm256_add_epi64(a0, a2);
+    a1 = _mm256_add_epi64(a1, a3);
+    uint64_t l[8];
+    _mm256_storeu_si256((__m256i *)l, a0);
+    _mm256_storeu_si256((__m256i *)(l + 4), a1);
+    for (size_t i = 0; i < 8; ++i)
+        sum = csum_add64(sum, l[i]);
+    return csum_partial_scalar(p, len, sum);
+}
+
+static bool csum_have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static bool csum_have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+#ifdef CSUM_NEON
+static uint64_t csum_partial_neon(const void *buf, size_t len, uint64_t sum)
+{
+    const uint8_t *p = buf;
+    uint64x2_t a0 = vdupq_n_u64(0), a1 = vdupq_n_u64(0);
+    for (; len >= 32; p += 32, len -= 32) {
+        a0 = vpadalq_u32(a0, vreinterpretq_u32_u8(vld1q_u8(p)));
+        a1 = vpadalq_u32(a1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+    }
+    uint64_t l[4];
+    vst1q_u64(l, a0);
+    vst1q_u64(l + 2, a1);
+    for (size_t i = 0; i < 4; ++i)
+        sum = csum_add64(sum, l[i]);
+    return csum_partial_scalar(p, len, sum);
+}
+
+static bool csum_have_neon(void) { return true; }
+#endif
+
+static bool csum_have_scalar(void) { return true; }
+
+// Fastest first; csum_init() picks the first one that the CPU supports.
+const struct csum_impl csum_impls[] = {
+#ifdef CSUM_X86
+    { "avx2", csum_partial_avx2, csum_have_avx2 },
+    { "sse2", csum_partial_sse2, csum_have_sse2 },
+#endif
+#ifdef CSUM_NEON
+    { "neon", csum_partial_neon, csum_have_neon },
+#endif
+    { "scalar", csum_partial_scalar, csum_have_scalar },
+};
+const size_t csum_num_impls = sizeof csum_impls / sizeof csum_impls[0];
+
+static const struct csum_impl *csum_cur = &csum_impls[csum_num_impls - 1];
+
+void csum_init(void)
+{
+    for (size_t i = 0; i < csum_num_impls; ++i) {
+        if (csum_impls[i].usable()) {
+            csum_cur = &csum_impls[i];
+            return;
+        }
+    }
+}
+
+int csum_use(size_t i)
+{
+    if (i >= csum_num_impls || !csum_impls[i].usable())
+        return -1;
+    csum_cur = &csum_impls[i];
+    return 0;
+}
+
+const char *csum_impl_name(void)
+{
+    return csum_cur->name;
+}
+
+uint64_t csum_partial(const void *buf, size_t len, uint64_t sum)
+{
+    return csum_cur->partial(buf, len, sum);
+}
+
+uint16_t csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffffffffu) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// RFC1624 eqn. 3: HC' = ~(~HC + ~m + m'), where m is a 16-bit word of the
+// checksummed data that changes to m'.
+uint16_t csum_update16(uint16_t hc, uint16_t m, uint16_t mp)
+{
+    uint32_t sum = (uint16_t)~hc + (uint32_t)(uint16_t)~m + mp;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+uint16_t csum_udp4(uint32_t saddr, uint32_t daddr,
+                   const void *udp, size_t len)
+{
+    // The pseudo-header seeds the sum: both addresses, a zero byte and the
+    // protocol, then the UDP length.  Each is added in the memory order
+    // of its bytes, like the data that follows.
+    uint16_t proto = htons(IPPROTO_UDP);
+    uint16_t ulen = htons((uint16_t)len);
+    uint64_t sum = (uint64_t)saddr + daddr + proto + ulen;
+    return csum_fold(csum_partial(udp, len, sum));
+}
@@ -0,0 +1,79 @@
+/* checksum.h - Internet checksum (RFC1071) routines
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NJK_NDHC_CHECKSUM_H_
+#define NJK_NDHC_CHECKSUM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The Internet checksum is accumulated in a 64-bit ones-complement sum
+// that is only folded down to 16 bits once, at the end.  Sums and
+// checksums are in the byte order of the data, so they can be stored
+// into a header or compared with one without swapping.
+//
+// When a sum is built from several buffers with csum_partial(), every
+// buffer but the last must have an even length.
+//
+// csum_partial() is implemented once for plain integer registers and once
+// for each vector extension that the build target may have.  csum_init()
+// selects the fastest one that the running CPU supports; until then the
+// scalar one is used.  The variants differ in the unfolded sum that they
+// return, but never in the folded checksum.
+
+struct csum_impl {
+    const char *name;
+    uint64_t (*partial)(const void *buf, size_t len, uint64_t sum);
+    bool (*usable)(void);
+};
+
+extern const struct csum_impl csum_impls[];
+extern const size_t csum_num_impls;
+
+void csum_init(void);
+int csum_use(size_t i);
+const char *csum_impl_name(void);
+
+uint64_t csum_partial(const void *buf, size_t len, uint64_t sum);
+uint16_t csum_fold(uint64_t sum);
+uint16_t csum_update16(uint16_t hc, uint16_t m, uint16_t mp);
+
+// Checksum of a single buffer; bit-exact with ncmlib's net_checksum161c().
+static inline uint16_t csum_buf(const void *buf, size_t len)
+{
+    return csum_fold(csum_partial(buf, len, 0));
+}
+
+// Checksum of a UDP datagram (header and data, len bytes) together with
+// its IPv4 pseudo-header, in a single pass.  saddr and daddr are in
+// network byte order.
+uint16_t csum_udp4(uint32_t saddr, uint32_t daddr,
+                   const void *udp, size_t len);
+
+#endif /* NJK_NDHC_CHECKSUM_H_ */
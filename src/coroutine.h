@@ -178,4 +178,34 @@
 #define ccrContext       void *
 #define ccrAbort(ctx)    do { free (ctx); ctx = 0; } while (0)
 
+/*
+ * `ccr' macros for re-entrant coroutines with a caller-owned context.
+ *
+ * These never call malloc() or free().  The context is any structure
+ * with an `int ccrLine' member; the caller owns its storage and must
+ * zero ccrLine before the first call.  ccrLine is zero again once the
+ * coroutine finishes or is stopped, and `ccrAbortP' resets it so that
+ * the next call starts from the beginning.
+ */
+
+#define ccrBeginP(x)     switch((x)->ccrLine) { case 0:;
+#define ccrFinishP(x,z)  } (x)->ccrLine=0; return (z)
+#define ccrFinishVP(x)   } (x)->ccrLine=0; return
+
+#define ccrReturnP(x,z)  \
+        do {\
+            (x)->ccrLine=__LINE__;\
+            return (z); case __LINE__:;\
+        } while (0)
+#define ccrReturnVP(x)   \
+        do {\
+            (x)->ccrLine=__LINE__;\
+            return; case __LINE__:;\
+        } while (0)
+
+#define ccrStopP(x,z)    do{ (x)->ccrLine=0; return (z); }while(0)
+#define ccrStopVP(x)     do{ (x)->ccrLine=0; return; }while(0)
+
+#define ccrAbortP(x)     do { (x)->ccrLine = 0; } while (0)
+
 #endif /* COROUTINE_H */
@@ -34,13 +34,14 @@
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netpacket/packet.h>
 #include <net/ethernet.h>
 #include <errno.h>
 #include "nk/log.h"
 #include "nk/io.h"
 #include "nk/random.h"
-#include "nk/net_checksum.h"
 
 #include "dhcp.h"
 #include "state.h"
@@ -49,273 +50,423 @@
 #include "sys.h"
 #include "options.h"
 #include "sockd.h"
+#include "checksum.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rtt.h"
+
+// The send sockets are obtained from sockd once and then reused.  They
+// are only closed and requested again if a send on them fails or, for
+// the unicast socket, if the address it is bound to is no longer ours.
+static void close_udp_unicast_socket(struct client_state_t cs[static 1])
+{
+    if (cs->ucastFd < 0)
+        return;
+    if (cs->gdhcp->last_tx.fd == cs->ucastFd)
+        cs->gdhcp->last_tx.fd = -1;
+    close(cs->ucastFd);
+    cs->ucastFd = -1;
+}
 
 static int get_udp_unicast_socket(struct client_state_t cs[static 1])
 {
+    if (cs->ucastFd >= 0 && cs->ucastClientAddr != cs->clientAddr)
+        close_udp_unicast_socket(cs);
+    if (cs->ucastFd >= 0)
+        return cs->ucastFd;
     char buf[32];
     buf[0] = 'u';
     memcpy(buf + 1, &cs->clientAddr, sizeof cs->clientAddr);
-    return request_sockd_fd(buf, 1 + sizeof cs->clientAddr, NULL);
+    int fd = request_sockd_fd(cs, buf, 1 + sizeof cs->clientAddr, NULL);
+    if (fd < 0)
+        return -1;
+    cs->ucastFd = fd;
+    cs->ucastClientAddr = cs->clientAddr;
+    cs->ucastServerAddr = 0;
+    return fd;
+}
+
+static void close_raw_broadcast_socket(struct client_state_t cs[static 1])
+{
+    if (cs->bcastFd < 0)
+        return;
+    if (cs->gdhcp->last_tx.fd == cs->bcastFd)
+        cs->gdhcp->last_tx.fd = -1;
+    close(cs->bcastFd);
+    cs->bcastFd = -1;
 }
 
-static int get_raw_broadcast_socket(void)
+static int get_raw_broadcast_socket(struct client_state_t cs[static 1])
 {
-    return request_sockd_fd("s", 1, NULL);
+    if (cs->bcastFd < 0)
+        cs->bcastFd = request_sockd_fd(cs, "s", 1, NULL);
+    return cs->bcastFd;
 }
 
 static int get_raw_listen_socket(struct client_state_t cs[static 1])
 {
+    char buf[32];
+    size_t buflen = 0;
+    buf[0] = 'L';
+    buflen += 1;
+    memcpy(buf + buflen, &cs->xid, sizeof cs->xid);
+    buflen += sizeof cs->xid;
+    memcpy(buf + buflen, cs->cfg->arp, 6);
+    buflen += 6;
     char resp;
-    int fd = request_sockd_fd("L", 1, &resp);
+    int fd = request_sockd_fd(cs, buf, buflen, &resp);
     switch (resp) {
     case 'L': cs->using_dhcp_bpf = 1; break;
     case 'l': cs->using_dhcp_bpf = 0; break;
     default: suicide("%s: (%s) expected l or L sockd reply but got %c",
-                     client_config.interface, __func__, resp);
+                     cs->cfg->interface, __func__, resp);
     }
+    if (fd >= 0)
+        metrics_dhcp_listen(cs, cs->using_dhcp_bpf);
     return fd;
 }
 
+// Overwrite an even-length, even-aligned field of the DHCP message in a
+// template and fold the change into its UDP checksum.
+static void dhcp_tmpl_patch(struct dhcp_tmpl t[static 1], void *field,
+                            const void *val, size_t len)
+{
+    uint8_t *f = field;
+    const uint8_t *v = val;
+    for (size_t i = 0; i < len; i += 2) {
+        uint16_t m, mp;
+        memcpy(&m, f + i, sizeof m);
+        memcpy(&mp, v + i, sizeof mp);
+        if (m == mp)
+            continue;
+        t->iud.udp.check = csum_update16(t->iud.udp.check, m, mp);
+        memcpy(f + i, &mp, sizeof mp);
+    }
+}
+
+// Serialize payload into t, computing the IP and UDP headers and checksums
+// once.  Packets are sent as short as possible.
+static int dhcp_tmpl_build(struct client_state_t cs[static 1],
+                           struct dhcp_tmpl t[static 1],
+                           const struct dhcpmsg payload[static 1],
+                           uint32_t reqip, uint32_t serverid)
+{
+    ssize_t endloc = get_end_option_idx(payload);
+    if (endloc < 0) {
+        log_error("%s: (%s) No end marker.  Not sending.",
+                  cs->cfg->interface, __func__);
+        t->valid = false;
+        return -1;
+    }
+    size_t padding = sizeof payload->options - 1 - endloc;
+    size_t iud_len = sizeof(struct ip_udp_dhcp_packet) - padding;
+    size_t ud_len = sizeof(struct udp_dhcp_packet) - padding;
+
+    t->iud = (struct ip_udp_dhcp_packet){
+        .ip = {
+            .saddr = INADDR_ANY,
+            .daddr = INADDR_BROADCAST,
+            .protocol = IPPROTO_UDP,
+            .tot_len = htons(iud_len),
+            .ihl = sizeof t->iud.ip >> 2,
+            .version = IPVERSION,
+            .ttl = IPDEFTTL,
+        },
+        .data = *payload,
+    };
+    t->iud.udp.source = htons(DHCP_CLIENT_PORT);
+    t->iud.udp.dest = htons(DHCP_SERVER_PORT);
+    t->iud.udp.len = htons(ud_len);
+    t->iud.udp.check = 0;
+    t->iud.udp.check = csum_udp4(t->iud.ip.saddr, t->iud.ip.daddr,
+                                 &t->iud.udp, ud_len);
+    t->iud.ip.check = csum_buf(&t->iud.ip, sizeof t->iud.ip);
+    t->len = iud_len;
+    t->reqip = reqip;
+    t->serverid = serverid;
+    struct dhcp_optidx oi;
+    dhcp_optidx_build(&oi, payload, sizeof *payload);
+    t->msgtype = get_option_msgtype(&oi);
+    t->valid = true;
+    t->stamped = false;
+    t->rexmit = false;
+    return 0;
+}
+
+static bool dhcp_tmpl_usable(const struct dhcp_tmpl t[static 1],
+                             uint32_t reqip, uint32_t serverid)
+{
+    return t->valid && t->reqip == reqip && t->serverid == serverid;
+}
+
+// Bring the per-transmission fields of a template up to date: xid, secs
+// (seconds since the transaction began, RFC2131 4.4.1) and ciaddr.
+static void dhcp_tmpl_stamp(struct client_state_t cs[static 1],
+                            struct dhcp_tmpl t[static 1], uint32_t ciaddr)
+{
+    long long now = curms();
+    if (cs->gdhcp->secs_xid != cs->xid || !cs->gdhcp->secs_start) {
+        cs->gdhcp->secs_xid = cs->xid;
+        cs->gdhcp->secs_start = now;
+    }
+    long long secs = (now - cs->gdhcp->secs_start) / 1000;
+    uint16_t nsecs = htons(secs > 0xffff ? 0xffff : (uint16_t)secs);
+    t->rexmit = t->stamped && t->iud.data.xid == cs->xid;
+    t->stamped = true;
+    dhcp_tmpl_patch(t, &t->iud.data.xid, &cs->xid, sizeof cs->xid);
+    dhcp_tmpl_patch(t, &t->iud.data.secs, &nsecs, sizeof nsecs);
+    dhcp_tmpl_patch(t, &t->iud.data.ciaddr, &ciaddr, sizeof ciaddr);
+}
+
+// Drops timestamps left over from earlier sends on fd, so that the one
+// that the kernel queues for this send is the last one.
+static void dhcp_tx_begin(int fd)
+{
+    (void)rtt_tx_ts_last(fd);
+}
+
+static void dhcp_tx_done(struct client_state_t cs[static 1],
+                         const struct dhcp_tmpl t[static 1], int fd)
+{
+    metrics_dhcp_tx(cs, t->msgtype, t->rexmit);
+    trace_event(cs, TEV_DHCP_TX, t->msgtype);
+    cs->gdhcp->last_tx.ns = rtt_now_ns();
+    cs->gdhcp->last_tx.fd = fd;
+    cs->gdhcp->last_tx.xid = t->iud.data.xid;
+    cs->gdhcp->last_tx.ambiguous = t->rexmit;
+    cs->gdhcp->last_tx.valid = true;
+}
+
+// Replies are timed against the last request that was sent with their
+// xid.  If that request had already been sent with the same xid, the reply
+// may answer any copy of it, so as in TCP (Karn's algorithm) it is not
+// timed.  Each server that answers a broadcast is timed separately.
+static void dhcp_rtt_sample(struct client_state_t cs[static 1],
+                            const struct dhcp_optidx oi[static 1],
+                            uint8_t msgtype, uint32_t srcaddr,
+                            long long rx_ns)
+{
+    if (msgtype != DHCPOFFER && msgtype != DHCPACK && msgtype != DHCPNAK)
+        return;
+    if (!cs->gdhcp->last_tx.valid || cs->gdhcp->last_tx.ambiguous ||
+        oi->packet->xid != cs->gdhcp->last_tx.xid)
+        return;
+    if (cs->gdhcp->last_tx.fd >= 0) {
+        long long ts = rtt_tx_ts_last(cs->gdhcp->last_tx.fd);
+        if (ts >= 0)
+            cs->gdhcp->last_tx.ns = ts;
+        cs->gdhcp->last_tx.fd = -1;
+    }
+    int found;
+    uint32_t sid = get_option_serverid(oi, &found);
+    rtt_sample(cs, RTT_DHCP, found && sid ? sid : srcaddr,
+               rx_ns - cs->gdhcp->last_tx.ns);
+}
+
 // Unicast a DHCP message using a UDP socket.
 static ssize_t send_dhcp_unicast(struct client_state_t cs[static 1],
-                                 struct dhcpmsg payload[static 1])
+                                 const struct dhcp_tmpl t[static 1])
 {
     ssize_t ret = -1;
     int fd = get_udp_unicast_socket(cs);
     if (fd < 0) {
         log_error("%s: (%s) get_udp_unicast_socket failed",
-                  client_config.interface, __func__);
+                  cs->cfg->interface, __func__);
         goto out;
     }
 
-    struct sockaddr_in raddr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(DHCP_SERVER_PORT),
-        .sin_addr.s_addr = cs->serverAddr,
-    };
-    if (connect(fd, (struct sockaddr *)&raddr, sizeof(struct sockaddr)) < 0) {
-        log_error("%s: (%s) connect failed: %s", client_config.interface,
-                  __func__, strerror(errno));
-        goto out_fd;
+    if (cs->ucastServerAddr != cs->serverAddr) {
+        struct sockaddr_in raddr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(DHCP_SERVER_PORT),
+            .sin_addr.s_addr = cs->serverAddr,
+        };
+        if (connect(fd, (struct sockaddr *)&raddr,
+                    sizeof(struct sockaddr)) < 0) {
+            log_error("%s: (%s) connect failed: %s", cs->cfg->interface,
+                      __func__, strerror(errno));
+            goto out_fd;
+        }
+        cs->ucastServerAddr = cs->serverAddr;
     }
 
-    // Send packets that are as short as possible.
-    ssize_t endloc = get_end_option_idx(payload);
-    if (endloc < 0) {
-        log_error("%s: (%s) No end marker.  Not sending.",
-                  client_config.interface, __func__);
-        goto out_fd;
-    }
-    size_t payload_len =
-        sizeof *payload - (sizeof payload->options - 1 - endloc);
-    if (check_carrier()) {
+    size_t payload_len = t->len - sizeof t->iud.ip - sizeof t->iud.udp;
+    if (check_carrier(cs)) {
         log_error("%s: (%s) carrier down; write would fail",
-                  client_config.interface, __func__);
+                  cs->cfg->interface, __func__);
         ret = -99;
-        goto out_fd;
+        goto out;
     }
-    ret = safe_write(fd, (const char *)payload, payload_len);
-    if (ret < 0 || (size_t)ret != payload_len)
-        log_error("%s: (%s) write failed: %d", client_config.interface,
+    dhcp_tx_begin(fd);
+    ret = safe_write(fd, (const char *)&t->iud.data, payload_len);
+    if (ret < 0 || (size_t)ret != payload_len) {
+        log_error("%s: (%s) write failed: %d", cs->cfg->interface,
                   __func__, ret);
+        goto out_fd;
+    }
+    dhcp_tx_done(cs, t, fd);
+    return ret;
   out_fd:
-    close(fd);
+    close_udp_unicast_socket(cs);
   out:
     return ret;
 }
 
 // Returns 1 if IP checksum is correct, otherwise 0.
-static int ip_checksum(struct ip_udp_dhcp_packet packet[static 1])
+static int ip_checksum(const struct ip_udp_dhcp_packet packet[static 1])
 {
-    return net_checksum161c(&packet->ip, sizeof packet->ip) == 0;
+    return csum_buf(&packet->ip, sizeof packet->ip) == 0;
 }
 
 // Returns 1 if UDP checksum is correct, otherwise 0.
-static int udp_checksum(struct ip_udp_dhcp_packet packet[static 1])
+static int udp_checksum(const struct ip_udp_dhcp_packet packet[static 1])
 {
-    struct iphdr ph = {
-        .saddr = packet->ip.saddr,
-        .daddr = packet->ip.daddr,
-        .protocol = packet->ip.protocol,
-        .tot_len = packet->udp.len,
-    };
-    uint16_t udpcs =
-        net_checksum161c(&packet->udp,
-                         min_size_t(ntohs(packet->udp.len),
-                                    sizeof *packet - sizeof(struct iphdr)));
-    uint16_t hdrcs = net_checksum161c(&ph, sizeof ph);
-    uint16_t cs = net_checksum161c_add(udpcs, hdrcs);
-    return cs == 0;
+    size_t len = min_size_t(ntohs(packet->udp.len),
+                            sizeof *packet - sizeof(struct iphdr));
+    return csum_udp4(packet->ip.saddr, packet->ip.daddr,
+                     &packet->udp, len) == 0;
 }
 
-static int get_raw_packet_validate_bpf(struct ip_udp_dhcp_packet packet[static 1])
+static int
+get_raw_packet_validate_bpf(struct client_state_t cs[static 1],
+                            const struct ip_udp_dhcp_packet packet[static 1])
 {
     if (packet->ip.version != IPVERSION) {
-        log_warning("%s: IP version is not IPv4.", client_config.interface);
+        log_warning("%s: IP version is not IPv4.", cs->cfg->interface);
         return 0;
     }
     if (packet->ip.ihl != sizeof packet->ip >> 2) {
         log_warning("%s: IP header length incorrect.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     if (packet->ip.protocol != IPPROTO_UDP) {
         log_warning("%s: IP header is not UDP: %d",
-                    client_config.interface, packet->ip.protocol);
+                    cs->cfg->interface, packet->ip.protocol);
         return 0;
     }
     if (ntohs(packet->udp.dest) != DHCP_CLIENT_PORT) {
         log_warning("%s: UDP destination port incorrect: %d",
-                    client_config.interface, ntohs(packet->udp.dest));
+                    cs->cfg->interface, ntohs(packet->udp.dest));
         return 0;
     }
     if (ntohs(packet->udp.len) !=
         ntohs(packet->ip.tot_len) - sizeof packet->ip) {
         log_warning("%s: UDP header length incorrect.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return 0;
     }
     return 1;
 }
 
-// Read a packet from a raw socket.  Returns -1 on fatal error, -2 on
-// transient error.
+// Validate, in place, a raw IP/UDP datagram of length inc that was read
+// from the listen socket.  Returns the length of the DHCP payload in
+// packet->data or -2 if the datagram should be ignored.
 static ssize_t get_raw_packet(struct client_state_t cs[static 1],
-                              struct dhcpmsg payload[static 1],
-                              uint32_t *srcaddr)
+                              const struct ip_udp_dhcp_packet packet[static 1],
+                              size_t inc, uint32_t *srcaddr)
 {
-    struct ip_udp_dhcp_packet packet;
-    memset(&packet, 0, sizeof packet);
-
-    ssize_t inc = safe_read(cs->listenFd, (char *)&packet, sizeof packet);
-    if (inc < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return -2;
-        log_warning("%s: (%s) read error %s", client_config.interface,
-                    __func__, strerror(errno));
-        return -1;
+    if (inc < sizeof packet->ip + sizeof packet->udp) {
+        metrics_dhcp_reject(cs, MREJ_LENGTH);
+        return -2;
     }
-    size_t iphdrlen = ntohs(packet.ip.tot_len);
-    if ((size_t)inc < iphdrlen)
+    size_t iphdrlen = ntohs(packet->ip.tot_len);
+    if (inc < iphdrlen) {
+        metrics_dhcp_reject(cs, MREJ_LENGTH);
         return -2;
-    if (!cs->using_dhcp_bpf && !get_raw_packet_validate_bpf(&packet))
+    }
+    if (!cs->using_dhcp_bpf && !get_raw_packet_validate_bpf(cs, packet)) {
+        metrics_dhcp_reject(cs, MREJ_FILTER);
         return -2;
+    }
 
-    if (!ip_checksum(&packet)) {
+    if (!ip_checksum(packet)) {
         log_error("%s: IP header checksum incorrect.",
-                  client_config.interface);
+                  cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_IP_CHECKSUM);
         return -2;
     }
-    if (iphdrlen <= sizeof packet.ip + sizeof packet.udp) {
+    if (iphdrlen <= sizeof packet->ip + sizeof packet->udp) {
         log_error("%s: Packet received that is too small (%zu bytes).",
                   iphdrlen);
+        metrics_dhcp_reject(cs, MREJ_LENGTH);
         return -2;
     }
-    size_t l = iphdrlen - sizeof packet.ip - sizeof packet.udp;
-    if (l > sizeof *payload) {
+    size_t l = iphdrlen - sizeof packet->ip - sizeof packet->udp;
+    if (l > sizeof packet->data) {
         log_error("%s: Packet received that is too long (%zu bytes).",
                   l);
+        metrics_dhcp_reject(cs, MREJ_LENGTH);
         return -2;
     }
-    if (packet.udp.check && !udp_checksum(&packet)) {
+    if (packet->udp.check && !udp_checksum(packet)) {
         log_error("%s: Packet with bad UDP checksum received.  Ignoring.",
-                  client_config.interface);
+                  cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_UDP_CHECKSUM);
         return -2;
     }
     if (srcaddr)
-        *srcaddr = packet.ip.saddr;
-    memcpy(payload, &packet.data, l);
+        *srcaddr = packet->ip.saddr;
     return l;
 }
 
 // Broadcast a DHCP message using a raw socket.
-static ssize_t send_dhcp_raw(struct dhcpmsg payload[static 1])
+static ssize_t send_dhcp_raw(struct client_state_t cs[static 1],
+                             const struct dhcp_tmpl t[static 1])
 {
     ssize_t ret = -1;
-    int fd = get_raw_broadcast_socket();
+    int fd = get_raw_broadcast_socket(cs);
     if (fd < 0) {
         log_error("%s: (%s) get_raw_broadcast_socket failed",
-                  client_config.interface, __func__);
-        return ret;
-    }
-
-    // Send packets that are as short as possible.
-    ssize_t endloc = get_end_option_idx(payload);
-    if (endloc < 0) {
-        log_error("%s: (%s) No end marker.  Not sending.",
-                  client_config.interface, __func__);
-        close(fd);
+                  cs->cfg->interface, __func__);
         return ret;
     }
-    size_t padding = sizeof payload->options - 1 - endloc;
-    size_t iud_len = sizeof(struct ip_udp_dhcp_packet) - padding;
-    size_t ud_len = sizeof(struct udp_dhcp_packet) - padding;
-
-    struct iphdr ph = {
-        .saddr = INADDR_ANY,
-        .daddr = INADDR_BROADCAST,
-        .protocol = IPPROTO_UDP,
-        .tot_len = htons(ud_len),
-    };
-    struct ip_udp_dhcp_packet iudmsg = {
-        .ip = {
-            .saddr = INADDR_ANY,
-            .daddr = INADDR_BROADCAST,
-            .protocol = IPPROTO_UDP,
-            .tot_len = htons(iud_len),
-            .ihl = sizeof iudmsg.ip >> 2,
-            .version = IPVERSION,
-            .ttl = IPDEFTTL,
-        },
-        .data = *payload,
-    };
-    iudmsg.udp.source = htons(DHCP_CLIENT_PORT);
-    iudmsg.udp.dest = htons(DHCP_SERVER_PORT);
-    iudmsg.udp.len = htons(ud_len);
-    iudmsg.udp.check = 0;
-    uint16_t udpcs = net_checksum161c(&iudmsg.udp, ud_len);
-    uint16_t phcs = net_checksum161c(&ph, sizeof ph);
-    iudmsg.udp.check = net_checksum161c_add(udpcs, phcs);
-    iudmsg.ip.check = net_checksum161c(&iudmsg.ip, sizeof iudmsg.ip);
 
     struct sockaddr_ll da = {
         .sll_family = AF_PACKET,
         .sll_protocol = htons(ETH_P_IP),
         .sll_pkttype = PACKET_BROADCAST,
-        .sll_ifindex = client_config.ifindex,
+        .sll_ifindex = cs->cfg->ifindex,
         .sll_halen = 6,
     };
     memcpy(da.sll_addr, "\xff\xff\xff\xff\xff\xff", 6);
-    if (check_carrier()) {
+    if (check_carrier(cs)) {
         log_error("%s: (%s) carrier down; sendto would fail",
-                  client_config.interface, __func__);
-        ret = -99;
-        goto carrier_down;
+                  cs->cfg->interface, __func__);
+        return -99;
     }
-    ret = safe_sendto(fd, (const char *)&iudmsg, iud_len, 0,
+    dhcp_tx_begin(fd);
+    ret = safe_sendto(fd, (const char *)&t->iud, t->len, 0,
                       (struct sockaddr *)&da, sizeof da);
-    if (ret < 0 || (size_t)ret != iud_len) {
+    if (ret < 0 || (size_t)ret != t->len) {
         if (ret < 0)
-            log_error("%s: (%s) sendto failed: %s", client_config.interface,
+            log_error("%s: (%s) sendto failed: %s", cs->cfg->interface,
                       __func__, strerror(errno));
         else
             log_error("%s: (%s) sendto short write: %z < %zu",
-                      client_config.interface, __func__, ret, iud_len);
-    }
-carrier_down:
-    close(fd);
+                      cs->cfg->interface, __func__, ret, t->len);
+        close_raw_broadcast_socket(cs);
+    } else
+        dhcp_tx_done(cs, t, fd);
     return ret;
 }
 
+// The listen socket filter only passes replies that carry our current xid,
+// so if the xid has changed since the socket was created, it is replaced.
+// The new socket is installed before the old one is closed so that there
+// is never a window where we are not listening.
 void start_dhcp_listen(struct client_state_t cs[static 1])
 {
-    if (cs->listenFd >= 0)
+    if (cs->listenFd >= 0 && cs->listen_xid == cs->xid)
         return;
-    cs->listenFd = get_raw_listen_socket(cs);
-    if (cs->listenFd < 0)
+    int fd = get_raw_listen_socket(cs);
+    if (fd < 0)
         suicide("%s: FATAL: Couldn't listen on socket: %s",
-                client_config.interface, strerror(errno));
-    epoll_add(cs->epollFd, cs->listenFd);
+                cs->cfg->interface, strerror(errno));
+    stop_dhcp_listen(cs);
+    cs->listenFd = fd;
+    cs->listen_xid = cs->xid;
+    epoll_add_tag(cs->epollFd, cs->listenFd, cs->slot);
 }
 
 void stop_dhcp_listen(struct client_state_t cs[static 1])
@@ -325,97 +476,158 @@ void stop_dhcp_listen(struct client_state_t cs[static 1])
     epoll_del(cs->epollFd, cs->listenFd);
     close(cs->listenFd);
     cs->listenFd = -1;
+    cs->gdhcp->rbatch.num = cs->gdhcp->rbatch.next = 0;
 }
 
 static int validate_dhcp_packet(struct client_state_t cs[static 1],
-                                size_t len, struct dhcpmsg packet[static 1],
+                                const struct dhcp_optidx oi[static 1],
                                 uint8_t msgtype[static 1])
 {
-    if (len < offsetof(struct dhcpmsg, options)) {
+    const struct dhcpmsg *packet = oi->packet;
+    if (oi->len < offsetof(struct dhcpmsg, options)) {
         log_warning("%s: Packet is too short to contain magic cookie.  Ignoring.",
-                    client_config.interface);
+                    cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_LENGTH);
         return 0;
     }
     if (ntohl(packet->cookie) != DHCP_MAGIC) {
         log_warning("%s: Packet with bad magic number. Ignoring.",
-                    client_config.interface);
+                    cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_COOKIE);
         return 0;
     }
     if (packet->xid != cs->xid) {
+        ++cs->foreign_dhcp_packets;
         log_warning("%s: Packet XID %lx does not equal our XID %lx.  Ignoring.",
-                    client_config.interface, packet->xid, cs->xid);
+                    cs->cfg->interface, packet->xid, cs->xid);
+        metrics_dhcp_reject(cs, MREJ_XID);
         return 0;
     }
-    if (memcmp(packet->chaddr, client_config.arp, sizeof client_config.arp)) {
+    if (memcmp(packet->chaddr, cs->cfg->arp, sizeof cs->cfg->arp)) {
+        ++cs->foreign_dhcp_packets;
         log_warning("%s: Packet client MAC %2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x does not equal our MAC %2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x.  Ignoring it.",
-                    client_config.interface,
+                    cs->cfg->interface,
                     packet->chaddr[0], packet->chaddr[1], packet->chaddr[2],
                     packet->chaddr[3], packet->chaddr[4], packet->chaddr[5],
-                    client_config.arp[0], client_config.arp[1],
-                    client_config.arp[2], client_config.arp[3],
-                    client_config.arp[4], client_config.arp[5]);
+                    cs->cfg->arp[0], cs->cfg->arp[1],
+                    cs->cfg->arp[2], cs->cfg->arp[3],
+                    cs->cfg->arp[4], cs->cfg->arp[5]);
+        metrics_dhcp_reject(cs, MREJ_CHADDR);
         return 0;
     }
-    ssize_t endloc = get_end_option_idx(packet);
-    if (endloc < 0) {
-        log_warning("%s: Packet does not have an end option.  Ignoring.");
+    if (oi->end < 0) {
+        log_warning("%s: Packet does not have an end option.  Ignoring.",
+                    cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_NO_END);
         return 0;
     }
-    *msgtype = get_option_msgtype(packet);
+    *msgtype = get_option_msgtype(oi);
     if (!*msgtype) {
         log_warning("%s: Packet does not specify a DHCP message type.  Ignoring.",
-                    client_config.interface);
+                    cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_NO_MSGTYPE);
         return 0;
     }
     char clientid[MAX_DOPT_SIZE];
-    size_t cidlen = get_option_clientid(packet, clientid, MAX_DOPT_SIZE);
+    size_t cidlen = get_option_clientid(oi, clientid, MAX_DOPT_SIZE);
     if (cidlen == 0)
         return 1;
-    if (memcmp(client_config.clientid, clientid,
-               min_size_t(cidlen, client_config.clientid_len))) {
+    if (memcmp(cs->cfg->clientid, clientid,
+               min_size_t(cidlen, cs->cfg->clientid_len))) {
         log_warning("%s: Packet clientid does not match our clientid.  Ignoring.",
-                    client_config.interface);
+                    cs->cfg->interface);
+        metrics_dhcp_reject(cs, MREJ_CLIENTID);
         return 0;
     }
     return 1;
 }
 
+// Read every datagram that is ready on the listen socket, up to
+// DHCP_RECV_BATCH, with a single syscall.  Packets from an earlier batch
+// that were never consumed are dropped.
+void dhcp_packets_recv(struct client_state_t cs[static 1])
+{
+    struct iovec iov[DHCP_RECV_BATCH];
+    struct mmsghdr msgs[DHCP_RECV_BATCH];
+    int r;
+
+    cs->gdhcp->rbatch.num = cs->gdhcp->rbatch.next = 0;
+    if (cs->listenFd < 0)
+        return;
+    memset(msgs, 0, sizeof msgs);
+    for (size_t i = 0; i < DHCP_RECV_BATCH; ++i) {
+        iov[i].iov_base = &cs->gdhcp->rbatch.pkt[i];
+        iov[i].iov_len = sizeof cs->gdhcp->rbatch.pkt[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = cs->gdhcp->rbatch.cmsg[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof cs->gdhcp->rbatch.cmsg[i].buf;
+    }
+    do {
+        r = recvmmsg(cs->listenFd, msgs, DHCP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        log_error("%s: Error reading from listening socket: %s.  Reopening.",
+                  cs->cfg->interface, strerror(errno));
+        stop_dhcp_listen(cs);
+        start_dhcp_listen(cs);
+        return;
+    }
+    // Packets that the kernel did not stamp are stamped now, which is
+    // still before any of them are handled.
+    long long nowns = rtt_now_ns();
+    for (int i = 0; i < r; ++i) {
+        cs->gdhcp->rbatch.len[i] = msgs[i].msg_len;
+        long long ts = rtt_rx_ts(&msgs[i].msg_hdr);
+        cs->gdhcp->rbatch.ts[i] = ts >= 0 ? ts : nowns;
+    }
+    cs->gdhcp->rbatch.num = (unsigned)r;
+}
+
+// Hand out the next valid packet from the current receive batch.  Packets
+// are validated here rather than when they are read so that they are
+// checked against the xid that is current when the state machine sees them.
+// Nothing is copied: oi is a view into the receive buffer that remains
+// valid until the next call to dhcp_packets_recv() or stop_dhcp_listen().
 bool dhcp_packet_get(struct client_state_t cs[static 1],
-                     struct dhcpmsg packet[static 1],
+                     struct dhcp_optidx *oi,
                      uint8_t msgtype[static 1],
                      uint32_t srcaddr[static 1])
 {
-    if (cs->listenFd < 0)
-        return false;
-    ssize_t r = get_raw_packet(cs, packet, srcaddr);
-    if (r < 0) {
-        // Not a transient issue handled by packet collection functions.
-        if (r != -2) {
-            log_error("%s: Error reading from listening socket: %s.  Reopening.",
-                      client_config.interface, strerror(errno));
-            stop_dhcp_listen(cs);
-            start_dhcp_listen(cs);
-        }
-        return false;
+    while (cs->gdhcp->rbatch.next < cs->gdhcp->rbatch.num) {
+        unsigned i = cs->gdhcp->rbatch.next++;
+        ssize_t r = get_raw_packet(cs, &cs->gdhcp->rbatch.pkt[i],
+                                   cs->gdhcp->rbatch.len[i], srcaddr);
+        if (r < 0)
+            continue;
+        dhcp_optidx_build(oi, &cs->gdhcp->rbatch.pkt[i].data, (size_t)r);
+        if (!validate_dhcp_packet(cs, oi, msgtype))
+            continue;
+        metrics_dhcp_rx(cs, *msgtype);
+        trace_event(cs, TEV_DHCP_RX, *msgtype);
+        dhcp_rtt_sample(cs, oi, *msgtype, *srcaddr, cs->gdhcp->rbatch.ts[i]);
+        return true;
     }
-    if (!validate_dhcp_packet(cs, (size_t)r, packet, msgtype))
-        return false;
-    return true;
+    return false;
 }
 
-static void add_options_vendor_hostname(struct dhcpmsg packet[static 1])
+static void add_options_vendor_hostname(struct client_state_t cs[static 1],
+                                        struct dhcpmsg packet[static 1])
 {
-    size_t vlen = strlen(client_config.vendor);
-    size_t hlen = strlen(client_config.hostname);
+    size_t vlen = strlen(cs->cfg->vendor);
+    size_t hlen = strlen(cs->cfg->hostname);
     if (vlen)
-        add_option_vendor(packet, client_config.vendor, vlen);
+        add_option_vendor(packet, cs->cfg->vendor, vlen);
     else
         add_option_vendor(packet, "ndhc", sizeof "ndhc" - 1);
-    add_option_hostname(packet, client_config.hostname, hlen);
+    add_option_hostname(packet, cs->cfg->hostname, hlen);
 }
 
 // Initialize a DHCP client packet that will be sent to a server
-static void init_packet(struct dhcpmsg packet[static 1], char type)
+static void init_packet(struct client_state_t cs[static 1],
+                        struct dhcpmsg packet[static 1], char type)
 {
     packet->op = 1; // BOOTREQUEST (client)
     packet->htype = 1; // ETH_10MB
@@ -423,84 +635,140 @@ static void init_packet(struct dhcpmsg packet[static 1], char type)
     packet->cookie = htonl(DHCP_MAGIC);
     packet->options[0] = DCODE_END;
     add_option_msgtype(packet, type);
-    memcpy(packet->chaddr, client_config.arp, 6);
-    add_option_clientid(packet, client_config.clientid,
-                        client_config.clientid_len);
+    memcpy(packet->chaddr, cs->cfg->arp, 6);
+    add_option_clientid(packet, cs->cfg->clientid,
+                        cs->cfg->clientid_len);
 }
 
 ssize_t send_discover(struct client_state_t cs[static 1])
 {
-    struct dhcpmsg packet = {.xid = cs->xid};
-    init_packet(&packet, DHCPDISCOVER);
-    if (cs->clientAddr)
-        add_option_reqip(&packet, cs->clientAddr);
-    add_option_maxsize(&packet);
-    add_option_request_list(&packet);
-    add_options_vendor_hostname(&packet);
-    log_line("%s: Discovering DHCP servers...", client_config.interface);
-    return send_dhcp_raw(&packet);
+    struct dhcp_tmpl *t = &cs->gdhcp->tmpls[DTMPL_DISCOVER];
+    if (!dhcp_tmpl_usable(t, cs->clientAddr, 0)) {
+        struct dhcpmsg packet = {0};
+        init_packet(cs, &packet, DHCPDISCOVER);
+        if (cs->clientAddr)
+            add_option_reqip(&packet, cs->clientAddr);
+        if (cs->cfg->rapid_commit)
+            add_option_rapid_commit(&packet);
+        add_option_maxsize(&packet);
+        add_option_request_list(&packet);
+        add_options_vendor_hostname(cs, &packet);
+        if (dhcp_tmpl_build(cs, t, &packet, cs->clientAddr, 0) < 0)
+            return -1;
+    }
+    dhcp_tmpl_stamp(cs, t, 0);
+    metrics_acquire_begin(cs, curms());
+    log_line("%s: Discovering DHCP servers...", cs->cfg->interface);
+    return send_dhcp_raw(cs, t);
 }
 
 ssize_t send_selecting(struct client_state_t cs[static 1])
 {
     char clibuf[INET_ADDRSTRLEN];
-    struct dhcpmsg packet = {.xid = cs->xid};
-    init_packet(&packet, DHCPREQUEST);
-    add_option_reqip(&packet, cs->clientAddr);
-    add_option_serverid(&packet, cs->serverAddr);
-    add_option_maxsize(&packet);
-    add_option_request_list(&packet);
-    add_options_vendor_hostname(&packet);
+    struct dhcp_tmpl *t = &cs->gdhcp->tmpls[DTMPL_SELECTING];
+    if (!dhcp_tmpl_usable(t, cs->clientAddr, cs->serverAddr)) {
+        struct dhcpmsg packet = {0};
+        init_packet(cs, &packet, DHCPREQUEST);
+        add_option_reqip(&packet, cs->clientAddr);
+        add_option_serverid(&packet, cs->serverAddr);
+        add_option_maxsize(&packet);
+        add_option_request_list(&packet);
+        add_options_vendor_hostname(cs, &packet);
+        if (dhcp_tmpl_build(cs, t, &packet, cs->clientAddr, cs->serverAddr) < 0)
+            return -1;
+    }
+    dhcp_tmpl_stamp(cs, t, 0);
     inet_ntop(AF_INET, &(struct in_addr){.s_addr = cs->clientAddr},
               clibuf, sizeof clibuf);
     log_line("%s: Sending a selection request for %s...",
-             client_config.interface, clibuf);
-    return send_dhcp_raw(&packet);
+             cs->cfg->interface, clibuf);
+    return send_dhcp_raw(cs, t);
+}
+
+// INIT-REBOOT: ask for the address of a lease that we remember.  Unlike a
+// request in SELECTING, no server identifier is included (RFC2131 4.3.2).
+ssize_t send_init_reboot(struct client_state_t cs[static 1])
+{
+    char clibuf[INET_ADDRSTRLEN];
+    struct dhcp_tmpl *t = &cs->gdhcp->tmpls[DTMPL_INIT_REBOOT];
+    if (!dhcp_tmpl_usable(t, cs->clientAddr, 0)) {
+        struct dhcpmsg packet = {0};
+        init_packet(cs, &packet, DHCPREQUEST);
+        add_option_reqip(&packet, cs->clientAddr);
+        add_option_maxsize(&packet);
+        add_option_request_list(&packet);
+        add_options_vendor_hostname(cs, &packet);
+        if (dhcp_tmpl_build(cs, t, &packet, cs->clientAddr, 0) < 0)
+            return -1;
+    }
+    dhcp_tmpl_stamp(cs, t, 0);
+    metrics_acquire_begin(cs, curms());
+    inet_ntop(AF_INET, &(struct in_addr){.s_addr = cs->clientAddr},
+              clibuf, sizeof clibuf);
+    log_line("%s: Requesting our stored lease of %s...",
+             cs->cfg->interface, clibuf);
+    return send_dhcp_raw(cs, t);
 }
 
 ssize_t send_renew(struct client_state_t cs[static 1])
 {
-    struct dhcpmsg packet = {.xid = cs->xid};
-    init_packet(&packet, DHCPREQUEST);
-    packet.ciaddr = cs->clientAddr;
-    add_option_maxsize(&packet);
-    add_option_request_list(&packet);
-    add_options_vendor_hostname(&packet);
-    log_line("%s: Sending a renew request...", client_config.interface);
-    return send_dhcp_unicast(cs, &packet);
+    struct dhcp_tmpl *t = &cs->gdhcp->tmpls[DTMPL_RENEW];
+    if (!dhcp_tmpl_usable(t, 0, 0)) {
+        struct dhcpmsg packet = {0};
+        init_packet(cs, &packet, DHCPREQUEST);
+        add_option_maxsize(&packet);
+        add_option_request_list(&packet);
+        add_options_vendor_hostname(cs, &packet);
+        if (dhcp_tmpl_build(cs, t, &packet, 0, 0) < 0)
+            return -1;
+    }
+    dhcp_tmpl_stamp(cs, t, cs->clientAddr);
+    log_line("%s: Sending a renew request...", cs->cfg->interface);
+    return send_dhcp_unicast(cs, t);
 }
 
 ssize_t send_rebind(struct client_state_t cs[static 1])
 {
-    struct dhcpmsg packet = {.xid = cs->xid};
-    init_packet(&packet, DHCPREQUEST);
-    packet.ciaddr = cs->clientAddr;
-    add_option_reqip(&packet, cs->clientAddr);
-    add_option_maxsize(&packet);
-    add_option_request_list(&packet);
-    add_options_vendor_hostname(&packet);
-    log_line("%s: Sending a rebind request...", client_config.interface);
-    return send_dhcp_raw(&packet);
+    struct dhcp_tmpl *t = &cs->gdhcp->tmpls[DTMPL_REBIND];
+    if (!dhcp_tmpl_usable(t, cs->clientAddr, 0)) {
+        struct dhcpmsg packet = {0};
+        init_packet(cs, &packet, DHCPREQUEST);
+        add_option_reqip(&packet, cs->clientAddr);
+        add_option_maxsize(&packet);
+        add_option_request_list(&packet);
+        add_options_vendor_hostname(cs, &packet);
+        if (dhcp_tmpl_build(cs, t, &packet, cs->clientAddr, 0) < 0)
+            return -1;
+    }
+    dhcp_tmpl_stamp(cs, t, cs->clientAddr);
+    log_line("%s: Sending a rebind request...", cs->cfg->interface);
+    return send_dhcp_raw(cs, t);
 }
 
 ssize_t send_decline(struct client_state_t cs[static 1], uint32_t server)
 {
     struct dhcpmsg packet = {.xid = cs->xid};
-    init_packet(&packet, DHCPDECLINE);
+    init_packet(cs, &packet, DHCPDECLINE);
     add_option_reqip(&packet, cs->clientAddr);
     add_option_serverid(&packet, server);
-    log_line("%s: Sending a decline message...", client_config.interface);
-    return send_dhcp_raw(&packet);
+    struct dhcp_tmpl t;
+    if (dhcp_tmpl_build(cs, &t, &packet, cs->clientAddr, server) < 0)
+        return -1;
+    log_line("%s: Sending a decline message...", cs->cfg->interface);
+    return send_dhcp_raw(cs, &t);
 }
 
 ssize_t send_release(struct client_state_t cs[static 1])
 {
     struct dhcpmsg packet = {.xid = nk_random_u32(&cs->rnd32_state)};
-    init_packet(&packet, DHCPRELEASE);
+    init_packet(cs, &packet, DHCPRELEASE);
     packet.ciaddr = cs->clientAddr;
     add_option_reqip(&packet, cs->clientAddr);
     add_option_serverid(&packet, cs->serverAddr);
-    log_line("%s: Sending a release message...", client_config.interface);
-    return send_dhcp_unicast(cs, &packet);
+    struct dhcp_tmpl t;
+    if (dhcp_tmpl_build(cs, &t, &packet, cs->clientAddr, cs->serverAddr) < 0)
+        return -1;
+    log_line("%s: Sending a release message...", cs->cfg->interface);
+    return send_dhcp_unicast(cs, &t);
 }
 
@@ -29,10 +29,12 @@
 #ifndef NDHC_DHCP_H_
 #define NDHC_DHCP_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <netinet/udp.h>
 #include <netinet/ip.h>
 #include "ndhc.h"
+#include "rtt.h"
 
 #define DHCP_SERVER_PORT        67
 #define DHCP_CLIENT_PORT        68
@@ -81,14 +83,79 @@ struct udp_dhcp_packet {
     struct dhcpmsg data;
 };
 
+// Maximum number of datagrams that are drained from the listen socket with
+// a single recvmmsg() call.
+#define DHCP_RECV_BATCH 16
+
+// Datagrams read by dhcp_packets_recv() that have not yet been handed out
+// by dhcp_packet_get().
+struct dhcp_rbatch {
+    struct ip_udp_dhcp_packet pkt[DHCP_RECV_BATCH];
+    size_t len[DHCP_RECV_BATCH];
+    long long ts[DHCP_RECV_BATCH];      // Receive time, see rtt.c.
+    union rtt_cmsg cmsg[DHCP_RECV_BATCH];
+    unsigned num;
+    unsigned next;
+};
+
+// A fully serialized DHCP request: IP and UDP headers with their checksums
+// followed by the DHCP message.  Broadcasts send the whole frame and
+// unicasts send only the DHCP message.  The requests that are retransmitted
+// keep a template per kind, so a retransmission only patches the few
+// header fields that can change and sends the ready buffer.
+struct dhcp_tmpl {
+    struct ip_udp_dhcp_packet iud;
+    size_t len;         // Bytes of iud that go on the wire when broadcast.
+    uint32_t reqip;     // Option values that the template was built with.
+    uint32_t serverid;
+    uint8_t msgtype;
+    bool valid;
+    bool stamped;       // Sent at least once since it was built.
+    bool rexmit;        // The last stamp left the xid unchanged.
+};
+
+enum {
+    DTMPL_DISCOVER = 0,
+    DTMPL_SELECTING,
+    DTMPL_INIT_REBOOT,
+    DTMPL_RENEW,
+    DTMPL_REBIND,
+    DTMPL_MAX,
+};
+
+// The last request that was sent, so that replies can be timed.
+struct dhcp_last_tx {
+    long long ns;       // Send time, see rtt.c.
+    int fd;             // Socket whose error queue may hold the kernel's
+                        // timestamp for it, or -1.
+    uint32_t xid;
+    bool ambiguous;     // It had already been sent with the same xid.
+    bool valid;
+};
+
+// DHCP socket data of one interface.
+struct dhcp_data {
+    struct dhcp_rbatch rbatch;
+    struct dhcp_tmpl tmpls[DTMPL_MAX];
+    // Start of the transaction that the secs field is measured from.
+    uint32_t secs_xid;
+    long long secs_start;
+    struct dhcp_last_tx last_tx;
+};
+
+#define DHCP_DATA_INIT { .last_tx = { .fd = -1 } }
+
 void start_dhcp_listen(struct client_state_t cs[static 1]);
 void stop_dhcp_listen(struct client_state_t cs[static 1]);
+struct dhcp_optidx;
+void dhcp_packets_recv(struct client_state_t cs[static 1]);
 bool dhcp_packet_get(struct client_state_t cs[static 1],
-                     struct dhcpmsg packet[static 1],
+                     struct dhcp_optidx *oi,
                      uint8_t msgtype[static 1],
                      uint32_t srcaddr[static 1]);
 ssize_t send_discover(struct client_state_t cs[static 1]);
 ssize_t send_selecting(struct client_state_t cs[static 1]);
+ssize_t send_init_reboot(struct client_state_t cs[static 1]);
 ssize_t send_renew(struct client_state_t cs[static 1]);
 ssize_t send_rebind(struct client_state_t cs[static 1]);
 ssize_t send_decline(struct client_state_t cs[static 1], uint32_t server);
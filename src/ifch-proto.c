@@ -0,0 +1,160 @@
+/* ifch-proto.c - binary ndhc <-> ndhc-ifch message format
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "ifch-proto.h"
+
+// Checks that a record value has the length and content that its type
+// requires.
+static int ifch_tlv_check(uint8_t type, const uint8_t *val, size_t len)
+{
+    switch (type) {
+    case IFCH_T_IP4: return len == 8 || len == 12 ? 0 : -1;
+    case IFCH_T_ROUTER: return len == 4 ? 0 : -1;
+    case IFCH_T_DNS:
+    case IFCH_T_LPRSVR:
+    case IFCH_T_NTPSVR:
+    case IFCH_T_WINS: return len >= 4 && !(len % 4) ? 0 : -1;
+    case IFCH_T_HOSTNAME:
+    case IFCH_T_DOMAIN: return len > 0 && !memchr(val, '\0', len) ? 0 : -1;
+    case IFCH_T_TIMEZONE: return len == 4 ? 0 : -1;
+    case IFCH_T_MTU: return len == 2 ? 0 : -1;
+    case IFCH_T_IPTTL: return len == 1 ? 0 : -1;
+    case IFCH_T_CARRIER: return len == 0 ? 0 : -1;
+    default: return -1;
+    }
+}
+
+static void ifch_msg_set_len(struct ifch_msg m[static 1])
+{
+    uint16_t rlen = htons((uint16_t)(m->len - IFCH_PROTO_HDRLEN));
+    memcpy(m->buf + 4, &rlen, sizeof rlen);
+}
+
+void ifch_msg_set_id(struct ifch_msg m[static 1], uint16_t id)
+{
+    id = htons(id);
+    memcpy(m->buf + 2, &id, sizeof id);
+}
+
+uint16_t ifch_msg_get_id(const uint8_t buf[static IFCH_PROTO_HDRLEN])
+{
+    uint16_t id;
+    memcpy(&id, buf + 2, sizeof id);
+    return ntohs(id);
+}
+
+void ifch_msg_set_iface(struct ifch_msg m[static 1], uint16_t slot)
+{
+    slot = htons(slot);
+    memcpy(m->buf + 6, &slot, sizeof slot);
+}
+
+uint16_t ifch_msg_get_iface(const uint8_t buf[static IFCH_PROTO_HDRLEN])
+{
+    uint16_t slot;
+    memcpy(&slot, buf + 6, sizeof slot);
+    return ntohs(slot);
+}
+
+void ifch_msg_init(struct ifch_msg m[static 1])
+{
+    m->buf[0] = IFCH_PROTO_MAGIC;
+    m->buf[1] = IFCH_PROTO_VERSION;
+    m->len = IFCH_PROTO_HDRLEN;
+    ifch_msg_set_id(m, 0);
+    ifch_msg_set_len(m);
+    ifch_msg_set_iface(m, 0);
+}
+
+// Appends a record.  Returns -1 and leaves the message unchanged if the
+// value is not valid for the type or if the record will not fit.
+int ifch_msg_add(struct ifch_msg m[static 1], uint8_t type,
+                 const void *val, size_t len)
+{
+    if (len > UINT8_MAX || len + 2 > sizeof m->buf - m->len)
+        return -1;
+    if (ifch_tlv_check(type, val, len) < 0)
+        return -1;
+    m->buf[m->len] = type;
+    m->buf[m->len + 1] = (uint8_t)len;
+    if (len)
+        memcpy(m->buf + m->len + 2, val, len);
+    m->len += 2 + len;
+    ifch_msg_set_len(m);
+    return 0;
+}
+
+// Checks the header and every record of a received message, so that the
+// records can then be walked without any further bounds checks.  A record
+// type may appear only once.  Returns 0 if the message is well-formed,
+// otherwise -1.
+int ifch_msg_check(const uint8_t *buf, size_t len)
+{
+    uint32_t seen = 0;
+    if (len < IFCH_PROTO_HDRLEN)
+        return -1;
+    if (buf[0] != IFCH_PROTO_MAGIC || buf[1] != IFCH_PROTO_VERSION)
+        return -1;
+    uint16_t rlen;
+    memcpy(&rlen, buf + 4, sizeof rlen);
+    if (ntohs(rlen) != len - IFCH_PROTO_HDRLEN)
+        return -1;
+    for (size_t off = IFCH_PROTO_HDRLEN; off < len;) {
+        if (len - off < 2)
+            return -1;
+        size_t vlen = buf[off + 1];
+        if (len - off - 2 < vlen)
+            return -1;
+        if (ifch_tlv_check(buf[off], buf + off + 2, vlen) < 0)
+            return -1;
+        if (seen & (1u << buf[off]))
+            return -1;
+        seen |= 1u << buf[off];
+        off += 2 + vlen;
+    }
+    return 0;
+}
+
+// Walks the records of a message that ifch_msg_check() has accepted.  off
+// must start at 0.  Fills in rec for each record in turn and returns
+// false once they have all been seen.
+bool ifch_msg_next(const uint8_t *buf, size_t len, size_t off[static 1],
+                   struct ifch_tlv rec[static 1])
+{
+    if (*off < IFCH_PROTO_HDRLEN)
+        *off = IFCH_PROTO_HDRLEN;
+    if (*off >= len)
+        return false;
+    rec->type = buf[*off];
+    rec->len = buf[*off + 1];
+    rec->val = buf + *off + 2;
+    *off += 2 + (size_t)rec->len;
+    return true;
+}
@@ -0,0 +1,99 @@
+/* ifch-proto.h - binary ndhc <-> ndhc-ifch message format
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NJK_NDHC_IFCH_PROTO_H_
+#define NJK_NDHC_IFCH_PROTO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ndhc-defines.h"
+
+// A message is a fixed header followed by a sequence of type-length-value
+// records: one type byte, one length byte, then that many bytes of value.
+// Addresses are four bytes in network byte order; the other multi-byte
+// integers are also in network byte order.  The magic byte is never the
+// first byte of a text command, so ndhc-ifch can accept either form.
+//
+// The header also names the interface that the message is for by its
+// slot, which is its index in client_configs.
+//
+// ndhc-ifch answers each message with a reply of '+' (success) or '-'
+// (failure) followed by the u16 request id and the u16 interface slot of
+// the message, so that ndhc can have several requests in flight for any
+// of its interfaces and match up their completions.
+#define IFCH_PROTO_MAGIC   0xfe
+#define IFCH_PROTO_VERSION 2
+#define IFCH_PROTO_HDRLEN  8    // magic, version, u16 id, u16 record length,
+                                // u16 interface slot
+#define IFCH_REPLY_LEN     5    // status, u16 id, u16 interface slot
+
+enum ifch_tlv_type {
+    IFCH_T_IP4 = 1,     // address, subnet[, broadcast]: 8 or 12 bytes
+    IFCH_T_ROUTER,      // 4 bytes
+    IFCH_T_DNS,         // 4 bytes per address, at least one
+    IFCH_T_LPRSVR,      // "
+    IFCH_T_NTPSVR,      // "
+    IFCH_T_WINS,        // "
+    IFCH_T_HOSTNAME,    // 1-255 bytes without a NUL
+    IFCH_T_DOMAIN,      // "
+    IFCH_T_TIMEZONE,    // 4 bytes, signed
+    IFCH_T_MTU,         // 2 bytes
+    IFCH_T_IPTTL,       // 1 byte
+    IFCH_T_CARRIER,     // 0 bytes
+    IFCH_T_MAX,
+};
+
+// ndhc-ifch keeps one byte of its receive buffer free to terminate text.
+#define IFCH_PROTO_MAXLEN  (MAX_BUF - 1)
+
+struct ifch_msg {
+    size_t len;
+    uint8_t buf[IFCH_PROTO_MAXLEN];
+};
+
+// One record of a received message, pointing into the message.
+struct ifch_tlv {
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *val;
+};
+
+void ifch_msg_init(struct ifch_msg m[static 1]);
+void ifch_msg_set_id(struct ifch_msg m[static 1], uint16_t id);
+uint16_t ifch_msg_get_id(const uint8_t buf[static IFCH_PROTO_HDRLEN]);
+void ifch_msg_set_iface(struct ifch_msg m[static 1], uint16_t slot);
+uint16_t ifch_msg_get_iface(const uint8_t buf[static IFCH_PROTO_HDRLEN]);
+int ifch_msg_add(struct ifch_msg m[static 1], uint8_t type,
+                 const void *val, size_t len);
+int ifch_msg_check(const uint8_t *buf, size_t len);
+bool ifch_msg_next(const uint8_t *buf, size_t len, size_t off[static 1],
+                   struct ifch_tlv rec[static 1]);
+
+#endif /* NJK_NDHC_IFCH_PROTO_H_ */
@@ -44,315 +44,376 @@
 #include "options.h"
 #include "arp.h"
 #include "ifchange.h"
-
-static struct dhcpmsg cfg_packet; // Copy of the current configuration packet.
-
-static int ifcmd_raw(char buf[static 1], size_t buflen,
-                     const char optname[static 1],
-                     char *optdata, ssize_t optlen)
+#include "netlink.h"
+#include "ifch-proto.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Requests to ndhc-ifch are asynchronous: they are queued here when they
+// are sent, and their replies arrive in order on ifchSock[0], which the
+// main loop polls along with everything else.  Nothing waits for a reply
+// except for the rare cases that need the answer before going on.  Every
+// interface of the master shares ifchSock[0], so each reply names the
+// interface that it is for, and the requests of each interface are
+// queued separately.
+enum ifch_req_kind {
+    IFCH_REQ_CARRIER,
+    IFCH_REQ_DECONFIG,
+    IFCH_REQ_BIND,
+    IFCH_REQ_REBIND,
+};
+
+static void ifch_complete(struct client_state_t cs[static 1],
+                          uint8_t kind, bool ok)
 {
-    if (!optdata) {
-        log_warning("%s: (%s) '%s' option has no data",
-                    client_config.interface, __func__, optname);
-        return -1;
-    }
-    if (optlen > INT_MAX || optlen < 0) {
-        log_warning("%s: (%s) '%s' option optlen out of bounds",
-                    client_config.interface, __func__, optname);
-        return -1;
-    }
-    if (buflen < strlen(optname) + optlen + 3) {
-        log_warning("%s: (%s) '%s' option buf too short",
-                    client_config.interface, __func__, optname);
-        return -1;
-    }
-    int ioptlen = (int)optlen;
-    ssize_t olen = snprintf(buf, buflen, "%s:%.*s;",
-                            optname, ioptlen, optdata);
-    if (olen < 0 || (size_t)olen >= buflen) {
-        log_warning("%s: (%s) '%s' option would truncate, so it was dropped.",
-                    client_config.interface, __func__, optname);
-        memset(buf, 0, buflen);
-        return -1;
+    if (ok)
+        return;
+    switch (kind) {
+    case IFCH_REQ_DECONFIG:
+        log_error("%s: Failed to reset IP configuration.",
+                  cs->cfg->interface);
+        cs->ifDeconfig = 0;
+        break;
+    case IFCH_REQ_BIND:
+        suicide("%s: Failed to set the interface IP address and properties!",
+                cs->cfg->interface);
+        break;
+    case IFCH_REQ_REBIND:
+        // We no longer know what ifch has applied, so send everything on
+        // the next bind.
+        log_warning("%s: Failed to update the interface configuration.",
+                    cs->cfg->interface);
+        memset(cs->cfg_lease, 0, sizeof *cs->cfg_lease);
+        break;
+    default: break;
     }
-    return olen;
 }
 
-static int ifcmd_bytes(char buf[static 1], size_t buflen,
-                       const char optname[static 1],
-                       uint8_t *optdata, ssize_t optlen)
+// Collects one reply, for the oldest outstanding request of whichever
+// interface it is for.  Returns -2 if wait is false and there is no reply
+// yet, otherwise 0 if the request succeeded or -1 if it failed.  If owner
+// or kind are not NULL, they are set to the client state and the kind of
+// the request that completed.
+static int ifch_take_reply(bool wait, struct client_state_t **owner,
+                           uint8_t *kind)
 {
-    return ifcmd_raw(buf, buflen, optname, (char *)optdata, optlen);
-}
-
-static int ifcmd_u8(char buf[static 1], size_t buflen,
-                    const char optname[static 1],
-                    uint8_t *optdata, ssize_t optlen)
-{
-    if (!optdata || optlen < 1)
-        return -1;
-    char numbuf[16];
-    uint8_t c = optdata[0];
-    ssize_t olen = snprintf(numbuf, sizeof numbuf, "%c", c);
-    if (olen < 0 || (size_t)olen >= sizeof numbuf)
-        return -1;
-    return ifcmd_raw(buf, buflen, optname, numbuf, strlen(numbuf));
+    uint8_t reply[IFCH_REPLY_LEN];
+    ssize_t r = safe_recv(ifchSock[0], (char *)reply, sizeof reply,
+                          wait ? 0 : MSG_DONTWAIT);
+    if (r == 0) {
+        // Remote end hung up.
+        exit(EXIT_SUCCESS);
+    } else if (r < 0) {
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -2;
+        suicide("(%s) recv failed: %s", __func__, strerror(errno));
+    }
+    if (r != sizeof reply)
+        suicide("(%s) unexpected reply from ifch", __func__);
+    uint16_t id, slot;
+    memcpy(&id, reply + 1, sizeof id);
+    memcpy(&slot, reply + 3, sizeof slot);
+    struct client_state_t *cs = client_state_get(ntohs(slot));
+    if (!cs)
+        suicide("(%s) ifch reply is for unknown interface slot %u",
+                __func__, ntohs(slot));
+    if (!cs->ifchq->num)
+        suicide("%s: (%s) no ifch request is outstanding",
+                cs->cfg->interface, __func__);
+    struct ifch_req *req = &cs->ifchq->pending[cs->ifchq->head];
+    if (ntohs(id) != req->id)
+        suicide("%s: (%s) unexpected reply from ifch",
+                cs->cfg->interface, __func__);
+    cs->ifchq->head = (cs->ifchq->head + 1) % IFCH_MAX_PENDING;
+    --cs->ifchq->num;
+    client_wake(cs);
+    bool ok = reply[0] == '+';
+    if (owner)
+        *owner = cs;
+    if (kind)
+        *kind = req->kind;
+    metrics_ipc(cs, MIPC_IFCH, ok);
+    trace_event(cs, TEV_IFCH_RX, req->id);
+    if (req->kind == IFCH_REQ_BIND)
+        trace_event(cs, TEV_BOUND, ok);
+    ifch_complete(cs, req->kind, ok);
+    return ok ? 0 : -1;
 }
 
-static int ifcmd_u16(char buf[static 1], size_t buflen,
-                     const char optname[static 1],
-                     uint8_t *optdata, ssize_t optlen)
+// Sends a request without waiting for its reply.  Returns the id of the
+// request, or -1 if it could not be sent.
+static int ifch_submit(struct client_state_t cs[static 1],
+                       struct ifch_msg m[static 1], uint8_t kind)
 {
-    if (!optdata || optlen < 2)
-        return -1;
-    char numbuf[16];
-    uint16_t v;
-    memcpy(&v, optdata, 2);
-    v = ntohs(v);
-    ssize_t olen = snprintf(numbuf, sizeof numbuf, "%hu", v);
-    if (olen < 0 || (size_t)olen >= sizeof numbuf)
+    while (cs->ifchq->num == IFCH_MAX_PENDING)
+        ifch_take_reply(true, NULL, NULL);
+    if (!cs->ifchq->next_id)
+        cs->ifchq->next_id = 1;
+    uint16_t id = cs->ifchq->next_id++;
+    ifch_msg_set_id(m, id);
+    ifch_msg_set_iface(m, cs->slot);
+    ssize_t r = safe_write(ifchSock[0], (const char *)m->buf, m->len);
+    if (r < 0 || (size_t)r != m->len) {
+        log_error("%s: (%s) write failed: %s", cs->cfg->interface,
+                  __func__, r < 0 ? strerror(errno) : "short write");
         return -1;
-    return ifcmd_raw(buf, buflen, optname, numbuf, strlen(numbuf));
+    }
+    trace_event(cs, TEV_IFCH_TX, id);
+    size_t tail = (cs->ifchq->head + cs->ifchq->num) % IFCH_MAX_PENDING;
+    cs->ifchq->pending[tail] = (struct ifch_req){ .id = id, .kind = kind };
+    ++cs->ifchq->num;
+    return id;
 }
 
-static int ifcmd_s32(char buf[static 1], size_t buflen,
-                     const char optname[static 1],
-                     uint8_t *optdata, ssize_t optlen)
+// Handles all of the ifch replies that have arrived, for any interface.
+void ifchange_event_get(void)
 {
-    if (!optdata || optlen < 4)
-        return -1;
-    char numbuf[16];
-    int32_t v;
-    memcpy(&v, optdata, 4);
-    v = ntohl(v);
-    ssize_t olen = snprintf(numbuf, sizeof numbuf, "%d", v);
-    if (olen < 0 || (size_t)olen >= sizeof numbuf)
-        return -1;
-    return ifcmd_raw(buf, buflen, optname, numbuf, strlen(numbuf));
+    // A reply with nothing outstanding is fatal in ifch_take_reply().
+    while (ifch_take_reply(false, NULL, NULL) != -2);
 }
 
-static int ifcmd_ip(char buf[static 1], size_t buflen,
-                    const char optname[static 1],
-                    uint8_t *optdata, ssize_t optlen)
+// Waits until every outstanding ifch request of cs has completed.
+void ifchange_flush(struct client_state_t cs[static 1])
 {
-    if (!optdata || optlen < 4)
-        return -1;
-    char ipbuf[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, optdata, ipbuf, sizeof ipbuf);
-    return ifcmd_raw(buf, buflen, optname, ipbuf, strlen(ipbuf));
+    while (cs->ifchq->num)
+        ifch_take_reply(true, NULL, NULL);
 }
 
-static int ifcmd_iplist(char out[static 1], size_t outlen,
-                        const char optname[static 1],
-                        uint8_t *optdata, ssize_t optlen)
+// Returns 0 if there is a carrier, -1 if not.  The link state that we
+// track from netlink events is used if it is current; ndhc-ifch is only
+// asked to query the kernel if that state is unknown, if netlink events
+// were lost, or if there are link events that we have not yet processed.
+// That query is the one ifch request that we must wait for.
+int check_carrier(struct client_state_t cs[static 1])
 {
-    char buf[2048];
-    char ipbuf[INET_ADDRSTRLEN];
-    size_t bufoff = 0;
-    size_t optoff = 0;
-
-    if (!optdata || optlen < 4)
-        return -1;
+    if (cs->ifsPrevState != IFS_NONE && !cs->ifsStale && !nl_event_pending(cs))
+        return cs->ifsPrevState == IFS_UP ? 0 : -1;
 
-    inet_ntop(AF_INET, optdata + optoff, ipbuf, sizeof ipbuf);
-    ssize_t wc = snprintf(buf + bufoff, sizeof buf, "%s", ipbuf);
-    if (wc < 0 || (size_t)wc >= sizeof buf)
+    struct ifch_msg m;
+    ifch_msg_init(&m);
+    ifch_msg_add(&m, IFCH_T_CARRIER, NULL, 0);
+    if (ifch_submit(cs, &m, IFCH_REQ_CARRIER) < 0)
         return -1;
-    optoff += 4;
-    bufoff += wc;
-    while (optlen - optoff >= 4) {
-        inet_ntop(AF_INET, optdata + optoff, ipbuf, sizeof ipbuf);
-        wc = snprintf(buf + bufoff, sizeof buf, ",%s", ipbuf);
-        if (wc < 0 || (size_t)wc >= sizeof buf)
-            return -1;
-        optoff += 4;
-        bufoff += wc;
-    }
-    return ifcmd_raw(out, outlen, optname, buf, strlen(buf));
-}
-
-static int ifchd_cmd(char b[static 1], size_t bl, uint8_t *od,
-                     ssize_t ol, uint8_t code)
-{
-    switch (code) {
-    case DCODE_ROUTER: return ifcmd_ip(b, bl, "routr", od, ol);
-    case DCODE_DNS: return ifcmd_iplist(b, bl, "dns", od, ol);
-    case DCODE_LPRSVR: return ifcmd_iplist(b, bl, "lpr", od, ol);
-    case DCODE_NTPSVR: return ifcmd_iplist(b, bl, "ntp", od, ol);
-    case DCODE_WINS: return ifcmd_iplist(b, bl, "wins", od, ol);
-    case DCODE_HOSTNAME: return ifcmd_bytes(b, bl, "host", od, ol);
-    case DCODE_DOMAIN: return ifcmd_bytes(b, bl, "dom", od, ol);
-    case DCODE_TIMEZONE: return ifcmd_s32(b, bl, "tzone", od, ol);
-    case DCODE_MTU: return ifcmd_u16(b, bl, "mtu", od, ol);
-    case DCODE_IPTTL: return ifcmd_u8(b, bl, "ipttl", od, ol);
-    default: break;
-    }
-    log_warning("%s: Invalid option code (%c) for ifchd cmd.",
-                client_config.interface, code);
-    return -1;
-}
-
-static int ifchwrite(const char buf[static 1], size_t count)
-{
-    ssize_t r = safe_write(ifchSock[0], buf, count);
-    if (r < 0 || (size_t)r != count) {
-        log_error("%s: (%s) write failed: %d", client_config.interface);
-        return -1;
-    }
-    char data[256], control[256];
-    struct iovec iov = {
-        .iov_base = data,
-        .iov_len = sizeof data - 1,
-    };
-    struct msghdr msg = {
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-        .msg_control = control,
-        .msg_controllen = sizeof control
-    };
-    r = safe_recvmsg(ifchSock[0], &msg, 0);
-    if (r == 0) {
-        // Remote end hung up.
-        exit(EXIT_SUCCESS);
-    } else if (r < 0) {
-        suicide("%s: (%s) recvmsg failed: %s", client_config.interface,
-                __func__, strerror(errno));
+    // Replies for each interface arrive in order, so ours is the last one
+    // of cs that is outstanding.  Those for other interfaces are handled
+    // as they come in.
+    int ret = -1;
+    uint8_t kind = IFCH_REQ_CARRIER;
+    while (cs->ifchq->num) {
+        struct client_state_t *owner;
+        uint8_t k;
+        int r = ifch_take_reply(true, &owner, &k);
+        if (owner == cs) {
+            ret = r;
+            kind = k;
+        }
     }
-    data[iov.iov_len] = '\0';
-    if (r == 1 && data[0] == '+')
-        return 0;
-    return -1;
-}
-
-// Returns 0 if there is a carrier, -1 if not.
-int check_carrier(void)
-{
-    char buf[256];
-    snprintf(buf, sizeof buf, "carrier:;");
-    return ifchwrite(buf, strlen(buf));
+    if (kind != IFCH_REQ_CARRIER)
+        suicide("%s: (%s) unexpected reply from ifch",
+                cs->cfg->interface, __func__);
+    // Trust our tracked state again once the kernel agrees with it.
+    if ((ret == 0) == (cs->ifsPrevState == IFS_UP))
+        cs->ifsStale = false;
+    return ret;
 }
 
+// The interface is treated as deconfigured as soon as the request is sent;
+// if ifch then fails, ifDeconfig is cleared again.
 int ifchange_deconfig(struct client_state_t cs[static 1])
 {
-    char buf[256];
+    static const uint32_t ip4[] = { 0, 0xffffffffu };
+    struct ifch_msg m;
     int ret = -1;
 
     if (cs->ifDeconfig)
         return 0;
 
-    snprintf(buf, sizeof buf, "ip4:0.0.0.0,255.255.255.255;");
-    log_line("%s: Resetting IP configuration.", client_config.interface);
-    ret = ifchwrite(buf, strlen(buf));
+    ifch_msg_init(&m);
+    ifch_msg_add(&m, IFCH_T_IP4, ip4, sizeof ip4);
+    log_line("%s: Resetting IP configuration.", cs->cfg->interface);
+    ret = ifch_submit(cs, &m, IFCH_REQ_DECONFIG) < 0 ? -1 : 0;
 
     if (ret >= 0) {
         cs->ifDeconfig = 1;
-        memset(&cfg_packet, 0, sizeof cfg_packet);
+        memset(cs->cfg_lease, 0, sizeof *cs->cfg_lease);
     }
     return ret;
 }
 
-static size_t send_client_ip(char out[static 1], size_t olen,
-                             struct dhcpmsg packet[static 1])
+// Copies the first address in an option into *addr.
+static bool lease_config_addr(const struct dhcp_optidx oi[static 1],
+                              uint8_t code, uint32_t addr[static 1])
 {
-    uint8_t optdata[MAX_DOPT_SIZE], olddata[MAX_DOPT_SIZE];
-    char ip[INET_ADDRSTRLEN], sn[INET_ADDRSTRLEN], bc[INET_ADDRSTRLEN];
-    ssize_t optlen, oldlen;
-    bool change_ipaddr = false;
-    bool have_subnet = false;
-    bool change_subnet = false;
-    bool have_bcast = false;
-    bool change_bcast = false;
+    uint8_t buf[MAX_DOPT_SIZE];
+    if (get_dhcp_opt(oi, code, buf, sizeof buf) < 4)
+        return false;
+    memcpy(addr, buf, sizeof *addr);
+    return true;
+}
 
-    if (memcmp(&packet->yiaddr, &cfg_packet.yiaddr, sizeof packet->yiaddr))
-        change_ipaddr = true;
-    inet_ntop(AF_INET, &packet->yiaddr, ip, sizeof ip);
+static uint8_t lease_config_addrs(const struct dhcp_optidx oi[static 1],
+                                  uint8_t code,
+                                  uint32_t addrs[static LCFG_MAX_ADDRS])
+{
+    ssize_t len = get_dhcp_opt(oi, code, (uint8_t *)addrs,
+                               LCFG_MAX_ADDRS * sizeof *addrs);
+    return (uint8_t)(len / sizeof *addrs);
+}
 
-    optlen = get_dhcp_opt(packet, DCODE_SUBNET, optdata, sizeof optdata);
-    if (optlen >= 4) {
-        have_subnet = true;
-        inet_ntop(AF_INET, optdata, sn, sizeof sn);
-        oldlen = get_dhcp_opt(&cfg_packet, DCODE_SUBNET, olddata,
-                              sizeof olddata);
-        if (oldlen != optlen || memcmp(optdata, olddata, optlen))
-            change_subnet = true;
+// Decode the options that we pass on to ifch from an ACK.
+static void lease_config_decode(struct lease_config lc[static 1],
+                                const struct dhcp_optidx oi[static 1])
+{
+    uint8_t buf[MAX_DOPT_SIZE];
+    ssize_t len;
+
+    memset(lc, 0, sizeof *lc);
+    lc->ipaddr = oi->packet->yiaddr;
+    if (lease_config_addr(oi, DCODE_SUBNET, &lc->subnet))
+        lc->have |= LCFG_SUBNET;
+    if (lease_config_addr(oi, DCODE_BROADCAST, &lc->bcast))
+        lc->have |= LCFG_BCAST;
+    if (lease_config_addr(oi, DCODE_ROUTER, &lc->router))
+        lc->have |= LCFG_ROUTER;
+    if ((lc->dns_num = lease_config_addrs(oi, DCODE_DNS, lc->dns)))
+        lc->have |= LCFG_DNS;
+    if ((lc->wins_num = lease_config_addrs(oi, DCODE_WINS, lc->wins)))
+        lc->have |= LCFG_WINS;
+    len = get_dhcp_opt(oi, DCODE_HOSTNAME, (uint8_t *)lc->hostname,
+                       sizeof lc->hostname);
+    if (len > 0) {
+        lc->hostname_len = (uint8_t)len;
+        lc->have |= LCFG_HOSTNAME;
     }
-
-    optlen = get_dhcp_opt(packet, DCODE_BROADCAST, optdata, sizeof optdata);
-    if (optlen >= 4) {
-        have_bcast = true;
-        inet_ntop(AF_INET, optdata, bc, sizeof bc);
-        oldlen = get_dhcp_opt(&cfg_packet, DCODE_BROADCAST, olddata,
-                              sizeof olddata);
-        if (oldlen != optlen || memcmp(optdata, olddata, optlen))
-            change_bcast = true;
+    len = get_dhcp_opt(oi, DCODE_DOMAIN, (uint8_t *)lc->domain,
+                       sizeof lc->domain);
+    if (len > 0) {
+        lc->domain_len = (uint8_t)len;
+        lc->have |= LCFG_DOMAIN;
+    }
+    if (get_dhcp_opt(oi, DCODE_MTU, buf, sizeof buf) >= 2) {
+        memcpy(&lc->mtu, buf, sizeof lc->mtu);
+        lc->have |= LCFG_MTU;
     }
+}
 
-    // Nothing to change.
-    if (!change_ipaddr && !change_subnet && !change_bcast)
-        return 0;
+// Returns a mask of the LCFG_* fields of nc that must be sent to ifch to
+// move the interface from configuration oc to nc.  Fields that are absent
+// from nc are left alone, as ifch has no way to remove them.
+static unsigned int lease_config_diff(const struct lease_config oc[static 1],
+                                      const struct lease_config nc[static 1])
+{
+    unsigned int r = 0;
+    unsigned int newf = nc->have & ~oc->have;
+    if (nc->ipaddr != oc->ipaddr)
+        r |= LCFG_IPADDR;
+    if ((nc->have & LCFG_SUBNET) &&
+        ((newf & LCFG_SUBNET) || nc->subnet != oc->subnet))
+        r |= LCFG_SUBNET;
+    if ((nc->have & LCFG_BCAST) &&
+        ((newf & LCFG_BCAST) || nc->bcast != oc->bcast))
+        r |= LCFG_BCAST;
+    if ((nc->have & LCFG_ROUTER) &&
+        ((newf & LCFG_ROUTER) || nc->router != oc->router))
+        r |= LCFG_ROUTER;
+    if ((nc->have & LCFG_DNS) &&
+        ((newf & LCFG_DNS) || nc->dns_num != oc->dns_num ||
+         memcmp(nc->dns, oc->dns, nc->dns_num * sizeof nc->dns[0])))
+        r |= LCFG_DNS;
+    if ((nc->have & LCFG_HOSTNAME) &&
+        ((newf & LCFG_HOSTNAME) || nc->hostname_len != oc->hostname_len ||
+         memcmp(nc->hostname, oc->hostname, nc->hostname_len)))
+        r |= LCFG_HOSTNAME;
+    if ((nc->have & LCFG_DOMAIN) &&
+        ((newf & LCFG_DOMAIN) || nc->domain_len != oc->domain_len ||
+         memcmp(nc->domain, oc->domain, nc->domain_len)))
+        r |= LCFG_DOMAIN;
+    if ((nc->have & LCFG_MTU) &&
+        ((newf & LCFG_MTU) || nc->mtu != oc->mtu))
+        r |= LCFG_MTU;
+    if ((nc->have & LCFG_WINS) &&
+        ((newf & LCFG_WINS) || nc->wins_num != oc->wins_num ||
+         memcmp(nc->wins, oc->wins, nc->wins_num * sizeof nc->wins[0])))
+        r |= LCFG_WINS;
+    return r;
+}
 
-    if (!have_subnet) {
-        static char snClassC[] = "255.255.255.0";
-        log_line("%s: Server did not send a subnet mask.  Assuming 255.255.255.0.",
-                 client_config.interface);
-        memcpy(sn, snClassC, sizeof snClassC);
-    }
+static int send_client_ip(struct client_state_t cs[static 1],
+                          struct ifch_msg m[static 1],
+                          const struct lease_config lc[static 1])
+{
+    uint32_t ip4[3] = { lc->ipaddr, lc->subnet, lc->bcast };
+    size_t len = lc->have & LCFG_BCAST ? 12 : 8;
 
-    int snlen;
-    if (have_bcast) {
-        snlen = snprintf(out, olen, "ip4:%s,%s,%s;", ip, sn, bc);
-    } else {
-        snlen = snprintf(out, olen, "ip4:%s,%s;", ip, sn);
-    }
-    if (snlen < 0 || (size_t)snlen >= olen) {
-        log_warning("%s: (%s) ip4 command would truncate so it was dropped.",
-                    client_config.interface, __func__);
-        memset(out, 0, olen);
-        return 0;
+    if (!(lc->have & LCFG_SUBNET)) {
+        log_line("%s: Server did not send a subnet mask.  Assuming 255.255.255.0.",
+                 cs->cfg->interface);
+        ip4[1] = htonl(0xffffff00u);
     }
-    return snlen;
+    return ifch_msg_add(m, IFCH_T_IP4, ip4, len);
 }
 
-static size_t send_cmd(char out[static 1], size_t olen,
-                       struct dhcpmsg packet[static 1], uint8_t code)
+static int send_cmd(struct client_state_t cs[static 1],
+                    struct ifch_msg m[static 1], uint8_t type,
+                    const void *val, size_t len)
 {
-    uint8_t optdata[MAX_DOPT_SIZE], olddata[MAX_DOPT_SIZE];
-    ssize_t optlen, oldlen;
-
-    optlen = get_dhcp_opt(packet, code, optdata, sizeof optdata);
-    if (!optlen)
-        return 0;
-    oldlen = get_dhcp_opt(&cfg_packet, code, olddata, sizeof olddata);
-    if (oldlen == optlen && !memcmp(optdata, olddata, optlen))
-        return 0;
-    int r = ifchd_cmd(out, olen, optdata, optlen, code);
-    return r > 0 ? r : 0;
+    if (ifch_msg_add(m, type, val, len) < 0) {
+        log_warning("%s: (%s) ifch command %u was invalid or would not fit, so it was dropped.",
+                    cs->cfg->interface, __func__, type);
+        return -1;
+    }
+    return 0;
 }
 
+// Applies the configuration in the ACK indexed by oi to the interface.
+// Only the settings that differ from the current configuration are sent
+// to ifch, so an ACK that changes nothing costs no ifch round-trip.
+// The request is not waited for.  If it fails, ndhc exits when this is
+// the initial bind of a lease; for a renewal, a warning is logged and
+// the whole configuration is sent again next time.
 int ifchange_bind(struct client_state_t cs[static 1],
-                   struct dhcpmsg packet[static 1])
+                  const struct dhcp_optidx oi[static 1], bool renew)
 {
-    char buf[2048];
-    size_t bo;
-    int ret = -1;
-
-    memset(buf, 0, sizeof buf);
-    bo = send_client_ip(buf, sizeof buf, packet);
-    bo += send_cmd(buf + bo, sizeof buf - bo, packet, DCODE_ROUTER);
-    bo += send_cmd(buf + bo, sizeof buf - bo, packet, DCODE_DNS);
-    bo += send_cmd(buf + bo, sizeof buf - bo, packet, DCODE_HOSTNAME);
-    bo += send_cmd(buf + bo, sizeof buf - bo, packet, DCODE_DOMAIN);
-    bo += send_cmd(buf + bo, sizeof buf - bo, packet, DCODE_MTU);
-    bo += send_cmd(buf + bo, sizeof buf - bo, packet, DCODE_WINS);
-    if (bo) {
-        log_line("%s: bind command: '%s'", client_config.interface, buf);
-        ret = ifchwrite(buf, bo);
+    struct lease_config lc;
+    struct ifch_msg m;
+    int ret = 0;
+
+    lease_config_decode(&lc, oi);
+    unsigned int chg = lease_config_diff(cs->cfg_lease, &lc);
+    if (!renew)
+        trace_event(cs, TEV_BIND, 0);
+
+    ifch_msg_init(&m);
+    if (chg & (LCFG_IPADDR | LCFG_SUBNET | LCFG_BCAST))
+        send_client_ip(cs, &m, &lc);
+    if (chg & LCFG_ROUTER)
+        send_cmd(cs, &m, IFCH_T_ROUTER, &lc.router, sizeof lc.router);
+    if (chg & LCFG_DNS)
+        send_cmd(cs, &m, IFCH_T_DNS, lc.dns, lc.dns_num * sizeof lc.dns[0]);
+    if (chg & LCFG_HOSTNAME)
+        send_cmd(cs, &m, IFCH_T_HOSTNAME, lc.hostname, lc.hostname_len);
+    if (chg & LCFG_DOMAIN)
+        send_cmd(cs, &m, IFCH_T_DOMAIN, lc.domain, lc.domain_len);
+    if (chg & LCFG_MTU)
+        send_cmd(cs, &m, IFCH_T_MTU, &lc.mtu, sizeof lc.mtu);
+    if (chg & LCFG_WINS)
+        send_cmd(cs, &m, IFCH_T_WINS, lc.wins, lc.wins_num * sizeof lc.wins[0]);
+    if (m.len > IFCH_PROTO_HDRLEN) {
+        log_line("%s: Sending bind changes (mask 0x%x) to ifch.",
+                 cs->cfg->interface, chg);
+        ret = ifch_submit(cs, &m, renew ? IFCH_REQ_REBIND
+                                        : IFCH_REQ_BIND) < 0 ? -1 : 0;
+    } else if (chg) {
+        // Every command that should have been sent was dropped.
+        ret = -1;
+    } else if (!renew) {
+        // Nothing to change, so the lease is already in place.
+        trace_event(cs, TEV_BOUND, 1);
     }
 
     if (ret >= 0) {
         cs->ifDeconfig = 0;
-        memcpy(&cfg_packet, packet, sizeof cfg_packet);
+        memcpy(cs->cfg_lease, &lc, sizeof *cs->cfg_lease);
     }
     return ret;
 }
-
@@ -29,9 +29,66 @@
 #ifndef IFCHANGE_H_
 #define IFCHANGE_H_
 
-int check_carrier(void);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ndhc.h"
+#include "options.h"
+
+// Bits of lease_config.have and of the change masks that are computed
+// from two lease_configs.
+#define LCFG_IPADDR   (1u << 0)
+#define LCFG_SUBNET   (1u << 1)
+#define LCFG_BCAST    (1u << 2)
+#define LCFG_ROUTER   (1u << 3)
+#define LCFG_DNS      (1u << 4)
+#define LCFG_HOSTNAME (1u << 5)
+#define LCFG_DOMAIN   (1u << 6)
+#define LCFG_MTU      (1u << 7)
+#define LCFG_WINS     (1u << 8)
+
+#define LCFG_MAX_ADDRS 32
+
+// The interface configuration that we have given to ifch, decoded from the
+// ACK that it came from.  Addresses and mtu are in network byte order so
+// that they can be compared and formatted without conversion.
+struct lease_config {
+    unsigned int have;      // LCFG_* fields that the server provided.
+    uint32_t ipaddr;
+    uint32_t subnet;
+    uint32_t bcast;
+    uint32_t router;
+    uint32_t dns[LCFG_MAX_ADDRS];
+    uint32_t wins[LCFG_MAX_ADDRS];
+    uint16_t mtu;
+    uint8_t dns_num;
+    uint8_t wins_num;
+    uint8_t hostname_len;
+    uint8_t domain_len;
+    char hostname[255];
+    char domain[255];
+};
+
+#define IFCH_MAX_PENDING 8
+
+struct ifch_req {
+    uint16_t id;
+    uint8_t kind;
+};
+
+// Requests that have been sent to ndhc-ifch and are awaiting their replies,
+// oldest first.
+struct ifch_queue {
+    struct ifch_req pending[IFCH_MAX_PENDING];
+    size_t head, num;
+    uint16_t next_id;
+};
+
+int check_carrier(struct client_state_t cs[static 1]);
 int ifchange_bind(struct client_state_t cs[static 1],
-                  struct dhcpmsg packet[static 1]);
+                  const struct dhcp_optidx oi[static 1], bool renew);
 int ifchange_deconfig(struct client_state_t cs[static 1]);
+void ifchange_event_get(void);
+void ifchange_flush(struct client_state_t cs[static 1]);
 
 #endif
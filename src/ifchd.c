@@ -40,6 +40,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <arpa/inet.h>
 #include "nk/log.h"
 #include "nk/privilege.h"
 #include "nk/signals.h"
@@ -51,12 +52,18 @@
 #include "ifchd-parse.h"
 #include "sys.h"
 #include "ifset.h"
+#include "ifch-proto.h"
 
 struct ifchd_client cl;
 
+// The DNS settings of every interface, indexed by slot, and those of the
+// interface that the message being handled is for.
+static struct ifchd_dns *dns_slots;
+static struct ifchd_dns *dns;
+
 static int epollfd, signalFd;
-/* Slots are for signalFd and the ndhc -> ifchd socket. */
-static struct epoll_event events[2];
+/* Slots are for signalFd and the ndhc -> ifchd socket and stream. */
+static struct epoll_event events[3];
 
 static int resolv_conf_fd = -1;
 /* int ntp_conf_fd = -1; */
@@ -109,7 +116,40 @@ static int write_append_fd(int to_fd, int from_fd, const char descr[static 1])
     return 0;
 }
 
-/* Writes a new resolv.conf based on the information we have received. */
+// Appends the entries of the ','-delimited list src that dst doesn't
+// already have to dst.  Entries that don't fit are dropped.
+static void dns_list_merge(char dst[static MAX_BUF], const char src[static 1])
+{
+    size_t dlen = strlen(dst);
+    while (*src) {
+        size_t n = strcspn(src, ",");
+        bool dup = false;
+        for (const char *p = dst; *p && !dup;) {
+            size_t m = strcspn(p, ",");
+            dup = m == n && !memcmp(p, src, n);
+            p += m + (p[m] == ',');
+        }
+        if (n && !dup) {
+            if (dlen + !!dlen + n >= MAX_BUF) {
+                log_warning("%s: (%s) DNS list is too long; dropping '%.*s'",
+                            client_config.interface, __func__, (int)n, src);
+                return;
+            }
+            if (dlen)
+                dst[dlen++] = ',';
+            memcpy(dst + dlen, src, n);
+            dlen += n;
+            dst[dlen] = '\0';
+        }
+        src += n + (src[n] == ',');
+    }
+}
+
+// Writes a new resolv.conf based on the information we have received.
+// There is one resolv.conf for every interface: it has the nameservers
+// and the domains of all of them merged in slot order, without
+// duplicates, so the resolver prefers those of the interface that was
+// named first.
 static int write_resolve_conf(void)
 {
     static const char ns_str[] = "nameserver ";
@@ -117,10 +157,15 @@ static int write_resolve_conf(void)
     static const char srch_str[] = "search ";
     off_t off;
     char buf[MAX_BUF];
+    char namesvrs[MAX_BUF] = "", domains[MAX_BUF] = "";
 
     if (resolv_conf_fd < 0)
         return 0;
-    if (strlen(cl.namesvrs) == 0)
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        dns_list_merge(namesvrs, dns_slots[i].namesvrs);
+        dns_list_merge(domains, dns_slots[i].domains);
+    }
+    if (strlen(namesvrs) == 0)
         return -1;
 
     if (lseek(resolv_conf_fd, 0, SEEK_SET) < 0)
@@ -128,7 +173,7 @@ static int write_resolve_conf(void)
 
     write_append_fd(resolv_conf_fd, resolv_conf_head_fd, "prepending resolv_conf head");
 
-    char *p = cl.namesvrs;
+    char *p = namesvrs;
     while (p && (*p != '\0')) {
         char *q = strchr(p, ',');
         if (!q)
@@ -148,7 +193,7 @@ static int write_resolve_conf(void)
         p = q;
     }
 
-    p = cl.domains;
+    p = domains;
     int numdoms = 0;
     while (p && (*p != '\0')) {
         char *q = strchr(p, ',');
@@ -221,12 +266,13 @@ int perform_dns(const char str[static 1], size_t len)
     if (resolv_conf_fd < 0)
         return 0;
     int ret = -1;
-    if (len > sizeof cl.namesvrs) {
-        log_line("DNS server list is too long: %zu > %zu", len, cl.namesvrs);
+    if (len > sizeof dns->namesvrs) {
+        log_line("DNS server list is too long: %zu > %zu", len,
+                 sizeof dns->namesvrs);
         return ret;
     }
-    ssize_t sl = snprintf(cl.namesvrs, sizeof cl.namesvrs, "%s", str);
-    if (sl < 0 || (size_t)sl >= sizeof cl.namesvrs) {
+    ssize_t sl = snprintf(dns->namesvrs, sizeof dns->namesvrs, "%s", str);
+    if (sl < 0 || (size_t)sl >= sizeof dns->namesvrs) {
         log_warning("%s: (%s) snprintf failed",
                     client_config.interface, __func__);
     }
@@ -263,12 +309,13 @@ int perform_domain(const char str[static 1], size_t len)
     if (resolv_conf_fd < 0)
         return 0;
     int ret = -1;
-    if (len > sizeof cl.domains) {
-        log_line("DNS domain list is too long: %zu > %zu", len, cl.namesvrs);
+    if (len > sizeof dns->domains) {
+        log_line("DNS domain list is too long: %zu > %zu", len,
+                 sizeof dns->domains);
         return ret;
     }
-    ssize_t sl = snprintf(cl.domains, sizeof cl.domains, "%s", str);
-    if (sl < 0 || (size_t)sl >= sizeof cl.domains) {
+    ssize_t sl = snprintf(dns->domains, sizeof dns->domains, "%s", str);
+    if (sl < 0 || (size_t)sl >= sizeof dns->domains) {
         log_warning("%s: (%s) snprintf failed",
                     client_config.interface, __func__);
     }
@@ -303,9 +350,18 @@ int perform_wins(const char str[static 1], size_t len)
     return 0;
 }
 
-static void inform_execute(char c)
+// hdr is the header of a binary request, whose id and interface slot are
+// sent back; text requests get a bare status byte.
+static void inform_execute(char c, const uint8_t *hdr)
 {
-    ssize_t r = safe_write(ifchSock[1], &c, sizeof c);
+    char reply[IFCH_REPLY_LEN] = { c };
+    size_t rlen = 1;
+    if (hdr) {
+        memcpy(reply + 1, hdr + 2, 2);
+        memcpy(reply + 3, hdr + 6, 2);
+        rlen = IFCH_REPLY_LEN;
+    }
+    ssize_t r = safe_write(ifchSock[1], reply, rlen);
     if (r == 0) {
         // Remote end hung up.
         exit(EXIT_SUCCESS);
@@ -314,6 +370,108 @@ static void inform_execute(char c)
                 client_config.interface, __func__, strerror(errno));
 }
 
+// Formats a list of addresses as the comma-separated text that the
+// resolv.conf writer and the text command handlers expect.
+static size_t addr_list_str(char out[static 1], size_t olen,
+                            const uint8_t *addrs, size_t len)
+{
+    size_t o = 0;
+    out[0] = '\0';
+    for (size_t i = 0; i + 4 <= len; i += 4) {
+        if (o + INET_ADDRSTRLEN + 1 > olen)
+            break;
+        if (o)
+            out[o++] = ',';
+        inet_ntop(AF_INET, addrs + i, out + o, olen - o);
+        o += strlen(out + o);
+    }
+    return o;
+}
+
+static int execute_tlv(uint8_t type, const uint8_t *val, size_t len)
+{
+    char tb[MAX_BUF];
+    uint32_t a[3];
+    uint16_t u16;
+    int32_t s32;
+    size_t tl;
+
+    switch (type) {
+    case IFCH_T_IP4:
+        memcpy(a, val, len);
+        return perform_ip4(a[0], a[1], len == 12 ? &a[2] : NULL);
+    case IFCH_T_ROUTER:
+        memcpy(a, val, 4);
+        return perform_router_ip(a[0]);
+    case IFCH_T_DNS:
+        tl = addr_list_str(tb, sizeof tb, val, len);
+        return perform_dns(tb, tl);
+    case IFCH_T_LPRSVR:
+        tl = addr_list_str(tb, sizeof tb, val, len);
+        return perform_lprsvr(tb, tl);
+    case IFCH_T_NTPSVR:
+        tl = addr_list_str(tb, sizeof tb, val, len);
+        return perform_ntpsrv(tb, tl);
+    case IFCH_T_WINS:
+        tl = addr_list_str(tb, sizeof tb, val, len);
+        return perform_wins(tb, tl);
+    case IFCH_T_HOSTNAME:
+        memcpy(tb, val, len);
+        tb[len] = '\0';
+        return perform_hostname(tb, len);
+    case IFCH_T_DOMAIN:
+        memcpy(tb, val, len);
+        tb[len] = '\0';
+        return perform_domain(tb, len);
+    case IFCH_T_TIMEZONE:
+        memcpy(&s32, val, 4);
+        tl = snprintf(tb, sizeof tb, "%d", (int32_t)ntohl(s32));
+        return perform_timezone(tb, tl);
+    case IFCH_T_MTU:
+        memcpy(&u16, val, 2);
+        return perform_mtu_num(ntohs(u16));
+    case IFCH_T_IPTTL:
+        tl = snprintf(tb, sizeof tb, "%u", val[0]);
+        return perform_ipttl(tb, tl);
+    case IFCH_T_CARRIER:
+        return perform_carrier();
+    default:
+        return -99;
+    }
+}
+
+/*
+ * Binary counterpart of execute_buffer().  The whole message is checked
+ * before any record in it is acted upon.
+ * Returns -99 if the message is malformed.
+ * Returns -1 if one of the commands failed.
+ * Returns 0 on success.
+ */
+static int execute_binary(const uint8_t buf[static 1], size_t len)
+{
+    int cmdf = 0;
+
+    if (ifch_msg_check(buf, len) < 0) {
+        log_error("%s: ifch received a malformed message",
+                  client_config.interface);
+        return -99;
+    }
+    // The netlink requests of all of the records are sent to the kernel
+    // together once every record has been handled.
+    ifset_batch_begin();
+    struct ifch_tlv rec;
+    for (size_t off = 0; ifch_msg_next(buf, len, &off, &rec);) {
+        int pr = execute_tlv(rec.type, rec.val, rec.len);
+        if (pr == -99) {
+            ifset_batch_discard();
+            return -99;
+        }
+        cmdf |= pr;
+    }
+    cmdf |= ifset_batch_commit();
+    return !cmdf ? 0 : -1;
+}
+
 static void process_client_socket(void)
 {
     char buf[MAX_BUF];
@@ -330,14 +488,27 @@ static void process_client_socket(void)
                 client_config.interface, __func__, strerror(errno));
     }
 
-    int ebr = execute_buffer(buf);
+    // The text protocol is still accepted so that ifch can be driven by
+    // hand when debugging.  It always acts on the first interface.
+    bool binary = (uint8_t)buf[0] == IFCH_PROTO_MAGIC;
+    const uint8_t *hdr = binary && r >= IFCH_PROTO_HDRLEN
+                         ? (const uint8_t *)buf : NULL;
+    size_t slot = hdr ? ifch_msg_get_iface(hdr) : 0;
+    client_config_select(slot);
+    dns = &dns_slots[slot];
+    int ebr = binary ? execute_binary((const uint8_t *)buf, (size_t)r)
+                     : execute_buffer(buf);
     if (ebr < 0) {
-        inform_execute('-');
-        if (ebr == -99)
+        inform_execute('-', hdr);
+        if (ebr == -99) {
+            if (binary)
+                suicide("%s: (%s) received an invalid message",
+                        client_config.interface, __func__);
             suicide("%s: (%s) received invalid commands: '%s'",
                     client_config.interface, __func__, buf);
+        }
     } else
-        inform_execute('+');
+        inform_execute('+', hdr);
 }
 
 static void do_ifch_work(void)
@@ -351,15 +522,14 @@ static void do_ifch_work(void)
 
     cl.state = STATE_NOTHING;
     memset(cl.ibuf, 0, sizeof cl.ibuf);
-    memset(cl.namesvrs, 0, sizeof cl.namesvrs);
-    memset(cl.domains, 0, sizeof cl.domains);
 
     epoll_add(epollfd, ifchSock[1]);
     epoll_add(epollfd, ifchStream[1]);
     epoll_add(epollfd, signalFd);
 
     for (;;) {
-        int r = epoll_wait(epollfd, events, 3, -1);
+        int r = epoll_wait(epollfd, events,
+                           sizeof events / sizeof events[0], -1);
         if (r < 0) {
             if (errno == EINTR)
                 continue;
@@ -367,7 +537,7 @@ static void do_ifch_work(void)
                 suicide("epoll_wait failed");
         }
         for (int i = 0; i < r; ++i) {
-            int fd = events[i].data.fd;
+            int fd = epoll_event_fd(&events[i]);
             if (fd == ifchSock[1]) {
                 if (events[i].events & EPOLLIN)
                     process_client_socket();
@@ -420,6 +590,9 @@ void ifch_main(void)
     umask(077);
     signalFd = setup_signals_subprocess();
     setup_resolv_conf();
+    dns_slots = calloc(client_configs_num, sizeof *dns_slots);
+    if (!dns_slots)
+        suicide("ifch: failed to allocate DNS state");
 
     nk_set_chroot(chroot_dir);
     memset(chroot_dir, '\0', sizeof chroot_dir);
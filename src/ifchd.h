@@ -26,7 +26,10 @@ struct ifchd_client {
     int state;
     /* Per-connection buffer. */
     char ibuf[MAX_BUF];
-    /* ' '-delimited buffers of nameservers and domains */
+};
+
+/* ','-delimited lists of the nameservers and domains of one interface */
+struct ifchd_dns {
     char namesvrs[MAX_BUF];
     char domains[MAX_BUF];
 };
@@ -73,83 +73,215 @@ static inline int subnet4_to_prefixlen(uint32_t sn)
 }
 
 struct ipbcpfx {
-    int fd;
     uint32_t ipaddr;
     uint32_t bcast;
     uint8_t prefixlen;
     bool already_ok;
 };
 
-static ssize_t rtnl_do_send(int fd, const uint8_t *sbuf, size_t slen,
-                            const char *fnname)
+#define RTNL_BATCH_MAX 16
+
+// A set of rtnetlink requests that are sent to the kernel with a single
+// sendto() and that then have their ACKs collected by sequence number.
+struct rtnl_batch {
+    size_t len;
+    int num;
+    struct {
+        uint32_t seq;
+        int err;            // errno from the ACK, or -1 if none arrived.
+        const char *what;   // Names the request in error messages.
+        char note[128];     // Logged if the request succeeds.
+    } req[RTNL_BATCH_MAX];
+    uint8_t buf[4096];
+};
+
+// ifch keeps one rtnetlink socket open for all of its requests.
+static int ifset_nl_fd = -1;
+
+// Requests made by the perform_*() functions are collected in ifset_batch
+// while ifset_batching is set; otherwise each call sends its own batch.
+static struct rtnl_batch ifset_batch;
+static bool ifset_batching;
+
+static int ifset_nl_socket(void)
 {
-    uint8_t response[NLMSG_ALIGN(sizeof(struct nlmsghdr)) + 64];
-    struct sockaddr_nl nl_addr;
+    if (ifset_nl_fd < 0) {
+        ifset_nl_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK,
+                             NETLINK_ROUTE);
+        if (ifset_nl_fd < 0)
+            log_error("%s: netlink socket open failed: %s",
+                      client_config.interface, strerror(errno));
+    }
+    return ifset_nl_fd;
+}
 
-    memset(&nl_addr, 0, sizeof nl_addr);
-    nl_addr.nl_family = AF_NETLINK;
+// Called after a netlink error that may leave stray replies queued on the
+// socket; the next request gets a fresh one.
+static void ifset_nl_reset(void)
+{
+    if (ifset_nl_fd >= 0) {
+        close(ifset_nl_fd);
+        ifset_nl_fd = -1;
+    }
+}
 
-    ssize_t r = safe_sendto(fd, (const char *)sbuf, slen, 0,
+// Appends a copy of the request nlh to the batch.  Returns its index in
+// the batch, or -1 if there is no room.
+static int rtnl_batch_add(struct rtnl_batch b[static 1],
+                          const struct nlmsghdr *nlh, const char *what)
+{
+    size_t len = NLMSG_ALIGN(nlh->nlmsg_len);
+    if (b->num >= RTNL_BATCH_MAX || len > sizeof b->buf - b->len) {
+        log_error("%s: (%s) netlink batch is full",
+                  client_config.interface, what);
+        return -1;
+    }
+    memcpy(b->buf + b->len, nlh, nlh->nlmsg_len);
+    memset(b->buf + b->len + nlh->nlmsg_len, 0, len - nlh->nlmsg_len);
+    b->len += len;
+    int i = b->num++;
+    b->req[i].seq = nlh->nlmsg_seq;
+    b->req[i].err = -1;
+    b->req[i].what = what;
+    b->req[i].note[0] = '\0';
+    return i;
+}
+
+// Sends every request in the batch at once and collects their ACKs.  The
+// kernel handles the requests in order and ACKs each one before sendto()
+// returns.  Returns 0 if all of the ACKs arrived, otherwise -1; the result
+// of each request is left in b->req[].err.
+static int rtnl_batch_send(struct rtnl_batch b[static 1])
+{
+    char nlbuf[8192];
+    int acked = 0;
+
+    if (!b->num)
+        return 0;
+    int fd = ifset_nl_socket();
+    if (fd < 0)
+        return -1;
+    struct sockaddr_nl nl_addr = { .nl_family = AF_NETLINK };
+    ssize_t r = safe_sendto(fd, (const char *)b->buf, b->len, 0,
                             (struct sockaddr *)&nl_addr, sizeof nl_addr);
-    if (r < 0 || (size_t)r != slen) {
+    if (r < 0 || (size_t)r != b->len) {
         if (r < 0)
             log_error("%s: (%s) netlink sendto failed: %s",
-                      client_config.interface, fnname, strerror(errno));
+                      client_config.interface, __func__, strerror(errno));
         else
-            log_error("%s: (%s) netlink sendto short write: %z < %zu",
-                      client_config.interface, fnname, r, slen);
-        return -1;
-    }
-    struct iovec iov = {
-        .iov_base = response,
-        .iov_len = sizeof response,
-    };
-    struct msghdr msg = {
-        .msg_name = &nl_addr,
-        .msg_namelen = sizeof nl_addr,
-        .msg_iov = &iov,
-        .msg_iovlen = 1,
-    };
-    r = safe_recvmsg(fd, &msg, 0);
-    if (r < 0) {
-        log_error("%s: (%s) netlink recvmsg failed: %s",
-                  client_config.interface, fnname, strerror(errno));
-        return -1;
-    }
-    if (msg.msg_flags & MSG_TRUNC) {
-        log_error("%s: (%s) Buffer not long enough for message.",
-                  client_config.interface, fnname);
-        return -1;
-    }
-    if ((size_t)r < sizeof(struct nlmsghdr)) {
-        log_line("%s: (%s) netlink recvmsg returned a headerless response",
-                 client_config.interface, fnname);
-        return -1;
+            log_error("%s: (%s) netlink sendto short write: %zd < %zu",
+                      client_config.interface, __func__, r, b->len);
+        goto fail;
     }
-    const struct nlmsghdr *nlh = (const struct nlmsghdr *)response;
-    if (nlh->nlmsg_type == NLMSG_ERROR) {
-        int nlerr = nlmsg_get_error(nlh);
-        if (nlerr == 0)
-            return 0;
-        else {
-            if (nlerr == 132) {
-                log_line("%s: (%s) RF-kill is set (%d).  Cannot change interface.",
-                         client_config.interface, fnname, nlerr);
-                return -3;
+    while (acked < b->num) {
+        r = nl_recv_buf(fd, nlbuf, sizeof nlbuf);
+        if (r <= 0) {
+            log_error("%s: (%s) only %d of %d netlink requests were ACKed",
+                      client_config.interface, __func__, acked, b->num);
+            goto fail;
+        }
+        size_t blen = (size_t)r;
+        struct nlmsghdr *nlh = (struct nlmsghdr *)nlbuf;
+        for (; NLMSG_OK(nlh, blen); nlh = NLMSG_NEXT(nlh, blen)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR)
+                continue;
+            for (int i = 0; i < b->num; ++i) {
+                if (b->req[i].seq != nlh->nlmsg_seq || b->req[i].err >= 0)
+                    continue;
+                b->req[i].err = nlmsg_get_error(nlh);
+                ++acked;
+                break;
             }
-            log_error("%s: (%s) netlink sendto returned NLMSG_ERROR: %s",
-                      client_config.interface, fnname, strerror(nlerr));
-            return -1;
         }
     }
-    if (nlh->nlmsg_type == NLMSG_DONE)
-        return -2;
-    log_error("%s: (%s) netlink sendto returned an error.",
-              client_config.interface, __func__);
+    return 0;
+fail:
+    ifset_nl_reset();
+    return -1;
+}
+
+// Reports the result of request i.  Returns 0 if it succeeded, -3 if it
+// failed because rfkill is set, otherwise -1.
+static int rtnl_batch_result(const struct rtnl_batch b[static 1], int i)
+{
+    int err = b->req[i].err;
+    if (err == 0) {
+        if (b->req[i].note[0])
+            log_line("%s: %s", client_config.interface, b->req[i].note);
+        return 0;
+    }
+    if (err == 132) {
+        log_line("%s: (%s) RF-kill is set (%d).  Cannot change interface.",
+                 client_config.interface, b->req[i].what, err);
+        return -3;
+    }
+    if (err < 0)
+        log_error("%s: (%s) netlink request was not ACKed",
+                  client_config.interface, b->req[i].what);
+    else
+        log_error("%s: (%s) netlink request failed: %s",
+                  client_config.interface, b->req[i].what, strerror(err));
     return -1;
 }
 
-static ssize_t rtnl_if_flags_send(int fd, int type, int ifi_flags)
+// Starts collecting the netlink requests of the perform_*() calls that
+// follow so that they are sent together by ifset_batch_commit().
+void ifset_batch_begin(void)
+{
+    ifset_batch.len = 0;
+    ifset_batch.num = 0;
+    ifset_batching = true;
+}
+
+// Sends the collected requests.  Returns 0 if they all succeeded, -3 if
+// one failed because rfkill is set, otherwise -1.
+int ifset_batch_commit(void)
+{
+    int ret = 0;
+    ifset_batching = false;
+    rtnl_batch_send(&ifset_batch);
+    for (int i = 0; i < ifset_batch.num; ++i) {
+        int r = rtnl_batch_result(&ifset_batch, i);
+        if (r == -3 || (r < 0 && !ret))
+            ret = r;
+    }
+    ifset_batch.num = 0;
+    ifset_batch.len = 0;
+    return ret;
+}
+
+// Drops the collected requests without sending them.
+void ifset_batch_discard(void)
+{
+    ifset_batching = false;
+    ifset_batch.num = 0;
+    ifset_batch.len = 0;
+}
+
+// Used by the perform_*() functions: joins the batch that is being
+// collected, or starts one of their own, in which case true is returned
+// and the caller must finish it with ifset_batch_end().
+static bool ifset_batch_join(void)
+{
+    if (ifset_batching)
+        return false;
+    ifset_batch_begin();
+    return true;
+}
+
+static int ifset_batch_end(bool own, int ret)
+{
+    if (!own)
+        return ret;
+    if (ret < 0) {
+        ifset_batch_discard();
+        return ret;
+    }
+    return ifset_batch_commit();
+}
+
+static int rtnl_if_flags_add(struct rtnl_batch b[static 1], int type,
+                             uint32_t ifi_flags, uint32_t ifi_change)
 {
     uint8_t request[NLMSG_ALIGN(sizeof(struct nlmsghdr)) +
                     NLMSG_ALIGN(sizeof(struct ifinfomsg))];
@@ -166,14 +298,15 @@ static ssize_t rtnl_if_flags_send(int fd, int type, int ifi_flags)
     ifinfomsg = NLMSG_DATA(header);
     ifinfomsg->ifi_flags = ifi_flags;
     ifinfomsg->ifi_index = client_config.ifindex;
-    ifinfomsg->ifi_change = 0xffffffff;
+    ifinfomsg->ifi_change = ifi_change;
 
-    return rtnl_do_send(fd, request, header->nlmsg_len, __func__);
+    return rtnl_batch_add(b, header, __func__);
 }
 
-static ssize_t rtnl_addr_broadcast_send(int fd, int type, int ifa_flags,
-                                        int ifa_scope, uint32_t *ipaddr,
-                                        uint32_t *bcast, uint8_t prefixlen)
+static int rtnl_addr_broadcast_add(struct rtnl_batch b[static 1], int type,
+                                   int ifa_flags, int ifa_scope,
+                                   const uint32_t *ipaddr,
+                                   const uint32_t *bcast, uint8_t prefixlen)
 {
     uint8_t request[NLMSG_ALIGN(sizeof(struct nlmsghdr)) +
                     NLMSG_ALIGN(sizeof(struct ifaddrmsg)) +
@@ -218,10 +351,11 @@ static ssize_t rtnl_addr_broadcast_send(int fd, int type, int ifa_flags,
         }
     }
 
-    return rtnl_do_send(fd, request, header->nlmsg_len, __func__);
+    return rtnl_batch_add(b, header, __func__);
 }
 
-static ssize_t rtnl_set_default_gw_v4(int fd, uint32_t gw4, int metric)
+static int rtnl_set_default_gw_v4(struct rtnl_batch b[static 1],
+                                  uint32_t gw4, int metric)
 {
     uint8_t request[NLMSG_ALIGN(sizeof(struct nlmsghdr)) +
                     NLMSG_ALIGN(sizeof(struct rtmsg)) +
@@ -273,11 +407,10 @@ static ssize_t rtnl_set_default_gw_v4(int fd, uint32_t gw4, int metric)
         }
     }
 
-    return rtnl_do_send(fd, request, header->nlmsg_len, __func__);
+    return rtnl_batch_add(b, header, __func__);
 }
 
 struct link_flag_data {
-    int fd;
     uint32_t flags;
     bool got_flags;
 };
@@ -303,19 +436,22 @@ static void link_flags_get_do(const struct nlmsghdr *nlh, void *data)
     }
 }
 
-static int link_flags_get(int fd, uint32_t flags[static 1])
+static int link_flags_get(uint32_t flags[static 1])
 {
     char nlbuf[8192];
-    struct link_flag_data ipx = { .fd = fd, .flags = 0, .got_flags = false };
+    struct link_flag_data ipx = { .flags = 0, .got_flags = false };
     ssize_t ret;
+    int fd = ifset_nl_socket();
+    if (fd < 0)
+        return -1;
     uint32_t seq = ifset_nl_seq++;
     if (nl_sendgetlink(fd, seq, client_config.ifindex) < 0)
-        return -1;
+        goto fail;
 
     do {
         ret = nl_recv_buf(fd, nlbuf, sizeof nlbuf);
         if (ret < 0)
-            return -2;
+            goto fail;
         if (nl_foreach_nlmsg(nlbuf, ret, seq, 0, link_flags_get_do,
                              &ipx) < 0)
             return -3;
@@ -325,58 +461,32 @@ static int link_flags_get(int fd, uint32_t flags[static 1])
         return 0;
     }
     return -4;
+fail:
+    ifset_nl_reset();
+    return -2;
 }
 
 int perform_carrier(void)
 {
-    int ret = -1;
     uint32_t flags;
-    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK, NETLINK_ROUTE);
-    if (fd < 0) {
-        log_error("%s: (%s) netlink socket open failed: %s",
-                  client_config.interface, __func__, strerror(errno));
-        goto fail;
-    }
-
-    if (link_flags_get(fd, &flags) < 0)
-        goto fail_fd;
+    if (link_flags_get(&flags) < 0)
+        return -1;
     if ((flags & IFF_RUNNING) && (flags & IFF_UP))
-        ret = 0;
-fail_fd:
-    close(fd);
-fail:
-    return ret;
+        return 0;
+    return -1;
 }
 
-static int link_set_flags(int fd, uint32_t flags)
+// Only the bits in flags are changed, so the current flags need not be
+// fetched first.
+static int link_set_flags(struct rtnl_batch b[static 1], uint32_t flags)
 {
-    uint32_t oldflags;
-
-    int r = link_flags_get(fd, &oldflags);
-    if (r < 0) {
-        log_error("%s: (%s) failed to get old link flags: %u",
-                  client_config.interface, __func__, r);
-        return -1;
-    }
-    if ((oldflags & flags) == flags)
-        return 1;
-    return (int)rtnl_if_flags_send(fd, RTM_SETLINK, flags | oldflags);
+    return rtnl_if_flags_add(b, RTM_SETLINK, flags, flags);
 }
 
 #if 0
-static int link_unset_flags(int fd, uint32_t flags)
+static int link_unset_flags(struct rtnl_batch b[static 1], uint32_t flags)
 {
-    uint32_t oldflags;
-
-    int r = link_flags_get(fd, &oldflags);
-    if (r < 0) {
-        log_error("%s: (%s) failed to get old link flags: %u",
-                  client_config.interface, __func__, r);
-        return -1;
-    }
-    if ((oldflags & flags) == 0)
-        return 1;
-    return (int)rtnl_if_flags_send(fd, RTM_SETLINK, oldflags & ~flags);
+    return rtnl_if_flags_add(b, RTM_SETLINK, 0, flags);
 }
 #endif
 
@@ -385,7 +495,6 @@ static void ipbcpfx_clear_others_do(const struct nlmsghdr *nlh, void *data)
     struct rtattr *tb[IFA_MAX] = {0};
     struct ifaddrmsg *ifm = NLMSG_DATA(nlh);
     struct ipbcpfx *ipx = data;
-    int r;
 
     nl_rtattr_parse(nlh, sizeof *ifm, rtattr_assign, tb);
     switch(nlh->nlmsg_type) {
@@ -419,33 +528,43 @@ static void ipbcpfx_clear_others_do(const struct nlmsghdr *nlh, void *data)
     return;
 
   erase:
-    r = rtnl_addr_broadcast_send(ipx->fd, RTM_DELADDR, ifm->ifa_flags,
-                                 ifm->ifa_scope,
-                                 tb[IFA_ADDRESS] ? RTA_DATA(tb[IFA_ADDRESS]) : NULL,
-                                 tb[IFA_BROADCAST] ? RTA_DATA(tb[IFA_BROADCAST]) : NULL,
-                                 ifm->ifa_prefixlen);
-    if (r < 0 && r != -2) {
+    // Queued rather than sent so that the replies to the dump that we
+    // are reading do not get mixed up with the ACKs.
+    if (rtnl_addr_broadcast_add(&ifset_batch, RTM_DELADDR, ifm->ifa_flags,
+                                ifm->ifa_scope,
+                                tb[IFA_ADDRESS] ? RTA_DATA(tb[IFA_ADDRESS]) : NULL,
+                                tb[IFA_BROADCAST] ? RTA_DATA(tb[IFA_BROADCAST]) : NULL,
+                                ifm->ifa_prefixlen) < 0) {
         log_warning("%s: (%s) Failed to delete IP and broadcast addresses.",
                     client_config.interface, __func__);
     }
     return;
 }
 
-static int ipbcpfx_clear_others(int fd, uint32_t ipaddr, uint32_t bcast,
+// Queues the removal of every address on the interface other than the
+// one we want.  Returns 1 if the one we want is already there.
+static int ipbcpfx_clear_others(uint32_t ipaddr, uint32_t bcast,
                                 uint8_t prefixlen)
 {
     char nlbuf[8192];
-    struct ipbcpfx ipx = { .fd = fd, .ipaddr = ipaddr, .bcast = bcast,
+    struct ipbcpfx ipx = { .ipaddr = ipaddr, .bcast = bcast,
                            .prefixlen = prefixlen, .already_ok = false };
     ssize_t ret;
+    int fd = ifset_nl_socket();
+    if (fd < 0)
+        return -1;
     uint32_t seq = ifset_nl_seq++;
-    if (nl_sendgetaddr4(fd, seq, client_config.ifindex) < 0)
+    if (nl_sendgetaddr4(fd, seq, client_config.ifindex) < 0) {
+        ifset_nl_reset();
         return -1;
+    }
 
     do {
         ret = nl_recv_buf(fd, nlbuf, sizeof nlbuf);
-        if (ret < 0)
+        if (ret < 0) {
+            ifset_nl_reset();
             return -2;
+        }
         if (nl_foreach_nlmsg(nlbuf, ret, seq, 0,
                              ipbcpfx_clear_others_do, &ipx) < 0)
             return -3;
@@ -453,21 +572,14 @@ static int ipbcpfx_clear_others(int fd, uint32_t ipaddr, uint32_t bcast,
     return ipx.already_ok ? 1 : 0;
 }
 
-static ssize_t rtnl_if_mtu_set(int fd, unsigned int mtu)
+// ifi_change is zero, so the link flags are left alone.
+static int rtnl_if_mtu_set(struct rtnl_batch b[static 1], unsigned int mtu)
 {
     uint8_t request[NLMSG_ALIGN(sizeof(struct nlmsghdr)) +
                     NLMSG_ALIGN(sizeof(struct ifinfomsg)) +
                     RTA_LENGTH(sizeof(unsigned int))];
     struct nlmsghdr *header;
     struct ifinfomsg *ifinfomsg;
-    uint32_t oldflags;
-
-    int r = link_flags_get(fd, &oldflags);
-    if (r < 0) {
-        log_error("%s: (%s) failed to get old link flags: %u",
-                  client_config.interface, __func__, r);
-        return -1;
-    }
 
     memset(&request, 0, sizeof request);
     header = (struct nlmsghdr *)request;
@@ -477,9 +589,7 @@ static ssize_t rtnl_if_mtu_set(int fd, unsigned int mtu)
     header->nlmsg_seq = ifset_nl_seq++;
 
     ifinfomsg = NLMSG_DATA(header);
-    ifinfomsg->ifi_flags = oldflags;
     ifinfomsg->ifi_index = client_config.ifindex;
-    ifinfomsg->ifi_change = 0xffffffff;
 
     if (nl_add_rtattr(header, sizeof request, IFLA_MTU,
                       &mtu, sizeof mtu) < 0) {
@@ -488,19 +598,28 @@ static ssize_t rtnl_if_mtu_set(int fd, unsigned int mtu)
         return -1;
     }
 
-    return rtnl_do_send(fd, request, header->nlmsg_len, __func__);
+    return rtnl_batch_add(b, header, __func__);
 }
 
+// Returns 1 if the link was already up, 0 if it was set up, -3 if rfkill
+// prevents it from being set up, or -1 on other failures.
 int perform_ifup(void)
 {
-    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK, NETLINK_ROUTE);
-    if (fd < 0) {
-        log_line("%s: (%s) netlink socket open failed: %s",
-                 client_config.interface, __func__, strerror(errno));
-        return fd;
+    uint32_t oldflags;
+    int r = link_flags_get(&oldflags);
+    if (r < 0) {
+        log_error("%s: (%s) failed to get old link flags: %d",
+                  client_config.interface, __func__, r);
+        r = -1;
+        goto out;
     }
-
-    int r = link_set_flags(fd, IFF_UP);
+    if (oldflags & IFF_UP) {
+        r = 1;
+        goto out;
+    }
+    bool own = ifset_batch_join();
+    r = link_set_flags(&ifset_batch, IFF_UP);
+    r = ifset_batch_end(own, r < 0 ? r : 0);
     if (r < 0) {
         if (r != -3)
             log_error("%s: (%s) Failed to set link to be up.",
@@ -509,51 +628,31 @@ int perform_ifup(void)
             log_line("%s: (%s) rfkill is set; waiting until it is unset",
                      client_config.interface, __func__);
     }
-    close(fd);
+out:
+    // This is called by ndhc before ndhc-ifch is forked, so the socket
+    // must not be kept open.
+    ifset_nl_reset();
     return r;
 }
 
-// str_bcast is optional.
-int perform_ip_subnet_bcast(const char str_ipaddr[static 1],
-                            const char str_subnet[static 1],
-                            const char *str_bcast)
+// bcast is optional; all addresses are in network byte order.
+int perform_ip4(uint32_t ipaddr, uint32_t subnet, const uint32_t *bcast)
 {
-    struct in_addr ipaddr, subnet, bcast;
-    int fd, r, ret = -99;
-    uint8_t prefixlen;
-
-    if (inet_pton(AF_INET, str_ipaddr, &ipaddr) <= 0) {
-        log_error("%s: (%s) bad interface ip address: '%s'",
-                  client_config.interface, __func__, str_ipaddr);
-        goto fail;
-    }
-
-    if (inet_pton(AF_INET, str_subnet, &subnet) <= 0) {
-        log_error("%s: (%s) bad interface subnet address: '%s'",
-                  client_config.interface, __func__, str_subnet);
-        goto fail;
-    }
-    prefixlen = subnet4_to_prefixlen(subnet.s_addr);
+    char str_ipaddr[INET_ADDRSTRLEN], str_subnet[INET_ADDRSTRLEN];
+    char str_bcast[INET_ADDRSTRLEN];
+    uint32_t bc;
+    int r, ret = -99;
+    uint8_t prefixlen = subnet4_to_prefixlen(subnet);
+    bool own = ifset_batch_join();
 
-    if (str_bcast) {
-        if (inet_pton(AF_INET, str_bcast, &bcast) <= 0) {
-            log_error("%s: (%s) bad interface broadcast address: '%s'",
-                      client_config.interface, __func__, str_bcast);
-            goto fail;
-        }
+    if (bcast) {
+        bc = *bcast;
     } else {
         // Generate the standard broadcast address if unspecified.
-        bcast.s_addr = ipaddr.s_addr | htonl(0xfffffffflu >> prefixlen);
-    }
-
-    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK, NETLINK_ROUTE);
-    if (fd < 0) {
-        log_error("%s: (%s) netlink socket open failed: %s",
-                  client_config.interface, __func__, strerror(errno));
-        goto fail;
+        bc = ipaddr | htonl(0xfffffffflu >> prefixlen);
     }
 
-    r = ipbcpfx_clear_others(fd, ipaddr.s_addr, bcast.s_addr, prefixlen);
+    r = ipbcpfx_clear_others(ipaddr, bc, prefixlen);
     if (r < 0 && r > -3) {
         if (r == -1)
             log_error("%s: (%s) error requesting link ip address list",
@@ -561,123 +660,128 @@ int perform_ip_subnet_bcast(const char str_ipaddr[static 1],
         else if (r == -2)
             log_error("%s: (%s) error receiving link ip address list",
                       client_config.interface, __func__);
-        goto fail_fd;
+        goto out;
     }
 
     if (r < 1) {
-        r = rtnl_addr_broadcast_send(fd, RTM_NEWADDR, IFA_F_PERMANENT,
-                                     RT_SCOPE_UNIVERSE, &ipaddr.s_addr, &bcast.s_addr,
-                                     prefixlen);
-        if (r < 0)
-            goto fail_fd;
-
-        log_line("%s: Interface IP set to: '%s'", client_config.interface,
-                 str_ipaddr);
-        log_line("%s: Interface subnet set to: '%s'", client_config.interface,
-                 str_subnet);
-        if (str_bcast)
-            log_line("%s: Broadcast address set to: '%s'",
-                     client_config.interface, str_bcast);
+        int i = rtnl_addr_broadcast_add(&ifset_batch, RTM_NEWADDR,
+                                        IFA_F_PERMANENT, RT_SCOPE_UNIVERSE,
+                                        &ipaddr, &bc, prefixlen);
+        if (i < 0)
+            goto out;
+
+        inet_ntop(AF_INET, &ipaddr, str_ipaddr, sizeof str_ipaddr);
+        inet_ntop(AF_INET, &subnet, str_subnet, sizeof str_subnet);
+        inet_ntop(AF_INET, &bc, str_bcast, sizeof str_bcast);
+        snprintf(ifset_batch.req[i].note, sizeof ifset_batch.req[i].note,
+                 "Interface IP set to: '%s', subnet: '%s', broadcast: '%s'",
+                 str_ipaddr, str_subnet, str_bcast);
     } else
         log_line("%s: Interface IP, subnet, and broadcast were already OK.",
                  client_config.interface);
 
-    if (link_set_flags(fd, IFF_UP | IFF_RUNNING) < 0) {
+    if (link_set_flags(&ifset_batch, IFF_UP) < 0) {
         ret = -1;
-        log_error("%s: (%s) Failed to set link to be up and running.",
-                  client_config.interface, __func__);
-        goto fail_fd;
+        goto out;
     }
     ret = 0;
-fail_fd:
-    close(fd);
-fail:
-    return ret;
+out:
+    return ifset_batch_end(own, ret);
+}
+
+// str_bcast is optional.
+int perform_ip_subnet_bcast(const char str_ipaddr[static 1],
+                            const char str_subnet[static 1],
+                            const char *str_bcast)
+{
+    struct in_addr ipaddr, subnet, bcast;
+
+    if (inet_pton(AF_INET, str_ipaddr, &ipaddr) <= 0) {
+        log_error("%s: (%s) bad interface ip address: '%s'",
+                  client_config.interface, __func__, str_ipaddr);
+        return -99;
+    }
+    if (inet_pton(AF_INET, str_subnet, &subnet) <= 0) {
+        log_error("%s: (%s) bad interface subnet address: '%s'",
+                  client_config.interface, __func__, str_subnet);
+        return -99;
+    }
+    if (str_bcast && inet_pton(AF_INET, str_bcast, &bcast) <= 0) {
+        log_error("%s: (%s) bad interface broadcast address: '%s'",
+                  client_config.interface, __func__, str_bcast);
+        return -99;
+    }
+    return perform_ip4(ipaddr.s_addr, subnet.s_addr,
+                       str_bcast ? &bcast.s_addr : NULL);
 }
 
 
+// router is in network byte order.
+int perform_router_ip(uint32_t router)
+{
+    char str_router[INET_ADDRSTRLEN];
+    bool own = ifset_batch_join();
+
+    int i = rtnl_set_default_gw_v4(&ifset_batch, router, client_config.metric);
+    if (i >= 0) {
+        inet_ntop(AF_INET, &router, str_router, sizeof str_router);
+        snprintf(ifset_batch.req[i].note, sizeof ifset_batch.req[i].note,
+                 "Gateway router set to: '%s'", str_router);
+    }
+    return ifset_batch_end(own, i < 0 ? -99 : 0);
+}
+
 int perform_router(const char str_router[static 1], size_t len)
 {
-    int ret = -99;
     if (len < 7)
-        goto fail;
+        return -99;
     struct in_addr router;
     if (inet_pton(AF_INET, str_router, &router) <= 0) {
         log_error("%s: (%s) bad router ip address: '%s'",
                   client_config.interface, __func__, str_router);
-        goto fail;
+        return -99;
     }
+    return perform_router_ip(router.s_addr);
+}
 
-    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK, NETLINK_ROUTE);
-    if (fd < 0) {
-        log_error("%s: (%s) netlink socket open failed: %s",
-                  client_config.interface, __func__, strerror(errno));
-        goto fail;
+int perform_mtu_num(unsigned int mtu)
+{
+    // 68 bytes for IPv4.  1280 bytes for IPv6.
+    if (mtu < 68) {
+        log_error("%s: (%s) provided mtu arg (%u) less than minimum MTU (68)",
+                  client_config.interface, __func__, mtu);
+        return -99;
     }
 
-    if (rtnl_set_default_gw_v4(fd, router.s_addr, client_config.metric) < 0) {
-        log_error("%s: (%s) failed to set route: %s",
-                  client_config.interface, __func__, strerror(errno));
-        goto fail_fd;
-    }
-    log_line("%s: Gateway router set to: '%s'", client_config.interface,
-             str_router);
-    ret = 0;
-fail_fd:
-    close(fd);
-fail:
-    return ret;
+    bool own = ifset_batch_join();
+    int i = rtnl_if_mtu_set(&ifset_batch, mtu);
+    if (i >= 0)
+        snprintf(ifset_batch.req[i].note, sizeof ifset_batch.req[i].note,
+                 "MTU set to: '%u'", mtu);
+    return ifset_batch_end(own, i < 0 ? -99 : 0);
 }
 
 int perform_mtu(const char str[static 1], size_t len)
 {
-    unsigned int mtu;
-    int fd, ret = -99;
     if (len < 2)
-        goto fail;
+        return -99;
 
     char *estr;
     long tmtu = strtol(str, &estr, 10);
     if (estr == str) {
         log_error("%s: (%s) provided mtu arg isn't a valid number",
                   client_config.interface, __func__);
-        goto fail;
+        return -99;
     }
     if ((tmtu == LONG_MAX || tmtu == LONG_MIN) && errno == ERANGE) {
         log_error("%s: (%s) provided mtu arg would overflow a long",
                   client_config.interface, __func__);
-        goto fail;
+        return -99;
     }
-    if (tmtu > INT_MAX) {
+    if (tmtu > INT_MAX || tmtu < 0) {
         log_error("%s: (%s) provided mtu arg would overflow int",
                   client_config.interface, __func__);
-        goto fail;
-    }
-    // 68 bytes for IPv4.  1280 bytes for IPv6.
-    if (tmtu < 68) {
-        log_error("%s: (%s) provided mtu arg (%ul) less than minimum MTU (68)",
-                  client_config.interface, __func__, tmtu);
-        goto fail;
-    }
-    mtu = (unsigned int)tmtu;
-
-    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK, NETLINK_ROUTE);
-    if (fd < 0) {
-        log_error("%s: (%s) netlink socket open failed: %s",
-                  client_config.interface, __func__, strerror(errno));
-        goto fail;
+        return -99;
     }
-
-    if (rtnl_if_mtu_set(fd, mtu) < 0) {
-        log_error("%s: (%s) failed to set MTU [%d]",
-                  client_config.interface, __func__, mtu);
-        goto fail_fd;
-    }
-    log_line("%s: MTU set to: '%s'", client_config.interface, str);
-    ret = 0;
-fail_fd:
-    close(fd);
-fail:
-    return ret;
+    return perform_mtu_num((unsigned int)tmtu);
 }
-
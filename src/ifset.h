@@ -28,12 +28,19 @@
 
 #ifndef NJK_IFSET_H_
 #define NJK_IFSET_H_
+#include <stdint.h>
+void ifset_batch_begin(void);
+int ifset_batch_commit(void);
+void ifset_batch_discard(void);
 int perform_carrier(void);
 int perform_ifup(void);
+int perform_ip4(uint32_t ipaddr, uint32_t subnet, const uint32_t *bcast);
 int perform_ip_subnet_bcast(const char str_ipaddr[static 1],
                             const char str_subnet[static 1],
                             const char *str_bcast);
+int perform_router_ip(uint32_t router);
 int perform_router(const char str[static 1], size_t len);
+int perform_mtu_num(unsigned int mtu);
 int perform_mtu(const char *str, size_t len);
 #endif
 
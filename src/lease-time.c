@@ -0,0 +1,68 @@
+/* lease-time.c - renew and rebind times of a lease
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lease-time.h"
+
+// Returns the T1 and T2 for a lease of lease seconds, given the renew and
+// rebind times that the server sent (zero if it sent none).
+//
+// The server's T1 and T2 are used if they are sane: T1 < T2 < lease, and
+// neither may be less than 1/8 of the lease so that a hostile server
+// can't make us renew constantly.  Otherwise, we fall back to the
+// RFC2131 'default' values.
+//
+// If jitter is positive, T1 is then moved by a uniformly chosen amount of
+// up to +/- jitter% of itself, so that clients that got their leases at
+// the same moment don't all renew at once.  rnd is the random number that
+// picks the amount.  T1 stays below T2.
+struct lease_times lease_renew_times(uint32_t lease, uint32_t renew,
+                                     uint32_t rebind, int jitter,
+                                     uint32_t rnd)
+{
+    uint32_t tmin = lease >> 3;
+    uint32_t t2 = rebind;
+    if (t2 < tmin || t2 >= lease)
+        t2 = tmin * 0x7; // * 0.875
+    uint32_t t1 = renew;
+    if (t1 < tmin || t1 >= t2) {
+        t1 = lease >> 1;
+        if (t1 >= t2)
+            t1 = t2 >> 1;
+    }
+    if (jitter > 0) {
+        uint32_t j = (uint32_t)((uint64_t)t1 * jitter / 100);
+        if (j) {
+            t1 = t1 - j + rnd % (2 * j + 1);
+            if (t1 >= t2)
+                t1 = t2 - 1;
+            if (t1 < 1)
+                t1 = 1;
+        }
+    }
+    return (struct lease_times){ .t1 = t1, .t2 = t2 };
+}
@@ -1,4 +1,4 @@
-/* leasefile.c - functions for writing the lease file
+/* leasefile.c - functions for reading and writing the lease files
  *
  * Copyright (c) 2011-2015 Nicholas J. Kain <njkain at gmail dot com>
  * All rights reserved.
@@ -31,6 +31,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -41,66 +43,238 @@
 #include "nk/io.h"
 #include "leasefile.h"
 #include "ndhc.h"
+#include "dhcp.h"
+#include "options.h"
+#include "sys.h"
 
-static int leasefilefd = -1;
+#define LEASE_RECORD_MAGIC 0x4e44484cu // "NDHL"
+#define LEASE_RECORD_VERSION 1
 
-static void get_leasefile_path(char *leasefile, size_t dlen, char *ifname)
+// The complete lease as it was last bound or renewed, kept so that ndhc
+// can ask for the same address again with INIT-REBOOT after a restart.
+// Fields are in host byte order except for the addresses, which are kept
+// as they appear in the packet.  A record written on a host of different
+// endianness fails the magic check and is ignored.  Only the first optlen
+// octets of options are written.
+struct lease_record {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t optlen;    // Valid octets in options.
+    uint8_t chaddr[6];  // Hardware address that the lease was bound to.
+    uint8_t pad[2];
+    uint32_t yiaddr;
+    uint32_t serverid;
+    int64_t start;      // Lease start, in seconds on the realtime clock.
+    uint32_t lease;     // Lease length, T1 and T2, in seconds.
+    uint32_t t1;
+    uint32_t t2;
+    uint8_t options[sizeof ((struct dhcpmsg *)0)->options]; // From the ACK.
+};
+
+static void get_leasefile_path(char *leasefile, size_t dlen,
+                               const char *prefix, char *ifname)
 {
-    int splen = snprintf(leasefile, dlen, "%s/LEASE-%s",
-                         state_dir, ifname);
+    int splen = snprintf(leasefile, dlen, "%s/%s-%s",
+                         state_dir, prefix, ifname);
     if (splen < 0)
         suicide("%s: (%s) snprintf failed; return=%d",
-                client_config.interface, __func__, splen);
+                ifname, __func__, splen);
     if ((size_t)splen >= dlen)
         suicide("%s: (%s) snprintf dest buffer too small %d >= %u",
-                client_config.interface, __func__, splen, sizeof dlen);
+                ifname, __func__, splen, sizeof dlen);
 }
 
-void open_leasefile(void)
+void open_leasefile(struct client_state_t cs[static 1])
 {
     char leasefile[PATH_MAX];
-    get_leasefile_path(leasefile, sizeof leasefile, client_config.interface);
-    leasefilefd = open(leasefile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (leasefilefd < 0)
+    get_leasefile_path(leasefile, sizeof leasefile, "LEASE",
+                       cs->cfg->interface);
+    cs->leaseFd = open(leasefile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    if (cs->leaseFd < 0)
         suicide("%s: Failed to create lease file '%s': %s",
-                client_config.interface, leasefile, strerror(errno));
+                cs->cfg->interface, leasefile, strerror(errno));
+    get_leasefile_path(leasefile, sizeof leasefile, "LEASEREC",
+                       cs->cfg->interface);
+    cs->leaseRecFd = open(leasefile, O_RDWR|O_CREAT, 0644);
+    if (cs->leaseRecFd < 0)
+        suicide("%s: Failed to create lease record file '%s': %s",
+                cs->cfg->interface, leasefile, strerror(errno));
 }
 
-void write_leasefile(struct in_addr ipnum)
+// Replaces the contents of a lease file.  Returns 0 on success, -1 on
+// failure.
+static int replace_leasefile(struct client_state_t cs[static 1], int fd,
+                             const char buf[static 1], size_t len)
+{
+    ssize_t ret;
+  retry_trunc:
+    ret = ftruncate(fd, 0);
+    switch (ret) {
+        default: break;
+        case -1:
+            if (errno == EINTR)
+                goto retry_trunc;
+            log_warning("%s: Failed to truncate lease file: %s",
+                        cs->cfg->interface, strerror(errno));
+            return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    ret = safe_write(fd, buf, len);
+    if (ret < 0 || (size_t)ret != len)
+        return -1;
+    fsync(fd);
+    return 0;
+}
+
+void write_leasefile(struct client_state_t cs[static 1], struct in_addr ipnum)
 {
     char ip[INET_ADDRSTRLEN];
     char out[INET_ADDRSTRLEN*2];
-    ssize_t ret;
-    if (leasefilefd < 0) {
+    if (cs->leaseFd < 0) {
         log_error("%s: (%s) leasefile fd < 0; no leasefile will be written",
-                  client_config.interface, __func__);
+                  cs->cfg->interface, __func__);
         return;
     }
     inet_ntop(AF_INET, &ipnum, ip, sizeof ip);
     ssize_t olen = snprintf(out, sizeof out, "%s\n", ip);
     if (olen < 0 || (size_t)olen >= sizeof ip) {
         log_error("%s: (%s) snprintf failed; return=%d",
-                  client_config.interface, __func__, olen);
+                  cs->cfg->interface, __func__, olen);
         return;
     }
-  retry_trunc:
-    ret = ftruncate(leasefilefd, 0);
-    switch (ret) {
-        default: break;
-        case -1:
-            if (errno == EINTR)
-                goto retry_trunc;
-            log_warning("%s: Failed to truncate lease file: %s",
-                        client_config.interface, strerror(errno));
-            return;
-    }
-    lseek(leasefilefd, 0, SEEK_SET);
-    size_t outlen = strlen(out);
-    ret = safe_write(leasefilefd, out, outlen);
-    if (ret < 0 || (size_t)ret != outlen)
+    if (replace_leasefile(cs, cs->leaseFd, out, strlen(out)) < 0)
         log_warning("%s: Failed to write ip to lease file.",
-                    client_config.interface);
-    else
-        fsync(leasefilefd);
+                    cs->cfg->interface);
+}
+
+// Stores the lease that was just bound or renewed from the ACK indexed by oi.
+// cs must already hold the lease times from that ACK.
+void write_lease_record(struct client_state_t cs[static 1],
+                        const struct dhcp_optidx oi[static 1])
+{
+    if (cs->leaseRecFd < 0 || oi->end < 0)
+        return;
+    const struct dhcpmsg *packet = oi->packet;
+    int found;
+    struct lease_record rec = {
+        .magic = LEASE_RECORD_MAGIC,
+        .version = LEASE_RECORD_VERSION,
+        .optlen = (uint16_t)(oi->end + 1),
+        .yiaddr = packet->yiaddr,
+        .serverid = get_option_serverid(oi, &found),
+        .start = time(NULL) - (curms() - cs->leaseStartTime) / 1000,
+        .lease = cs->lease,
+        .t1 = (uint32_t)cs->renewTime,
+        .t2 = (uint32_t)cs->rebindTime,
+    };
+    memcpy(rec.chaddr, cs->cfg->arp, sizeof rec.chaddr);
+    memcpy(rec.options, packet->options, rec.optlen);
+    if (replace_leasefile(cs, cs->leaseRecFd, (const char *)&rec,
+                          offsetof(struct lease_record, options)
+                          + rec.optlen) < 0)
+        log_warning("%s: Failed to write lease record.",
+                    cs->cfg->interface);
 }
 
+// Forgets the stored lease so that it will not be requested again.
+void clear_lease_record(struct client_state_t cs[static 1])
+{
+    if (cs->leaseRecFd < 0)
+        return;
+    if (ftruncate(cs->leaseRecFd, 0) < 0)
+        log_warning("%s: Failed to truncate lease record: %s",
+                    cs->cfg->interface, strerror(errno));
+}
+
+// Reads the stored lease into rec and checks that it belongs to this
+// interface and that its times are still usable.  Returns the seconds that
+// are left of the lease, or -1 if there is no valid stored lease.
+static long long lease_record_load(struct client_state_t cs[static 1],
+                                   struct lease_record rec[static 1])
+{
+    if (cs->leaseRecFd < 0)
+        return -1;
+    lseek(cs->leaseRecFd, 0, SEEK_SET);
+    ssize_t r = safe_read(cs->leaseRecFd, (char *)rec, sizeof *rec);
+    if (r < (ssize_t)offsetof(struct lease_record, options))
+        return -1;
+    if (rec->magic != LEASE_RECORD_MAGIC
+        || rec->version != LEASE_RECORD_VERSION
+        || rec->optlen > sizeof rec->options
+        || (size_t)r != offsetof(struct lease_record, options) + rec->optlen
+        || !rec->t1 || rec->t1 >= rec->t2 || rec->t2 >= rec->lease) {
+        log_line("%s: Ignoring invalid lease record.", cs->cfg->interface);
+        return -1;
+    }
+    if (memcmp(rec->chaddr, cs->cfg->arp, sizeof rec->chaddr))
+        return -1;
+    if (cs->clientAddr && cs->clientAddr != rec->yiaddr)
+        return -1;
+    long long now = time(NULL);
+    // If the realtime clock has been set back since the lease was stored,
+    // there is no way to tell how much of the lease is left.
+    if (now < rec->start) {
+        log_line("%s: Stored lease starts in the future.  Ignoring it.",
+                 cs->cfg->interface);
+        return -1;
+    }
+    if (now >= rec->start + rec->lease) {
+        log_line("%s: Stored lease has expired.", cs->cfg->interface);
+        return -1;
+    }
+    return rec->start + rec->lease - now;
+}
+
+// Loads the stored lease, if there is one that is still valid for this
+// interface, and sets up cs to request it with INIT-REBOOT.  Returns 1 if
+// a lease was loaded, otherwise 0.
+int read_lease_record(struct client_state_t cs[static 1])
+{
+    struct lease_record rec;
+    long long left = lease_record_load(cs, &rec);
+    if (left < 0)
+        return 0;
+    char clibuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(struct in_addr){.s_addr=rec.yiaddr},
+              clibuf, sizeof clibuf);
+    log_line("%s: Found stored lease of %s with %lld seconds left.",
+             cs->cfg->interface, clibuf, left);
+    cs->clientAddr = rec.yiaddr;
+    cs->prevAddr = rec.yiaddr;
+    cs->init_reboot = true;
+    return 1;
+}
+
+// RFC2131 3.7: if no server answers our INIT-REBOOT request, we may keep
+// using the stored lease for the rest of its time.  Rebuilds the stored
+// ACK into packet and restores the server and the lease times in cs as
+// they were when the lease was bound, so that we renew and rebind on the
+// original schedule.  Returns 0 on success, or -1 if there is no valid
+// stored lease left to use.
+int restore_lease_record(struct client_state_t cs[static 1],
+                         struct dhcpmsg packet[static 1])
+{
+    struct lease_record rec;
+    long long left = lease_record_load(cs, &rec);
+    if (left < 0)
+        return -1;
+    memset(packet, 0, sizeof *packet);
+    packet->op = 2;
+    packet->htype = 1;
+    packet->hlen = 6;
+    packet->yiaddr = rec.yiaddr;
+    packet->cookie = htonl(DHCP_MAGIC);
+    memcpy(packet->chaddr, rec.chaddr, sizeof rec.chaddr);
+    memcpy(packet->options, rec.options, rec.optlen);
+
+    long long nowts = curms();
+    cs->clientAddr = rec.yiaddr;
+    cs->serverAddr = rec.serverid;
+    cs->srcAddr = rec.serverid;
+    cs->lease = rec.lease;
+    cs->renewTime = rec.t1;
+    cs->rebindTime = rec.t2;
+    cs->leaseStartTime = nowts - (rec.lease - left) * 1000;
+    ntimer_arm(&cs->dhcp_wake_ts, cs->leaseStartTime + cs->renewTime * 1000);
+    return 0;
+}
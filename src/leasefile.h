@@ -1,4 +1,4 @@
-/* leasefile.h - functions for writing the lease file
+/* leasefile.h - functions for reading and writing the lease files
  *
  * Copyright (c) 2011-2015 Nicholas J. Kain <njkain at gmail dot com>
  * All rights reserved.
@@ -29,8 +29,18 @@
 #ifndef NJK_NDHC_LEASEFILE_H_
 #define NJK_NDHC_LEASEFILE_H_
 
-void open_leasefile(void);
-void write_leasefile(struct in_addr ipnum);
+#include "ndhc.h"
+#include "dhcp.h"
+#include "options.h"
+
+void open_leasefile(struct client_state_t cs[static 1]);
+void write_leasefile(struct client_state_t cs[static 1], struct in_addr ipnum);
+void write_lease_record(struct client_state_t cs[static 1],
+                        const struct dhcp_optidx oi[static 1]);
+void clear_lease_record(struct client_state_t cs[static 1]);
+int read_lease_record(struct client_state_t cs[static 1]);
+int restore_lease_record(struct client_state_t cs[static 1],
+                         struct dhcpmsg packet[static 1]);
 
 #endif /* NJK_NDHC_LEASEFILE_H_ */
 
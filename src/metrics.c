@@ -0,0 +1,506 @@
+/* metrics.c - counters exported in Prometheus text format
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include "nk/log.h"
+#include "nk/io.h"
+#include "metrics.h"
+#include "ndhc.h"
+#include "arp.h"
+#include "timer.h"
+
+// The counters live in each interface's struct metrics_data and are only
+// ever incremented in place.  A text rendering of them replaces
+// METRICS-<interface>.prom in state_dir whenever they have changed, but no
+// more often than once every METRICS_INTERVAL ms, so that a node exporter
+// textfile collector can pick them up.  The file is written under a
+// temporary name and renamed over the old one, so readers never see a
+// partial file.
+
+#define METRICS_INTERVAL 1000
+
+static const char * const metrics_msgtype_names[METRICS_MSGTYPES] = {
+    "other", "discover", "offer", "request", "decline", "ack", "nak",
+    "release", "inform",
+};
+
+static const char * const metrics_reject_names[MREJ_MAX] = {
+    [MREJ_FILTER] = "filter",
+    [MREJ_LENGTH] = "length",
+    [MREJ_IP_CHECKSUM] = "ip_checksum",
+    [MREJ_UDP_CHECKSUM] = "udp_checksum",
+    [MREJ_COOKIE] = "cookie",
+    [MREJ_XID] = "xid",
+    [MREJ_CHADDR] = "chaddr",
+    [MREJ_NO_END] = "no_end",
+    [MREJ_NO_MSGTYPE] = "no_msgtype",
+    [MREJ_CLIENTID] = "clientid",
+};
+
+static const char * const metrics_ipc_names[MIPC_MAX] = {
+    [MIPC_SOCKD] = "sockd",
+    [MIPC_IFCH] = "ifch",
+};
+
+// Upper bounds of the time-to-lease histogram buckets, in ms.
+static const long long metrics_lease_bounds[METRICS_LEASE_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000,
+};
+
+// Upper bounds of the round-trip time histogram buckets, in us.
+static const long long metrics_rtt_bounds[METRICS_RTT_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000,
+};
+
+// Upper bounds of the ARP defense latency histogram buckets, in us.
+static const long long metrics_defense_bounds[METRICS_DEFENSE_BUCKETS] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 10000, 100000,
+};
+
+static const char * const metrics_bind_names[2] = { "idle", "pending" };
+
+static const char * const metrics_filter_names[2] = { "ndhc", "kernel" };
+
+static const char * const metrics_rtt_names[RTT_KINDS] = {
+    [RTT_DHCP] = "dhcp",
+    [RTT_ARP] = "arp",
+};
+
+// The directory is shared by every interface of the master.
+static int metrics_dirfd = -1;
+
+// The directory is opened before ndhc chroots, and the file is always
+// addressed relative to it.  Metrics are optional: if any of this fails,
+// ndhc runs without them.
+void metrics_open(struct client_state_t cs[static 1])
+{
+    struct metrics_data *m = cs->metrics;
+    int r = snprintf(m->name, sizeof m->name, "METRICS-%s.prom",
+                     cs->cfg->interface);
+    if (r < 0 || (size_t)r >= sizeof m->name)
+        return;
+    r = snprintf(m->tmpname, sizeof m->tmpname, ".METRICS-%s.tmp",
+                 cs->cfg->interface);
+    if (r < 0 || (size_t)r >= sizeof m->tmpname)
+        return;
+    size_t j = 0;
+    for (const char *c = cs->cfg->interface; *c; ++c) {
+        if (*c == '\\' || *c == '"')
+            m->label[j++] = '\\';
+        m->label[j++] = *c;
+    }
+    m->label[j] = '\0';
+    if (metrics_dirfd < 0)
+        metrics_dirfd = open(state_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    m->dirfd = metrics_dirfd;
+    if (m->dirfd < 0) {
+        log_warning("%s: Failed to open state directory for metrics: %s",
+                    cs->cfg->interface, strerror(errno));
+        return;
+    }
+    m->dirty = true;
+}
+
+void metrics_touch(struct client_state_t cs[static 1])
+{
+    cs->metrics->dirty = true;
+}
+
+void metrics_dhcp_rx(struct client_state_t cs[static 1], uint8_t msgtype)
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->dhcp_rx[msgtype < METRICS_MSGTYPES ? msgtype : 0];
+    m->dirty = true;
+}
+
+void metrics_dhcp_tx(struct client_state_t cs[static 1], uint8_t msgtype,
+                     bool retransmit)
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->dhcp_tx[msgtype < METRICS_MSGTYPES ? msgtype : 0];
+    if (retransmit)
+        ++m->dhcp_retransmits;
+    m->dirty = true;
+}
+
+void metrics_dhcp_reject(struct client_state_t cs[static 1],
+                         enum metrics_reject why)
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->dhcp_rejects[why];
+    m->dirty = true;
+}
+
+void metrics_dhcp_listen(struct client_state_t cs[static 1], bool kernel)
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->dhcp_listens[kernel];
+    m->dirty = true;
+}
+
+void metrics_arp_rx(struct client_state_t cs[static 1], bool filtered)
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->arp_rx;
+    if (filtered)
+        ++m->arp_filtered;
+    m->dirty = true;
+}
+
+void metrics_arp_defend(struct client_state_t cs[static 1])
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->arp_defends;
+    m->dirty = true;
+}
+
+// Time from a conflicting ARP frame being received to our announcement
+// being sent in reply.
+void metrics_arp_defense_latency(struct client_state_t cs[static 1],
+                                 long long ns, bool bind_pending)
+{
+    struct metrics_data *m = cs->metrics;
+    if (ns < 0)
+        return;
+    long long us = ns / 1000;
+    size_t i = 0;
+    while (i < METRICS_DEFENSE_BUCKETS && us > metrics_defense_bounds[i])
+        ++i;
+    ++m->defense_buckets[bind_pending][i];
+    ++m->defense_count[bind_pending];
+    m->defense_sum_us[bind_pending] += us;
+    m->dirty = true;
+}
+
+void metrics_ipc(struct client_state_t cs[static 1], enum metrics_ipc peer,
+                 bool ok)
+{
+    struct metrics_data *m = cs->metrics;
+    ++m->ipc[peer];
+    if (!ok)
+        ++m->ipc_failures[peer];
+    m->dirty = true;
+}
+
+void metrics_acquire_begin(struct client_state_t cs[static 1], long long nowts)
+{
+    struct metrics_data *m = cs->metrics;
+    if (m->acquire_start < 0)
+        m->acquire_start = nowts;
+}
+
+void metrics_lease_bound(struct client_state_t cs[static 1], long long nowts)
+{
+    struct metrics_data *m = cs->metrics;
+    if (m->acquire_start < 0)
+        return;
+    long long d = nowts - m->acquire_start;
+    size_t i = 0;
+    while (i < METRICS_LEASE_BUCKETS && d > metrics_lease_bounds[i])
+        ++i;
+    ++m->lease_buckets[i];
+    ++m->lease_count;
+    m->lease_sum_ms += d;
+    m->acquire_start = -1;
+    m->dirty = true;
+}
+
+void metrics_rtt(struct client_state_t cs[static 1], enum rtt_kind kind,
+                 long long rtt_us)
+{
+    struct metrics_data *m = cs->metrics;
+    size_t i = 0;
+    while (i < METRICS_RTT_BUCKETS && rtt_us > metrics_rtt_bounds[i])
+        ++i;
+    ++m->rtt_buckets[kind][i];
+    ++m->rtt_count[kind];
+    m->rtt_sum_us[kind] += rtt_us;
+    m->dirty = true;
+}
+
+struct mbuf {
+    const char *label;  // Escaped interface name.
+    char buf[16384];
+    size_t len;
+    bool overflow;
+};
+
+static void mprintf(struct mbuf b[static 1], const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void mprintf(struct mbuf b[static 1], const char *fmt, ...)
+{
+    if (b->overflow)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int r = vsnprintf(b->buf + b->len, sizeof b->buf - b->len, fmt, ap);
+    va_end(ap);
+    if (r < 0 || (size_t)r >= sizeof b->buf - b->len) {
+        b->overflow = true;
+        return;
+    }
+    b->len += (size_t)r;
+}
+
+static void mhdr(struct mbuf b[static 1], const char *name,
+                 const char *type, const char *help)
+{
+    mprintf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void mval(struct mbuf b[static 1], const char *name,
+                 unsigned long long v)
+{
+    mprintf(b, "%s{interface=\"%s\"} %llu\n", name, b->label, v);
+}
+
+static void mval_l(struct mbuf b[static 1], const char *name,
+                   const char *lname, const char *lval,
+                   unsigned long long v)
+{
+    mprintf(b, "%s{interface=\"%s\",%s=\"%s\"} %llu\n",
+            name, b->label, lname, lval, v);
+}
+
+static void metrics_render(struct client_state_t cs[static 1],
+                           struct mbuf b[static 1])
+{
+    const struct metrics_data *m = cs->metrics;
+    mhdr(b, "ndhc_dhcp_rx_packets_total", "counter",
+         "DHCP packets accepted, by message type.");
+    for (size_t i = 0; i < METRICS_MSGTYPES; ++i)
+        mval_l(b, "ndhc_dhcp_rx_packets_total", "type",
+               metrics_msgtype_names[i], m->dhcp_rx[i]);
+    mhdr(b, "ndhc_dhcp_tx_packets_total", "counter",
+         "DHCP packets sent, by message type.");
+    for (size_t i = 0; i < METRICS_MSGTYPES; ++i)
+        mval_l(b, "ndhc_dhcp_tx_packets_total", "type",
+               metrics_msgtype_names[i], m->dhcp_tx[i]);
+    mhdr(b, "ndhc_dhcp_retransmits_total", "counter",
+         "DHCP requests sent again with an unchanged xid.");
+    mval(b, "ndhc_dhcp_retransmits_total", m->dhcp_retransmits);
+    mhdr(b, "ndhc_dhcp_rejected_packets_total", "counter",
+         "Received DHCP packets that were dropped, by reason.");
+    for (size_t i = 0; i < MREJ_MAX; ++i)
+        mval_l(b, "ndhc_dhcp_rejected_packets_total", "reason",
+               metrics_reject_names[i], m->dhcp_rejects[i]);
+    mhdr(b, "ndhc_dhcp_listen_sockets_total", "counter",
+         "DHCP listen sockets opened, by whether replies for other "
+         "clients are dropped in the kernel or in ndhc.");
+    for (size_t i = 0; i < 2; ++i)
+        mval_l(b, "ndhc_dhcp_listen_sockets_total", "filter",
+               metrics_filter_names[i], m->dhcp_listens[i]);
+    mhdr(b, "ndhc_dhcp_foreign_packets_total", "counter",
+         "Replies for another client or transaction that woke ndhc.  "
+         "Under the kernel filter, only those queued before an xid change "
+         "get this far.");
+    mval(b, "ndhc_dhcp_foreign_packets_total", cs->foreign_dhcp_packets);
+    mhdr(b, "ndhc_dhcp_renews_sent", "gauge",
+         "Renew and rebind requests sent for the current lease.");
+    mval(b, "ndhc_dhcp_renews_sent", cs->renews_sent);
+
+    mhdr(b, "ndhc_bpf_active", "gauge",
+         "Whether a socket is filtered in the kernel (1) or in ndhc (0).");
+    mval_l(b, "ndhc_bpf_active", "socket", "dhcp", cs->using_dhcp_bpf);
+    mval_l(b, "ndhc_bpf_active", "socket", "arp", cs->garp->using_bpf);
+    mhdr(b, "ndhc_arp_rx_frames_total", "counter",
+         "ARP frames received.");
+    mval(b, "ndhc_arp_rx_frames_total", m->arp_rx);
+    mhdr(b, "ndhc_arp_filtered_frames_total", "counter",
+         "ARP frames dropped by ndhc's emulation of the socket BPF.");
+    mval(b, "ndhc_arp_filtered_frames_total", m->arp_filtered);
+    mhdr(b, "ndhc_arp_conflicts_total", "counter",
+         "Address conflicts seen on the interface.");
+    mval(b, "ndhc_arp_conflicts_total", cs->garp->total_conflicts);
+    mhdr(b, "ndhc_arp_defense_announcements_total", "counter",
+         "ARP announcements sent to defend the lease address.");
+    mval(b, "ndhc_arp_defense_announcements_total", m->arp_defends);
+
+    mhdr(b, "ndhc_arp_defense_latency_seconds", "histogram",
+         "Time from receiving a conflicting ARP to sending the defense, "
+         "by whether a bind was in progress.");
+    for (size_t k = 0; k < 2; ++k) {
+        uint64_t cum = 0;
+        for (size_t i = 0; i < METRICS_DEFENSE_BUCKETS; ++i) {
+            cum += m->defense_buckets[k][i];
+            mprintf(b, "ndhc_arp_defense_latency_seconds_bucket"
+                    "{interface=\"%s\",bind=\"%s\",le=\"%lld.%06lld\"} %llu\n",
+                    b->label, metrics_bind_names[k],
+                    metrics_defense_bounds[i] / 1000000,
+                    metrics_defense_bounds[i] % 1000000,
+                    (unsigned long long)cum);
+        }
+        cum += m->defense_buckets[k][METRICS_DEFENSE_BUCKETS];
+        mprintf(b, "ndhc_arp_defense_latency_seconds_bucket"
+                "{interface=\"%s\",bind=\"%s\",le=\"+Inf\"} %llu\n",
+                b->label, metrics_bind_names[k],
+                (unsigned long long)cum);
+        mprintf(b, "ndhc_arp_defense_latency_seconds_sum"
+                "{interface=\"%s\",bind=\"%s\"} %lld.%06lld\n",
+                b->label, metrics_bind_names[k],
+                m->defense_sum_us[k] / 1000000,
+                m->defense_sum_us[k] % 1000000);
+        mval_l(b, "ndhc_arp_defense_latency_seconds_count", "bind",
+               metrics_bind_names[k], m->defense_count[k]);
+    }
+
+    mhdr(b, "ndhc_ipc_roundtrips_total", "counter",
+         "Requests answered by the privileged helper processes.");
+    for (size_t i = 0; i < MIPC_MAX; ++i)
+        mval_l(b, "ndhc_ipc_roundtrips_total", "peer",
+               metrics_ipc_names[i], m->ipc[i]);
+    mhdr(b, "ndhc_ipc_failures_total", "counter",
+         "Requests that a privileged helper process reported as failed.");
+    for (size_t i = 0; i < MIPC_MAX; ++i)
+        mval_l(b, "ndhc_ipc_failures_total", "peer",
+               metrics_ipc_names[i], m->ipc_failures[i]);
+
+    mhdr(b, "ndhc_time_to_lease_seconds", "histogram",
+         "Time from starting to look for a lease until one was bound.");
+    uint64_t cum = 0;
+    for (size_t i = 0; i < METRICS_LEASE_BUCKETS; ++i) {
+        cum += m->lease_buckets[i];
+        mprintf(b, "ndhc_time_to_lease_seconds_bucket"
+                "{interface=\"%s\",le=\"%lld.%03lld\"} %llu\n",
+                b->label, metrics_lease_bounds[i] / 1000,
+                metrics_lease_bounds[i] % 1000, (unsigned long long)cum);
+    }
+    cum += m->lease_buckets[METRICS_LEASE_BUCKETS];
+    mprintf(b, "ndhc_time_to_lease_seconds_bucket"
+            "{interface=\"%s\",le=\"+Inf\"} %llu\n",
+            b->label, (unsigned long long)cum);
+    mprintf(b, "ndhc_time_to_lease_seconds_sum"
+            "{interface=\"%s\"} %lld.%03lld\n",
+            b->label, m->lease_sum_ms / 1000, m->lease_sum_ms % 1000);
+    mval(b, "ndhc_time_to_lease_seconds_count", m->lease_count);
+
+    mhdr(b, "ndhc_rtt_seconds", "histogram",
+         "Round-trip times of DHCP requests and ARP pings, "
+         "from kernel timestamps.");
+    for (size_t k = 0; k < RTT_KINDS; ++k) {
+        cum = 0;
+        for (size_t i = 0; i < METRICS_RTT_BUCKETS; ++i) {
+            cum += m->rtt_buckets[k][i];
+            mprintf(b, "ndhc_rtt_seconds_bucket"
+                    "{interface=\"%s\",kind=\"%s\",le=\"%lld.%06lld\"} %llu\n",
+                    b->label, metrics_rtt_names[k],
+                    metrics_rtt_bounds[i] / 1000000,
+                    metrics_rtt_bounds[i] % 1000000,
+                    (unsigned long long)cum);
+        }
+        cum += m->rtt_buckets[k][METRICS_RTT_BUCKETS];
+        mprintf(b, "ndhc_rtt_seconds_bucket"
+                "{interface=\"%s\",kind=\"%s\",le=\"+Inf\"} %llu\n",
+                b->label, metrics_rtt_names[k],
+                (unsigned long long)cum);
+        mprintf(b, "ndhc_rtt_seconds_sum"
+                "{interface=\"%s\",kind=\"%s\"} %lld.%06lld\n",
+                b->label, metrics_rtt_names[k],
+                m->rtt_sum_us[k] / 1000000, m->rtt_sum_us[k] % 1000000);
+        mval_l(b, "ndhc_rtt_seconds_count", "kind", metrics_rtt_names[k],
+               m->rtt_count[k]);
+    }
+    mhdr(b, "ndhc_rtt_smoothed_seconds", "gauge",
+         "Smoothed round-trip time to each DHCP server and ARP target.");
+    for (size_t k = 0; k < RTT_KINDS; ++k) {
+        const struct rtt_est *t = rtt_table(cs, k);
+        for (size_t i = 0; i < RTT_PEERS; ++i) {
+            if (!t[i].addr)
+                continue;
+            char peer[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &(struct in_addr){.s_addr = t[i].addr},
+                      peer, sizeof peer);
+            mprintf(b, "ndhc_rtt_smoothed_seconds"
+                    "{interface=\"%s\",kind=\"%s\",peer=\"%s\"} "
+                    "%lld.%06lld\n",
+                    b->label, metrics_rtt_names[k], peer,
+                    t[i].srtt_us / 1000000, t[i].srtt_us % 1000000);
+        }
+    }
+}
+
+static int metrics_write(const struct metrics_data m[static 1],
+                         const char *buf, size_t len)
+{
+    int fd = openat(m->dirfd, m->tmpname, METRICS_OPEN_FLAGS, 0644);
+    if (fd < 0)
+        return -1;
+    ssize_t r = safe_write(fd, buf, len);
+    close(fd);
+    if (r < 0 || (size_t)r != len)
+        return -1;
+    return renameat(m->dirfd, m->tmpname,
+                    m->dirfd, m->name);
+}
+
+// Called once per pass of the main loop.  If the counters have changed too
+// soon after the last write, a timer is armed so that the main loop comes
+// back around when the write is due.
+void metrics_flush(struct client_state_t cs[static 1], long long nowts)
+{
+    struct metrics_data *m = cs->metrics;
+    if (!m->dirty || m->dirfd < 0)
+        return;
+    if (m->last_ts >= 0 && nowts < m->last_ts + METRICS_INTERVAL) {
+        ntimer_arm(&m->wake, m->last_ts + METRICS_INTERVAL);
+        return;
+    }
+    ntimer_disarm(&m->wake);
+    m->dirty = false;
+    m->last_ts = nowts;
+
+    // Scratch space only; nothing in it outlives this call.
+    static struct mbuf b;
+    b.label = m->label;
+    b.len = 0;
+    b.overflow = false;
+    metrics_render(cs, &b);
+    if (b.overflow) {
+        log_error("%s: (%s) metrics buffer is too small",
+                  cs->cfg->interface, __func__);
+        return;
+    }
+    if (metrics_write(m, b.buf, b.len) < 0) {
+        if (!m->failed)
+            log_warning("%s: Failed to write metrics file '%s': %s",
+                        cs->cfg->interface, m->name,
+                        strerror(errno));
+        m->failed = true;
+        return;
+    }
+    m->failed = false;
+}
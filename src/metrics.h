@@ -0,0 +1,130 @@
+/* metrics.h - counters exported in Prometheus text format
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NDHC_METRICS_H_
+#define NDHC_METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include "ndhc.h"
+#include "rtt.h"
+
+// Why a received DHCP packet was dropped before reaching the state machine.
+enum metrics_reject {
+    MREJ_FILTER = 0,   // Userspace emulation of the listen socket BPF.
+    MREJ_LENGTH,
+    MREJ_IP_CHECKSUM,
+    MREJ_UDP_CHECKSUM,
+    MREJ_COOKIE,
+    MREJ_XID,
+    MREJ_CHADDR,
+    MREJ_NO_END,
+    MREJ_NO_MSGTYPE,
+    MREJ_CLIENTID,
+    MREJ_MAX,
+};
+
+enum metrics_ipc {
+    MIPC_SOCKD = 0,
+    MIPC_IFCH,
+    MIPC_MAX,
+};
+
+// The seccomp filter allows the metrics file to be opened with only these.
+#define METRICS_OPEN_FLAGS (O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC)
+
+#define METRICS_MSGTYPES 9    // Index 0 counts unknown message types.
+#define METRICS_LEASE_BUCKETS 9
+#define METRICS_RTT_BUCKETS 10
+#define METRICS_DEFENSE_BUCKETS 10
+
+// The counters of one interface and the state of its metrics file.  Each
+// histogram has one more bucket than it has bounds, for +Inf.
+struct metrics_data {
+    uint64_t dhcp_rx[METRICS_MSGTYPES];
+    uint64_t dhcp_tx[METRICS_MSGTYPES];
+    uint64_t dhcp_retransmits;
+    uint64_t dhcp_rejects[MREJ_MAX];
+    // Listen sockets opened; index 1 is for those with the xid and chaddr
+    // filter installed in the kernel.
+    uint64_t dhcp_listens[2];
+    uint64_t arp_rx;
+    uint64_t arp_filtered;
+    uint64_t arp_defends;
+    uint64_t ipc[MIPC_MAX];
+    uint64_t ipc_failures[MIPC_MAX];
+    uint64_t lease_buckets[METRICS_LEASE_BUCKETS + 1];
+    uint64_t lease_count;
+    long long lease_sum_ms;
+    uint64_t rtt_buckets[RTT_KINDS][METRICS_RTT_BUCKETS + 1];
+    uint64_t rtt_count[RTT_KINDS];
+    long long rtt_sum_us[RTT_KINDS];
+    // Defense latency; index 1 is for conflicts seen while ifch requests
+    // were outstanding.
+    uint64_t defense_buckets[2][METRICS_DEFENSE_BUCKETS + 1];
+    uint64_t defense_count[2];
+    long long defense_sum_us[2];
+    long long acquire_start; // -1 when no acquisition is being timed.
+
+    int dirfd;          // The state directory, or -1 if metrics are off.
+    bool dirty;
+    bool failed;        // The last write failed and was logged.
+    long long last_ts;
+    struct ntimer wake;
+    char name[IFNAMSIZ + 16];
+    char tmpname[IFNAMSIZ + 16];
+    char label[IFNAMSIZ * 2]; // Escaped interface name.
+};
+
+#define METRICS_DATA_INIT { .acquire_start = -1, .dirfd = -1, \
+                            .last_ts = -1, .wake = NTIMER_INIT }
+
+void metrics_open(struct client_state_t cs[static 1]);
+void metrics_flush(struct client_state_t cs[static 1], long long nowts);
+void metrics_touch(struct client_state_t cs[static 1]);
+
+void metrics_dhcp_rx(struct client_state_t cs[static 1], uint8_t msgtype);
+void metrics_dhcp_tx(struct client_state_t cs[static 1], uint8_t msgtype,
+                     bool retransmit);
+void metrics_dhcp_reject(struct client_state_t cs[static 1],
+                         enum metrics_reject why);
+void metrics_dhcp_listen(struct client_state_t cs[static 1], bool kernel);
+void metrics_arp_rx(struct client_state_t cs[static 1], bool filtered);
+void metrics_arp_defend(struct client_state_t cs[static 1]);
+void metrics_arp_defense_latency(struct client_state_t cs[static 1],
+                                 long long ns, bool bind_pending);
+void metrics_ipc(struct client_state_t cs[static 1], enum metrics_ipc peer,
+                 bool ok);
+void metrics_acquire_begin(struct client_state_t cs[static 1],
+                           long long nowts);
+void metrics_lease_bound(struct client_state_t cs[static 1], long long nowts);
+void metrics_rtt(struct client_state_t cs[static 1], enum rtt_kind kind,
+                 long long rtt_us);
+
+#endif /* NDHC_METRICS_H_ */
@@ -43,6 +43,7 @@
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <net/if.h>
 #include <errno.h>
 #include <pwd.h>
@@ -72,19 +73,32 @@
 #include "duiaid.h"
 #include "sockd.h"
 #include "rfkill.h"
-
-struct client_state_t cs = {
-    .init = 1,
-    .epollFd = -1,
-    .signalFd = -1,
-    .listenFd = -1,
-    .arpFd = -1,
-    .nlFd = -1,
-    .nlPortId = -1,
-    .rfkillFd = -1,
-    .dhcp_wake_ts = -1,
-    .routerArp = "\0\0\0\0\0\0",
-    .serverArp = "\0\0\0\0\0\0",
+#include "timer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "checksum.h"
+
+// Maximum number of ready fds that are collected per epoll_wait() call.
+#define NDHC_EPOLL_EVENTS 8
+
+// The timers of an interface: its ARP timers, dhcp_wake_ts and the
+// metrics flush timer.
+#define CLIENT_TIMERS (AS_MAX + 2)
+
+// One interface's client state and everything that hangs off of it.
+struct client_iface {
+    struct client_state_t cs;
+    struct client_config_t cfg;
+    struct arp_data garp;
+    struct dhcp_data gdhcp;
+    struct lease_config cfg_lease;
+    struct ifch_queue ifchq;
+    struct metrics_data metrics;
+    struct trace_data trace;
+    struct rtt_data rtt;
+    bool force_fingerprint; // Confirm the network on the next run.
+    bool parked; // The timers are out of the heap; see client_park_timers().
+    long long parked_ts[CLIENT_TIMERS];
 };
 
 struct client_config_t client_config = {
@@ -95,7 +109,165 @@ struct client_config_t client_config = {
     .foreground = 1,
 };
 
-void set_client_addr(const char v[static 1]) { cs.clientAddr = inet_addr(v); }
+struct client_config_t *client_configs;
+size_t client_configs_num;
+
+// The interfaces of the master, indexed by slot.
+static struct client_iface **client_ifaces;
+
+// Slots of the interfaces that client_wake() marked since the main loop
+// last ran their state machines.  cs->woke keeps a slot from being listed
+// twice, so there is room for every interface.
+static uint16_t *client_woken;
+static size_t client_woken_num;
+
+void set_client_addr(const char v[static 1])
+{
+    client_config.request_addr = inet_addr(v);
+}
+
+// Interfaces that are named on the command line or in a config file are
+// collected in client_configs while the options are parsed; naming one
+// twice is harmless.  The rest of each entry is filled in from the
+// finished client_config by client_configs_init().
+void add_client_interface(const char name[static 1])
+{
+    size_t len = strlen(name);
+    if (!len || len >= IFNAMSIZ)
+        suicide("interface name '%s' is invalid", name);
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        if (!strcmp(client_configs[i].interface, name))
+            return;
+    }
+    if (client_configs_num >= NDHC_MAX_IFACES)
+        suicide("too many interfaces; at most %d are supported",
+                NDHC_MAX_IFACES);
+    struct client_config_t *n = realloc(client_configs,
+                                        (client_configs_num + 1) * sizeof *n);
+    if (!n)
+        suicide("failed to allocate interface configuration");
+    client_configs = n;
+    memset(&n[client_configs_num], 0, sizeof *n);
+    snprintf(n[client_configs_num].interface,
+             sizeof n[client_configs_num].interface, "%s", name);
+    ++client_configs_num;
+}
+
+static void client_configs_init(void)
+{
+    if (!client_configs_num)
+        add_client_interface(client_config.interface);
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_config_t *cc = &client_configs[i];
+        char name[sizeof cc->interface];
+        memcpy(name, cc->interface, sizeof name);
+        *cc = client_config;
+        memcpy(cc->interface, name, sizeof name);
+    }
+    if (nl_getifdata() < 0)
+        suicide("failed to get interface MAC or index");
+}
+
+// Makes client_config the configuration of the interface in slot.
+void client_config_select(size_t slot)
+{
+    static size_t selected = SIZE_MAX;
+    if (slot == selected)
+        return;
+    if (slot >= client_configs_num)
+        suicide("request for unknown interface slot %zu", slot);
+    client_config = client_configs[slot];
+    selected = slot;
+}
+
+// Returns the client state of the interface in slot, or NULL if there is
+// no such interface.  Only the master has client states.
+struct client_state_t *client_state_get(size_t slot)
+{
+    if (!client_ifaces || slot >= client_configs_num || !client_ifaces[slot])
+        return NULL;
+    return &client_ifaces[slot]->cs;
+}
+
+// Marks the interface of cs so that its state machine runs on this pass
+// of the main loop, or on the next one if it is running now.
+void client_wake(struct client_state_t cs[static 1])
+{
+    if (cs->woke)
+        return;
+    cs->woke = true;
+    client_woken[client_woken_num++] = cs->slot;
+}
+
+// With -q, ndhc exits once every interface has a lease.
+void client_lease_obtained(struct client_state_t cs[static 1])
+{
+    static size_t num_leased;
+    if (!cs->got_lease) {
+        cs->got_lease = true;
+        ++num_leased;
+    }
+    if (cs->cfg->quit_after_lease && num_leased == client_configs_num)
+        exit(EXIT_SUCCESS);
+}
+
+static struct ntimer *client_timer(struct client_iface ci[static 1],
+                                   size_t i)
+{
+    if (i < AS_MAX)
+        return &ci->garp.wake_ts[i];
+    return i == AS_MAX ? &ci->cs.dhcp_wake_ts : &ci->metrics.wake;
+}
+
+// Allocates the state for the interface in slot along with its own copy
+// of its configuration.  This happens once per interface at startup,
+// before the seccomp filter is installed; the lease handling itself never
+// allocates.
+static void client_state_new(size_t slot)
+{
+    const struct client_config_t *cfg = &client_configs[slot];
+    struct client_iface *ci = calloc(1, sizeof *ci);
+    if (!ci)
+        suicide("%s: failed to allocate client state", cfg->interface);
+    client_ifaces[slot] = ci;
+    ci->cfg = *cfg;
+    for (size_t i = 0; i < AS_MAX; ++i)
+        ci->garp.wake_ts[i] = (struct ntimer)NTIMER_INIT;
+    ci->metrics = (struct metrics_data)METRICS_DATA_INIT;
+    ci->gdhcp = (struct dhcp_data)DHCP_DATA_INIT;
+    ci->trace = (struct trace_data)TRACE_DATA_INIT;
+    ci->rtt = (struct rtt_data)RTT_DATA_INIT;
+    ci->cs = (struct client_state_t){
+        .init = 1,
+        .epollFd = -1,
+        .signalFd = -1,
+        .listenFd = -1,
+        .arpFd = -1,
+        .nlFd = -1,
+        .nlPortId = -1,
+        .rfkillFd = -1,
+        .leaseFd = -1,
+        .leaseRecFd = -1,
+        .timerFd = -1,
+        .bcastFd = -1,
+        .ucastFd = -1,
+        .slot = (uint16_t)slot,
+        .dhcp_wake_ts = NTIMER_INIT,
+        .clientAddr = cfg->request_addr,
+        .prevAddr = cfg->request_addr,
+        .cfg = &ci->cfg,
+        .garp = &ci->garp,
+        .gdhcp = &ci->gdhcp,
+        .cfg_lease = &ci->cfg_lease,
+        .ifchq = &ci->ifchq,
+        .metrics = &ci->metrics,
+        .trace = &ci->trace,
+        .rtt = &ci->rtt,
+    };
+    for (size_t i = 0; i < CLIENT_TIMERS; ++i)
+        client_timer(ci, i)->owner = (uint32_t)slot;
+    nk_random_u32_init(&ci->cs.rnd32_state);
+}
 
 void print_version(void)
 {
@@ -136,7 +308,8 @@ void show_usage(void)
 "  -b, --background                Fork to background if lease cannot be\n"
 "                                  immediately negotiated.\n"
 "  -p, --pidfile=FILE              File where the ndhc pid will be written\n"
-"  -i, --interface=INTERFACE       Interface to use (default: eth0)\n"
+"  -i, --interface=INTERFACE       Interface to use (default: eth0); may be\n"
+"                                  given more than once\n"
 "  -n, --now                       Exit with failure if lease cannot be\n"
 "                                  immediately negotiated.\n"
 "  -q, --quit                      Quit after obtaining lease\n"
@@ -158,53 +331,65 @@ void show_usage(void)
 "  -t, --gw-metric                 Route metric for default gw (default: 0)\n"
 "  -R, --resolve-conf=FILE         Path to resolv.conf or equivalent\n"
 "  -H, --dhcp-set-hostname         Allow DHCP to set machine hostname\n"
+"      --rapid-commit              Accept a lease without an offer if the\n"
+"                                  server supports Rapid Commit (RFC4039)\n"
+"      --offer-wait=TIMEMS         Time to collect more offers after the\n"
+"                                  first (default: 0)\n"
+"      --prefer-server=IP          Prefer offers from this DHCP server\n"
+"      --renew-jitter=PERCENT      Randomly spread renew time by up to\n"
+"                                  this percent of T1 (default: 0)\n"
+"      --adaptive-retransmit       Time retransmissions from the measured\n"
+"                                  round trip time to the DHCP server\n"
 "  -v, --version                   Display version\n"
            );
     exit(EXIT_SUCCESS);
 }
 
-static void setup_signals_ndhc(void)
+static int setup_signals_ndhc(void)
 {
     sigset_t mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
     sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
     sigaddset(&mask, SIGCHLD);
     sigaddset(&mask, SIGTERM);
     if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
         suicide("sigprocmask failed");
-    if (cs.signalFd >= 0) {
-        epoll_del(cs.epollFd, cs.signalFd);
-        close(cs.signalFd);
-    }
-    cs.signalFd = signalfd(-1, &mask, SFD_NONBLOCK);
-    if (cs.signalFd < 0)
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK);
+    if (sfd < 0)
         suicide("signalfd failed");
-    epoll_add(cs.epollFd, cs.signalFd);
+    return sfd;
 }
 
-static int signal_dispatch(void)
+// Signals are for every interface.
+static int signal_dispatch(int sfd)
 {
     struct signalfd_siginfo si;
     memset(&si, 0, sizeof si);
-    ssize_t r = safe_read(cs.signalFd, (char *)&si, sizeof si);
+    ssize_t r = safe_read(sfd, (char *)&si, sizeof si);
     if (r < 0) {
-        log_error("%s: ndhc: error reading from signalfd: %s",
-                  client_config.interface, strerror(errno));
+        log_error("ndhc: error reading from signalfd: %s", strerror(errno));
         return SIGNAL_NONE;
     }
     if ((size_t)r < sizeof si) {
-        log_error("%s: ndhc: short read from signalfd: %zd < %zu",
-                  client_config.interface, r, sizeof si);
+        log_error("ndhc: short read from signalfd: %zd < %zu",
+                  r, sizeof si);
         return SIGNAL_NONE;
     }
     switch (si.ssi_signo) {
         case SIGUSR1: return SIGNAL_RENEW;
         case SIGUSR2: return SIGNAL_RELEASE;
+        case SIGHUP:
+            for (size_t i = 0; i < client_configs_num; ++i)
+                trace_dump(&client_ifaces[i]->cs);
+            return SIGNAL_NONE;
         case SIGCHLD:
             suicide("ndhc-master: Subprocess terminated unexpectedly.  Exiting.");
         case SIGTERM:
             log_line("Received SIGTERM.  Exiting gracefully.");
+            for (size_t i = 0; i < client_configs_num; ++i)
+                rtt_flush(&client_ifaces[i]->cs);
             exit(EXIT_SUCCESS);
         default: return SIGNAL_NONE;
     }
@@ -257,166 +442,265 @@ static void fail_if_state_dir_dne(void)
         suicide("state_dir path '%s' does not specify a directory", state_dir);
 }
 
+// A single-interface ndhc stopped its timerfd while the interface was
+// down or after it failed to send, and only ran again on its next event.
+// The timerfd is shared by every interface now, so instead the timers of
+// the interface are taken out of the heap, keeping their deadlines, and
+// put back when it next has an event.
+static void client_park_timers(struct client_iface ci[static 1])
+{
+    for (size_t i = 0; i < CLIENT_TIMERS; ++i) {
+        struct ntimer *t = client_timer(ci, i);
+        ci->parked_ts[i] = t->ts;
+        ntimer_disarm(t);
+    }
+    ci->parked = true;
+}
+
+static void client_unpark_timers(struct client_iface ci[static 1])
+{
+    if (!ci->parked)
+        return;
+    for (size_t i = 0; i < CLIENT_TIMERS; ++i)
+        ntimer_arm(client_timer(ci, i), ci->parked_ts[i]);
+    ci->parked = false;
+}
+
+static void client_fd_event(uint32_t slot, int fd, uint32_t events)
+{
+    struct client_state_t *cs = client_state_get(slot);
+    if (!cs)
+        suicide("epoll_wait: unknown interface");
+    client_wake(cs);
+    if (fd == cs->listenFd) {
+        if (!(events & EPOLLIN))
+            suicide("%s: listenfd closed unexpectedly", cs->cfg->interface);
+        dhcp_packets_recv(cs);
+    } else if (fd == cs->arpFd) {
+        // EPOLLERR alone means transmit timestamps are queued.
+        if (!(events & (EPOLLIN|EPOLLERR)))
+            suicide("%s: arpfd closed unexpectedly", cs->cfg->interface);
+        arp_packets_recv(cs, events & EPOLLERR);
+    } else
+        suicide("epoll_wait: unknown fd");
+}
+
+static void client_rfkill(struct client_iface ci[static 1], int sev_rfk)
+{
+    struct client_state_t *cs = &ci->cs;
+    client_wake(cs);
+    if (sev_rfk == RFK_ENABLED) {
+        cs->rfkill_set = 1;
+        cs->rfkill_nl_state = cs->ifsPrevState;
+        cs->rfkill_nl_state_changed = false;
+        log_line("%s: rfkill: radio now blocked", cs->cfg->interface);
+    } else if (sev_rfk == RFK_DISABLED) {
+        cs->rfkill_set = 0;
+        log_line("%s: rfkill: radio now unblocked", cs->cfg->interface);
+        // We now simulate the state changes that may have happened
+        // during rfkill.
+        if (cs->rfkill_nl_state != cs->ifsPrevState)
+            nl_event_react(cs, cs->rfkill_nl_state);
+        else if (cs->rfkill_nl_state_changed &&
+                 cs->rfkill_nl_state == IFS_UP) {
+            // We might have changed networks even if we ended up
+            // back in IFS_UP state.  We need to fingerprint the
+            // network and confirm that we're on the same network.
+            ci->force_fingerprint = true;
+        }
+    }
+}
+
+// Runs the state machine of one interface that client_wake() marked
+// because it had an event or one of its timers expired.
+static void client_work(struct client_iface ci[static 1], long long nowts,
+                        int sev_signal)
+{
+    struct client_state_t *cs = &ci->cs;
+    struct dhcp_optidx dhcp_oi;
+    uint32_t dhcp_srcaddr;
+    uint8_t dhcp_msgtype;
+
+    cs->woke = false;
+    client_unpark_timers(ci);
+    bool force_fingerprint = ci->force_fingerprint;
+    ci->force_fingerprint = false;
+
+    int sev_nl = cs->ifsEvent;
+    cs->ifsEvent = IFS_NONE;
+    if (sev_nl != IFS_NONE) {
+        if (!cs->rfkill_set) {
+            if (nl_event_react(cs, sev_nl))
+                force_fingerprint = true;
+        } else {
+            // Store the state so it can be replayed later.
+            cs->rfkill_nl_state_changed = true;
+            cs->rfkill_nl_state = sev_nl;
+        }
+    }
+
+    if (cs->rfkill_set || cs->ifsPrevState != IFS_UP) {
+        // We can't do anything while the iface is disabled, anyway.
+        // XXX: It may be smart to set a non-infinite timeout
+        // and periodically poll to see if the rfkill or iface
+        // state changed; it might happen during suspend.
+        client_park_timers(ci);
+        return;
+    }
+
+    long long arp_wake_ts = arp_get_wake_ts(cs);
+    // Feed every packet that was drained above through the state
+    // machine.  Timeouts, signals and forced fingerprinting ride along
+    // with the first pass only so that each is acted upon exactly once.
+    int dhcp_ok;
+    for (bool first = true;; first = false) {
+        bool sev_dhcp = dhcp_packet_get(cs, &dhcp_oi, &dhcp_msgtype,
+                                        &dhcp_srcaddr);
+        bool sev_arp = !sev_dhcp && arp_packet_get(cs);
+        if (!first && !sev_dhcp && !sev_arp)
+            break;
+        dhcp_ok = dhcp_handle(cs, nowts, sev_dhcp, &dhcp_oi,
+                              dhcp_msgtype, dhcp_srcaddr,
+                              sev_arp, first && force_fingerprint,
+                              first && cs->dhcp_wake_ts.ts <= nowts,
+                              first && arp_wake_ts <= nowts,
+                              first ? sev_signal : SIGNAL_NONE);
+        if (sev_arp)
+            arp_reply_clear(cs);
+        if (dhcp_ok == COR_ERROR)
+            break;
+    }
+    metrics_flush(cs, nowts);
+
+    // XXX: Would be best if we detected RFKILL being set via an
+    //      error message and propagated it back to here as a
+    //      distinct return value.
+    if (dhcp_ok == COR_ERROR)
+        client_park_timers(ci);
+}
+
+// Every interface shares the epoll loop, the timerfd and the signalfd,
+// as well as the netlink and rfkill fds that ndhc_main() opened.  The
+// fds of a single interface are registered with its slot as their tag.
 static void do_ndhc_work(void)
 {
-    static bool rfkill_set; // Is the rfkill switch set?
-    static bool rfkill_nl_state_changed; // iface state changed during rfkill
-    static int rfkill_nl_state; // current iface state during rfkill
-    struct dhcpmsg dhcp_packet;
-    struct epoll_event events[1];
+    struct epoll_event events[NDHC_EPOLL_EVENTS];
+    struct client_state_t *cs0 = &client_ifaces[0]->cs;
     long long nowts;
-    int timeout = 0;
+    bool expired = false;
     bool had_event;
 
-    cs.epollFd = epoll_create1(0);
-    if (cs.epollFd < 0)
+    int epollFd = epoll_create1(0);
+    if (epollFd < 0)
         suicide("epoll_create1 failed");
+    int timerFd = ntimer_fd_open();
 
-    if (enforce_seccomp_ndhc())
+    // The metrics directory is shared by every interface.
+    int metrics_fd = -1;
+    for (size_t i = 0; i < client_configs_num && metrics_fd < 0; ++i)
+        metrics_fd = client_ifaces[i]->metrics.dirfd;
+    if (enforce_seccomp_ndhc(metrics_fd))
         log_line("ndhc seccomp filter cannot be installed");
 
-    setup_signals_ndhc();
+    int signalFd = setup_signals_ndhc();
 
-    epoll_add(cs.epollFd, cs.nlFd);
-    epoll_add(cs.epollFd, ifchStream[0]);
-    epoll_add(cs.epollFd, sockdStream[0]);
-    if (client_config.enable_rfkill && cs.rfkillFd != -1)
-        epoll_add(cs.epollFd, cs.rfkillFd);
-    start_dhcp_listen(&cs);
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_state_t *cs = &client_ifaces[i]->cs;
+        cs->epollFd = epollFd;
+        cs->timerFd = timerFd;
+        cs->signalFd = signalFd;
+        // Run the state machine once immediately.
+        client_wake(cs);
+    }
+    epoll_add(epollFd, signalFd);
+    epoll_add(epollFd, timerFd);
+    epoll_add(epollFd, cs0->nlFd);
+    epoll_add(epollFd, ifchSock[0]);
+    epoll_add(epollFd, ifchStream[0]);
+    epoll_add(epollFd, sockdStream[0]);
+    if (cs0->cfg->enable_rfkill && cs0->rfkillFd != -1)
+        epoll_add(epollFd, cs0->rfkillFd);
+    ntimer_fd_set(timerFd, curms());
 
     for (;;) {
         had_event = false;
-        int maxi = epoll_wait(cs.epollFd, events, 1, timeout);
+        int maxi = epoll_wait(epollFd, events, NDHC_EPOLL_EVENTS, -1);
         if (maxi < 0) {
             if (errno == EINTR)
                 continue;
             else
                 suicide("epoll_wait failed");
         }
-        bool sev_dhcp = false;
-        uint32_t dhcp_srcaddr;
-        uint8_t dhcp_msgtype;
-        bool sev_arp = false;
-        int sev_nl = IFS_NONE;
-        int sev_rfk = RFK_NONE;
         int sev_signal = SIGNAL_NONE;
-        bool force_fingerprint = false;
         for (int i = 0; i < maxi; ++i) {
+            int fd = epoll_event_fd(&events[i]);
+            uint32_t tag = epoll_event_tag(&events[i]);
+            if (fd == timerFd) {
+                if (!(events[i].events & EPOLLIN))
+                    suicide("timerfd closed unexpectedly");
+                ntimer_fd_clear(timerFd);
+                continue;
+            }
             had_event = true;
-            int fd = events[i].data.fd;
-            if (fd == cs.signalFd) {
+            if (tag != EPOLL_TAG_NONE) {
+                client_fd_event(tag, fd, events[i].events);
+            } else if (fd == signalFd) {
                 if (!(events[i].events & EPOLLIN))
                     suicide("signalfd closed unexpectedly");
-                sev_signal = signal_dispatch();
-            } else if (fd == cs.listenFd) {
-                if (!(events[i].events & EPOLLIN))
-                    suicide("listenfd closed unexpectedly");
-                sev_dhcp = dhcp_packet_get(&cs, &dhcp_packet, &dhcp_msgtype,
-                                           &dhcp_srcaddr);
-            } else if (fd == cs.arpFd) {
-                if (!(events[i].events & EPOLLIN))
-                    suicide("arpfd closed unexpectedly");
-                sev_arp = arp_packet_get(&cs);
-            } else if (fd == cs.nlFd) {
+                sev_signal = signal_dispatch(signalFd);
+            } else if (fd == cs0->nlFd) {
                 if (!(events[i].events & EPOLLIN))
                     suicide("nlfd closed unexpectedly");
-                sev_nl = nl_event_get(&cs);
+                nl_event_get(cs0);
+            } else if (fd == ifchSock[0]) {
+                if (!(events[i].events & EPOLLIN))
+                    suicide("ifchsock closed unexpectedly");
+                ifchange_event_get();
             } else if (fd == ifchStream[0]) {
                 if (events[i].events & (EPOLLHUP|EPOLLERR|EPOLLRDHUP))
                     exit(EXIT_FAILURE);
             } else if (fd == sockdStream[0]) {
                 if (events[i].events & (EPOLLHUP|EPOLLERR|EPOLLRDHUP))
                     exit(EXIT_FAILURE);
-            } else if (fd == cs.rfkillFd && client_config.enable_rfkill) {
+            } else if (fd == cs0->rfkillFd && cs0->cfg->enable_rfkill) {
                 if (!(events[i].events & EPOLLIN))
                     suicide("rfkillfd closed unexpectedly");
-                sev_rfk = rfkill_get(&cs, 1, client_config.rfkillIdx);
+                // Every interface watches the same rfkill switch.
+                int sev_rfk = rfkill_get(cs0, 1, cs0->cfg->rfkillIdx);
+                for (size_t j = 0; j < client_configs_num; ++j)
+                    client_rfkill(client_ifaces[j], sev_rfk);
             } else
                 suicide("epoll_wait: unknown fd");
-
-            if (sev_rfk == RFK_ENABLED) {
-                rfkill_set = 1;
-                rfkill_nl_state = cs.ifsPrevState;
-                rfkill_nl_state_changed = false;
-                log_line("rfkill: radio now blocked");
-            } else if (sev_rfk == RFK_DISABLED) {
-                rfkill_set = 0;
-                log_line("rfkill: radio now unblocked");
-                // We now simulate the state changes that may have happened
-                // during rfkill.
-                if (rfkill_nl_state != cs.ifsPrevState)
-                    nl_event_react(&cs, rfkill_nl_state);
-                else if (rfkill_nl_state_changed && rfkill_nl_state == IFS_UP) {
-                    // We might have changed networks even if we ended up
-                    // back in IFS_UP state.  We need to fingerprint the
-                    // network and confirm that we're on the same network.
-                    force_fingerprint = true;
-                }
-            }
-        }
-
-        if (sev_nl != IFS_NONE) {
-            if (!rfkill_set) {
-                if (nl_event_react(&cs, sev_nl))
-                    force_fingerprint = true;
-            } else {
-                // Store the state so it can be replayed later.
-                rfkill_nl_state_changed = true;
-                rfkill_nl_state = sev_nl;
-            }
-        }
-
-        if (rfkill_set || cs.ifsPrevState != IFS_UP) {
-            // We can't do anything while the iface is disabled, anyway.
-            // XXX: It may be smart to set a non-infinite timeout
-            // and periodically poll to see if the rfkill or iface
-            // state changed; it might happen during suspend.
-            timeout = -1;
-            continue;
         }
 
         nowts = curms();
-        long long arp_wake_ts = arp_get_wake_ts();
-        int dhcp_ok = dhcp_handle(&cs, nowts, sev_dhcp, &dhcp_packet,
-                                  dhcp_msgtype, dhcp_srcaddr,
-                                  sev_arp, force_fingerprint,
-                                  cs.dhcp_wake_ts <= nowts,
-                                  arp_wake_ts <= nowts, sev_signal);
-        if (sev_arp)
-            arp_reply_clear();
-
-        // XXX: Would be best if we detected RFKILL being set via an
-        //      error message and propagated it back to here as a
-        //      distinct return value.
-        if (dhcp_ok == COR_ERROR) {
-            timeout = -1;
-            continue;
-        }
-
-        int prev_timeout = timeout;
-        long long tt;
-
-        arp_wake_ts = arp_get_wake_ts();
-        if (arp_wake_ts < 0 && cs.dhcp_wake_ts < 0) {
-            timeout = -1;
-            continue;
-        } else if (arp_wake_ts < 0) {
-            tt = cs.dhcp_wake_ts - nowts;
-        } else if (cs.dhcp_wake_ts < 0) {
-            tt = arp_wake_ts - nowts;
-        } else {
-            tt = (arp_wake_ts < cs.dhcp_wake_ts ?
-                  arp_wake_ts : cs.dhcp_wake_ts) - nowts;
+        if (sev_signal != SIGNAL_NONE) {
+            for (size_t i = 0; i < client_configs_num; ++i)
+                client_wake(&client_ifaces[i]->cs);
         }
-        if (tt > INT_MAX) tt = INT_MAX;
-        if (tt < INT_MIN) tt = INT_MIN;
-        timeout = tt;
-        if (timeout < 0)
-            timeout = 0;
+        // Only the interfaces that had an event or an expired timer run,
+        // so a pass costs nothing for the ones that are waiting.
+        for (struct ntimer *t; (t = ntimer_pop_expired(nowts));)
+            client_wake(&client_ifaces[t->owner]->cs);
+        size_t woken = client_woken_num;
+        for (size_t i = 0; i < woken; ++i)
+            client_work(client_ifaces[client_woken[i]], nowts, sev_signal);
+        // Interfaces that were marked while the others ran wait for the
+        // next pass, as they did before.
+        client_woken_num -= woken;
+        memmove(client_woken, client_woken + woken,
+                client_woken_num * sizeof *client_woken);
+
+        bool prev_expired = expired;
+        long long next_ts = ntimer_next_ts();
+        expired = next_ts >= 0 && next_ts <= nowts;
 
         // Failsafe to prevent busy-spin.
-        if (timeout == 0 && prev_timeout == 0 && !had_event)
-            timeout = 10000;
+        if (expired && prev_expired && !had_event) {
+            next_ts = nowts + 10000;
+            expired = false;
+        }
+        ntimer_fd_set(timerFd, next_ts);
     }
 }
 
@@ -446,6 +730,13 @@ static void create_sockd_ipc_sockets(void) {
         suicide("FATAL - can't create ndhc/ifch socket: %s", strerror(errno));
 }
 
+// The subprocesses don't share the RNG state with the master process.
+static void reseed_client_states(void)
+{
+    for (size_t i = 0; i < client_configs_num; ++i)
+        nk_random_u32_init(&client_ifaces[i]->cs.rnd32_state);
+}
+
 static void spawn_ifch(void)
 {
     create_ifch_ipc_sockets();
@@ -453,8 +744,7 @@ static void spawn_ifch(void)
     if (ifch_pid == 0) {
         close(ifchSock[0]);
         close(ifchStream[0]);
-        // Don't share the RNG state with the master process.
-        nk_random_u32_init(&cs.rnd32_state);
+        reseed_client_states();
         ifch_main();
     } else if (ifch_pid > 0) {
         close(ifchSock[1]);
@@ -470,8 +760,7 @@ static void spawn_sockd(void)
     if (sockd_pid == 0) {
         close(sockdSock[0]);
         close(sockdStream[0]);
-        // Don't share the RNG state with the master process.
-        nk_random_u32_init(&cs.rnd32_state);
+        reseed_client_states();
         sockd_main();
     } else if (sockd_pid > 0) {
         close(sockdSock[1]);
@@ -481,27 +770,56 @@ static void spawn_sockd(void)
 }
 
 static void ndhc_main(void) {
+    struct client_state_t *cs0 = &client_ifaces[0]->cs;
     prctl(PR_SET_NAME, "ndhc: master");
-    log_line("ndhc client " NDHC_VERSION " started on interface [%s].",
-             client_config.interface);
+    for (size_t i = 0; i < client_configs_num; ++i)
+        log_line("ndhc client " NDHC_VERSION " started on interface [%s].",
+                 client_configs[i].interface);
 
-    if ((cs.nlFd = nl_open(NETLINK_ROUTE, RTMGRP_LINK, &cs.nlPortId)) < 0)
+    int nlPortId;
+    int nlFd = nl_open(NETLINK_ROUTE, RTMGRP_LINK, &nlPortId);
+    if (nlFd < 0)
         suicide("%s: failed to open netlink socket", __func__);
 
-    cs.rfkillFd = rfkill_open(&client_config.enable_rfkill);
+    int rfkillFd = rfkill_open(&cs0->cfg->enable_rfkill);
+
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_state_t *cs = &client_ifaces[i]->cs;
+        cs->nlFd = nlFd;
+        cs->nlPortId = nlPortId;
+        cs->rfkillFd = rfkillFd;
+        cs->cfg->enable_rfkill = cs0->cfg->enable_rfkill;
+    }
 
     if (write_pid_enabled &&
-        client_config.foreground && !client_config.background_if_no_lease)
+        cs0->cfg->foreground && !cs0->cfg->background_if_no_lease)
         write_pid(pidfile);
 
-    open_leasefile();
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_state_t *cs = &client_ifaces[i]->cs;
+        open_leasefile(cs);
+        read_lease_record(cs);
+        metrics_open(cs);
+        if (cs->cfg->adaptive_rexmit)
+            rtt_open(cs);
+    }
 
     nk_set_chroot(chroot_dir);
     memset(chroot_dir, '\0', sizeof chroot_dir);
     nk_set_uidgid(ndhc_uid, ndhc_gid, NULL, 0);
 
-    if (cs.ifsPrevState != IFS_UP) {
-        if (ifchange_deconfig(&cs) < 0)
+    // Every deconfiguration is queued before any of them is waited for.
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_state_t *cs = &client_ifaces[i]->cs;
+        if (cs->ifsPrevState != IFS_UP && ifchange_deconfig(cs) < 0)
+            suicide("%s: can't deconfigure interface settings", __func__);
+    }
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_state_t *cs = &client_ifaces[i]->cs;
+        if (cs->ifsPrevState == IFS_UP)
+            continue;
+        ifchange_flush(cs);
+        if (!cs->ifDeconfig)
             suicide("%s: can't deconfigure interface settings", __func__);
     }
 
@@ -522,16 +840,16 @@ void background(void)
         write_pid(pidfile);
 }
 
-static void wait_for_rfkill()
+static void wait_for_rfkill(struct client_state_t cs[static 1])
 {
     struct epoll_event events[2];
-    cs.rfkillFd = rfkill_open(&client_config.enable_rfkill);
-    if (cs.rfkillFd < 0)
+    cs->rfkillFd = rfkill_open(&cs->cfg->enable_rfkill);
+    if (cs->rfkillFd < 0)
         suicide("can't wait for rfkill to end if /dev/rfkill can't be opened");
     int epfd = epoll_create1(0);
     if (epfd < 0)
         suicide("epoll_create1 failed");
-    epoll_add(epfd, cs.rfkillFd);
+    epoll_add(epfd, cs->rfkillFd);
     for (;;) {
         int r = epoll_wait(epfd, events, 2, -1);
         if (r < 0) {
@@ -541,11 +859,11 @@ static void wait_for_rfkill()
                 suicide("epoll_wait failed");
         }
         for (int i = 0; i < r; ++i) {
-            int fd = events[i].data.fd;
-            if (fd != cs.rfkillFd)
+            int fd = epoll_event_fd(&events[i]);
+            if (fd != cs->rfkillFd)
                 suicide("epoll_wait: unknown fd");
             if (events[i].events & EPOLLIN) {
-                int rfk = rfkill_get(&cs, 0, 0);
+                int rfk = rfkill_get(cs, 0, 0);
                 if (rfk == RFK_DISABLED) {
                     switch (perform_ifup()) {
                     case 1: case 0: goto rfkill_gone;
@@ -562,15 +880,27 @@ rfkill_gone:
     close(epfd);
     // We always close because ifchd and sockd shouldn't keep
     // an rfkill fd open.
-    close(cs.rfkillFd);
-    cs.rfkillFd = -1;
+    close(cs->rfkillFd);
+    cs->rfkillFd = -1;
+}
+
+// Each interface keeps several sockets and files open, so a master with
+// many of them can need more fds than the usual soft limit of 1024.
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max)
+        return;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        log_warning("failed to raise the open file limit: %s",
+                    strerror(errno));
 }
 
 int main(int argc, char *argv[])
 {
     parse_cmdline(argc, argv);
-
-    nk_random_u32_init(&cs.rnd32_state);
+    csum_init();
 
     if (getuid())
         suicide("I need to be started as root.");
@@ -578,16 +908,28 @@ int main(int argc, char *argv[])
         suicide("No chroot path is specified.  Refusing to run.");
     fail_if_state_dir_dne();
 
-    if (nl_getifdata() < 0)
-        suicide("failed to get interface MAC or index");
-
-    get_clientid(&cs, &client_config);
-
-    switch (perform_ifup()) {
-    case 1: cs.ifsPrevState = IFS_UP;
-    case 0: break;
-    case -3: wait_for_rfkill(); break;
-    default: suicide("failed to set the interface to up state");
+    client_configs_init();
+    if (client_configs_num > 1)
+        raise_fd_limit();
+
+    client_ifaces = calloc(client_configs_num, sizeof *client_ifaces);
+    client_woken = calloc(client_configs_num, sizeof *client_woken);
+    if (!client_ifaces || !client_woken)
+        suicide("failed to allocate client states");
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        client_state_new(i);
+        struct client_state_t *cs = &client_ifaces[i]->cs;
+        get_clientid(cs, cs->cfg);
+
+        // perform_ifup() acts on the interface in client_config.
+        client_config_select(i);
+        switch (perform_ifup()) {
+        case 1: cs->ifsPrevState = IFS_UP;
+        case 0: break;
+        case -3: wait_for_rfkill(cs); break;
+        default: suicide("%s: failed to set the interface to up state",
+                         cs->cfg->interface);
+        }
     }
 
     if (setpgid(0, 0) < 0) {
@@ -601,4 +943,3 @@ int main(int argc, char *argv[])
     ndhc_main();
     exit(EXIT_SUCCESS);
 }
-
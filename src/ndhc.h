@@ -33,22 +33,86 @@
 #include <limits.h>
 #include <net/if.h>
 #include "nk/random.h"
+#include "timer.h"
 
+struct arp_data;
+struct client_config_t;
+struct dhcp_data;
+struct dhcpmsg;
+struct ifch_queue;
+struct lease_config;
+struct metrics_data;
+struct rtt_data;
+struct trace_data;
+
+// Context for the re-entrant dhcp_handle() coroutine.  It is zeroed along
+// with the rest of the client state, which is the correct initial state.
+struct dhcp_ccr_ctx {
+    int ccrLine;
+};
+
+#define NUM_OFFERS 4
+
+// An OFFER that was received in SELECTING and not yet requested.
+struct dhcp_offer {
+    uint32_t yiaddr, serverid, srcaddr;
+    uint32_t lease;
+};
+
+// Per-interface state.  Nothing that is specific to a single interface's
+// lease should live in file-scope variables; it belongs here or in one of
+// the structures that are referenced from here.  Each one is allocated
+// along with those structures by client_state_new().
 struct client_state_t {
     struct nk_random_state_u32 rnd32_state;
     long long leaseStartTime, renewTime, rebindTime;
-    long long dhcp_wake_ts;
+    struct ntimer dhcp_wake_ts;
     int ifsPrevState;
+    int ifsEvent; // Link state from netlink that is not yet acted upon.
+    bool ifsStale; // Link events were lost; ifsPrevState may be wrong.
+    bool woke; // Marked by client_wake() and not yet run.
     int ifDeconfig; // Set if the interface has already been deconfigured.
-    int epollFd, signalFd, listenFd, arpFd, nlFd, rfkillFd;
+    // epollFd, signalFd, nlFd, rfkillFd and timerFd are shared by every
+    // interface of the master.
+    int epollFd, signalFd, listenFd, arpFd, nlFd, rfkillFd, leaseFd;
+    int timerFd;
+    int leaseRecFd;
+    // Send sockets that are kept open across packets.  ucastFd is bound
+    // to ucastClientAddr and connected to ucastServerAddr.
+    int bcastFd, ucastFd;
+    uint32_t ucastClientAddr, ucastServerAddr;
     int nlPortId;
+    int rfkill_nl_state; // Interface state while rfkill is set.
     unsigned int num_dhcp_requests;
+    unsigned int renews_sent; // Renew and rebind requests for this lease.
     uint32_t clientAddr, serverAddr, srcAddr, routerAddr;
+    uint32_t prevAddr; // Last address we held or were asked to request.
     uint32_t lease, xid;
+    uint32_t listen_xid; // xid matched by the listen socket filter.
+    // Replies for other transactions or clients that were not dropped by
+    // the listen socket filter.  With the filter installed, only packets
+    // queued before an xid change should be counted here.
+    unsigned int foreign_dhcp_packets;
     uint8_t routerArp[6], serverArp[6];
     uint8_t using_dhcp_bpf, init, got_router_arp, got_server_arp,
             check_fingerprint;
     bool arp_is_defense;
+    bool init_reboot; // Request the stored lease with INIT-REBOOT.
+    bool rfkill_set; // Is the rfkill switch set?
+    bool rfkill_nl_state_changed; // Interface state changed during rfkill.
+    bool got_lease; // A lease has been bound since ndhc started.
+    uint16_t slot; // Index of this interface in client_configs.
+    struct client_config_t *cfg; // Configuration of this interface.
+    struct arp_data *garp;      // ARP state machine data.
+    struct dhcp_data *gdhcp;    // DHCP send and receive data.
+    struct lease_config *cfg_lease; // The current interface configuration.
+    struct ifch_queue *ifchq;   // Outstanding ndhc-ifch requests.
+    struct metrics_data *metrics; // Counters for the metrics file.
+    struct trace_data *trace;   // Recent events, dumped on SIGHUP.
+    struct rtt_data *rtt;       // Round-trip time estimates.
+    struct dhcp_ccr_ctx dhcp_ccr; // Resume point of dhcp_handle().
+    struct dhcp_offer offers[NUM_OFFERS]; // Offers for the current xid.
+    size_t num_offers;
 };
 
 struct client_config_t {
@@ -57,6 +121,11 @@ struct client_config_t {
     char abort_if_no_lease;      // Abort if no lease
     char background_if_no_lease; // Fork to background if no lease
     char enable_rfkill;          // Listen for rfkill events
+    char rapid_commit;           // Ask for RFC4039 two-message exchange
+    int offer_wait;              // ms to collect offers after the first
+    uint32_t prefer_server;      // Server id whose offers are preferred
+    int renew_jitter;            // Spread renew time by +/- this % of T1
+    char adaptive_rexmit;        // Retransmit based on measured server RTT
     char interface[IFNAMSIZ];    // The name of the interface to use
     char clientid[64];           // Optional client id to use
     uint8_t clientid_len;        // Length of the clientid
@@ -66,9 +135,23 @@ struct client_config_t {
     int ifindex;                 // Index number of the interface to use
     uint32_t rfkillIdx;          // Index of the corresponding rfkill device
     uint8_t arp[6];              // Our arp address
+    uint32_t request_addr;       // Address to ask for first
 };
 
+// The most interfaces that one ndhc can manage; a slot must fit in the
+// u16 that ndhc-ifch and ndhc-sockd requests carry.
+#define NDHC_MAX_IFACES 4096
+
+// The configuration from the command line and config file.  It is the
+// template for client_configs, which has one entry per interface and is
+// filled in before ndhc-ifch and ndhc-sockd are forked.  Every client
+// state takes its own copy of its entry in cs->cfg, which the master's
+// lease handling uses.  ndhc-ifch and ndhc-sockd copy the entry for the
+// interface of each request that they handle back into client_config
+// with client_config_select(), so their code only ever reads this one.
 extern struct client_config_t client_config;
+extern struct client_config_t *client_configs;
+extern size_t client_configs_num;
 
 extern int ifchSock[2];
 extern int ifchStream[2];
@@ -83,6 +166,11 @@ extern gid_t ndhc_gid;
 extern bool write_pid_enabled;
 
 void set_client_addr(const char v[static 1]);
+void add_client_interface(const char name[static 1]);
+void client_config_select(size_t slot);
+struct client_state_t *client_state_get(size_t slot);
+void client_wake(struct client_state_t cs[static 1]);
+void client_lease_obtained(struct client_state_t cs[static 1]);
 void show_usage(void);
 int get_clientid_string(const char str[static 1], size_t slen);
 void background(void);
@@ -55,13 +55,13 @@ int nl_event_react(struct client_state_t cs[static 1], int state)
     case IFS_DOWN:
         // Interface configured, but no hardware carrier.
         cs->ifsPrevState = IFS_DOWN;
-        log_line("%s: Carrier down.", client_config.interface);
+        log_line("%s: Carrier down.", cs->cfg->interface);
         return 0;
     case IFS_SHUT:
         // User shut down the interface.
         cs->ifsPrevState = IFS_SHUT;
         log_line("%s: Interface shut down.  Going to sleep.",
-                 client_config.interface);
+                 cs->cfg->interface);
         // XXX: I think this was wrong; instead it should just sleep.
         //      The lease has not expired just because the user shut down
         //      the interface...
@@ -75,13 +75,25 @@ int nl_event_react(struct client_state_t cs[static 1], int state)
     }
 }
 
-static int nl_process_msgs_return;
+// Link events for every interface of the master arrive on the one netlink
+// socket.  Each is handed to the client state of its interface, whose
+// ifsEvent keeps the latest state until the main loop acts on it.
+static struct client_state_t *nl_client_state(int ifindex)
+{
+    struct client_state_t *cs;
+    for (size_t i = 0; (cs = client_state_get(i)); ++i) {
+        if (cs->cfg->ifindex == ifindex)
+            return cs;
+    }
+    return NULL;
+}
+
 static void nl_process_msgs(const struct nlmsghdr *nlh, void *data)
 {
     (void)data;
     struct ifinfomsg *ifm = NLMSG_DATA(nlh);
-
-    if (ifm->ifi_index != client_config.ifindex)
+    struct client_state_t *cs = nl_client_state(ifm->ifi_index);
+    if (!cs)
         return;
 
     if (nlh->nlmsg_type == RTM_NEWLINK) {
@@ -89,31 +101,49 @@ static void nl_process_msgs(const struct nlmsghdr *nlh, void *data)
         // IFF_RUNNING is the hardware carrier.
         if (ifm->ifi_flags & IFF_UP) {
             if (ifm->ifi_flags & IFF_RUNNING)
-                nl_process_msgs_return = IFS_UP;
+                cs->ifsEvent = IFS_UP;
             else
-                nl_process_msgs_return = IFS_DOWN;
+                cs->ifsEvent = IFS_DOWN;
         } else {
-            nl_process_msgs_return = IFS_SHUT;
+            cs->ifsEvent = IFS_SHUT;
         }
     } else if (nlh->nlmsg_type == RTM_DELLINK)
-        nl_process_msgs_return = IFS_REMOVED;
+        cs->ifsEvent = IFS_REMOVED;
+    else
+        return;
+    client_wake(cs);
 }
 
-int nl_event_get(struct client_state_t cs[static 1])
+// Reads every queued link event.  nlFd and nlPortId are shared by every
+// interface, so any client state will do.
+void nl_event_get(struct client_state_t cs[static 1])
 {
     char nlbuf[8192];
     ssize_t ret;
     assert(cs->nlFd != -1);
-    nl_process_msgs_return = IFS_NONE;
     do {
         ret = nl_recv_buf(cs->nlFd, nlbuf, sizeof nlbuf);
-        if (ret < 0)
+        if (ret < 0) {
+            // Most likely ENOBUFS; link events may have been dropped, so
+            // the tracked link states can't be trusted until confirmed.
+            struct client_state_t *c;
+            for (size_t i = 0; (c = client_state_get(i)); ++i)
+                c->ifsStale = true;
             break;
-        if (nl_foreach_nlmsg(nlbuf, ret, 0, cs->nlPortId, nl_process_msgs, 0)
-            < 0)
+        }
+        if (nl_foreach_nlmsg(nlbuf, ret, 0, cs->nlPortId, nl_process_msgs,
+                             NULL) < 0)
             break;
     } while (ret > 0);
-    return nl_process_msgs_return;
+}
+
+// Returns true if there are link events queued that haven't been processed.
+bool nl_event_pending(struct client_state_t cs[static 1])
+{
+    char c;
+    if (cs->nlFd < 0)
+        return false;
+    return recv(cs->nlFd, &c, sizeof c, MSG_PEEK | MSG_DONTWAIT) > 0;
 }
 
 static int get_if_index_and_mac(const struct nlmsghdr *nlh,
@@ -121,12 +151,17 @@ static int get_if_index_and_mac(const struct nlmsghdr *nlh,
 {
     struct rtattr *tb[IFLA_MAX] = {0};
     nl_rtattr_parse(nlh, sizeof *ifm, rtattr_assign, tb);
-    if (tb[IFLA_IFNAME] && !strncmp(client_config.interface,
-                                    RTA_DATA(tb[IFLA_IFNAME]),
-                                    sizeof client_config.interface)) {
-        client_config.ifindex = ifm->ifi_index;
+    if (!tb[IFLA_IFNAME])
+        return 0;
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        struct client_config_t *cc = &client_configs[i];
+        if (strncmp(cc->interface, RTA_DATA(tb[IFLA_IFNAME]),
+                    sizeof cc->interface))
+            continue;
+        cc->ifindex = ifm->ifi_index;
         if (!tb[IFLA_ADDRESS])
-            suicide("FATAL: Adapter %s lacks a hardware address.");
+            suicide("FATAL: Adapter %s lacks a hardware address.",
+                    cc->interface);
         int maclen = tb[IFLA_ADDRESS]->rta_len - 4;
         if (maclen != 6)
             suicide("FATAL: Adapter hardware address length should be 6, but is %u.",
@@ -134,9 +169,9 @@ static int get_if_index_and_mac(const struct nlmsghdr *nlh,
 
         const unsigned char *mac = RTA_DATA(tb[IFLA_ADDRESS]);
         log_line("%s hardware address %x:%x:%x:%x:%x:%x",
-                 client_config.interface,
+                 cc->interface,
                  mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        memcpy(client_config.arp, mac, 6);
+        memcpy(cc->arp, mac, 6);
         return 1;
     }
     return 0;
@@ -144,12 +179,12 @@ static int get_if_index_and_mac(const struct nlmsghdr *nlh,
 
 static void do_handle_getifdata(const struct nlmsghdr *nlh, void *data)
 {
-    int *got_ifdata = (int *)data;
+    size_t *got_ifdata = (size_t *)data;
     struct ifinfomsg *ifm = NLMSG_DATA(nlh);
 
     switch(nlh->nlmsg_type) {
         case RTM_NEWLINK:
-            *got_ifdata |= get_if_index_and_mac(nlh, ifm);
+            *got_ifdata += get_if_index_and_mac(nlh, ifm);
             break;
         default:
             break;
@@ -160,7 +195,7 @@ static int handle_getifdata(int fd, uint32_t seq)
 {
     char nlbuf[8192];
     ssize_t ret;
-    int got_ifdata = 0;
+    size_t got_ifdata = 0;
     do {
         ret = nl_recv_buf(fd, nlbuf, sizeof nlbuf);
         if (ret < 0)
@@ -169,29 +204,34 @@ static int handle_getifdata(int fd, uint32_t seq)
                              do_handle_getifdata, &got_ifdata) < 0)
             return -1;
     } while (ret > 0);
-    return got_ifdata ? 0 : -1;
+    for (size_t i = 0; i < client_configs_num; ++i) {
+        if (!client_configs[i].ifindex)
+            log_line("%s: (%s) interface not found",
+                     client_configs[i].interface, __func__);
+    }
+    return got_ifdata == client_configs_num ? 0 : -1;
 }
 
+// Fills in the index and MAC address of every interface in
+// client_configs from a single dump of the links.
 int nl_getifdata(void)
 {
     int ret = -1;
     int fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
     if (fd < 0) {
-        log_line("%s: (%s) netlink socket open failed: %s",
-                 client_config.interface, __func__, strerror(errno));
+        log_line("(%s) netlink socket open failed: %s",
+                 __func__, strerror(errno));
         goto fail;
     }
 
     struct timespec ts;
     if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
-        log_line("%s: (%s) clock_gettime failed",
-                 client_config.interface, __func__);
+        log_line("(%s) clock_gettime failed", __func__);
         goto fail_fd;
     }
     uint32_t seq = ts.tv_nsec;
     if (nl_sendgetlinks(fd, seq)) {
-        log_line("%s: (%s) nl_sendgetlinks failed",
-                 client_config.interface, __func__);
+        log_line("(%s) nl_sendgetlinks failed", __func__);
         goto fail_fd;
     }
 
@@ -29,6 +29,7 @@
 #ifndef NK_NETLINK_H_
 #define NK_NETLINK_H_
 
+#include <stdbool.h>
 #include <linux/rtnetlink.h>
 #include "state.h"
 
@@ -41,7 +42,8 @@ enum {
 };
 
 int nl_event_react(struct client_state_t cs[static 1], int state);
-int nl_event_get(struct client_state_t cs[static 1]);
+void nl_event_get(struct client_state_t cs[static 1]);
+bool nl_event_pending(struct client_state_t cs[static 1]);
 int nl_getifdata(void);
 
 #endif /* NK_NETLINK_H_ */
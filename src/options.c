@@ -29,90 +29,124 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include "nk/log.h"
 
 #include "options.h"
 
-static int do_overload_value(const uint8_t *buf, ssize_t blen, int overload)
+static void optidx_add(struct dhcp_optidx oi[static 1], uint8_t code,
+                       size_t off, uint8_t len)
 {
-    ssize_t i = 0;
+    if (oi->nspans >= DHCP_OPTIDX_SPANS) {
+        log_warning("optidx_add: Too many options; ignoring option 0x%02x.",
+                    code);
+        return;
+    }
+    struct dhcp_optspan *sp = &oi->span[oi->nspans++];
+    sp->off = (uint16_t)off;
+    sp->len = len;
+    sp->next = 0;
+    // Repeated options are concatenated in the order seen (RFC3396).
+    if (!oi->first[code]) {
+        oi->first[code] = oi->nspans;
+        return;
+    }
+    struct dhcp_optspan *p = &oi->span[oi->first[code] - 1];
+    while (p->next)
+        p = &oi->span[p->next - 1];
+    p->next = oi->nspans;
+}
+
+// Returns the index of the end option within buf, or -1 if there is none.
+static ssize_t optidx_scan(struct dhcp_optidx oi[static 1],
+                           const uint8_t *buf, size_t blen, size_t base)
+{
+    size_t i = 0;
     while (i < blen) {
         if (buf[i] == DCODE_PADDING) {
             ++i;
             continue;
         }
         if (buf[i] == DCODE_END)
+            return i;
+        if (i + 2 > blen)
             break;
-        if (i >= blen - 2)
+        size_t len = buf[i+1];
+        if (i + 2 + len > blen)
             break;
-        if (buf[i] == DCODE_OVERLOAD) {
-            if (buf[i+1] == 1) {
-                overload |= buf[i+2];
-                i += 3;
-                continue;
-            }
-        }
-        i += buf[i+1] + 2;
+        optidx_add(oi, buf[i], base + i + 2, (uint8_t)len);
+        i += len + 2;
     }
-    return overload;
+    return -1;
 }
 
-static int overload_value(const struct dhcpmsg * const packet)
+// Number of bytes of the packet field at off that were actually received.
+static size_t optidx_field_len(const struct dhcp_optidx oi[static 1],
+                               size_t off, size_t size)
 {
-    int ol = do_overload_value(packet->options, sizeof packet->options, 0);
-    if (ol & 1 && ol & 2)
-        return ol;
-    if (ol & 1) {
-        ol |= do_overload_value(packet->file, sizeof packet->file, ol);
-        return ol;
-    }
-    if (ol & 2) {
-        ol |= do_overload_value(packet->sname, sizeof packet->sname, ol);
-        return ol;
-    }
-    return ol; // ol == 0
+    if (oi->len <= off)
+        return 0;
+    return oi->len - off < size ? oi->len - off : size;
 }
 
-static void do_get_dhcp_opt(const uint8_t *sbuf, ssize_t slen, uint8_t code,
-                            uint8_t *dbuf, ssize_t dlen, ssize_t *didx)
+// Build the index of all options in a received packet with a single walk
+// over the options field and, if they are overloaded, the file and sname
+// fields.  All of the get_option_*() accessors are served from the index.
+// Only the first len bytes of packet are examined.
+void dhcp_optidx_build(struct dhcp_optidx oi[static 1],
+                       const struct dhcpmsg packet[static 1], size_t len)
 {
-    ssize_t i = 0;
-    while (i < slen) {
-        if (sbuf[i] == DCODE_PADDING) {
-            ++i;
-            continue;
-        }
-        if (sbuf[i] == DCODE_END)
-            break;
-        if (i >= slen - 2)
-            break;
-        ssize_t soptsiz = sbuf[i+1];
-        if (sbuf[i] == code) {
-            if (dlen - *didx < soptsiz)
-                return;
-            if (slen - i - 2 < soptsiz)
-                return;
-            memcpy(dbuf + *didx, sbuf+i+2, soptsiz);
-            *didx += soptsiz;
-        }
-        i += soptsiz + 2;
+    memset(oi, 0, sizeof *oi);
+    oi->packet = packet;
+    oi->len = len < sizeof *packet ? len : sizeof *packet;
+    size_t olen = optidx_field_len(oi, offsetof(struct dhcpmsg, options),
+                                   sizeof packet->options);
+    oi->end = optidx_scan(oi, packet->options, olen,
+                          offsetof(struct dhcpmsg, options));
+    int ol = 0;
+    uint8_t ols = oi->first[DCODE_OVERLOAD];
+    if (ols) {
+        const struct dhcp_optspan *sp = &oi->span[ols - 1];
+        if (sp->len == 1)
+            ol = ((const uint8_t *)packet)[sp->off];
     }
+    if (ol & 1)
+        optidx_scan(oi, packet->file,
+                    optidx_field_len(oi, offsetof(struct dhcpmsg, file),
+                                     sizeof packet->file),
+                    offsetof(struct dhcpmsg, file));
+    if (ol & 2)
+        optidx_scan(oi, packet->sname,
+                    optidx_field_len(oi, offsetof(struct dhcpmsg, sname),
+                                     sizeof packet->sname),
+                    offsetof(struct dhcpmsg, sname));
 }
 
-ssize_t get_dhcp_opt(const struct dhcpmsg * const packet, uint8_t code,
+// Copy the packet that src refers to into dpacket and make dst an index of
+// that copy.  The spans hold offsets, so the index need not be rebuilt.
+void dhcp_optidx_copy(struct dhcp_optidx dst[static 1],
+                      struct dhcpmsg dpacket[static 1],
+                      const struct dhcp_optidx src[static 1])
+{
+    memset(dpacket, 0, sizeof *dpacket);
+    memcpy(dpacket, src->packet, src->len);
+    memcpy(dst, src, sizeof *dst);
+    dst->packet = dpacket;
+}
+
+ssize_t get_dhcp_opt(const struct dhcp_optidx * const oi, uint8_t code,
                      uint8_t *dbuf, ssize_t dlen)
 {
-    int ol = overload_value(packet);
+    const uint8_t *pkt = (const uint8_t *)oi->packet;
     ssize_t didx = 0;
-    do_get_dhcp_opt(packet->options, sizeof packet->options, code,
-                    dbuf, dlen, &didx);
-    if (ol & 1)
-        do_get_dhcp_opt(packet->file, sizeof packet->file, code,
-                        dbuf, dlen, &didx);
-    if (ol & 2)
-        do_get_dhcp_opt(packet->sname, sizeof packet->sname, code,
-                        dbuf, dlen, &didx);
+    for (uint8_t s = oi->first[code]; s; s = oi->span[s - 1].next) {
+        const struct dhcp_optspan *sp = &oi->span[s - 1];
+        if (dlen - didx < sp->len)
+            break;
+        memcpy(dbuf + didx, pkt + sp->off, sp->len);
+        didx += sp->len;
+    }
     return didx;
 }
 
@@ -287,6 +321,12 @@ void add_option_maxsize(struct dhcpmsg *packet)
                    htons(sizeof(struct ip_udp_dhcp_packet)));
 }
 
+// RFC4039: Rapid Commit has no data.
+void add_option_rapid_commit(struct dhcpmsg *packet)
+{
+    add_option_string(packet, DCODE_RAPIDCOMMIT, "", 0);
+}
+
 void add_option_vendor(struct dhcpmsg *packet, const char * const vendor,
                        size_t vsize)
 {
@@ -302,35 +342,35 @@ void add_option_hostname(struct dhcpmsg *packet, const char * const hostname,
 }
 #endif
 
-uint32_t get_option_router(const struct dhcpmsg * const packet)
+uint32_t get_option_router(const struct dhcp_optidx * const oi)
 {
     ssize_t ol;
     uint32_t ret = 0;
     uint8_t buf[MAX_DOPT_SIZE];
-    ol = get_dhcp_opt(packet, DCODE_ROUTER, buf, sizeof buf);
+    ol = get_dhcp_opt(oi, DCODE_ROUTER, buf, sizeof buf);
     if (ol == sizeof ret)
         memcpy(&ret, buf, sizeof ret);
     return ret;
 }
 
-uint8_t get_option_msgtype(const struct dhcpmsg * const packet)
+uint8_t get_option_msgtype(const struct dhcp_optidx * const oi)
 {
     ssize_t ol;
     uint8_t ret = 0;
     uint8_t buf[MAX_DOPT_SIZE];
-    ol = get_dhcp_opt(packet, DCODE_MSGTYPE, buf, sizeof buf);
+    ol = get_dhcp_opt(oi, DCODE_MSGTYPE, buf, sizeof buf);
     if (ol == sizeof ret)
         ret = buf[0];
     return ret;
 }
 
-uint32_t get_option_serverid(const struct dhcpmsg *const packet, int *found)
+uint32_t get_option_serverid(const struct dhcp_optidx * const oi, int *found)
 {
     ssize_t ol;
     uint32_t ret = 0;
     uint8_t buf[MAX_DOPT_SIZE];
     *found = 0;
-    ol = get_dhcp_opt(packet, DCODE_SERVER_ID, buf, sizeof buf);
+    ol = get_dhcp_opt(oi, DCODE_SERVER_ID, buf, sizeof buf);
     if (ol == sizeof ret) {
         *found = 1;
         memcpy(&ret, buf, sizeof ret);
@@ -338,12 +378,25 @@ uint32_t get_option_serverid(const struct dhcpmsg *const packet, int *found)
     return ret;
 }
 
-uint32_t get_option_leasetime(const struct dhcpmsg * const packet)
+uint32_t get_option_leasetime(const struct dhcp_optidx * const oi)
+{
+    ssize_t ol;
+    uint32_t ret = 0;
+    uint8_t buf[MAX_DOPT_SIZE];
+    ol = get_dhcp_opt(oi, DCODE_LEASET, buf, sizeof buf);
+    if (ol == sizeof ret) {
+        memcpy(&ret, buf, sizeof ret);
+        ret = ntohl(ret);
+    }
+    return ret;
+}
+
+uint32_t get_option_renewtime(const struct dhcp_optidx * const oi)
 {
     ssize_t ol;
     uint32_t ret = 0;
     uint8_t buf[MAX_DOPT_SIZE];
-    ol = get_dhcp_opt(packet, DCODE_LEASET, buf, sizeof buf);
+    ol = get_dhcp_opt(oi, DCODE_RENEWT, buf, sizeof buf);
     if (ol == sizeof ret) {
         memcpy(&ret, buf, sizeof ret);
         ret = ntohl(ret);
@@ -351,13 +404,31 @@ uint32_t get_option_leasetime(const struct dhcpmsg * const packet)
     return ret;
 }
 
+uint32_t get_option_rebindtime(const struct dhcp_optidx * const oi)
+{
+    ssize_t ol;
+    uint32_t ret = 0;
+    uint8_t buf[MAX_DOPT_SIZE];
+    ol = get_dhcp_opt(oi, DCODE_REBINDT, buf, sizeof buf);
+    if (ol == sizeof ret) {
+        memcpy(&ret, buf, sizeof ret);
+        ret = ntohl(ret);
+    }
+    return ret;
+}
+
+bool get_option_rapid_commit(const struct dhcp_optidx * const oi)
+{
+    return oi->first[DCODE_RAPIDCOMMIT] != 0;
+}
+
 // Returned buffer is not nul-terminated.
-size_t get_option_clientid(const struct dhcpmsg * const packet, char *cbuf,
+size_t get_option_clientid(const struct dhcp_optidx * const oi, char *cbuf,
                            size_t clen)
 {
     if (clen < 1)
         return 0;
-    ssize_t ol = get_dhcp_opt(packet, DCODE_CLIENT_ID,
+    ssize_t ol = get_dhcp_opt(oi, DCODE_CLIENT_ID,
                               (uint8_t *)cbuf, clen);
     return ol > 0 ? ol : 0;
 }
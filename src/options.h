@@ -28,6 +28,8 @@
 #ifndef OPTIONS_H_
 #define OPTIONS_H_
 
+#include <stdbool.h>
+#include <sys/types.h>
 #include "dhcp.h"
 
 #define DCODE_PADDING      0x00
@@ -50,13 +52,46 @@
 #define DCODE_SERVER_ID    0x36
 #define DCODE_PARAM_REQ    0x37
 #define DCODE_MAX_SIZE     0x39
+#define DCODE_RENEWT       0x3a
+#define DCODE_REBINDT      0x3b
 #define DCODE_VENDOR       0x3c
 #define DCODE_CLIENT_ID    0x3d
+#define DCODE_RAPIDCOMMIT  0x50
 #define DCODE_END          0xff
 
+// Every option but padding and the end marker takes at least two bytes, so
+// the options, file and sname fields can hold at most 154 + 64 + 32 = 250
+// of them.  The index can thus never be exhausted, and span indexes + 1
+// still fit in the uint8_t first[] and next fields.
+#define DHCP_OPTIDX_SPANS 255
+
+// Location of the data of one option instance within a packet.
+struct dhcp_optspan {
+    uint16_t off;   // Offset from the start of struct dhcpmsg.
+    uint8_t len;
+    uint8_t next;   // Index + 1 of the next span with the same code, or 0.
+};
+
+// Index of the options in a received packet, built by dhcp_optidx_build().
+// It is a view of the packet that it was built from, which must outlive it;
+// use dhcp_optidx_copy() to keep a packet and its index elsewhere.
+struct dhcp_optidx {
+    const struct dhcpmsg *packet;
+    size_t len;           // Bytes of *packet that were actually received.
+    ssize_t end;          // Index of the end option in options[], or -1.
+    uint8_t nspans;
+    uint8_t first[256];   // Index + 1 of the first span for each code, or 0.
+    struct dhcp_optspan span[DHCP_OPTIDX_SPANS];
+};
+
 #define MAX_DOPT_SIZE 500
 
-ssize_t get_dhcp_opt(const struct dhcpmsg * const packet, uint8_t code,
+void dhcp_optidx_build(struct dhcp_optidx oi[static 1],
+                       const struct dhcpmsg packet[static 1], size_t len);
+void dhcp_optidx_copy(struct dhcp_optidx dst[static 1],
+                      struct dhcpmsg dpacket[static 1],
+                      const struct dhcp_optidx src[static 1]);
+ssize_t get_dhcp_opt(const struct dhcp_optidx * const oi, uint8_t code,
                      uint8_t *dbuf, ssize_t dlen);
 ssize_t get_end_option_idx(const struct dhcpmsg * const packet);
 
@@ -78,16 +113,21 @@ void add_option_clientid(struct dhcpmsg *packet,
                          const char * const clientid, size_t clen);
 #ifndef NDHS_BUILD
 void add_option_maxsize(struct dhcpmsg *packet);
+void add_option_rapid_commit(struct dhcpmsg *packet);
 void add_option_vendor(struct dhcpmsg *packet, const char * const vendor,
                        size_t vsize);
 void add_option_hostname(struct dhcpmsg *packet, const char * const hostname,
                          size_t hsize);
 #endif
-uint32_t get_option_router(const struct dhcpmsg * const packet);
-uint8_t get_option_msgtype(const struct dhcpmsg * const packet);
-uint32_t get_option_serverid(const struct dhcpmsg * const packet, int *found);
-uint32_t get_option_leasetime(const struct dhcpmsg *const packet);
-size_t get_option_clientid(const struct dhcpmsg * const packet,
+uint32_t get_option_router(const struct dhcp_optidx * const oi);
+uint8_t get_option_msgtype(const struct dhcp_optidx * const oi);
+uint32_t get_option_serverid(const struct dhcp_optidx * const oi,
+                             int *found);
+uint32_t get_option_leasetime(const struct dhcp_optidx * const oi);
+uint32_t get_option_renewtime(const struct dhcp_optidx * const oi);
+uint32_t get_option_rebindtime(const struct dhcp_optidx * const oi);
+bool get_option_rapid_commit(const struct dhcp_optidx * const oi);
+size_t get_option_clientid(const struct dhcp_optidx * const oi,
                            char *cbuf, size_t clen);
 
 #endif
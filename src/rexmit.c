@@ -0,0 +1,101 @@
+/* rexmit.c - DHCP retransmission waits
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "rexmit.h"
+
+// Clock granularity term of the RFC 6298 retransmission timeout, in us.
+#define RTT_GRANULARITY_US 1000LL
+
+// Floor of the adaptive retransmission wait, in ms.
+#define ADAPTIVE_REXMIT_MIN 200
+
+// Folds the RTT sample r_us into a smoothed RTT and its variation as in
+// RFC 6298 2.2 and 2.3.  first is true if there were no samples before.
+void rexmit_rtt_sample(long long srtt_us[static 1],
+                       long long rttvar_us[static 1], bool first,
+                       long long r_us)
+{
+    if (first) {
+        *srtt_us = r_us;
+        *rttvar_us = r_us / 2;
+        return;
+    }
+    long long d = *srtt_us > r_us ? *srtt_us - r_us : r_us - *srtt_us;
+    *rttvar_us += (d - *rttvar_us) / 4;
+    *srtt_us += (r_us - *srtt_us) / 8;
+}
+
+// The RFC 6298 retransmission timeout, rounded up to ms.
+long long rexmit_rto_ms(long long srtt_us, long long rttvar_us)
+{
+    long long v = 4 * rttvar_us;
+    long long rto = srtt_us + (v > RTT_GRANULARITY_US ? v
+                                                      : RTT_GRANULARITY_US);
+    return (rto + 999) / 1000;
+}
+
+// With --adaptive-retransmit, the ms to wait before retransmission
+// numpackets of a request to a server whose retransmission timeout is
+// rto_ms.  The first wait is twice the timeout and it doubles from there,
+// but never exceeds cap, so a server that has answered quickly before
+// costs us much less than the RFC 2131 ladder when a packet is lost.
+long long rexmit_adaptive_ms(long long rto_ms, size_t numpackets,
+                             long long cap, uint32_t rnd)
+{
+    long long to = rto_ms * 2;
+    if (to < ADAPTIVE_REXMIT_MIN)
+        to = ADAPTIVE_REXMIT_MIN;
+    for (size_t i = 0; i < numpackets && to < cap; ++i)
+        to *= 2;
+    if (to > cap)
+        to = cap;
+    // Up to a quarter of jitter, scaled down from the second of the ladder.
+    // It is taken off instead where adding it would pass cap, so that
+    // clients that have all backed off to cap still spread out.
+    long long jitter = (rnd & 0x7fffffffu) % (to / 4 + 1);
+    return to + jitter <= cap ? to + jitter : to - jitter;
+}
+
+// The RFC 2131 4.1 wait before retransmission numpackets: 4s, doubling up
+// to 64s, plus up to a second of jitter.  With a zero rnd, there is none.
+int rexmit_ladder_ms(size_t numpackets, uint32_t rnd)
+{
+    int to = 64;
+    static const char tot[] = { 4, 8, 16, 32, 64 };
+    if (numpackets < sizeof tot)
+        to = tot[numpackets];
+    // Distribution is a bit biased but it doesn't really matter.
+    return to * 1000 + (rnd & 0x7fffffffu) % 1000;
+}
+
+// Wait before resending a renew or rebind request: roughly the 60s
+// minimum of RFC 2131 4.4.5.
+long long rexmit_renew_ms(uint32_t rnd)
+{
+    return (50 + rnd % 20) * 1000;
+}
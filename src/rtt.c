@@ -0,0 +1,292 @@
+/* rtt.c - round-trip time estimates from kernel timestamps
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include "nk/log.h"
+#include "nk/io.h"
+#include "rtt.h"
+#include "rexmit.h"
+#include "metrics.h"
+#include "ndhc.h"
+
+// sockd asks the kernel to stamp packets as they are received from, and
+// handed to, the network device; see set_timestamping() in sockd.c.  Those
+// stamps exclude the time that ndhc spends waiting to be scheduled and
+// handling other events, and have ns resolution.  Software timestamps are
+// CLOCK_REALTIME, so when a stamp is missing, rtt_now_ns() is used in its
+// place.
+
+// Samples beyond this are taken to be bogus (such as a clock step).
+#define RTT_MAX_NS 60000000000LL
+
+#define RTT_RECORD_MAGIC 0x4e444852u // "NDHR"
+#define RTT_RECORD_VERSION 1
+
+// The DHCP server estimates as they stood after the last sample, kept so
+// that --adaptive-retransmit can time the very first retransmission after
+// a restart.  Fields are in host byte order except for addr.  ARP
+// estimates are not kept, as they are only used for metrics.
+struct rtt_record_ent {
+    uint32_t addr;
+    uint32_t samples;
+    int64_t srtt_us;
+    int64_t rttvar_us;
+};
+
+struct rtt_record {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;     // Valid entries in e.
+    struct rtt_record_ent e[RTT_PEERS];
+};
+
+long long rtt_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns the software timestamp that msg carries, or -1 if it has none.
+long long rtt_rx_ts(struct msghdr msg[static 1])
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+        struct scm_timestamping st;
+        memcpy(&st, CMSG_DATA(cmsg), sizeof st);
+        if (!st.ts[0].tv_sec && !st.ts[0].tv_nsec)
+            return -1;
+        return st.ts[0].tv_sec * 1000000000LL + st.ts[0].tv_nsec;
+    }
+    return -1;
+}
+
+// Transmit timestamps come back on the error queue of the socket that sent
+// the packet, one message per packet, in the order that they were sent.
+// Returns false once the queue is empty; otherwise *ts is the timestamp of
+// the next packet, or -1 if the message did not carry one.
+bool rtt_tx_ts_next(int fd, long long ts[static 1])
+{
+    char control[256];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof control,
+    };
+    ssize_t r;
+    do {
+        r = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        return false;
+    *ts = rtt_rx_ts(&msg);
+    return true;
+}
+
+// Empties the error queue of fd and returns the last timestamp in it, or
+// -1 if there was none.
+long long rtt_tx_ts_last(int fd)
+{
+    long long last = -1, ts;
+    while (rtt_tx_ts_next(fd, &ts)) {
+        if (ts >= 0)
+            last = ts;
+    }
+    return last;
+}
+
+static struct rtt_est *rtt_slot(struct rtt_data rd[static 1],
+                                enum rtt_kind kind, uint32_t addr)
+{
+    struct rtt_est *t = rd->peers[kind], *stale = &t[0];
+    for (size_t i = 0; i < RTT_PEERS; ++i) {
+        if (t[i].addr == addr)
+            return &t[i];
+        if (!t[i].addr || (stale->addr && t[i].used < stale->used))
+            stale = &t[i];
+    }
+    memset(stale, 0, sizeof *stale);
+    stale->addr = addr;
+    return stale;
+}
+
+static void rtt_save(struct client_state_t cs[static 1])
+{
+    struct rtt_data *rd = cs->rtt;
+    struct rtt_record rec = {
+        .magic = RTT_RECORD_MAGIC,
+        .version = RTT_RECORD_VERSION,
+    };
+    const struct rtt_est *t = rd->peers[RTT_DHCP];
+    for (size_t i = 0; i < RTT_PEERS; ++i) {
+        if (!t[i].addr || !t[i].samples)
+            continue;
+        rec.e[rec.count++] = (struct rtt_record_ent){
+            .addr = t[i].addr,
+            .samples = t[i].samples,
+            .srtt_us = t[i].srtt_us,
+            .rttvar_us = t[i].rttvar_us,
+        };
+    }
+    size_t len = offsetof(struct rtt_record, e) + rec.count * sizeof rec.e[0];
+    int r;
+    do {
+        r = ftruncate(rd->fd, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0) {
+        lseek(rd->fd, 0, SEEK_SET);
+        ssize_t w = safe_write(rd->fd, (const char *)&rec, len);
+        if (w >= 0 && (size_t)w == len)
+            return;
+    }
+    log_warning("%s: Failed to write RTT record.", cs->cfg->interface);
+}
+
+void rtt_sample(struct client_state_t cs[static 1], enum rtt_kind kind,
+                uint32_t addr, long long rtt_ns)
+{
+    struct rtt_data *rd = cs->rtt;
+    if (!addr || rtt_ns < 0 || rtt_ns > RTT_MAX_NS)
+        return;
+    long long r = rtt_ns / 1000;
+    struct rtt_est *e = rtt_slot(rd, kind, addr);
+    rexmit_rtt_sample(&e->srtt_us, &e->rttvar_us, !e->samples, r);
+    e->last_us = r;
+    e->samples++;
+    e->used = ++rd->age;
+    metrics_rtt(cs, kind, r);
+    if (kind == RTT_DHCP)
+        rd->dirty = true;
+}
+
+// Writes the DHCP estimates to the RTT record if they have changed.  This
+// is done when a lease is bound or renewed and when ndhc exits rather than
+// for every sample, so that receiving a reply costs no file writes.
+void rtt_flush(struct client_state_t cs[static 1])
+{
+    struct rtt_data *rd = cs->rtt;
+    if (!rd->dirty || rd->fd < 0)
+        return;
+    rd->dirty = false;
+    rtt_save(cs);
+}
+
+const struct rtt_est *rtt_get(struct client_state_t cs[static 1],
+                              enum rtt_kind kind, uint32_t addr)
+{
+    const struct rtt_data *rd = cs->rtt;
+    for (size_t i = 0; i < RTT_PEERS; ++i) {
+        if (addr && rd->peers[kind][i].addr == addr)
+            return &rd->peers[kind][i];
+    }
+    return NULL;
+}
+
+// Returns the RTT_PEERS slots for kind; unused slots have a zero addr.
+const struct rtt_est *rtt_table(struct client_state_t cs[static 1],
+                               enum rtt_kind kind)
+{
+    return cs->rtt->peers[kind];
+}
+
+// Returns the RFC 6298 retransmission timeout for the DHCP server addr, in
+// ms, or -1 if we have no estimate.  If addr is zero or unknown, the lowest
+// timeout of any server that we know of is used instead, as the servers
+// that answer us are almost always on the same segment.
+long long rtt_rto_ms(struct client_state_t cs[static 1], uint32_t addr)
+{
+    const struct rtt_est *e = rtt_get(cs, RTT_DHCP, addr);
+    if (!e || !e->samples) {
+        e = NULL;
+        const struct rtt_est *t = cs->rtt->peers[RTT_DHCP];
+        for (size_t i = 0; i < RTT_PEERS; ++i) {
+            if (!t[i].addr || !t[i].samples)
+                continue;
+            if (!e || t[i].srtt_us + 4 * t[i].rttvar_us
+                      < e->srtt_us + 4 * e->rttvar_us)
+                e = &t[i];
+        }
+        if (!e)
+            return -1;
+    }
+    return rexmit_rto_ms(e->srtt_us, e->rttvar_us);
+}
+
+// Opens RTTREC-<interface> in state_dir and loads the DHCP server estimates
+// that it holds.  Must be called before the chroot.  A missing or unusable
+// record only means that we start without estimates.
+void rtt_open(struct client_state_t cs[static 1])
+{
+    struct rtt_data *rd = cs->rtt;
+    char path[PATH_MAX];
+    int r = snprintf(path, sizeof path, "%s/RTTREC-%s", state_dir,
+                     cs->cfg->interface);
+    if (r < 0 || (size_t)r >= sizeof path)
+        return;
+    rd->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if (rd->fd < 0) {
+        log_warning("%s: Failed to open RTT record '%s': %s",
+                    cs->cfg->interface, path, strerror(errno));
+        return;
+    }
+    struct rtt_record rec;
+    ssize_t len = safe_read(rd->fd, (char *)&rec, sizeof rec);
+    if (len < (ssize_t)offsetof(struct rtt_record, e))
+        return;
+    if (rec.magic != RTT_RECORD_MAGIC || rec.version != RTT_RECORD_VERSION
+        || rec.count > RTT_PEERS
+        || (size_t)len < offsetof(struct rtt_record, e)
+                         + rec.count * sizeof rec.e[0])
+        return;
+    for (size_t i = 0; i < rec.count; ++i) {
+        const struct rtt_record_ent *re = &rec.e[i];
+        if (!re->addr || !re->samples || re->srtt_us < 0 || re->rttvar_us < 0
+            || re->srtt_us > RTT_MAX_NS / 1000
+            || re->rttvar_us > RTT_MAX_NS / 1000)
+            continue;
+        struct rtt_est *e = rtt_slot(rd, RTT_DHCP, re->addr);
+        e->samples = re->samples;
+        e->srtt_us = re->srtt_us;
+        e->rttvar_us = re->rttvar_us;
+        e->last_us = re->srtt_us;
+        e->used = ++rd->age;
+    }
+}
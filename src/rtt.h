@@ -0,0 +1,88 @@
+/* rtt.h - round-trip time estimates from kernel timestamps
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NDHC_RTT_H_
+#define NDHC_RTT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "ndhc.h"
+
+// Control buffer space for the SCM_TIMESTAMPING message of one packet.
+#define RTT_CMSG_SPACE CMSG_SPACE(3 * sizeof(struct timespec))
+
+union rtt_cmsg {
+    char buf[RTT_CMSG_SPACE];
+    size_t align;       // The alignment of struct cmsghdr.
+};
+
+enum rtt_kind {
+    RTT_DHCP = 0,   // Keyed by DHCP server id.
+    RTT_ARP,        // Keyed by ARP target address.
+    RTT_KINDS,
+};
+
+#define RTT_PEERS 8
+
+struct rtt_est {
+    uint32_t addr;      // Network byte order; zero if the slot is unused.
+    uint32_t samples;
+    uint32_t used;      // Age stamp for replacing the stalest slot.
+    long long last_us;
+    long long srtt_us;  // Smoothed RTT and its variation, as in RFC 6298.
+    long long rttvar_us;
+};
+
+// The estimates of one interface.
+struct rtt_data {
+    struct rtt_est peers[RTT_KINDS][RTT_PEERS];
+    uint32_t age;
+    int fd;             // The RTT record, or -1.
+    bool dirty;         // DHCP estimates changed since the record was written.
+};
+
+#define RTT_DATA_INIT { .fd = -1 }
+
+long long rtt_now_ns(void);
+long long rtt_rx_ts(struct msghdr msg[static 1]);
+bool rtt_tx_ts_next(int fd, long long ts[static 1]);
+long long rtt_tx_ts_last(int fd);
+void rtt_sample(struct client_state_t cs[static 1], enum rtt_kind kind,
+                uint32_t addr, long long rtt_ns);
+const struct rtt_est *rtt_get(struct client_state_t cs[static 1],
+                              enum rtt_kind kind, uint32_t addr);
+const struct rtt_est *rtt_table(struct client_state_t cs[static 1],
+                               enum rtt_kind kind);
+long long rtt_rto_ms(struct client_state_t cs[static 1], uint32_t addr);
+void rtt_open(struct client_state_t cs[static 1]);
+void rtt_flush(struct client_state_t cs[static 1]);
+
+#endif /* NDHC_RTT_H_ */
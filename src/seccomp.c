@@ -26,17 +26,62 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include "seccomp.h"
+#include "metrics.h"
 #include "nk/log.h"
 #include "nk/seccomp-bpf.h"
 
 bool seccomp_enforce = false;
 
-int enforce_seccomp_ndhc(void)
+#ifdef ENABLE_SECCOMP_FILTER
+// Offset of the low 32 bits of syscall argument n.  Only descriptors and
+// flags are checked, and the kernel ignores the high half of both.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SECCOMP_ARG_LO(n) (offsetof(struct seccomp_data, args[(n)]))
+#else
+#define SECCOMP_ARG_LO(n) (offsetof(struct seccomp_data, args[(n)]) + 4)
+#endif
+
+// A syscall number that is never made, to disable the rules below.
+#define SECCOMP_NR_NONE 0xffffffffu
+
+// Allows openat(dirfd, ..., flags) with exactly the given flags, apart
+// from O_LARGEFILE, which 32-bit libcs add on their own.  Like the rest
+// of the filter, this leaves the syscall number in the accumulator.
+#define ALLOW_OPENAT_IN(nr, dirfd, flags) \
+    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, (nr), 0, 7), \
+    BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SECCOMP_ARG_LO(0)), \
+    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, (uint32_t)(dirfd), 0, 4), \
+    BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SECCOMP_ARG_LO(2)), \
+    BPF_STMT(BPF_ALU+BPF_AND+BPF_K, ~(uint32_t)O_LARGEFILE), \
+    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, (uint32_t)(flags), 0, 1), \
+    BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_ALLOW), \
+    EXAMINE_SYSCALL
+
+// Allows renameat() or renameat2() when both names are relative to dirfd.
+#define ALLOW_RENAMEAT_IN(nr, dirfd) \
+    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, (nr), 0, 6), \
+    BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SECCOMP_ARG_LO(0)), \
+    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, (uint32_t)(dirfd), 0, 3), \
+    BPF_STMT(BPF_LD+BPF_W+BPF_ABS, SECCOMP_ARG_LO(2)), \
+    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, (uint32_t)(dirfd), 0, 1), \
+    BPF_STMT(BPF_RET+BPF_K, SECCOMP_RET_ALLOW), \
+    EXAMINE_SYSCALL
+#endif
+
+// metrics_fd is the directory that metrics_flush() writes into, or -1 if
+// metrics are off.  The metrics file is the only one that is opened after
+// the filter is installed.  A dirfd does not confine absolute paths, but
+// those resolve inside the chroot, and only files opened for writing
+// with the flags of the metrics file are allowed.
+int enforce_seccomp_ndhc(int metrics_fd)
 {
 #ifdef ENABLE_SECCOMP_FILTER
     if (!seccomp_enforce)
         return 0;
+    bool metrics_on = metrics_fd >= 0;
     struct sock_filter filter[] = {
         VALIDATE_ARCHITECTURE,
         EXAMINE_SYSCALL,
@@ -45,15 +90,18 @@ int enforce_seccomp_ndhc(void)
         ALLOW_SYSCALL(read),
         ALLOW_SYSCALL(write),
         ALLOW_SYSCALL(close),
+        ALLOW_SYSCALL(timerfd_settime),
 
 #if defined(__x86_64__) || (defined(__arm__) && defined(__ARM_EABI__))
         ALLOW_SYSCALL(sendto), // used for glibc syslog routines
         ALLOW_SYSCALL(recvmsg),
         ALLOW_SYSCALL(sendmsg),
         ALLOW_SYSCALL(recvfrom),
+        ALLOW_SYSCALL(recvmmsg),
         ALLOW_SYSCALL(connect),
 #elif defined(__i386__)
         ALLOW_SYSCALL(socketcall),
+        ALLOW_SYSCALL(recvmmsg),
 #else
 #error Target platform does not support seccomp-filter.
 #endif
@@ -71,6 +119,18 @@ int enforce_seccomp_ndhc(void)
         ALLOW_SYSCALL(lseek),
         ALLOW_SYSCALL(fsync),
 
+        // These are for 'metrics_flush()'
+        ALLOW_OPENAT_IN(metrics_on ? __NR_openat : SECCOMP_NR_NONE,
+                        metrics_fd, METRICS_OPEN_FLAGS),
+#ifdef __NR_renameat
+        ALLOW_RENAMEAT_IN(metrics_on ? __NR_renameat : SECCOMP_NR_NONE,
+                          metrics_fd),
+#endif
+#ifdef __NR_renameat2
+        ALLOW_RENAMEAT_IN(metrics_on ? __NR_renameat2 : SECCOMP_NR_NONE,
+                          metrics_fd),
+#endif
+
         // These are for 'background()'
         ALLOW_SYSCALL(clone),
         ALLOW_SYSCALL(set_robust_list),
@@ -83,6 +143,12 @@ int enforce_seccomp_ndhc(void)
         ALLOW_SYSCALL(mmap),
         ALLOW_SYSCALL(munmap),
 
+        // mmap() and munmap() are also used for the ARP defense socket
+        // receive ring.
+#ifdef __NR_mmap2
+        ALLOW_SYSCALL(mmap2),
+#endif
+
         ALLOW_SYSCALL(rt_sigreturn),
 #ifdef __NR_sigreturn
         ALLOW_SYSCALL(sigreturn),
@@ -100,6 +166,8 @@ int enforce_seccomp_ndhc(void)
     if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog))
         return -1;
     log_line("ndhc seccomp filter installed.  Please disable seccomp if you encounter problems.");
+#else
+    (void)metrics_fd;
 #endif
     return 0;
 }
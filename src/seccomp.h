@@ -32,7 +32,7 @@
 
 extern bool seccomp_enforce;
 
-int enforce_seccomp_ndhc(void);
+int enforce_seccomp_ndhc(int metrics_fd);
 int enforce_seccomp_ifch(void);
 int enforce_seccomp_sockd(void);
 
@@ -35,6 +35,7 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
@@ -42,10 +43,11 @@
 #include <sys/prctl.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
 #include <net/ethernet.h>
 #include <netinet/if_ether.h>
 #include <linux/filter.h>
+#include <linux/net_tstamp.h>
 #include <pwd.h>
 #include <grp.h>
 #include "nk/log.h"
@@ -56,24 +58,36 @@
 #include "ndhc-defines.h"
 #include "ndhc.h"
 #include "dhcp.h"
+#include "arp.h"
 #include "sys.h"
 #include "seccomp.h"
+#include "metrics.h"
+#include "trace.h"
 
 static int epollfd, signalFd;
-/* Slots are for signalFd and the ndhc -> ifchd socket. */
-static struct epoll_event events[2];
+/* Slots are for signalFd and the ndhc -> sockd socket and stream. */
+static struct epoll_event events[3];
 
 uid_t sockd_uid = 0;
 gid_t sockd_gid = 0;
 
+// Every request starts with the u16 slot of the interface that it is for,
+// in host byte order, as both ends are the same machine.
+#define SOCKD_HDRLEN 2
+
 // Interface to make requests of sockd.  Called from ndhc process.
-int request_sockd_fd(char buf[static 1], size_t buflen, char *response)
+int request_sockd_fd(struct client_state_t cs[static 1],
+                     char buf[static 1], size_t buflen, char *response)
 {
-    if (!buflen)
+    char req[SOCKD_HDRLEN + 32];
+    if (!buflen || buflen > sizeof req - SOCKD_HDRLEN)
         return -1;
-    ssize_t r = safe_write(sockdSock[0], buf, buflen);
-    if (r < 0 || (size_t)r != buflen)
-        suicide("%s: (%s) write failed: %d", client_config.interface,
+    trace_event(cs, TEV_SOCKD_TX, (uint8_t)buf[0]);
+    memcpy(req, &cs->slot, SOCKD_HDRLEN);
+    memcpy(req + SOCKD_HDRLEN, buf, buflen);
+    ssize_t r = safe_write(sockdSock[0], req, SOCKD_HDRLEN + buflen);
+    if (r < 0 || (size_t)r != SOCKD_HDRLEN + buflen)
+        suicide("%s: (%s) write failed: %d", cs->cfg->interface,
                 __func__, r);
 
     char data[MAX_BUF], control[MAX_BUF];
@@ -89,10 +103,10 @@ int request_sockd_fd(char buf[static 1], size_t buflen, char *response)
     };
     r = safe_recvmsg(sockdSock[0], &msg, 0);
     if (r == 0) {
-        suicide("%s: (%s) recvmsg received EOF", client_config.interface,
+        suicide("%s: (%s) recvmsg received EOF", cs->cfg->interface,
                 __func__);
     } else if (r < 0) {
-        suicide("%s: (%s) recvmsg failed: %s", client_config.interface,
+        suicide("%s: (%s) recvmsg failed: %s", cs->cfg->interface,
                 __func__, strerror(errno));
     }
     data[iov.iov_len] = '\0';
@@ -104,23 +118,79 @@ int request_sockd_fd(char buf[static 1], size_t buflen, char *response)
                 *response = repc;
             else if (repc != buf[0])
                 suicide("%s: (%s) expected %c sockd reply but got %c",
-                        client_config.interface, __func__, buf[0], repc);
+                        cs->cfg->interface, __func__, buf[0], repc);
             int *fd = (int *)CMSG_DATA(cmsg);
+            metrics_ipc(cs, MIPC_SOCKD, true);
+            trace_event(cs, TEV_SOCKD_RX, (uint8_t)repc);
             return *fd;
         }
     }
     suicide("%s: (%s) sockd reply did not include a fd",
-            client_config.interface, __func__);
+            cs->cfg->interface, __func__);
+}
+
+// Ask the kernel to stamp packets as they are received from or handed to
+// the network device, so that ndhc can measure round-trip times that don't
+// include its own scheduling delay.  Transmit stamps are returned on the
+// socket error queue without a copy of the packet.  ndhc stamps packets
+// itself if this fails, so it is not an error.
+#define TSTAMP_RX (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
+#define TSTAMP_TX (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE \
+                   | SOF_TIMESTAMPING_OPT_TSONLY)
+
+static void set_timestamping(int fd, int flags)
+{
+    if (fd < 0)
+        return;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags) < 0)
+        log_warning("%s: Failed to enable socket timestamps: %s",
+                    client_config.interface, strerror(errno));
+}
+
+// Attach a TPACKET_V3 receive ring so that ndhc can consume ARP frames a
+// block at a time out of shared memory rather than with a syscall per
+// frame.  Returns false if the kernel refuses; the socket then still works
+// with ordinary reads.
+static bool arp_set_rx_ring(int fd)
+{
+    int ver = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof ver) < 0) {
+        log_warning("%s: Failed to select TPACKET_V3 for ARP socket: %s",
+                    client_config.interface, strerror(errno));
+        return false;
+    }
+    struct tpacket_req3 req = {
+        .tp_block_size = ARP_RING_BLOCK_SIZE,
+        .tp_block_nr = ARP_RING_BLOCK_NR,
+        .tp_frame_size = ARP_RING_FRAME_SIZE,
+        .tp_frame_nr = ARP_RING_BLOCK_SIZE / ARP_RING_FRAME_SIZE
+                       * ARP_RING_BLOCK_NR,
+        .tp_retire_blk_tov = ARP_RING_RETIRE_MS,
+    };
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) < 0) {
+        log_warning("%s: Failed to set up ARP socket receive ring: %s",
+                    client_config.interface, strerror(errno));
+        return false;
+    }
+    return true;
 }
 
-static int create_arp_socket(void)
+// If using_ring is non-NULL, a receive ring is requested and *using_ring
+// reports whether it was installed.  The socket is created without a
+// protocol in that case so that nothing can be queued to it through the
+// ordinary receive path before the ring is in place.
+static int create_arp_socket(bool *using_ring)
 {
-    int fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_ARP));
+    int fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK,
+                    using_ring ? 0 : htons(ETH_P_ARP));
     if (fd < 0) {
         log_error("%s: (%s) socket failed: %s", client_config.interface,
                   __func__, strerror(errno));
         goto out;
     }
+    if (using_ring)
+        *using_ring = arp_set_rx_ring(fd);
+    set_timestamping(fd, TSTAMP_RX | TSTAMP_TX);
 
     int opt = 1;
     if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof opt) < 0) {
@@ -150,6 +220,17 @@ static int create_arp_socket(void)
     return -1;
 }
 
+// ndhc keeps its send sockets open for as long as they remain usable, so
+// they are given a filter that drops everything; otherwise they would
+// queue a copy of every received packet that matches them.
+static const struct sock_filter sf_drop_all[] = {
+    BPF_STMT(BPF_RET + BPF_K, 0),
+};
+static const struct sock_fprog sfp_drop_all = {
+    .len = sizeof sf_drop_all / sizeof sf_drop_all[0],
+    .filter = (struct sock_filter *)sf_drop_all,
+};
+
 // Returns fd of new udp socket bound on success, or -1 on failure.
 static int create_udp_socket(uint32_t ip, uint16_t port, char *iface)
 {
@@ -188,6 +269,11 @@ static int create_udp_socket(uint32_t ip, uint16_t port, char *iface)
                   client_config.interface, __func__, strerror(errno));
         goto out_fd;
     }
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &sfp_drop_all,
+                   sizeof sfp_drop_all) < 0)
+        log_warning("%s: (%s) Failed to set BPF for udp socket: %s",
+                    client_config.interface, __func__, strerror(errno));
+    set_timestamping(fd, TSTAMP_TX);
 
     struct sockaddr_in sa = {
         .sin_family = AF_INET,
@@ -258,9 +344,14 @@ out:
     return -1;
 }
 
-static int create_raw_listen_socket(bool *using_bpf)
+static int create_raw_listen_socket(uint32_t xid, uint8_t chaddr[6],
+                                    bool *using_bpf)
 {
-    static const struct sock_filter sf_dhcp[] = {
+    uint32_t chaddr4b = (uint32_t)chaddr[0] << 24 | (uint32_t)chaddr[1] << 16
+                        | (uint32_t)chaddr[2] << 8 | chaddr[3];
+    uint16_t chaddr2b = (uint16_t)(chaddr[4] << 8 | chaddr[5]);
+
+    struct sock_filter sf_dhcp[] = {
         // Verify that the packet has a valid IPv4 version nibble and
         // that no IP options are defined.
         BPF_STMT(BPF_LD + BPF_B + BPF_ABS, 0),
@@ -284,6 +375,22 @@ static int create_raw_listen_socket(bool *using_bpf)
         BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,
                  (DHCP_SERVER_PORT << 16) + DHCP_CLIENT_PORT, 1, 0),
         BPF_STMT(BPF_RET + BPF_K, 0),
+        // Verify that the BOOTP transaction id is the one that is
+        // currently in use.  Replies to other clients on the segment
+        // are dropped here rather than waking up ndhc.
+        BPF_STMT(BPF_LD + BPF_W + BPF_IND,
+                 sizeof(struct udphdr) + offsetof(struct dhcpmsg, xid)),
+        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ntohl(xid), 1, 0),
+        BPF_STMT(BPF_RET + BPF_K, 0),
+        // Verify that the BOOTP client hardware address is ours.
+        BPF_STMT(BPF_LD + BPF_W + BPF_IND,
+                 sizeof(struct udphdr) + offsetof(struct dhcpmsg, chaddr)),
+        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, chaddr4b, 1, 0),
+        BPF_STMT(BPF_RET + BPF_K, 0),
+        BPF_STMT(BPF_LD + BPF_H + BPF_IND,
+                 sizeof(struct udphdr) + offsetof(struct dhcpmsg, chaddr) + 4),
+        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, chaddr2b, 1, 0),
+        BPF_STMT(BPF_RET + BPF_K, 0),
         // Get the UDP length field and store it in X.
         BPF_STMT(BPF_LD + BPF_H + BPF_IND, 4),
         BPF_STMT(BPF_MISC + BPF_TAX, 0),
@@ -298,7 +405,7 @@ static int create_raw_listen_socket(bool *using_bpf)
         BPF_STMT(BPF_LD + BPF_MEM, 0),
         BPF_STMT(BPF_RET + BPF_A, 0),
     };
-    static const struct sock_fprog sfp_dhcp = {
+    struct sock_fprog sfp_dhcp = {
         .len = sizeof sf_dhcp / sizeof sf_dhcp[0],
         .filter = (struct sock_filter *)sf_dhcp,
     };
@@ -307,7 +414,9 @@ static int create_raw_listen_socket(bool *using_bpf)
         .sll_protocol = htons(ETH_P_IP),
         .sll_ifindex = client_config.ifindex,
     };
-    return create_raw_socket(&sa, using_bpf, &sfp_dhcp);
+    int fd = create_raw_socket(&sa, using_bpf, &sfp_dhcp);
+    set_timestamping(fd, TSTAMP_RX);
+    return fd;
 }
 
 static int create_raw_broadcast_socket(void)
@@ -320,7 +429,9 @@ static int create_raw_broadcast_socket(void)
         .sll_halen = 6,
     };
     memcpy(da.sll_addr, "\xff\xff\xff\xff\xff\xff", 6);
-    return create_raw_socket(&da, NULL, NULL);
+    int fd = create_raw_socket(&da, NULL, &sfp_drop_all);
+    set_timestamping(fd, TSTAMP_TX);
+    return fd;
 }
 
 static bool arp_set_bpf_basic(int fd)
@@ -367,10 +478,12 @@ static bool arp_set_bpf_basic(int fd)
 static bool arp_set_bpf_defense(int fd, uint32_t client_addr,
                                 uint8_t client_mac[6])
 {
-    uint32_t mac4b;
-    uint16_t mac2b;
-    memcpy(&mac4b, client_mac, 4);
-    memcpy(&mac2b, client_mac + 4, 2);
+    // BPF loads are in network byte order, so the constants that they are
+    // compared against must be in host order.
+    uint32_t mac4b = (uint32_t)client_mac[0] << 24
+                     | (uint32_t)client_mac[1] << 16
+                     | (uint32_t)client_mac[2] << 8 | client_mac[3];
+    uint16_t mac2b = (uint16_t)(client_mac[4] << 8 | client_mac[5]);
 
     struct sock_filter sf_arp[] = {
         // Verify that the frame has ethernet protocol type of ARP
@@ -389,7 +502,7 @@ static bool arp_set_bpf_defense(int fd, uint32_t client_addr,
         // If the ARP packet source IP does not match our IP address, then
         // it can be ignored.
         BPF_STMT(BPF_LD + BPF_W + BPF_ABS, 28),
-        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, client_addr, 1, 0),
+        BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ntohl(client_addr), 1, 0),
         BPF_STMT(BPF_RET + BPF_K, 0),
         // If the first four bytes of the ARP packet source hardware address
         // does not equal our hardware address, then it's a conflict and should
@@ -431,10 +544,11 @@ static bool arp_set_bpf_defense(int fd, uint32_t client_addr,
 }
 
 static int create_arp_defense_socket(uint32_t client_addr,
-                                     uint8_t client_mac[6], bool *using_bpf)
+                                     uint8_t client_mac[6], bool *using_bpf,
+                                     bool *using_ring)
 {
     assert(using_bpf);
-    int fd = create_arp_socket();
+    int fd = create_arp_socket(using_ring);
     *using_bpf = arp_set_bpf_defense(fd, client_addr, client_mac);
     return fd;
 }
@@ -442,7 +556,7 @@ static int create_arp_defense_socket(uint32_t client_addr,
 static int create_arp_basic_socket(bool *using_bpf)
 {
     assert(using_bpf);
-    int fd = create_arp_socket();
+    int fd = create_arp_socket(NULL);
     *using_bpf = arp_set_bpf_basic(fd);
     return fd;
 }
@@ -477,7 +591,7 @@ static void xfer_fd(int fd, char cmd)
     close(fd);
 }
 
-static size_t execute_sockd(char buf[static 1], size_t buflen)
+static size_t execute_sockd_cmd(char buf[static 1], size_t buflen)
 {
     if (!buflen)
         return 0;
@@ -485,10 +599,17 @@ static size_t execute_sockd(char buf[static 1], size_t buflen)
     char c = buf[0];
     switch (c) {
     case 'L': {
+        uint32_t xid;
+        uint8_t chaddr[6];
         bool using_bpf;
-        int fd = create_raw_listen_socket(&using_bpf);
+        if (buflen < 1 + sizeof xid + 6)
+            suicide("%s: (%s) 'L' does not have necessary arguments: %zu",
+                      client_config.interface, __func__, buflen);
+        memcpy(&xid, buf + 1, sizeof xid);
+        memcpy(chaddr, buf + 1 + sizeof xid, 6);
+        int fd = create_raw_listen_socket(xid, chaddr, &using_bpf);
         xfer_fd(fd, using_bpf ? 'L' : 'l');
-        return 1;
+        return 11;
     }
     case 'a': {
         bool using_bpf;
@@ -498,16 +619,21 @@ static size_t execute_sockd(char buf[static 1], size_t buflen)
     case 'd': {
         uint32_t client_addr;
         uint8_t client_mac[6];
-        bool using_bpf;
-        if (buflen < 1 + sizeof client_addr + 6)
+        bool using_bpf, using_ring = false;
+        if (buflen < 1 + sizeof client_addr + 6 + 1)
             suicide("%s: (%s) 'd' does not have necessary arguments: %zu",
                       client_config.interface, __func__, buflen);
         memcpy(&client_addr, buf + 1, sizeof client_addr);
         memcpy(client_mac, buf + 1 + sizeof client_addr, 6);
+        bool want_ring = buf[1 + sizeof client_addr + 6];
         int fd = create_arp_defense_socket(client_addr, client_mac,
-                                           &using_bpf);
-        xfer_fd(fd, using_bpf ? 'D' : 'd');
-        return 11;
+                                           &using_bpf,
+                                           want_ring ? &using_ring : NULL);
+        if (using_ring)
+            xfer_fd(fd, using_bpf ? 'R' : 'r');
+        else
+            xfer_fd(fd, using_bpf ? 'D' : 'd');
+        return 12;
     }
     case 's': xfer_fd(create_raw_broadcast_socket(), 's'); return 1;
     case 'u': {
@@ -525,6 +651,18 @@ static size_t execute_sockd(char buf[static 1], size_t buflen)
     }
 }
 
+// Acts on one request for the interface that it names.
+static size_t execute_sockd(char buf[static SOCKD_HDRLEN + 1], size_t buflen)
+{
+    uint16_t slot;
+    if (buflen <= SOCKD_HDRLEN)
+        return 0;
+    memcpy(&slot, buf, sizeof slot);
+    client_config_select(slot);
+    return SOCKD_HDRLEN + execute_sockd_cmd(buf + SOCKD_HDRLEN,
+                                            buflen - SOCKD_HDRLEN);
+}
+
 static void process_client_socket(void)
 {
     static char buf[MAX_BUF];
@@ -563,7 +701,8 @@ static void do_sockd_work(void)
     epoll_add(epollfd, signalFd);
 
     for (;;) {
-        int r = epoll_wait(epollfd, events, 3, -1);
+        int r = epoll_wait(epollfd, events,
+                           sizeof events / sizeof events[0], -1);
         if (r < 0) {
             if (errno == EINTR)
                 continue;
@@ -571,7 +710,7 @@ static void do_sockd_work(void)
                 suicide("epoll_wait failed");
         }
         for (int i = 0; i < r; ++i) {
-            int fd = events[i].data.fd;
+            int fd = epoll_event_fd(&events[i]);
             if (fd == sockdSock[1]) {
                 if (events[i].events & EPOLLIN)
                     process_client_socket();
@@ -1,9 +1,12 @@
 #ifndef NDHC_SOCKD_H_
 #define NDHC_SOCKD_H_
 
+#include "ndhc.h"
+
 extern uid_t sockd_uid;
 extern gid_t sockd_gid;
-int request_sockd_fd(char buf[static 1], size_t buflen, char *response);
+int request_sockd_fd(struct client_state_t cs[static 1],
+                     char buf[static 1], size_t buflen, char *response);
 void sockd_main(void);
 
 #endif /* NDHC_SOCKD_H_ */
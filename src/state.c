@@ -42,6 +42,12 @@
 #include "sys.h"
 #include "netlink.h"
 #include "coroutine.h"
+#include "timer.h"
+#include "leasefile.h"
+#include "trace.h"
+#include "rtt.h"
+#include "lease-time.h"
+#include "rexmit.h"
 
 #define SEL_SUCCESS 0
 #define SEL_FAIL -1
@@ -49,6 +55,7 @@
 #define REQ_SUCCESS 0
 #define REQ_TIMEOUT -1
 #define REQ_FAIL -2
+#define REQ_RESTORED -3
 
 #define ANP_SUCCESS 0
 #define ANP_IGNORE -1
@@ -63,14 +70,51 @@
 #define IFUP_NEWLEASE 1
 #define IFUP_FAIL -1
 
-static int delay_timeout(struct client_state_t cs[static 1], size_t numpackets)
+// With --adaptive-retransmit, returns the ms to wait before retransmission
+// numpackets of a request to server (zero for any server), capped at cap,
+// or -1 if we have no RTT estimate to go on.
+static long long adaptive_timeout(struct client_state_t cs[static 1],
+                                  uint32_t server, size_t numpackets,
+                                  long long cap)
 {
-    int to = 64;
-    char tot[] = { 4, 8, 16, 32, 64 };
-    if (numpackets < sizeof tot)
-        to = tot[numpackets];
-    // Distribution is a bit biased but it doesn't really matter.
-    return to * 1000 + (nk_random_u32(&cs->rnd32_state) & 0x7fffffffu) % 1000;
+    if (!cs->cfg->adaptive_rexmit)
+        return -1;
+    long long to = rtt_rto_ms(cs, server);
+    if (to < 0)
+        return -1;
+    return rexmit_adaptive_ms(to, numpackets, cap,
+                              nk_random_u32(&cs->rnd32_state));
+}
+
+static int delay_timeout(struct client_state_t cs[static 1], size_t numpackets,
+                         uint32_t server)
+{
+    long long ato = adaptive_timeout(cs, server, numpackets,
+                                     rexmit_ladder_ms(numpackets, 0));
+    if (ato >= 0)
+        return (int)ato;
+    return rexmit_ladder_ms(numpackets, nk_random_u32(&cs->rnd32_state));
+}
+
+// Wait before resending a renew or rebind request.
+static long long renew_delay(struct client_state_t cs[static 1],
+                             uint32_t server)
+{
+    long long ato = adaptive_timeout(cs, server, cs->renews_sent - 1, 60000);
+    if (ato >= 0)
+        return ato;
+    return rexmit_renew_ms(nk_random_u32(&cs->rnd32_state));
+}
+
+// Every path into SELECTING or INIT-REBOOT passes through here exactly
+// once.  The listen socket filter matches on the xid, so the listen socket
+// is opened or replaced here and nowhere else on those paths.  Any offers
+// that we are holding were made for the old xid and can't be requested.
+static void new_xid(struct client_state_t cs[static 1])
+{
+    cs->xid = nk_random_u32(&cs->rnd32_state);
+    cs->num_offers = 0;
+    start_dhcp_listen(cs);
 }
 
 static void reinit_shared_deconfig(struct client_state_t cs[static 1])
@@ -82,33 +126,155 @@ static void reinit_shared_deconfig(struct client_state_t cs[static 1])
     cs->got_server_arp = 0;
     memset(&cs->routerArp, 0, sizeof cs->routerArp);
     memset(&cs->serverArp, 0, sizeof cs->serverArp);
-    arp_reset_send_stats();
+    arp_reset_send_stats(cs);
 }
 
+// The caller must then enter SELECTING, which picks a new xid and listens
+// for it.
 static void reinit_selecting(struct client_state_t cs[static 1], int timeout)
 {
     reinit_shared_deconfig(cs);
-    cs->dhcp_wake_ts = curms() + timeout;
+    ntimer_arm(&cs->dhcp_wake_ts, curms() + timeout);
+}
+
+static bool offer_is_better(struct client_state_t cs[static 1],
+                            const struct dhcp_offer a[static 1],
+                            const struct dhcp_offer b[static 1])
+{
+    if (cs->cfg->prefer_server) {
+        bool ap = a->serverid == cs->cfg->prefer_server;
+        bool bp = b->serverid == cs->cfg->prefer_server;
+        if (ap != bp)
+            return ap;
+    }
+    if (cs->prevAddr) {
+        bool ap = a->yiaddr == cs->prevAddr;
+        bool bp = b->yiaddr == cs->prevAddr;
+        if (ap != bp)
+            return ap;
+    }
+    return a->lease > b->lease;
+}
+
+// Remember an offer so that it can be requested later.  A newer offer from
+// the same server replaces the old one; if the table is full, the new offer
+// replaces the worst one that we hold if it is better.
+static void add_offer(struct client_state_t cs[static 1],
+                      const struct dhcp_offer o[static 1])
+{
+    size_t i;
+    for (i = 0; i < cs->num_offers; ++i) {
+        if (cs->offers[i].serverid == o->serverid)
+            break;
+    }
+    if (i == NUM_OFFERS) {
+        i = 0;
+        for (size_t j = 1; j < cs->num_offers; ++j) {
+            if (offer_is_better(cs, &cs->offers[i], &cs->offers[j]))
+                i = j;
+        }
+        if (!offer_is_better(cs, o, &cs->offers[i]))
+            return;
+    } else if (i == cs->num_offers)
+        ++cs->num_offers;
+    cs->offers[i] = *o;
+}
+
+// Removes the best offer that we hold and makes it the one that we will
+// request.  Returns false if we hold no offers.
+static bool take_best_offer(struct client_state_t cs[static 1])
+{
+    if (!cs->num_offers)
+        return false;
+    size_t b = 0;
+    for (size_t i = 1; i < cs->num_offers; ++i) {
+        if (offer_is_better(cs, &cs->offers[i], &cs->offers[b]))
+            b = i;
+    }
+    cs->clientAddr = cs->offers[b].yiaddr;
+    cs->serverAddr = cs->offers[b].serverid;
+    cs->srcAddr = cs->offers[b].srcaddr;
+    cs->offers[b] = cs->offers[--cs->num_offers];
+    ntimer_arm(&cs->dhcp_wake_ts, curms());
+    cs->num_dhcp_requests = 0;
+    return true;
+}
+
+// The lease that we requested was rejected, was never acknowledged, or its
+// address is in use.  If another server made us an offer, request it rather
+// than starting over with a new DISCOVER.  Returns false if there are no
+// offers left.
+static bool next_offer(struct client_state_t cs[static 1])
+{
+    arp_close_fd(cs);
+    arp_reset_send_stats(cs);
+    if (!take_best_offer(cs))
+        return false;
+    char clibuf[INET_ADDRSTRLEN];
+    char svrbuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->clientAddr},
+              clibuf, sizeof clibuf);
+    inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->serverAddr},
+              svrbuf, sizeof svrbuf);
+    log_line("%s: Trying the next offer: %s from server %s.",
+             cs->cfg->interface, clibuf, svrbuf);
     start_dhcp_listen(cs);
+    return true;
 }
 
 // Triggered after a DHCP lease request packet has been sent and no reply has
 // been received within the response wait time.  If we've not exceeded the
 // maximum number of request retransmits, then send another packet and wait
-// again.  Otherwise, return to the DHCP initialization state.
+// again.  Otherwise, the caller must move on to another offer or return to
+// the DHCP initialization state.
 static int requesting_timeout(struct client_state_t cs[static 1],
                                long long nowts)
 {
-    if (cs->num_dhcp_requests >= 5) {
-        reinit_selecting(cs, 0);
+    if (cs->num_dhcp_requests >= 5)
         return REQ_TIMEOUT;
-    }
     if (send_selecting(cs) < 0) {
         log_warning("%s: Failed to send a selecting request packet.",
-                    client_config.interface);
+                    cs->cfg->interface);
+        return REQ_FAIL;
+    }
+    ntimer_arm(&cs->dhcp_wake_ts,
+               nowts + delay_timeout(cs, cs->num_dhcp_requests,
+                                  cs->serverAddr));
+    cs->num_dhcp_requests++;
+    return REQ_SUCCESS;
+}
+
+// Triggered when an INIT-REBOOT request for our stored lease has been sent
+// and no reply has been received within the response wait time.  Retransmit
+// a few times, and then fall back to the rest of the stored lease if it is
+// still valid and free on the network, or else go to the INIT state.
+static int rebooting_timeout(struct client_state_t cs[static 1],
+                             long long nowts)
+{
+    if (cs->num_dhcp_requests >= 2) {
+        struct dhcpmsg packet;
+        if (!restore_lease_record(cs, &packet)) {
+            struct dhcp_optidx oi;
+            dhcp_optidx_build(&oi, &packet, sizeof packet);
+            log_line("%s: No reply for our stored lease.  Using it until it can be renewed...",
+                     cs->cfg->interface);
+            if (arp_check(cs, &oi) >= 0)
+                return REQ_RESTORED;
+            log_warning("%s: Failed to make arp socket.", cs->cfg->interface);
+        }
+        log_line("%s: No reply for our stored lease.  Searching for a new lease...",
+                 cs->cfg->interface);
+        reinit_selecting(cs, 0);
+        return REQ_TIMEOUT;
+    }
+    if (send_init_reboot(cs) < 0) {
+        log_warning("%s: Failed to send an init-reboot request packet.",
+                    cs->cfg->interface);
         return REQ_FAIL;
     }
-    cs->dhcp_wake_ts = nowts + delay_timeout(cs, cs->num_dhcp_requests);
+    ntimer_arm(&cs->dhcp_wake_ts,
+               nowts + delay_timeout(cs, cs->num_dhcp_requests,
+                                  cs->serverAddr));
     cs->num_dhcp_requests++;
     return REQ_SUCCESS;
 }
@@ -135,18 +301,19 @@ static int rebinding_timeout(struct client_state_t cs[static 1],
     long long elt = cs->leaseStartTime + cs->lease * 1000;
     if (nowts >= elt) {
         log_line("%s: Lease expired.  Searching for a new lease...",
-                 client_config.interface);
+                 cs->cfg->interface);
         reinit_selecting(cs, 0);
         return BTO_EXPIRED;
     }
     start_dhcp_listen(cs);
     if (send_rebind(cs) < 0) {
         log_warning("%s: Failed to send a rebind request packet.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return BTO_HARDFAIL;
     }
-    long long ts0 = nowts + (50 + nk_random_u32(&cs->rnd32_state) % 20) * 1000;
-    cs->dhcp_wake_ts = ts0 < elt ? ts0 : elt;
+    ++cs->renews_sent;
+    long long ts0 = nowts + renew_delay(cs, 0);
+    ntimer_arm(&cs->dhcp_wake_ts, ts0 < elt ? ts0 : elt);
     return BTO_WAIT;
 }
 
@@ -165,11 +332,12 @@ static int renewing_timeout(struct client_state_t cs[static 1],
     start_dhcp_listen(cs);
     if (send_renew(cs) < 0) {
         log_warning("%s: Failed to send a renew request packet.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return BTO_HARDFAIL;
     }
-    long long ts0 = nowts + (50 + nk_random_u32(&cs->rnd32_state) % 20) * 1000;
-    cs->dhcp_wake_ts = ts0 < rbt ? ts0 : rbt;
+    ++cs->renews_sent;
+    long long ts0 = nowts + renew_delay(cs, cs->serverAddr);
+    ntimer_arm(&cs->dhcp_wake_ts, ts0 < rbt ? ts0 : rbt);
     return BTO_WAIT;
 }
 
@@ -179,21 +347,21 @@ static int bound_timeout(struct client_state_t cs[static 1], long long nowts)
 {
     long long rnt = cs->leaseStartTime + cs->renewTime * 1000;
     if (nowts < rnt) {
-        cs->dhcp_wake_ts = rnt;
+        ntimer_arm(&cs->dhcp_wake_ts, rnt);
         return BTO_WAIT;
     }
     return renewing_timeout(cs, nowts);
 }
 
 static int validate_serverid(struct client_state_t cs[static 1],
-                             struct dhcpmsg packet[static 1],
+                             const struct dhcp_optidx oi[static 1],
                              const char typemsg[static 1])
 {
     int found;
-    uint32_t sid = get_option_serverid(packet, &found);
+    uint32_t sid = get_option_serverid(oi, &found);
     if (!found) {
         log_line("%s: Received %s with no server id.  Ignoring it.",
-                 client_config.interface, typemsg);
+                 cs->cfg->interface, typemsg);
         return 0;
     }
     if (cs->serverAddr != sid) {
@@ -201,67 +369,77 @@ static int validate_serverid(struct client_state_t cs[static 1],
         inet_ntop(AF_INET, &(struct in_addr){.s_addr=sid},
                   svrbuf, sizeof svrbuf);
         log_line("%s: Received %s with an unexpected server id: %s.  Ignoring it.",
-                 client_config.interface, typemsg, svrbuf);
+                 cs->cfg->interface, typemsg, svrbuf);
         return 0;
     }
     return 1;
 }
 
 static void get_leasetime(struct client_state_t cs[static 1],
-                          struct dhcpmsg packet[static 1])
+                          const struct dhcp_optidx oi[static 1])
 {
-    cs->lease = get_option_leasetime(packet);
+    cs->lease = get_option_leasetime(oi);
     cs->leaseStartTime = curms();
     if (!cs->lease) {
         log_line("%s: No lease time received; assuming 1h.",
-                 client_config.interface);
+                 cs->cfg->interface);
         cs->lease = 60 * 60;
     } else {
         if (cs->lease < 60) {
             log_warning("Server sent lease of <1m.  Forcing lease to 1m.",
-                        client_config.interface);
+                        cs->cfg->interface);
             cs->lease = 60;
         }
     }
-    // Always use RFC2131 'default' values.  It's not worth validating
-    // the remote server values, if they even exist, for sanity.
-    cs->renewTime = cs->lease >> 1;
-    cs->rebindTime = (cs->lease >> 3) * 0x7; // * 0.875
-    cs->dhcp_wake_ts = cs->leaseStartTime + cs->renewTime * 1000;
+    struct lease_times lt =
+        lease_renew_times(cs->lease, get_option_renewtime(oi),
+                          get_option_rebindtime(oi), cs->cfg->renew_jitter,
+                          nk_random_u32(&cs->rnd32_state));
+    cs->renewTime = lt.t1;
+    cs->rebindTime = lt.t2;
+    ntimer_arm(&cs->dhcp_wake_ts, cs->leaseStartTime + cs->renewTime * 1000);
 }
 
 static int extend_packet(struct client_state_t cs[static 1],
-                         struct dhcpmsg packet[static 1], uint8_t msgtype,
-                         uint32_t srcaddr)
+                         const struct dhcp_optidx oi[static 1],
+                         uint8_t msgtype, uint32_t srcaddr)
 {
     (void)srcaddr;
     if (msgtype == DHCPACK) {
-        if (!validate_serverid(cs, packet, "a DHCP ACK"))
+        if (!validate_serverid(cs, oi, "a DHCP ACK"))
             return ANP_IGNORE;
-        get_leasetime(cs, packet);
+        get_leasetime(cs, oi);
 
         // Did we receive a lease with a different IP than we had before?
-        if (memcmp(&packet->yiaddr, &cs->clientAddr, 4)) {
+        if (memcmp(&oi->packet->yiaddr, &cs->clientAddr, 4)) {
             char clibuf[INET_ADDRSTRLEN];
             inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->clientAddr},
                       clibuf, sizeof clibuf);
             log_line("%s: Server is now offering IP %s.  Validating...",
-                     client_config.interface, clibuf);
+                     cs->cfg->interface, clibuf);
             return ANP_CHECK_IP;
         } else {
-            log_line("%s: Lease refreshed to %u seconds.",
-                     client_config.interface, cs->lease);
+            log_line("%s: Lease refreshed to %u seconds after %u renew requests.",
+                     cs->cfg->interface, cs->lease, cs->renews_sent);
+            cs->renews_sent = 0;
+            // Apply any options that the server changed.  This does
+            // nothing at all if the ACK carries the same configuration.
+            if (ifchange_bind(cs, oi, true) < 0)
+                log_warning("%s: Failed to update the interface configuration.",
+                            cs->cfg->interface);
+            write_lease_record(cs, oi);
+            rtt_flush(cs);
             if (arp_set_defense_mode(cs) < 0)
                 log_warning("%s: Failed to create ARP defense socket.",
-                            client_config.interface);
+                            cs->cfg->interface);
             stop_dhcp_listen(cs);
             return ANP_SUCCESS;
         }
     } else if (msgtype == DHCPNAK) {
-        if (!validate_serverid(cs, packet, "a DHCP NAK"))
+        if (!validate_serverid(cs, oi, "a DHCP NAK"))
             return ANP_IGNORE;
         log_line("%s: Our request was rejected.  Searching for a new lease...",
-                 client_config.interface);
+                 cs->cfg->interface);
         reinit_selecting(cs, 3000);
         return ANP_REJECTED;
     }
@@ -269,55 +447,101 @@ static int extend_packet(struct client_state_t cs[static 1],
 }
 
 static int selecting_packet(struct client_state_t cs[static 1],
-                            struct dhcpmsg packet[static 1], uint8_t msgtype,
-                            uint32_t srcaddr, bool is_requesting)
+                            const struct dhcp_optidx oi[static 1],
+                            uint8_t msgtype, uint32_t srcaddr,
+                            bool is_requesting)
 {
-    if (!is_requesting && msgtype == DHCPOFFER) {
+    if (msgtype == DHCPOFFER) {
         int found;
-        uint32_t sid = get_option_serverid(packet, &found);
+        uint32_t sid = get_option_serverid(oi, &found);
         if (!found) {
             log_line("%s: Invalid offer received: it didn't have a server id.",
-                     client_config.interface);
+                     cs->cfg->interface);
+            return ANP_IGNORE;
+        }
+        char clibuf[INET_ADDRSTRLEN];
+        char svrbuf[INET_ADDRSTRLEN];
+        char srcbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(struct in_addr){.s_addr=oi->packet->yiaddr},
+                  clibuf, sizeof clibuf);
+        inet_ntop(AF_INET, &(struct in_addr){.s_addr=sid},
+                  svrbuf, sizeof svrbuf);
+        inet_ntop(AF_INET, &(struct in_addr){.s_addr=srcaddr},
+                  srcbuf, sizeof srcbuf);
+        log_line("%s: Received IP offer: %s from server %s via %s.",
+                 cs->cfg->interface, clibuf, svrbuf, srcbuf);
+        add_offer(cs, &(struct dhcp_offer){
+                  .yiaddr = oi->packet->yiaddr,
+                  .serverid = sid,
+                  .srcaddr = srcaddr,
+                  .lease = get_option_leasetime(oi),
+                  });
+        // Offers that arrive while we are requesting are kept as fallbacks.
+        if (is_requesting)
+            return ANP_IGNORE;
+        if (cs->cfg->offer_wait > 0) {
+            // Wait for more offers.  The window runs from the first offer.
+            long long wts = curms() + cs->cfg->offer_wait;
+            if (cs->dhcp_wake_ts.ts < 0 || wts < cs->dhcp_wake_ts.ts)
+                ntimer_arm(&cs->dhcp_wake_ts, wts);
+            return ANP_IGNORE;
+        }
+        take_best_offer(cs);
+        return ANP_SUCCESS;
+    } else if (is_requesting && msgtype == DHCPNAK) {
+        if (!validate_serverid(cs, oi, "a DHCP NAK"))
+            return ANP_IGNORE;
+        log_line("%s: Our request was rejected.", cs->cfg->interface);
+        return ANP_REJECTED;
+    } else if (!is_requesting && msgtype == DHCPACK) {
+        // RFC4039: An ACK in SELECTING is only valid if we asked for
+        // Rapid Commit and the server's reply says that it was used.
+        if (!cs->cfg->rapid_commit || !get_option_rapid_commit(oi))
+            return ANP_IGNORE;
+        int found;
+        uint32_t sid = get_option_serverid(oi, &found);
+        if (!found) {
+            log_line("%s: Invalid rapid commit ACK received: it didn't have a server id.",
+                     cs->cfg->interface);
             return ANP_IGNORE;
         }
         char clibuf[INET_ADDRSTRLEN];
         char svrbuf[INET_ADDRSTRLEN];
         char srcbuf[INET_ADDRSTRLEN];
-        cs->clientAddr = packet->yiaddr;
+        cs->clientAddr = oi->packet->yiaddr;
         cs->serverAddr = sid;
         cs->srcAddr = srcaddr;
-        cs->dhcp_wake_ts = curms();
-        cs->num_dhcp_requests = 0;
+        get_leasetime(cs, oi);
         inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->clientAddr},
                   clibuf, sizeof clibuf);
         inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->serverAddr},
                   svrbuf, sizeof svrbuf);
         inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->srcAddr},
                   srcbuf, sizeof srcbuf);
-        log_line("%s: Received IP offer: %s from server %s via %s.",
-                 client_config.interface, clibuf, svrbuf, srcbuf);
-        return ANP_SUCCESS;
+        log_line("%s: Received rapid commit ACK: %s from server %s via %s.  Validating...",
+                 cs->cfg->interface, clibuf, svrbuf, srcbuf);
+        return ANP_CHECK_IP;
     } else if (is_requesting && msgtype == DHCPACK) {
         // Don't validate the server id.  Instead validate that the
         // yiaddr matches.  Some networks have multiple servers
         // that don't respect the serverid that was specified in
         // our DHCPREQUEST.
-        if (!memcmp(&packet->yiaddr, &cs->clientAddr, 4)) {
+        if (!memcmp(&oi->packet->yiaddr, &cs->clientAddr, 4)) {
             char clibuf[INET_ADDRSTRLEN];
             char svrbuf[INET_ADDRSTRLEN];
             char srcbuf[INET_ADDRSTRLEN];
             int found;
-            uint32_t sid = get_option_serverid(packet, &found);
+            uint32_t sid = get_option_serverid(oi, &found);
             if (!found) {
                 log_line("%s: Invalid offer received: it didn't have a server id.",
-                         client_config.interface);
+                         cs->cfg->interface);
                 return ANP_IGNORE;
             }
             if (cs->serverAddr != sid) {
                 cs->serverAddr = sid;
                 cs->srcAddr = srcaddr;
             }
-            get_leasetime(cs, packet);
+            get_leasetime(cs, oi);
 
             inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->clientAddr},
                       clibuf, sizeof clibuf);
@@ -326,13 +550,27 @@ static int selecting_packet(struct client_state_t cs[static 1],
             inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->srcAddr},
                       srcbuf, sizeof srcbuf);
             log_line("%s: Received ACK: %s from server %s via %s.  Validating...",
-                     client_config.interface, clibuf, svrbuf, srcbuf);
+                     cs->cfg->interface, clibuf, svrbuf, srcbuf);
             return ANP_CHECK_IP;
         }
     }
     return ANP_IGNORE;
 }
 
+static int rebooting_packet(struct client_state_t cs[static 1],
+                            const struct dhcp_optidx oi[static 1],
+                            uint8_t msgtype, uint32_t srcaddr)
+{
+    if (msgtype == DHCPNAK) {
+        // We didn't send a server id, so any server may reject us.
+        log_line("%s: Our stored lease was rejected.  Searching for a new lease...",
+                 cs->cfg->interface);
+        reinit_selecting(cs, 0);
+        return ANP_REJECTED;
+    }
+    return selecting_packet(cs, oi, msgtype, srcaddr, true);
+}
+
 // Triggered after a DHCP discover packet has been sent and no reply has
 // been received within the response wait time.  If we've not exceeded the
 // maximum number of discover retransmits, then send another packet and wait
@@ -341,22 +579,22 @@ static int selecting_timeout(struct client_state_t cs[static 1],
                               long long nowts)
 {
     if (cs->init && cs->num_dhcp_requests >= 2) {
-        if (client_config.background_if_no_lease) {
+        if (cs->cfg->background_if_no_lease) {
             log_line("%s: No lease; going to background.",
-                     client_config.interface);
+                     cs->cfg->interface);
             cs->init = 0;
             background();
-        } else if (client_config.abort_if_no_lease)
-            suicide("%s: No lease; failing.", client_config.interface);
+        } else if (cs->cfg->abort_if_no_lease)
+            suicide("%s: No lease; failing.", cs->cfg->interface);
     }
-    if (cs->num_dhcp_requests == 0)
-        cs->xid = nk_random_u32(&cs->rnd32_state);
     if (send_discover(cs) < 0) {
         log_warning("%s: Failed to send a discover request packet.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return SEL_FAIL;
     }
-    cs->dhcp_wake_ts = nowts + delay_timeout(cs, cs->num_dhcp_requests);
+    ntimer_arm(&cs->dhcp_wake_ts,
+               nowts + delay_timeout(cs, cs->num_dhcp_requests,
+                                  cs->cfg->prefer_server));
     cs->num_dhcp_requests++;
     return SEL_SUCCESS;
 }
@@ -365,9 +603,9 @@ static int selecting_timeout(struct client_state_t cs[static 1],
 static void print_release(struct client_state_t cs[static 1])
 {
     log_line("%s: ndhc going to sleep.  Wake it by sending a SIGUSR1.",
-             client_config.interface);
+             cs->cfg->interface);
     reinit_shared_deconfig(cs);
-    cs->dhcp_wake_ts = -1;
+    ntimer_disarm(&cs->dhcp_wake_ts);
     stop_dhcp_listen(cs);
 }
 
@@ -380,13 +618,14 @@ static int xmit_release(struct client_state_t cs[static 1])
               clibuf, sizeof clibuf);
     inet_ntop(AF_INET, &(struct in_addr){.s_addr=cs->serverAddr},
               svrbuf, sizeof svrbuf);
-    log_line("%s: Unicasting a release of %s to %s.", client_config.interface,
+    log_line("%s: Unicasting a release of %s to %s.", cs->cfg->interface,
              clibuf, svrbuf);
     if (send_release(cs) < 0) {
         log_warning("%s: Failed to send a release request packet.",
-                    client_config.interface);
+                    cs->cfg->interface);
         return -1;
     }
+    clear_lease_record(cs);
     print_release(cs);
     return 0;
 }
@@ -395,13 +634,14 @@ static int xmit_release(struct client_state_t cs[static 1])
 static int frenew(struct client_state_t cs[static 1], bool is_bound)
 {
     if (is_bound) {
-        log_line("%s: Forcing a DHCP renew...", client_config.interface);
+        log_line("%s: Forcing a DHCP renew...", cs->cfg->interface);
         start_dhcp_listen(cs);
         if (send_renew(cs) < 0) {
             log_warning("%s: Failed to send a renew request packet.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return -1;
         }
+        ++cs->renews_sent;
     } else { // RELEASED
         reinit_selecting(cs, 0);
     }
@@ -415,32 +655,80 @@ static int ifup_action(struct client_state_t cs[static 1])
     if (cs->routerAddr && cs->serverAddr) {
         if (arp_gw_check(cs) >= 0) {
             log_line("%s: Interface is back.  Revalidating lease...",
-                     client_config.interface);
+                     cs->cfg->interface);
             return IFUP_REVALIDATE;
         } else {
             log_warning("%s: arp_gw_check could not make arp socket.",
-                        client_config.interface);
+                        cs->cfg->interface);
             return IFUP_FAIL;
         }
     }
     log_line("%s: Interface is back.  Searching for new lease...",
-             client_config.interface);
+             cs->cfg->interface);
     return IFUP_NEWLEASE;
 }
 
 #define BAD_STATE() suicide("%s(%d): bad state", __func__, __LINE__)
 
-// XXX: Should be re-entrant so as to handle multiple servers.
 int dhcp_handle(struct client_state_t cs[static 1], long long nowts,
-                bool sev_dhcp, struct dhcpmsg dhcp_packet[static 1],
+                bool sev_dhcp, const struct dhcp_optidx dhcp_oi[static 1],
                 uint8_t dhcp_msgtype, uint32_t dhcp_srcaddr, bool sev_arp,
                 bool force_fingerprint, bool dhcp_timeout, bool arp_timeout,
                 int sev_signal)
 {
-    scrBegin;
+    struct dhcp_ccr_ctx *ccr = &cs->dhcp_ccr;
+    ccrBeginP(ccr);
+    if (!cs->init_reboot)
+        goto reinit;
+    cs->init_reboot = false;
+    new_xid(cs);
+    // We're in the INIT-REBOOT or REBOOTING state here.
+    trace_state(cs, TST_REBOOTING);
+    for (;;) {
+        int ret = COR_SUCCESS;
+        if (sev_signal == SIGNAL_RELEASE) {
+            print_release(cs);
+            goto skip_to_released;
+        }
+        if (sev_dhcp) {
+            int r = rebooting_packet(cs, dhcp_oi, dhcp_msgtype,
+                                     dhcp_srcaddr);
+            if (r == ANP_IGNORE) {
+            } else if (r == ANP_REJECTED) {
+                sev_dhcp = false;
+                goto reinit;
+            } else if (r == ANP_CHECK_IP) {
+                if (arp_check(cs, dhcp_oi) < 0) {
+                    log_warning("%s: Failed to make arp socket.  Searching for new lease...",
+                                cs->cfg->interface);
+                    reinit_selecting(cs, 3000);
+                    sev_dhcp = false;
+                    goto reinit;
+                }
+                break;
+            } else BAD_STATE();
+        }
+        if (dhcp_timeout) {
+            int r = rebooting_timeout(cs, nowts);
+            if (r == REQ_SUCCESS) {
+            } else if (r == REQ_RESTORED) {
+                break;
+            } else if (r == REQ_TIMEOUT) {
+                sev_dhcp = false;
+                goto reinit;
+            } else if (r == REQ_FAIL) {
+                // Failed to send packet.  Sleep and retry.
+                ret = COR_ERROR;
+            } else BAD_STATE();
+        }
+        ccrReturnP(ccr, ret);
+    }
+    ccrReturnP(ccr, COR_SUCCESS);
+    goto skip_to_checking;
 reinit:
-    cs->xid = nk_random_u32(&cs->rnd32_state);
+    new_xid(cs);
     // We're in the SELECTING state here.
+    trace_state(cs, TST_SELECTING);
     for (;;) {
         int ret = COR_SUCCESS;
         if (sev_signal == SIGNAL_RELEASE) {
@@ -448,14 +736,30 @@ reinit:
             goto skip_to_released;
         }
         if (sev_dhcp) {
-            int r = selecting_packet(cs, dhcp_packet, dhcp_msgtype,
+            int r = selecting_packet(cs, dhcp_oi, dhcp_msgtype,
                                      dhcp_srcaddr, false);
             if (r == ANP_SUCCESS) {
                 // Send a request packet to the answering DHCP server.
                 sev_dhcp = false;
                 goto skip_to_requesting;
+            } else if (r == ANP_CHECK_IP) {
+                // Rapid Commit: we already have the lease.
+                if (arp_check(cs, dhcp_oi) < 0) {
+                    log_warning("%s: Failed to make arp socket.  Searching for new lease...",
+                                cs->cfg->interface);
+                    reinit_selecting(cs, 3000);
+                    sev_dhcp = false;
+                    goto reinit;
+                }
+                ccrReturnP(ccr, COR_SUCCESS);
+                goto skip_to_checking;
             }
         }
+        if (dhcp_timeout && take_best_offer(cs)) {
+            // The offer collection window has closed.
+            sev_dhcp = false;
+            goto skip_to_requesting;
+        }
         if (dhcp_timeout) {
             int r = selecting_timeout(cs, nowts);
             if (r == SEL_SUCCESS) {
@@ -463,26 +767,35 @@ reinit:
                 ret = COR_ERROR;
             } else BAD_STATE();
         }
-        scrReturn(ret);
+        ccrReturnP(ccr, ret);
     }
-    scrReturn(COR_SUCCESS);
+    ccrReturnP(ccr, COR_SUCCESS);
     // We're in the REQUESTING state here.
     for (;;) {
         int ret;
 skip_to_requesting:
         ret = COR_SUCCESS;
+        trace_state(cs, TST_REQUESTING);
         if (sev_signal == SIGNAL_RELEASE) {
             print_release(cs);
             goto skip_to_released;
         }
         if (sev_dhcp) {
-            int r = selecting_packet(cs, dhcp_packet, dhcp_msgtype,
+            int r = selecting_packet(cs, dhcp_oi, dhcp_msgtype,
                                      dhcp_srcaddr, true);
             if (r == ANP_IGNORE) {
+            } else if (r == ANP_REJECTED) {
+                if (!next_offer(cs)) {
+                    log_line("%s: Searching for a new lease...",
+                             cs->cfg->interface);
+                    reinit_selecting(cs, 3000);
+                    sev_dhcp = false;
+                    goto reinit;
+                }
             } else if (r == ANP_CHECK_IP) {
-                if (arp_check(cs, dhcp_packet) < 0) {
+                if (arp_check(cs, dhcp_oi) < 0) {
                     log_warning("%s: Failed to make arp socket.  Searching for new lease...",
-                                client_config.interface);
+                                cs->cfg->interface);
                     reinit_selecting(cs, 3000);
                     sev_dhcp = false;
                     goto reinit;
@@ -495,22 +808,27 @@ skip_to_requesting:
             int r = requesting_timeout(cs, nowts);
             if (r == REQ_SUCCESS) {
             } else if (r == REQ_TIMEOUT) {
-                // We timed out.  Send another packet.
-                sev_dhcp = false;
-                goto reinit;
+                // We timed out.  Try another offer or start over.
+                if (!next_offer(cs)) {
+                    reinit_selecting(cs, 0);
+                    sev_dhcp = false;
+                    goto reinit;
+                }
             } else if (r == REQ_FAIL) {
                 // Failed to send packet.  Sleep and retry.
                 ret = COR_ERROR;
             } else BAD_STATE();
         }
-        scrReturn(ret);
+        ccrReturnP(ccr, ret);
     }
-    scrReturn(COR_SUCCESS);
+    ccrReturnP(ccr, COR_SUCCESS);
     // We're checking to see if there's a conflict for our IP.  Technically,
     // this is still in REQUESTING.
     for (;;) {
         int ret;
+skip_to_checking:
         ret = COR_SUCCESS;
+        trace_state(cs, TST_CHECKING);
         if (sev_signal == SIGNAL_RELEASE) {
             print_release(cs);
             goto skip_to_released;
@@ -523,14 +841,14 @@ skip_to_requesting:
             int r = arp_do_collision_check(cs);
             if (r == ARPR_OK) {
             } else if (r == ARPR_CONFLICT) {
-                // XXX: If we tracked multiple DHCP servers, then we
-                //      could fall back on another one.
-                reinit_selecting(cs, 0);
                 sev_dhcp = false;
+                if (next_offer(cs))
+                    goto skip_to_requesting;
+                reinit_selecting(cs, 0);
                 goto reinit;
             } else if (r == ARPR_FAIL) {
                 ret = COR_ERROR;
-                scrReturn(ret);
+                ccrReturnP(ccr, ret);
                 continue;
             } else BAD_STATE();
         }
@@ -541,7 +859,7 @@ skip_to_requesting:
             } else if (r == ARPR_OK) {
             } else if (r == ARPR_FAIL) {
                 ret = COR_ERROR;
-                scrReturn(ret);
+                ccrReturnP(ccr, ret);
                 continue;
             } else BAD_STATE();
         }
@@ -550,7 +868,8 @@ skip_to_requesting:
             int r = requesting_timeout(cs, nowts);
             if (r == REQ_SUCCESS) {
             } else if (r == REQ_TIMEOUT) {
-                // We timed out.  Send another packet.
+                // We timed out.  Start over.
+                reinit_selecting(cs, 0);
                 sev_dhcp = false;
                 goto reinit;
             } else if (r == REQ_FAIL) {
@@ -558,10 +877,11 @@ skip_to_requesting:
                 ret = COR_ERROR;
             } else BAD_STATE();
         }
-        scrReturn(ret);
+        ccrReturnP(ccr, ret);
     }
-    scrReturn(COR_SUCCESS);
+    ccrReturnP(ccr, COR_SUCCESS);
     // We're in the BOUND, RENEWING, or REBINDING states here.
+    trace_state(cs, TST_BOUND);
     for (;;) {
         int ret = COR_SUCCESS;
         if (sev_signal) {
@@ -569,7 +889,7 @@ skip_to_requesting:
                 int r = xmit_release(cs);
                 if (r) {
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
                     continue;
                 }
                 goto skip_to_released;
@@ -578,21 +898,21 @@ skip_to_requesting:
                 int r = frenew(cs, true);
                 if (r) {
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
                     continue;
                 }
             }
         }
         if (sev_dhcp && is_renewing(cs, nowts)) {
-            int r = extend_packet(cs, dhcp_packet, dhcp_msgtype, dhcp_srcaddr);
+            int r = extend_packet(cs, dhcp_oi, dhcp_msgtype, dhcp_srcaddr);
             if (r == ANP_SUCCESS || r == ANP_IGNORE) {
             } else if (r == ANP_REJECTED) {
                 sev_dhcp = false;
                 goto reinit;
             } else if (r == ANP_CHECK_IP) {
-                if (arp_check(cs, dhcp_packet) < 0) {
+                if (arp_check(cs, dhcp_oi) < 0) {
                     log_warning("%s: Failed to make arp socket.  Searching for new lease...",
-                                client_config.interface);
+                                cs->cfg->interface);
                     reinit_selecting(cs, 3000);
                     sev_dhcp = false;
                     goto reinit;
@@ -609,7 +929,7 @@ skip_to_requesting:
                 goto reinit;
             } else if (r == ARPR_FAIL) {
                 ret = COR_ERROR;
-                scrReturn(ret);
+                ccrReturnP(ccr, ret);
                 continue;
             } else BAD_STATE();
             if (!cs->got_router_arp || !cs->got_server_arp) {
@@ -619,7 +939,7 @@ skip_to_requesting:
                     // We got both ARP addresses.
                 } else if (r == ARPR_FAIL) {
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
                     continue;
                 } else BAD_STATE();
             } else if (cs->check_fingerprint) {
@@ -634,7 +954,7 @@ skip_to_requesting:
                     goto reinit;
                 } else if (r == ARPR_FAIL) {
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
                     continue;
                 } else BAD_STATE();
             }
@@ -646,7 +966,7 @@ skip_to_requesting:
                 if (r == ARPR_OK) {
                 } else if (r == ARPR_FAIL) {
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
                     continue;
                 } else BAD_STATE();
             } else if (cs->check_fingerprint) {
@@ -659,7 +979,7 @@ skip_to_requesting:
                     goto reinit;
                 } else if (r == ARPR_FAIL) {
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
                     continue;
                 } else BAD_STATE();
             }
@@ -671,14 +991,21 @@ skip_to_requesting:
                 if (ifchange_deconfig(cs) < 0) {
                     // Likely only to fail because of rfkill.
                     ret = COR_ERROR;
-                    scrReturn(ret);
+                    ccrReturnP(ccr, ret);
+                }
+                // The outcome is needed before a new lease can be
+                // sought.  This path is rare, so simply wait for it.
+                ifchange_flush(cs);
+                if (!cs->ifDeconfig) {
+                    ret = COR_ERROR;
+                    ccrReturnP(ccr, ret);
                 }
                 reinit_selecting(cs, 0);
                 sev_dhcp = false;
                 goto reinit;
             } else if (r == IFUP_FAIL) {
                 ret = COR_ERROR;
-                scrReturn(ret);
+                ccrReturnP(ccr, ret);
                 continue;
             } else BAD_STATE();
         }
@@ -700,7 +1027,7 @@ skip_to_requesting:
             } else
                 BAD_STATE();
         }
-        scrReturn(ret);
+        ccrReturnP(ccr, ret);
     }
     sev_dhcp = false;
     goto reinit;
@@ -709,20 +1036,21 @@ skip_to_requesting:
         int ret;
 skip_to_released:
         ret = COR_SUCCESS;
+        trace_state(cs, TST_RELEASED);
         if (sev_signal == SIGNAL_RENEW) {
             int r = frenew(cs, false);
             if (r) {
                 ret = COR_ERROR;
-                scrReturn(ret);
+                ccrReturnP(ccr, ret);
                 continue;
             }
             break;
         }
-        scrReturn(ret);
+        ccrReturnP(ccr, ret);
     }
     sev_dhcp = false;
     goto reinit;
-    scrFinish(COR_SUCCESS);
+    ccrFinishP(ccr, COR_SUCCESS);
 }
 
 
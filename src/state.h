@@ -30,6 +30,7 @@
 
 #include "ndhc.h"
 #include "dhcp.h"
+#include "options.h"
 
 #define COR_SUCCESS 0
 #define COR_ERROR -1
@@ -41,7 +42,7 @@ enum {
 };
 
 int dhcp_handle(struct client_state_t cs[static 1], long long nowts,
-                bool sev_dhcp, struct dhcpmsg dhcp_packet[static 1],
+                bool sev_dhcp, const struct dhcp_optidx dhcp_oi[static 1],
                 uint8_t dhcp_msgtype, uint32_t dhcp_srcaddr, bool sev_arp,
                 bool force_fingerprint, bool dhcp_timeout, bool arp_timeout,
                 int sev_signal);
@@ -38,17 +38,24 @@
 #include "ndhc.h"
 #include "sys.h"
 
-void epoll_add(int epfd, int fd)
+// Events for the fd also carry tag, which the caller can get back with
+// epoll_event_tag().  ndhc uses it to find the interface that an fd is for.
+void epoll_add_tag(int epfd, int fd, uint32_t tag)
 {
     struct epoll_event ev;
     int r;
     ev.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-    ev.data.fd = fd;
+    ev.data.u64 = (uint64_t)tag << 32 | (uint32_t)fd;
     r = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
     if (r < 0)
         suicide("epoll_add failed %s", strerror(errno));
 }
 
+void epoll_add(int epfd, int fd)
+{
+    epoll_add_tag(epfd, fd, EPOLL_TAG_NONE);
+}
+
 void epoll_del(int epfd, int fd)
 {
     struct epoll_event ev;
@@ -60,6 +67,16 @@ void epoll_del(int epfd, int fd)
         suicide("epoll_del failed %s", strerror(errno));
 }
 
+int epoll_event_fd(const struct epoll_event ev[static 1])
+{
+    return (int)(uint32_t)ev->data.u64;
+}
+
+uint32_t epoll_event_tag(const struct epoll_event ev[static 1])
+{
+    return (uint32_t)(ev->data.u64 >> 32);
+}
+
 int setup_signals_subprocess(void)
 {
     sigset_t mask;
@@ -28,7 +28,9 @@
 #ifndef SYS_H_
 #define SYS_H_
 
+#include <stdint.h>
 #include <time.h>
+#include <sys/epoll.h>
 #include "ndhc-defines.h"
 
 static inline long long curms()
@@ -43,8 +45,14 @@ static inline size_t min_size_t(size_t a, size_t b)
     return a < b ? a : b;
 }
 
+// The tag of fds that are not registered with epoll_add_tag().
+#define EPOLL_TAG_NONE UINT32_MAX
+
 void epoll_add(int epfd, int fd);
+void epoll_add_tag(int epfd, int fd, uint32_t tag);
 void epoll_del(int epfd, int fd);
+int epoll_event_fd(const struct epoll_event ev[static 1]);
+uint32_t epoll_event_tag(const struct epoll_event ev[static 1]);
 
 int setup_signals_subprocess(void);
 void signal_dispatch_subprocess(int sfd, const char pname[static 1]);
@@ -0,0 +1,205 @@
+/* timer.c - heap-ordered deadline scheduler
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include "nk/log.h"
+#include "nk/io.h"
+#include "timer.h"
+
+// The heap holds pointers to the timers that are armed, ordered so that
+// the element at index 0 always has the earliest deadline.  Every timer
+// records its own index so that it can be moved or removed in O(log N)
+// without searching.
+//
+// The storage is taken directly from mmap() and doubled when it fills, so
+// that it can keep growing after the seccomp filter, which does not allow
+// brk(), has been installed.
+static struct ntimer **ntimer_heap;
+static size_t ntimer_heap_len;
+static size_t ntimer_heap_cap;
+
+static void ntimer_heap_grow(void)
+{
+    size_t ncap = ntimer_heap_cap ? ntimer_heap_cap * 2
+                                  : 4096 / sizeof *ntimer_heap;
+    if (ncap > SIZE_MAX / sizeof *ntimer_heap)
+        suicide("%s: timer heap would overflow (%zu timers)", __func__,
+                ntimer_heap_cap);
+    struct ntimer **nh = mmap(NULL, ncap * sizeof *nh, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (nh == MAP_FAILED)
+        suicide("%s: failed to grow timer heap to %zu timers: %s", __func__,
+                ncap, strerror(errno));
+    if (ntimer_heap) {
+        memcpy(nh, ntimer_heap, ntimer_heap_len * sizeof *nh);
+        munmap(ntimer_heap, ntimer_heap_cap * sizeof *nh);
+    }
+    ntimer_heap = nh;
+    ntimer_heap_cap = ncap;
+}
+
+static void ntimer_heap_set(size_t i, struct ntimer t[static 1])
+{
+    ntimer_heap[i] = t;
+    t->hidx = i;
+}
+
+static void ntimer_sift_up(size_t i)
+{
+    struct ntimer *t = ntimer_heap[i];
+    while (i > 0) {
+        size_t p = (i - 1) / 2;
+        if (ntimer_heap[p]->ts <= t->ts)
+            break;
+        ntimer_heap_set(i, ntimer_heap[p]);
+        i = p;
+    }
+    ntimer_heap_set(i, t);
+}
+
+static void ntimer_sift_down(size_t i)
+{
+    struct ntimer *t = ntimer_heap[i];
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= ntimer_heap_len)
+            break;
+        if (c + 1 < ntimer_heap_len &&
+            ntimer_heap[c + 1]->ts < ntimer_heap[c]->ts)
+            ++c;
+        if (t->ts <= ntimer_heap[c]->ts)
+            break;
+        ntimer_heap_set(i, ntimer_heap[c]);
+        i = c;
+    }
+    ntimer_heap_set(i, t);
+}
+
+// Sets the deadline of the timer to ts, arming it if it was not already
+// armed.  A negative ts disarms the timer.
+void ntimer_arm(struct ntimer t[static 1], long long ts)
+{
+    if (ts < 0) {
+        ntimer_disarm(t);
+        return;
+    }
+    if (t->ts < 0 || t->hidx == NTIMER_POPPED) {
+        if (ntimer_heap_len >= ntimer_heap_cap)
+            ntimer_heap_grow();
+        t->ts = ts;
+        ntimer_heap_set(ntimer_heap_len++, t);
+        ntimer_sift_up(t->hidx);
+        return;
+    }
+    long long oldts = t->ts;
+    t->ts = ts;
+    if (ts < oldts)
+        ntimer_sift_up(t->hidx);
+    else if (ts > oldts)
+        ntimer_sift_down(t->hidx);
+}
+
+void ntimer_disarm(struct ntimer t[static 1])
+{
+    if (t->ts < 0)
+        return;
+    size_t i = t->hidx;
+    t->ts = -1;
+    if (i == NTIMER_POPPED)
+        return;
+    if (--ntimer_heap_len == i)
+        return;
+    struct ntimer *last = ntimer_heap[ntimer_heap_len];
+    ntimer_heap_set(i, last);
+    if (i > 0 && ntimer_heap[(i - 1) / 2]->ts > last->ts)
+        ntimer_sift_up(i);
+    else
+        ntimer_sift_down(i);
+}
+
+// Returns the earliest deadline of any armed timer, or -1 if none are armed.
+long long ntimer_next_ts(void)
+{
+    return ntimer_heap_len ? ntimer_heap[0]->ts : -1;
+}
+
+// Takes the earliest timer out of the heap and returns it if its deadline
+// is at or before nowts; otherwise returns NULL.  Calling this until it
+// returns NULL costs O(log N) for each timer that expired, however many
+// are still waiting.
+struct ntimer *ntimer_pop_expired(long long nowts)
+{
+    if (!ntimer_heap_len || ntimer_heap[0]->ts > nowts)
+        return NULL;
+    struct ntimer *t = ntimer_heap[0];
+    if (--ntimer_heap_len) {
+        ntimer_heap_set(0, ntimer_heap[ntimer_heap_len]);
+        ntimer_sift_down(0);
+    }
+    t->hidx = NTIMER_POPPED;
+    return t;
+}
+
+int ntimer_fd_open(void)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (fd < 0)
+        suicide("%s: timerfd_create failed: %s", __func__, strerror(errno));
+    return fd;
+}
+
+// Makes the timerfd readable at the absolute curms() time ts.  If ts is
+// negative, the timerfd is disarmed.  Deadlines that are already in the
+// past make the timerfd readable immediately.
+void ntimer_fd_set(int fd, long long ts)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof its);
+    if (ts >= 0) {
+        // A zero it_value would disarm the timer rather than fire it.
+        if (ts == 0)
+            ts = 1;
+        its.it_value.tv_sec = ts / 1000;
+        its.it_value.tv_nsec = (ts % 1000) * 1000000;
+    }
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        suicide("%s: timerfd_settime failed: %s", __func__, strerror(errno));
+}
+
+// Consumes the expiration count so that the timerfd is no longer readable.
+void ntimer_fd_clear(int fd)
+{
+    uint64_t exp;
+    ssize_t r = safe_read(fd, (char *)&exp, sizeof exp);
+    if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        suicide("%s: timerfd read failed: %s", __func__, strerror(errno));
+}
@@ -0,0 +1,60 @@
+/* timer.h - heap-ordered deadline scheduler
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef NDHC_TIMER_H_
+#define NDHC_TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A deadline that is tracked by the process-wide timer heap.  ts is in
+// the same units and clock as curms(), and is -1 when the timer is not
+// armed.  Owners may read ts directly but must only change it through
+// the ntimer_*() functions.
+//
+// A timer that ntimer_pop_expired() returned keeps its ts, so that its
+// owner can still see that it expired, but it is out of the heap until
+// it is armed again.
+struct ntimer {
+    long long ts;
+    size_t hidx;  // Index into the timer heap, or NTIMER_POPPED.
+    uint32_t owner; // Tells the caller of ntimer_pop_expired() whose it is.
+};
+
+#define NTIMER_POPPED SIZE_MAX
+#define NTIMER_INIT { .ts = -1, .hidx = 0, .owner = 0 }
+
+void ntimer_arm(struct ntimer t[static 1], long long ts);
+void ntimer_disarm(struct ntimer t[static 1]);
+long long ntimer_next_ts(void);
+struct ntimer *ntimer_pop_expired(long long nowts);
+
+int ntimer_fd_open(void);
+void ntimer_fd_set(int fd, long long ts);
+void ntimer_fd_clear(int fd);
+
+#endif /* NDHC_TIMER_H_ */
@@ -0,0 +1,249 @@
+/* trace.c - lease acquisition timeline
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "nk/log.h"
+#include "trace.h"
+#include "ndhc.h"
+#include "dhcp.h"
+
+// Every event is stamped with the monotonic clock in microseconds and kept
+// in a fixed per-interface ring that is written to the log on SIGHUP.
+// While a lease is being acquired, the first crossing of each phase
+// boundary is remembered as well, and a one-line breakdown is logged once
+// ifch has applied the new lease.
+
+static const char * const trace_event_names[TEV_MAX] = {
+    [TEV_STATE] = "state",
+    [TEV_DHCP_TX] = "dhcp-tx",
+    [TEV_DHCP_RX] = "dhcp-rx",
+    [TEV_ARP_CHECK] = "arp-check",
+    [TEV_ARP_PROBE] = "arp-probe",
+    [TEV_ARP_FREE] = "arp-free",
+    [TEV_ARP_CONFLICT] = "arp-conflict",
+    [TEV_SOCKD_TX] = "sockd-tx",
+    [TEV_SOCKD_RX] = "sockd-rx",
+    [TEV_IFCH_TX] = "ifch-tx",
+    [TEV_IFCH_RX] = "ifch-rx",
+    [TEV_BIND] = "bind",
+    [TEV_BOUND] = "bound",
+};
+
+static const char * const trace_state_names[TST_MAX] = {
+    [TST_REBOOTING] = "rebooting",
+    [TST_SELECTING] = "selecting",
+    [TST_REQUESTING] = "requesting",
+    [TST_CHECKING] = "checking",
+    [TST_BOUND] = "bound",
+    [TST_RELEASED] = "released",
+};
+
+static const char * const trace_msgtype_names[] = {
+    "other", "discover", "offer", "request", "decline", "ack", "nak",
+    "release", "inform",
+};
+#define TRACE_MSGTYPES \
+    (sizeof trace_msgtype_names / sizeof trace_msgtype_names[0])
+
+static long long trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void trace_mark(struct trace_data t[static 1], enum trace_mark m,
+                       long long us)
+{
+    if (t->acq.active && t->acq.mark[m] < 0)
+        t->acq.mark[m] = us;
+}
+
+// Entering a state forgets the boundaries from that state onward, so that
+// going back a step (a NAK, a timeout, or an address conflict) times the
+// retry rather than the attempt that failed.
+static void trace_enter(struct trace_data t[static 1], enum trace_state st,
+                        long long us)
+{
+    static const enum trace_mark first[TST_MAX] = {
+        [TST_REBOOTING] = TM_DISCOVER,
+        [TST_SELECTING] = TM_DISCOVER,
+        [TST_REQUESTING] = TM_REQUEST,
+        [TST_CHECKING] = TM_ARP,
+        [TST_BOUND] = TM_MAX,
+        [TST_RELEASED] = TM_MAX,
+    };
+    if (st == TST_RELEASED) {
+        t->acq.active = false;
+        return;
+    }
+    if (!t->acq.active) {
+        if (st != TST_REBOOTING && st != TST_SELECTING)
+            return;
+        t->acq.active = true;
+        t->acq.dhcp_tx = t->acq.arp_probes = t->acq.restarts = 0;
+        for (size_t i = 0; i < TM_MAX; ++i)
+            t->acq.mark[i] = -1;
+        t->acq.mark[TM_START] = us;
+        return;
+    }
+    bool forgot = false;
+    for (size_t i = first[st]; i < TM_MAX; ++i) {
+        if (t->acq.mark[i] >= 0) {
+            t->acq.mark[i] = -1;
+            forgot = true;
+        }
+    }
+    if (forgot)
+        ++t->acq.restarts;
+}
+
+// Formats the time between two boundaries in ms, or "-" if either one
+// wasn't crossed.
+static const char *trace_span(const struct trace_data t[static 1],
+                              char buf[static 24], enum trace_mark a,
+                              enum trace_mark b)
+{
+    if (t->acq.mark[a] < 0 || t->acq.mark[b] < 0 ||
+        t->acq.mark[b] < t->acq.mark[a])
+        return "-";
+    long long d = t->acq.mark[b] - t->acq.mark[a];
+    snprintf(buf, 24, "%lld.%03lld", d / 1000, d % 1000);
+    return buf;
+}
+
+static void trace_summary(struct client_state_t cs[static 1])
+{
+    struct trace_data *t = cs->trace;
+    // INIT-REBOOT and Rapid Commit each skip a step.
+    enum trace_mark sent = t->acq.mark[TM_DISCOVER] >= 0 ? TM_DISCOVER
+                                                      : TM_REQUEST;
+    enum trace_mark asked = t->acq.mark[TM_REQUEST] >= 0 ? TM_REQUEST
+                                                      : TM_DISCOVER;
+    char total[24], wait[24], offer[24], sel[24], ack[24], arp[24],
+         bind[24];
+    log_line("%s: Lease acquired in %s ms (wait %s, offer %s, select %s, ack %s, arp %s, bind %s); %u DHCP sent, %u ARP probes, %u restarts.",
+             cs->cfg->interface,
+             trace_span(t, total, TM_START, TM_BOUND),
+             trace_span(t, wait, TM_START, sent),
+             trace_span(t, offer, TM_DISCOVER, TM_OFFER),
+             trace_span(t, sel, TM_OFFER, TM_REQUEST),
+             trace_span(t, ack, asked, TM_ACK),
+             trace_span(t, arp, TM_ARP, TM_ARP_DONE),
+             trace_span(t, bind, TM_BIND, TM_BOUND),
+             t->acq.dhcp_tx, t->acq.arp_probes, t->acq.restarts);
+    t->acq.active = false;
+}
+
+void trace_event(struct client_state_t cs[static 1], enum trace_event ev,
+                 uint32_t arg)
+{
+    struct trace_data *t = cs->trace;
+    long long us = trace_now();
+    size_t i = (t->head + t->num) % TRACE_RING_SIZE;
+    if (t->num < TRACE_RING_SIZE)
+        ++t->num;
+    else
+        t->head = (t->head + 1) % TRACE_RING_SIZE;
+    t->ring[i] = (struct trace_rec){ .us = us, .arg = arg, .ev = ev };
+
+    switch (ev) {
+    case TEV_STATE:
+        trace_enter(t, arg, us);
+        break;
+    case TEV_DHCP_TX:
+        t->acq.dhcp_tx++;
+        if (arg == DHCPDISCOVER)
+            trace_mark(t, TM_DISCOVER, us);
+        else if (arg == DHCPREQUEST)
+            trace_mark(t, TM_REQUEST, us);
+        break;
+    case TEV_DHCP_RX:
+        if (arg == DHCPOFFER)
+            trace_mark(t, TM_OFFER, us);
+        else if (arg == DHCPACK)
+            trace_mark(t, TM_ACK, us);
+        break;
+    case TEV_ARP_CHECK: trace_mark(t, TM_ARP, us); break;
+    case TEV_ARP_PROBE: t->acq.arp_probes++; break;
+    case TEV_ARP_FREE: trace_mark(t, TM_ARP_DONE, us); break;
+    case TEV_BIND: trace_mark(t, TM_BIND, us); break;
+    case TEV_BOUND:
+        if (t->acq.active && t->acq.mark[TM_BIND] >= 0) {
+            trace_mark(t, TM_BOUND, us);
+            trace_summary(cs);
+        }
+        break;
+    default: break;
+    }
+}
+
+// The coroutine in dhcp_handle() passes through its state loops on every
+// call, so only changes of state are recorded.
+void trace_state(struct client_state_t cs[static 1], enum trace_state st)
+{
+    struct trace_data *t = cs->trace;
+    if (t->acq.state == st)
+        return;
+    t->acq.state = st;
+    trace_event(cs, TEV_STATE, st);
+}
+
+void trace_dump(struct client_state_t cs[static 1])
+{
+    const struct trace_data *t = cs->trace;
+    log_line("%s: Dumping the last %zu trace events.",
+             cs->cfg->interface, t->num);
+    for (size_t n = 0; n < t->num; ++n) {
+        const struct trace_rec *r =
+            &t->ring[(t->head + n) % TRACE_RING_SIZE];
+        char arg[16];
+        switch (r->ev) {
+        case TEV_STATE:
+            snprintf(arg, sizeof arg, "%s", r->arg < TST_MAX
+                     ? trace_state_names[r->arg] : "?");
+            break;
+        case TEV_DHCP_TX: case TEV_DHCP_RX:
+            snprintf(arg, sizeof arg, "%s", trace_msgtype_names[
+                     r->arg < TRACE_MSGTYPES ? r->arg : 0]);
+            break;
+        case TEV_SOCKD_TX: case TEV_SOCKD_RX:
+            snprintf(arg, sizeof arg, "%c", (char)r->arg);
+            break;
+        default:
+            snprintf(arg, sizeof arg, "%u", r->arg);
+            break;
+        }
+        log_line("%s: trace %lld.%06lld %s %s", cs->cfg->interface,
+                 r->us / 1000000, r->us % 1000000,
+                 trace_event_names[r->ev], arg);
+    }
+}
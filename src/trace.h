@@ -0,0 +1,109 @@
+/* trace.h - lease acquisition timeline
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NDHC_TRACE_H_
+#define NDHC_TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ndhc.h"
+
+enum trace_event {
+    TEV_STATE = 0,      // arg is a trace_state.
+    TEV_DHCP_TX,        // arg is the DHCP message type.
+    TEV_DHCP_RX,        // arg is the DHCP message type.
+    TEV_ARP_CHECK,      // The ARP collision check has begun.
+    TEV_ARP_PROBE,      // arg is the number of probes sent so far.
+    TEV_ARP_FREE,       // The offered address is not in use.
+    TEV_ARP_CONFLICT,
+    TEV_SOCKD_TX,       // arg is the request code.
+    TEV_SOCKD_RX,       // arg is the reply code.
+    TEV_IFCH_TX,        // arg is the ifch request id.
+    TEV_IFCH_RX,        // arg is the ifch request id.
+    TEV_BIND,           // A new lease has been handed to ifch.
+    TEV_BOUND,          // ifch has applied the new lease; arg is success.
+    TEV_MAX,
+};
+
+// The states of the coroutine in dhcp_handle().
+enum trace_state {
+    TST_REBOOTING = 0,
+    TST_SELECTING,
+    TST_REQUESTING,
+    TST_CHECKING,
+    TST_BOUND,
+    TST_RELEASED,
+    TST_MAX,
+};
+
+#define TRACE_RING_SIZE 128
+
+struct trace_rec {
+    long long us;
+    uint32_t arg;
+    uint8_t ev;
+};
+
+// Phase boundaries of an acquisition, in the order that they are crossed.
+enum trace_mark {
+    TM_START = 0,   // Entered REBOOTING or SELECTING.
+    TM_DISCOVER,
+    TM_OFFER,
+    TM_REQUEST,
+    TM_ACK,
+    TM_ARP,         // ARP collision check started.
+    TM_ARP_DONE,    // The offered address is free.
+    TM_BIND,
+    TM_BOUND,
+    TM_MAX,
+};
+
+// The trace of one interface: its recent events and the acquisition that
+// is being timed.
+struct trace_data {
+    struct trace_rec ring[TRACE_RING_SIZE];
+    size_t head, num;
+    struct {
+        long long mark[TM_MAX]; // -1 if the boundary hasn't been crossed.
+        unsigned int dhcp_tx;
+        unsigned int arp_probes;
+        unsigned int restarts;
+        uint8_t state;
+        bool active;
+    } acq;
+};
+
+#define TRACE_DATA_INIT { .acq = { .state = TST_MAX } }
+
+void trace_event(struct client_state_t cs[static 1], enum trace_event ev,
+                 uint32_t arg);
+void trace_state(struct client_state_t cs[static 1], enum trace_state st);
+void trace_dump(struct client_state_t cs[static 1]);
+
+#endif /* NDHC_TRACE_H_ */
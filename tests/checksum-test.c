@@ -0,0 +1,289 @@
+/* checksum-test.c - Internet checksum tests against a reference
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "checksum.h"
+#include "expect.h"
+
+#define MAXLEN 2048
+
+static uint32_t rnd_state = 2463534242u;
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+// RFC1071 as written: big-endian 16-bit words, an odd trailing byte padded
+// with zero, carries folded back in.  The result is stored in network byte
+// order, as the checksum field of a header would hold it.
+static uint16_t ref_csum(const uint8_t *p, size_t len)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (uint32_t)p[i] << 8 | p[i + 1];
+    if (len & 1)
+        sum += (uint32_t)p[len - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons((uint16_t)~sum);
+}
+
+// The pseudo-header is laid out in front of the datagram and the whole
+// is checksummed as one buffer.
+static uint16_t ref_udp4(uint32_t saddr, uint32_t daddr,
+                         const uint8_t *udp, size_t len)
+{
+    static uint8_t b[12 + MAXLEN];
+    memcpy(b, &saddr, 4);
+    memcpy(b + 4, &daddr, 4);
+    b[8] = 0;
+    b[9] = IPPROTO_UDP;
+    b[10] = (uint8_t)(len >> 8);
+    b[11] = (uint8_t)len;
+    memcpy(b + 12, udp, len);
+    return ref_csum(b, 12 + len);
+}
+
+static void fill(uint8_t *p, size_t len, int kind)
+{
+    for (size_t i = 0; i < len; ++i) {
+        switch (kind) {
+        case 0: p[i] = (uint8_t)rnd(); break;
+        case 1: p[i] = 0xff; break;            // Every addition carries.
+        case 2: p[i] = (i & 1) ? 0x01 : 0xff; break; // 0xff01 words.
+        default: p[i] = 0; break;
+        }
+    }
+}
+
+// Every length up to MAXLEN at every alignment within a word, with random
+// data, all-ones data, data that carries on nearly every word, and zeros.
+static void test_buf(void)
+{
+    static uint8_t raw[MAXLEN + 16];
+    for (int kind = 0; kind < 4; ++kind) {
+        for (size_t off = 0; off < 8; ++off) {
+            for (size_t len = 0; len <= MAXLEN; ++len) {
+                uint8_t *p = raw + off;
+                fill(p, len, kind);
+                uint16_t want = ref_csum(p, len);
+                uint16_t got = csum_buf(p, len);
+                if (got != want) {
+                    fprintf(stderr, "kind %d off %zu len %zu: %04x != %04x\n",
+                            kind, off, len, got, want);
+                    ++failures;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+// A sum built from several even-length pieces with an odd-length last
+// piece matches the sum of the whole buffer.
+static void test_partial(void)
+{
+    static uint8_t b[MAXLEN];
+    for (int n = 0; n < 1000; ++n) {
+        size_t len = rnd() % MAXLEN;
+        fill(b, len, n & 1);
+        uint64_t sum = 0;
+        size_t done = 0;
+        while (done < len) {
+            size_t part = (rnd() % 64) & ~(size_t)1;
+            if (!part || part > len - done)
+                part = len - done;
+            sum = csum_partial(b + done, part, sum);
+            done += part;
+        }
+        EXPECT(csum_fold(sum) == ref_csum(b, len));
+    }
+}
+
+// Sums of a megabyte of all-ones overflow the 32-bit intermediate sums
+// that a naive implementation would use.
+static void test_long(void)
+{
+    size_t len = 1 << 20;
+    uint8_t *b = malloc(len + 1);
+    if (!b) {
+        EXPECT(b);
+        return;
+    }
+    fill(b, len + 1, 1);
+    EXPECT(csum_buf(b, len) == ref_csum(b, len));
+    EXPECT(csum_buf(b + 1, len - 1) == ref_csum(b + 1, len - 1));
+    EXPECT(csum_buf(b, 65535) == ref_csum(b, 65535));
+    free(b);
+}
+
+static void test_udp4(void)
+{
+    static uint8_t raw[MAXLEN + 8];
+    for (int n = 0; n < 20000; ++n) {
+        size_t len = 8 + rnd() % (MAXLEN - 8);
+        uint8_t *udp = raw + (rnd() & 7);
+        uint32_t saddr = rnd(), daddr = rnd();
+        if (n & 1) {
+            saddr = 0xffffffffu;
+            daddr = 0xffffffffu;
+        }
+        fill(udp, len, n % 3);
+        EXPECT(csum_udp4(saddr, daddr, udp, len)
+               == ref_udp4(saddr, daddr, udp, len));
+    }
+
+    // Storing the checksum into the datagram makes it verify as zero,
+    // which is how received packets are checked.
+    uint8_t *udp = raw;
+    size_t len = 300;
+    fill(udp, len, 0);
+    uint32_t saddr = htonl(0x0a090001), daddr = htonl(0xffffffffu);
+    udp[6] = udp[7] = 0;
+    uint16_t c = csum_udp4(saddr, daddr, udp, len);
+    memcpy(udp + 6, &c, sizeof c);
+    EXPECT(csum_udp4(saddr, daddr, udp, len) == 0);
+}
+
+// The RFC1624 section 4 example, where eqn. 2 yields 0xffff instead of the
+// correct 0x0000, and then random word changes at even offsets in the way
+// that dhcp.c patches its request templates.
+static void test_update16(void)
+{
+    EXPECT(csum_update16(0xdd2f, 0x5555, 0x3285) == 0x0000);
+
+    static uint8_t b[600];
+    for (int n = 0; n < 100000; ++n) {
+        size_t len = 2 + 2 * (rnd() % (sizeof b / 2 - 1));
+        fill(b, len, n % 3);
+        uint16_t hc = csum_buf(b, len);
+        for (int k = 0; k < 4; ++k) {
+            size_t off = 2 * (rnd() % (len / 2));
+            uint16_t m, mp = (uint16_t)rnd();
+            if (!(rnd() & 7))
+                mp = (uint16_t)~0;
+            memcpy(&m, b + off, sizeof m);
+            memcpy(b + off, &mp, sizeof mp);
+            hc = csum_update16(hc, m, mp);
+            uint16_t want = csum_buf(b, len);
+            // Both 0x0000 and 0xffff are ones-complement zero.
+            if (hc != want && !((hc == 0 || hc == 0xffff) &&
+                                (want == 0 || want == 0xffff))) {
+                fprintf(stderr, "update16 len %zu off %zu: %04x != %04x\n",
+                        len, off, hc, want);
+                ++failures;
+                return;
+            }
+            hc = want;
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH_RUNS 5
+
+// The cost of checksumming a UDP datagram with its pseudo-header, for each
+// variant that this CPU supports and for the reference, over the sizes of
+// DHCP packets that are seen in practice.  The variants are timed in
+// BENCH_RUNS runs each, of which the fastest is printed.
+static void bench(void)
+{
+    static uint8_t b[1500];
+    fill(b, sizeof b, 0);
+    volatile uint16_t sink = 0;
+    size_t ops = 50000;
+    printf("%-6s", "bytes");
+    for (size_t k = 0; k < csum_num_impls; ++k) {
+        if (csum_impls[k].usable())
+            printf(" %9s", csum_impls[k].name);
+    }
+    printf(" %9s  (ns/op)\n", "rfc1071");
+    for (size_t len = 300; len <= sizeof b; len += 100) {
+        printf("%-6zu", len);
+        for (size_t k = 0; k < csum_num_impls; ++k) {
+            if (csum_use(k) < 0)
+                continue;
+            double best = 0;
+            for (int r = 0; r < BENCH_RUNS; ++r) {
+                double t0 = now_ns();
+                for (size_t i = 0; i < ops; ++i) {
+                    b[0] = (uint8_t)i;
+                    sink ^= csum_udp4(0, 0xffffffffu, b, len);
+                }
+                double dt = now_ns() - t0;
+                if (!r || dt < best)
+                    best = dt;
+            }
+            printf(" %9.1f", best / ops);
+        }
+        double t0 = now_ns();
+        for (size_t i = 0; i < ops; ++i) {
+            b[0] = (uint8_t)i;
+            sink ^= ref_udp4(0, 0xffffffffu, b, len);
+        }
+        printf(" %9.1f\n", (now_ns() - t0) / ops);
+    }
+    csum_init();
+    printf("selected: %s\n", csum_impl_name());
+    (void)sink;
+}
+
+// Every test is run against each variant that this CPU supports.
+int main(void)
+{
+    for (size_t k = 0; k < csum_num_impls; ++k) {
+        if (csum_use(k) < 0) {
+            printf("%s: not supported, skipped\n", csum_impls[k].name);
+            continue;
+        }
+        int before = failures;
+        test_buf();
+        test_partial();
+        test_long();
+        test_udp4();
+        test_update16();
+        printf("%s: %s\n", csum_impls[k].name,
+               failures == before ? "ok" : "FAILED");
+    }
+    bench();
+    return expect_status();
+}
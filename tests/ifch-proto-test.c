@@ -0,0 +1,366 @@
+/* ifch-proto-test.c - ifch binary message parser tests
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "ifch-proto.h"
+#include "expect.h"
+
+static uint32_t rnd_state = 2463534242u;
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+// Encodes one of each kind of record that ndhc sends for a bind.  Returns
+// the number of records that were refused.
+static int encode_bind(struct ifch_msg m[static 1], uint16_t id)
+{
+    uint32_t ip4[3] = { htonl(0x0a090065), htonl(0xffffff00),
+                        htonl(0x0a0900ff) };
+    uint32_t router = htonl(0x0a090001);
+    uint32_t dns[2] = { htonl(0x0a090001), htonl(0x0a090002) };
+    uint16_t mtu = htons(1400);
+    int bad = 0;
+
+    ifch_msg_init(m);
+    ifch_msg_set_id(m, id);
+    bad -= ifch_msg_add(m, IFCH_T_IP4, ip4, sizeof ip4);
+    bad -= ifch_msg_add(m, IFCH_T_ROUTER, &router, sizeof router);
+    bad -= ifch_msg_add(m, IFCH_T_DNS, dns, sizeof dns);
+    bad -= ifch_msg_add(m, IFCH_T_HOSTNAME, "host", 4);
+    bad -= ifch_msg_add(m, IFCH_T_MTU, &mtu, sizeof mtu);
+    return bad;
+}
+
+static void make_bind(struct ifch_msg m[static 1])
+{
+    EXPECT(!encode_bind(m, 0x1234));
+}
+
+static void set_rlen(uint8_t buf[static 1], uint16_t rlen)
+{
+    rlen = htons(rlen);
+    memcpy(buf + 4, &rlen, sizeof rlen);
+}
+
+static void test_valid(void)
+{
+    struct ifch_msg m;
+    make_bind(&m);
+    EXPECT(!ifch_msg_check(m.buf, m.len));
+    EXPECT(ifch_msg_get_id(m.buf) == 0x1234);
+    EXPECT(ifch_msg_get_iface(m.buf) == 0);
+
+    // The interface slot is kept apart from the id and the length.
+    ifch_msg_set_iface(&m, 0xbeef);
+    EXPECT(ifch_msg_get_iface(m.buf) == 0xbeef);
+    EXPECT(ifch_msg_get_id(m.buf) == 0x1234);
+    EXPECT(!ifch_msg_check(m.buf, m.len));
+
+    // A header without records is a valid (empty) message.
+    ifch_msg_init(&m);
+    EXPECT(m.len == IFCH_PROTO_HDRLEN);
+    EXPECT(!ifch_msg_check(m.buf, m.len));
+
+    // A carrier query has a zero-length value.
+    EXPECT(!ifch_msg_add(&m, IFCH_T_CARRIER, NULL, 0));
+    EXPECT(!ifch_msg_check(m.buf, m.len));
+}
+
+static void test_truncated_header(void)
+{
+    struct ifch_msg m;
+    ifch_msg_init(&m);
+    for (size_t len = 0; len < IFCH_PROTO_HDRLEN; ++len)
+        EXPECT(ifch_msg_check(m.buf, len) < 0);
+}
+
+// Every prefix of a valid message fails, whether the header length is
+// left alone or patched to match, since the last record is then cut.
+static void test_truncated_records(void)
+{
+    struct ifch_msg m;
+    make_bind(&m);
+    for (size_t len = IFCH_PROTO_HDRLEN + 1; len < m.len; ++len) {
+        uint8_t buf[sizeof m.buf];
+        memcpy(buf, m.buf, len);
+        EXPECT(ifch_msg_check(buf, len) < 0);
+        set_rlen(buf, (uint16_t)(len - IFCH_PROTO_HDRLEN));
+        // The cut can fall exactly on a record boundary; those prefixes
+        // are well-formed messages in their own right.
+        size_t off = IFCH_PROTO_HDRLEN;
+        while (off < len)
+            off += 2 + buf[off + 1];
+        EXPECT((ifch_msg_check(buf, len) == 0) == (off == len));
+    }
+}
+
+static void test_oversized_length(void)
+{
+    struct ifch_msg m;
+    make_bind(&m);
+
+    // The header claims more record bytes than were received.
+    set_rlen(m.buf, (uint16_t)(m.len - IFCH_PROTO_HDRLEN + 1));
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+    set_rlen(m.buf, UINT16_MAX);
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+
+    // A record that claims to run past the end of the message.
+    ifch_msg_init(&m);
+    uint32_t router = htonl(0x0a090001);
+    EXPECT(!ifch_msg_add(&m, IFCH_T_ROUTER, &router, sizeof router));
+    m.buf[IFCH_PROTO_HDRLEN + 1] = 5;
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+    m.buf[IFCH_PROTO_HDRLEN + 1] = UINT8_MAX;
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+
+    // Values that can't be encoded, or that don't fit, are refused and
+    // leave the message unchanged.
+    char big[UINT8_MAX + 1];
+    memset(big, 'a', sizeof big);
+    ifch_msg_init(&m);
+    EXPECT(ifch_msg_add(&m, IFCH_T_HOSTNAME, big, sizeof big) < 0);
+    EXPECT(m.len == IFCH_PROTO_HDRLEN);
+    size_t n = 0;
+    while (!ifch_msg_add(&m, IFCH_T_DNS, big, 252))
+        ++n;
+    EXPECT(n == (IFCH_PROTO_MAXLEN - IFCH_PROTO_HDRLEN) / 254);
+    size_t full = m.len;
+    EXPECT(ifch_msg_add(&m, IFCH_T_DNS, big, 252) < 0);
+    EXPECT(m.len == full);
+}
+
+static void test_bad_magic(void)
+{
+    struct ifch_msg m;
+    make_bind(&m);
+    m.buf[0] = 'i';  // As in a text command.
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+    m.buf[0] = IFCH_PROTO_MAGIC;
+    m.buf[1] = IFCH_PROTO_VERSION + 1;
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+}
+
+static void test_bad_records(void)
+{
+    struct ifch_msg m;
+    make_bind(&m);
+    // Unknown record types.
+    m.buf[IFCH_PROTO_HDRLEN] = 0;
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+    m.buf[IFCH_PROTO_HDRLEN] = IFCH_T_MAX;
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+
+    uint32_t v = 0;
+    ifch_msg_init(&m);
+    EXPECT(ifch_msg_add(&m, IFCH_T_IP4, &v, 4) < 0);
+    EXPECT(ifch_msg_add(&m, IFCH_T_DNS, &v, 3) < 0);
+    EXPECT(ifch_msg_add(&m, IFCH_T_HOSTNAME, &v, 0) < 0);
+    EXPECT(ifch_msg_add(&m, IFCH_T_HOSTNAME, "a\0b", 3) < 0);
+    EXPECT(ifch_msg_add(&m, IFCH_T_MTU, &v, 4) < 0);
+    EXPECT(m.len == IFCH_PROTO_HDRLEN);
+}
+
+// Walking a message yields the records it was built from, in order.
+static void test_walk(void)
+{
+    struct ifch_msg m;
+    make_bind(&m);
+    static const uint8_t types[] = { IFCH_T_IP4, IFCH_T_ROUTER, IFCH_T_DNS,
+                                     IFCH_T_HOSTNAME, IFCH_T_MTU };
+    static const uint8_t lens[] = { 12, 4, 8, 4, 2 };
+    struct ifch_tlv rec;
+    size_t n = 0;
+    for (size_t off = 0; ifch_msg_next(m.buf, m.len, &off, &rec); ++n) {
+        if (n >= sizeof types) {
+            EXPECT(n < sizeof types);
+            break;
+        }
+        EXPECT(rec.type == types[n]);
+        EXPECT(rec.len == lens[n]);
+        EXPECT(rec.val >= m.buf + IFCH_PROTO_HDRLEN);
+        EXPECT(rec.val + rec.len <= m.buf + m.len);
+    }
+    EXPECT(n == sizeof types);
+    EXPECT(!memcmp(rec.val, &(uint16_t){htons(1400)}, 2));
+
+    ifch_msg_init(&m);
+    size_t off = 0;
+    EXPECT(!ifch_msg_next(m.buf, m.len, &off, &rec));
+}
+
+static void test_duplicate_type(void)
+{
+    struct ifch_msg m;
+    uint32_t router[2] = { htonl(0x0a090001), htonl(0x0a090002) };
+    ifch_msg_init(&m);
+    EXPECT(!ifch_msg_add(&m, IFCH_T_ROUTER, &router[0], 4));
+    EXPECT(!ifch_msg_add(&m, IFCH_T_ROUTER, &router[1], 4));
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+
+    // Non-adjacent duplicates are caught as well.
+    make_bind(&m);
+    EXPECT(!ifch_msg_add(&m, IFCH_T_HOSTNAME, "other", 5));
+    EXPECT(ifch_msg_check(m.buf, m.len) < 0);
+}
+
+#define FUZZ_ROUNDS 500000
+
+// Applies one random change to a message: a byte overwritten, the message
+// cut short or extended with random bytes, or one record copied to the end.
+static void mutate(uint8_t buf[static IFCH_PROTO_MAXLEN], size_t len[static 1])
+{
+    switch (rnd() % 4) {
+    case 0:
+        if (*len)
+            buf[rnd() % *len] = (uint8_t)rnd();
+        break;
+    case 1:
+        *len = rnd() % (*len + 1);
+        break;
+    case 2: {
+        size_t n = rnd() % 16;
+        for (size_t i = 0; i < n && *len < IFCH_PROTO_MAXLEN; ++i)
+            buf[(*len)++] = (uint8_t)rnd();
+        break;
+    }
+    case 3: {
+        if (*len <= IFCH_PROTO_HDRLEN)
+            break;
+        size_t off = IFCH_PROTO_HDRLEN + rnd() % (*len - IFCH_PROTO_HDRLEN);
+        size_t n = 2 + buf[off + 1 < *len ? off + 1 : off];
+        if (off + n > *len)
+            n = *len - off;
+        if (*len + n <= IFCH_PROTO_MAXLEN) {
+            memmove(buf + *len, buf + off, n);
+            *len += n;
+        }
+        break;
+    }
+    }
+}
+
+// Randomly mutated bind messages must never crash the parser, and every
+// one that ifch_msg_check() accepts must walk record for record, with no
+// repeated types, to a message that re-encodes to exactly the same bytes.
+// Most mutations also patch the header length to match, or nearly every
+// one of them would be refused by the length check alone.
+static void test_fuzz(void)
+{
+    struct ifch_msg base;
+    make_bind(&base);
+    size_t accepted = 0;
+    for (size_t round = 0; round < FUZZ_ROUNDS; ++round) {
+        uint8_t buf[IFCH_PROTO_MAXLEN];
+        size_t len = base.len;
+        memcpy(buf, base.buf, len);
+        for (size_t n = 1 + rnd() % 4; n > 0; --n)
+            mutate(buf, &len);
+        if (len >= IFCH_PROTO_HDRLEN && rnd() % 4)
+            set_rlen(buf, (uint16_t)(len - IFCH_PROTO_HDRLEN));
+        if (ifch_msg_check(buf, len) < 0)
+            continue;
+        ++accepted;
+
+        struct ifch_msg m;
+        ifch_msg_init(&m);
+        ifch_msg_set_id(&m, ifch_msg_get_id(buf));
+        ifch_msg_set_iface(&m, ifch_msg_get_iface(buf));
+        struct ifch_tlv rec;
+        uint32_t seen = 0;
+        bool ok = true;
+        for (size_t off = 0; ifch_msg_next(buf, len, &off, &rec);) {
+            if (off > len || rec.val + rec.len > buf + len ||
+                rec.type >= IFCH_T_MAX || (seen & (1u << rec.type)) ||
+                ifch_msg_add(&m, rec.type, rec.val, rec.len) < 0) {
+                ok = false;
+                break;
+            }
+            seen |= 1u << rec.type;
+        }
+        if (!ok || m.len != len || memcmp(m.buf, buf, len)) {
+            fprintf(stderr, "fuzz round %zu: accepted message of %zu bytes "
+                    "does not round-trip\n", round, len);
+            ++failures;
+            return;
+        }
+    }
+    printf("fuzz     %7d rounds %7zu accepted\n", FUZZ_ROUNDS, accepted);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The cost of a bind message from encoding in ndhc to the last record
+// being walked in ifch, without the socket in between.
+static void bench(void)
+{
+    size_t ops = 1000000;
+    volatile size_t sink = 0;
+    struct ifch_msg m;
+    double t0 = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        encode_bind(&m, (uint16_t)i);
+        if (ifch_msg_check(m.buf, m.len) < 0) {
+            ++failures;
+            return;
+        }
+        struct ifch_tlv rec;
+        for (size_t off = 0; ifch_msg_next(m.buf, m.len, &off, &rec);)
+            sink += rec.val[0];
+    }
+    double dt = now_ns() - t0;
+    printf("round-trip %zu-byte bind: %.1f ns/op\n", m.len, dt / ops);
+    (void)sink;
+}
+
+int main(void)
+{
+    test_valid();
+    test_truncated_header();
+    test_truncated_records();
+    test_oversized_length();
+    test_bad_magic();
+    test_bad_records();
+    test_duplicate_type();
+    test_walk();
+    test_fuzz();
+    bench();
+    return expect_status();
+}
@@ -0,0 +1,394 @@
+/* options-test.c - DHCP option index against a linear walk
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Checks that every option of a set of ACKs reads the same through the
+// option index as through a walk of the raw packet, as get_dhcp_opt() did
+// before the index existed, and times the lookups that one ACK costs in
+// the state machine and ifchange_bind() both ways.
+//
+// The ACKs are built here in the option order of the replies that some
+// common servers send; they are not captures.  The last one is the worst
+// case for the index: every field overloaded and packed with options that
+// have no data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "options.h"
+#include "expect.h"
+
+#define BENCH_ITERS 200000
+#define BENCH_RUNS 3
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// The lookup of one option in the raw packet, as it was done before the
+// index: find the overload option, then walk options, file and sname.
+static int ref_overload(const uint8_t *buf, ssize_t blen, int overload)
+{
+    ssize_t i = 0;
+    while (i < blen) {
+        if (buf[i] == DCODE_PADDING) {
+            ++i;
+            continue;
+        }
+        if (buf[i] == DCODE_END)
+            break;
+        if (i >= blen - 2)
+            break;
+        if (buf[i] == DCODE_OVERLOAD && buf[i+1] == 1) {
+            overload |= buf[i+2];
+            i += 3;
+            continue;
+        }
+        i += buf[i+1] + 2;
+    }
+    return overload;
+}
+
+static void ref_get_field(const uint8_t *sbuf, ssize_t slen, uint8_t code,
+                          uint8_t *dbuf, ssize_t dlen, ssize_t *didx)
+{
+    ssize_t i = 0;
+    while (i < slen) {
+        if (sbuf[i] == DCODE_PADDING) {
+            ++i;
+            continue;
+        }
+        if (sbuf[i] == DCODE_END)
+            break;
+        if (i >= slen - 2)
+            break;
+        ssize_t soptsiz = sbuf[i+1];
+        if (sbuf[i] == code) {
+            if (dlen - *didx < soptsiz || slen - i - 2 < soptsiz)
+                return;
+            memcpy(dbuf + *didx, sbuf + i + 2, soptsiz);
+            *didx += soptsiz;
+        }
+        i += soptsiz + 2;
+    }
+}
+
+static ssize_t ref_get_opt(const struct dhcpmsg *p, uint8_t code,
+                           uint8_t *dbuf, ssize_t dlen)
+{
+    int ol = ref_overload(p->options, sizeof p->options, 0);
+    if (ol & 1)
+        ol |= ref_overload(p->file, sizeof p->file, ol);
+    else if (ol & 2)
+        ol |= ref_overload(p->sname, sizeof p->sname, ol);
+    ssize_t didx = 0;
+    ref_get_field(p->options, sizeof p->options, code, dbuf, dlen, &didx);
+    if (ol & 1)
+        ref_get_field(p->file, sizeof p->file, code, dbuf, dlen, &didx);
+    if (ol & 2)
+        ref_get_field(p->sname, sizeof p->sname, code, dbuf, dlen, &didx);
+    return didx;
+}
+
+struct field {
+    uint8_t *buf;
+    size_t len, off;
+};
+
+static void put(struct field f[static 1], uint8_t code, const void *val,
+                uint8_t len)
+{
+    if (f->off + 2 + len > f->len) {
+        fprintf(stderr, "test ACK does not fit its field\n");
+        exit(EXIT_FAILURE);
+    }
+    f->buf[f->off++] = code;
+    f->buf[f->off++] = len;
+    if (len)
+        memcpy(f->buf + f->off, val, len);
+    f->off += len;
+}
+
+static void put_u32(struct field f[static 1], uint8_t code, uint32_t v)
+{
+    v = htonl(v);
+    put(f, code, &v, 4);
+}
+
+static void put_end(struct field f[static 1])
+{
+    if (f->off < f->len)
+        f->buf[f->off++] = DCODE_END;
+}
+
+static void ack_init(struct dhcpmsg p[static 1], struct field f[static 1])
+{
+    memset(p, 0, sizeof *p);
+    p->op = 2;
+    p->htype = 1;
+    p->hlen = 6;
+    p->xid = htonl(0x1234abcd);
+    p->yiaddr = inet_addr("192.168.1.50");
+    p->cookie = htonl(DHCP_MAGIC);
+    *f = (struct field){ .buf = p->options, .len = sizeof p->options };
+    static const uint8_t ack = DHCPACK;
+    put(f, DCODE_MSGTYPE, &ack, 1);
+}
+
+static const uint8_t dns2[] = { 192, 168, 1, 1, 8, 8, 8, 8 };
+static const char domain[] = "example.internal";
+
+// Server id, lease and the basic configuration, in ISC dhcpd's order.
+static void ack_isc(struct dhcpmsg p[static 1])
+{
+    struct field f;
+    ack_init(p, &f);
+    put_u32(&f, DCODE_SERVER_ID, 0xc0a80101);
+    put_u32(&f, DCODE_LEASET, 43200);
+    put_u32(&f, DCODE_SUBNET, 0xffffff00);
+    put_u32(&f, DCODE_ROUTER, 0xc0a80101);
+    put(&f, DCODE_DNS, dns2, sizeof dns2);
+    put(&f, DCODE_DOMAIN, domain, sizeof domain - 1);
+    put_u32(&f, DCODE_BROADCAST, 0xc0a801ff);
+    put_end(&f);
+}
+
+// dnsmasq sends T1 and T2 along with the lease, and a hostname.
+static void ack_dnsmasq(struct dhcpmsg p[static 1])
+{
+    struct field f;
+    ack_init(p, &f);
+    put_u32(&f, DCODE_SERVER_ID, 0xc0a80101);
+    put_u32(&f, DCODE_LEASET, 86400);
+    put_u32(&f, DCODE_RENEWT, 43200);
+    put_u32(&f, DCODE_REBINDT, 75600);
+    put_u32(&f, DCODE_SUBNET, 0xffffff00);
+    put_u32(&f, DCODE_BROADCAST, 0xc0a801ff);
+    put(&f, DCODE_DNS, dns2, 4);
+    put(&f, DCODE_DOMAIN, domain, sizeof domain - 1);
+    put(&f, DCODE_HOSTNAME, "client-7", 8);
+    put_u32(&f, DCODE_ROUTER, 0xc0a80101);
+    put_end(&f);
+}
+
+// Windows Server: T1/T2 first, then WINS, NetBIOS node type and a vendor
+// option, padded out to the minimum BOOTP size.
+static void ack_windows(struct dhcpmsg p[static 1])
+{
+    struct field f;
+    ack_init(p, &f);
+    put_u32(&f, DCODE_RENEWT, 345600);
+    put_u32(&f, DCODE_REBINDT, 604800);
+    put_u32(&f, DCODE_LEASET, 691200);
+    put_u32(&f, DCODE_SERVER_ID, 0xc0a8010a);
+    put_u32(&f, DCODE_SUBNET, 0xffffff00);
+    put(&f, 81, "\x03\xff\xff", 3);     // Client FQDN
+    put_u32(&f, DCODE_ROUTER, 0xc0a80101);
+    put(&f, DCODE_DNS, dns2, sizeof dns2);
+    put(&f, DCODE_DOMAIN, domain, sizeof domain - 1);
+    put_u32(&f, DCODE_WINS, 0xc0a8010a);
+    put(&f, 46, "\x08", 1);              // NetBIOS node type
+    put(&f, 43, "\x01\x04\x00\x00\x00\x00\xff", 7);
+    put_end(&f);
+}
+
+// A long DNS list split into two instances (RFC3396), plus MTU and NTP.
+static void ack_split(struct dhcpmsg p[static 1])
+{
+    struct field f;
+    ack_init(p, &f);
+    put_u32(&f, DCODE_SERVER_ID, 0x0a000001);
+    put_u32(&f, DCODE_LEASET, 3600);
+    put_u32(&f, DCODE_SUBNET, 0xff000000);
+    put_u32(&f, DCODE_ROUTER, 0x0a000001);
+    put(&f, DCODE_DNS, dns2, sizeof dns2);
+    put(&f, DCODE_DNS, dns2, sizeof dns2);
+    put(&f, DCODE_MTU, "\x05\xdc", 2);
+    put(&f, DCODE_NTPSVR, dns2, 4);
+    put(&f, DCODE_RAPIDCOMMIT, NULL, 0);
+    put_end(&f);
+}
+
+// The hostname overloaded into file and WINS into sname (option 52).
+static void ack_overload(struct dhcpmsg p[static 1])
+{
+    struct field f;
+    ack_init(p, &f);
+    put(&f, DCODE_OVERLOAD, "\x03", 1);
+    put_u32(&f, DCODE_SERVER_ID, 0xc0a80101);
+    put_u32(&f, DCODE_LEASET, 43200);
+    put_u32(&f, DCODE_SUBNET, 0xffffff00);
+    put_u32(&f, DCODE_ROUTER, 0xc0a80101);
+    put(&f, DCODE_DNS, dns2, sizeof dns2);
+    put(&f, DCODE_DOMAIN, domain, sizeof domain - 1);
+    put_end(&f);
+    struct field file = { .buf = p->file, .len = sizeof p->file };
+    put(&file, DCODE_HOSTNAME, "overloaded-host-name", 20);
+    put_end(&file);
+    struct field sname = { .buf = p->sname, .len = sizeof p->sname };
+    put_u32(&sname, DCODE_WINS, 0xc0a8010a);
+    put_end(&sname);
+}
+
+// Every field overloaded and filled with options that have no data, each
+// with a distinct code.  This is as many options as a packet can carry.
+static size_t ack_packed(struct dhcpmsg p[static 1])
+{
+    memset(p, 0, sizeof *p);
+    p->cookie = htonl(DHCP_MAGIC);
+    struct field f[3] = {
+        { .buf = p->options, .len = sizeof p->options - 1 },
+        { .buf = p->file, .len = sizeof p->file - 1 },
+        { .buf = p->sname, .len = sizeof p->sname - 1 },
+    };
+    put(&f[0], DCODE_OVERLOAD, "\x03", 1);
+    size_t n = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < 3; ++i) {
+        while (f[i].off + 2 <= f[i].len) {
+            if (code == DCODE_OVERLOAD)
+                ++code;
+            put(&f[i], code++, NULL, 0);
+            ++n;
+        }
+        f[i].len++;
+        put_end(&f[i]);
+    }
+    return n;
+}
+
+static const uint8_t bind_codes[] = {
+    DCODE_SUBNET, DCODE_BROADCAST, DCODE_ROUTER, DCODE_DNS, DCODE_WINS,
+    DCODE_HOSTNAME, DCODE_DOMAIN, DCODE_MTU,
+};
+static const uint8_t state_codes[] = {
+    DCODE_MSGTYPE, DCODE_SERVER_ID, DCODE_LEASET, DCODE_RENEWT,
+    DCODE_REBINDT, DCODE_RAPIDCOMMIT,
+};
+
+static void check_ack(const char *name, const struct dhcpmsg p[static 1])
+{
+    static struct dhcp_optidx oi;
+    dhcp_optidx_build(&oi, p, sizeof *p);
+    for (unsigned c = 1; c < DCODE_END; ++c) {
+        uint8_t a[MAX_DOPT_SIZE], b[MAX_DOPT_SIZE];
+        ssize_t al = get_dhcp_opt(&oi, (uint8_t)c, a, sizeof a);
+        ssize_t bl = ref_get_opt(p, (uint8_t)c, b, sizeof b);
+        if (al != bl || memcmp(a, b, (size_t)al)) {
+            fprintf(stderr, "%s: option %u differs\n", name, c);
+            ++failures;
+        }
+    }
+    EXPECT(oi.end == get_end_option_idx(p));
+}
+
+static volatile ssize_t sink;
+
+// The lookups of one ACK: the state machine's against the new packet, and
+// each bind code against the new packet and the current configuration.
+// Before, each was a walk; now the new packet is indexed once, and the
+// configuration keeps an index that was built when it was applied.
+static void bench_ack(const char *name, const struct dhcpmsg p[static 1])
+{
+    static struct dhcp_optidx oi, cfg;
+    uint8_t buf[MAX_DOPT_SIZE];
+    dhcp_optidx_build(&cfg, p, sizeof *p);
+    long long best_ref = 0, best_idx = 0;
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        long long t0 = now_ns();
+        for (size_t i = 0; i < BENCH_ITERS; ++i) {
+            ssize_t s = 0;
+            for (size_t k = 0; k < sizeof state_codes; ++k)
+                s += ref_get_opt(p, state_codes[k], buf, sizeof buf);
+            for (size_t k = 0; k < sizeof bind_codes; ++k) {
+                s += ref_get_opt(p, bind_codes[k], buf, sizeof buf);
+                s += ref_get_opt(p, bind_codes[k], buf, sizeof buf);
+            }
+            sink = s;
+        }
+        long long t1 = now_ns();
+        for (size_t i = 0; i < BENCH_ITERS; ++i) {
+            ssize_t s = 0;
+            dhcp_optidx_build(&oi, p, sizeof *p);
+            for (size_t k = 0; k < sizeof state_codes; ++k)
+                s += get_dhcp_opt(&oi, state_codes[k], buf, sizeof buf);
+            for (size_t k = 0; k < sizeof bind_codes; ++k) {
+                s += get_dhcp_opt(&oi, bind_codes[k], buf, sizeof buf);
+                s += get_dhcp_opt(&cfg, bind_codes[k], buf, sizeof buf);
+            }
+            sink = s;
+        }
+        long long t2 = now_ns();
+        if (!run || t1 - t0 < best_ref)
+            best_ref = t1 - t0;
+        if (!run || t2 - t1 < best_idx)
+            best_idx = t2 - t1;
+    }
+    printf("  %-9s %3u options  walk %7.1f ns  index %6.1f ns\n", name,
+           oi.nspans, (double)best_ref / BENCH_ITERS,
+           (double)best_idx / BENCH_ITERS);
+}
+
+int main(void)
+{
+    static struct dhcpmsg acks[6];
+    static const char *names[6] = {
+        "isc", "dnsmasq", "windows", "split", "overload", "packed",
+    };
+    ack_isc(&acks[0]);
+    ack_dnsmasq(&acks[1]);
+    ack_windows(&acks[2]);
+    ack_split(&acks[3]);
+    ack_overload(&acks[4]);
+    size_t packed = ack_packed(&acks[5]);
+
+    for (size_t i = 0; i < 6; ++i)
+        check_ack(names[i], &acks[i]);
+
+    // None of the options of the packed ACK may be dropped.
+    static struct dhcp_optidx oi;
+    dhcp_optidx_build(&oi, &acks[5], sizeof acks[5]);
+    EXPECT(oi.nspans == packed);
+    // A short read must not index options beyond it.
+    size_t cut = offsetof(struct dhcpmsg, options) + 20;
+    dhcp_optidx_build(&oi, &acks[0], cut);
+    for (uint8_t s = 0; s < oi.nspans; ++s)
+        EXPECT(oi.span[s].off + oi.span[s].len <= cut);
+
+    printf("lookups per ACK (%zu state + 2 x %zu bind), best of %d x %d:\n",
+           sizeof state_codes, sizeof bind_codes, BENCH_RUNS, BENCH_ITERS);
+    for (size_t i = 0; i < 6; ++i)
+        bench_ack(names[i], &acks[i]);
+    return expect_status();
+}
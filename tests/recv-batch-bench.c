@@ -0,0 +1,186 @@
+/* recv-batch-bench.c - receive throughput with and without batching
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures how many packets/sec one CPU can take off a socket when it
+// does nothing else, in the two ways that ndhc's event loop has read its
+// DHCP socket:
+//
+//   single: one epoll_wait() for one event, then one recv(), per packet.
+//   batch:  one epoll_wait() for up to NDHC_EPOLL_EVENTS events, then
+//           recvmmsg() of up to DHCP_RECV_BATCH packets until the socket
+//           is empty.
+//
+// Each round queues a burst of DHCP-sized datagrams on a loopback UDP
+// socket without timing it, then times how long it takes to drain them.
+// The sender thus never competes with the receiver for the CPU.  ndhc
+// reads raw sockets, but the per-syscall costs being compared are the
+// same.  It fails only if packets go missing, not on any timing.
+//
+// This is a benchmark of the syscall patterns rather than a test of
+// ndhc's code, so it is only built by "make bench" and ctest doesn't run
+// it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dhcp.h"
+#include "expect.h"
+
+#define NDHC_EPOLL_EVENTS 8     // As in ndhc.c.
+#define BURST 512
+#define ROUNDS 200
+#define PAYLOAD 300
+
+struct counts {
+    long long ns;
+    unsigned long packets, syscalls;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct dhcpmsg rbuf[DHCP_RECV_BATCH];
+
+static void drain_single(int ep, int fd, struct counts c[static 1])
+{
+    struct epoll_event ev[1];
+    for (;;) {
+        int n = epoll_wait(ep, ev, 1, 0);
+        c->syscalls++;
+        if (n <= 0)
+            return;
+        ssize_t r = recv(fd, &rbuf[0], sizeof rbuf[0], MSG_DONTWAIT);
+        c->syscalls++;
+        if (r < 0)
+            return;
+        c->packets++;
+    }
+}
+
+static void drain_batch(int ep, int fd, struct counts c[static 1])
+{
+    struct epoll_event ev[NDHC_EPOLL_EVENTS];
+    struct iovec iov[DHCP_RECV_BATCH];
+    struct mmsghdr msgs[DHCP_RECV_BATCH];
+    for (;;) {
+        int n = epoll_wait(ep, ev, NDHC_EPOLL_EVENTS, 0);
+        c->syscalls++;
+        if (n <= 0)
+            return;
+        memset(msgs, 0, sizeof msgs);
+        for (size_t i = 0; i < DHCP_RECV_BATCH; ++i) {
+            iov[i].iov_base = &rbuf[i];
+            iov[i].iov_len = sizeof rbuf[i];
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int r = recvmmsg(fd, msgs, DHCP_RECV_BATCH, MSG_DONTWAIT, NULL);
+        c->syscalls++;
+        if (r <= 0)
+            return;
+        c->packets += (unsigned long)r;
+    }
+}
+
+static int make_pair(int s[static 2])
+{
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t sl = sizeof sa;
+    int sz = 8 * 1024 * 1024;
+    s[0] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    s[1] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s[0] < 0 || s[1] < 0)
+        return -1;
+    // Not fatal: without the space, a burst is simply cut short and
+    // counted as lost below.
+    setsockopt(s[0], SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof sz);
+    setsockopt(s[0], SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+    if (bind(s[0], (struct sockaddr *)&sa, sizeof sa) < 0 ||
+        getsockname(s[0], (struct sockaddr *)&sa, &sl) < 0 ||
+        connect(s[1], (struct sockaddr *)&sa, sizeof sa) < 0)
+        return -1;
+    return 0;
+}
+
+static void run(const char *name, int ep, int s[static 2],
+                void (*drain)(int, int, struct counts *))
+{
+    static char pkt[PAYLOAD];
+    struct counts c = { 0 };
+    unsigned long sent = 0;
+    for (size_t round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < BURST; ++i) {
+            if (send(s[1], pkt, sizeof pkt, 0) == sizeof pkt)
+                ++sent;
+        }
+        long long t0 = now_ns();
+        drain(ep, s[0], &c);
+        c.ns += now_ns() - t0;
+    }
+    printf("  %-6s %9.0f pps  %5.2f syscalls/packet\n", name,
+           c.packets * 1e9 / c.ns, (double)c.syscalls / c.packets);
+    EXPECT(c.packets == sent);
+}
+
+int main(void)
+{
+    int s[2];
+    int ep = epoll_create1(0);
+    if (ep < 0 || make_pair(s) < 0) {
+        fprintf(stderr, "cannot create sockets: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = s[0] };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, s[0], &ev) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    printf("drain %d bursts of %d x %d-byte datagrams, batch %d:\n",
+           ROUNDS, BURST, PAYLOAD, DHCP_RECV_BATCH);
+    run("single", ep, s, drain_single);
+    run("batch", ep, s, drain_batch);
+    close(s[0]);
+    close(s[1]);
+    close(ep);
+    return expect_status();
+}
@@ -0,0 +1,145 @@
+/* renew-jitter-test.c - lease T1/T2 choice and the spread of renewals
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Checks lease_renew_times() against hostile and missing server times,
+// then simulates CLIENTS clients that all got the same lease at the same
+// moment, as after a power failure, and prints how their renewals spread
+// out for several --renew-jitter values.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lease-time.h"
+#include "expect.h"
+
+#define CLIENTS 10000
+#define LEASE 3600
+
+static uint32_t rnd_state = 2463534242u;
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static void test_sanitize(void)
+{
+    struct lease_times lt;
+
+    // Sane server times are kept.
+    lt = lease_renew_times(3600, 1000, 3000, 0, 0);
+    EXPECT(lt.t1 == 1000 && lt.t2 == 3000);
+    // Missing ones fall back to 1/2 and 7/8 of the lease.
+    lt = lease_renew_times(3600, 0, 0, 0, 0);
+    EXPECT(lt.t1 == 1800 && lt.t2 == 3150);
+    // Less than 1/8 of the lease, or not below the lease, is refused.
+    lt = lease_renew_times(3600, 1, 2, 0, 0);
+    EXPECT(lt.t1 == 1800 && lt.t2 == 3150);
+    lt = lease_renew_times(3600, 1800, 3600, 0, 0);
+    EXPECT(lt.t1 == 1800 && lt.t2 == 3150);
+    // T1 must be below T2.
+    lt = lease_renew_times(3600, 3000, 2000, 0, 0);
+    EXPECT(lt.t1 == 1800 && lt.t2 == 2000);
+    lt = lease_renew_times(3600, 1000, 500, 0, 0);
+    EXPECT(lt.t1 == 250 && lt.t2 == 500);
+    // A T2 near the floor forces T1 below half the lease.
+    lt = lease_renew_times(3600, 0, 460, 0, 0);
+    EXPECT(lt.t1 == 230 && lt.t2 == 460);
+    // The shortest lease that ndhc accepts.
+    lt = lease_renew_times(60, 0, 0, 0, 0);
+    EXPECT(lt.t1 == 30 && lt.t2 == 49);
+}
+
+static void test_jitter_bounds(void)
+{
+    // The extremes of rnd reach exactly +/- jitter%.
+    struct lease_times lt = lease_renew_times(3600, 0, 0, 10, 0);
+    EXPECT(lt.t1 == 1620);
+    lt = lease_renew_times(3600, 0, 0, 10, 360);
+    EXPECT(lt.t1 == 1980);
+    lt = lease_renew_times(3600, 0, 0, 10, 361);
+    EXPECT(lt.t1 == 1620);
+    // Jitter never pushes T1 up to T2 or down to zero.
+    lt = lease_renew_times(3600, 1000, 1100, 100, 2000);
+    EXPECT(lt.t1 == 1099 && lt.t2 == 1100);
+    lt = lease_renew_times(3600, 1000, 3000, 100, 0);
+    EXPECT(lt.t1 == 1);
+    // Too short a T1 for even one second of jitter is left alone.
+    lt = lease_renew_times(60, 0, 0, 1, 12345);
+    EXPECT(lt.t1 == 30);
+    for (size_t i = 0; i < 100000; ++i) {
+        uint32_t lease = 60 + rnd() % 1000000;
+        int jitter = (int)(rnd() % 101);
+        lt = lease_renew_times(lease, rnd() % lease, rnd() % lease,
+                               jitter, rnd());
+        EXPECT(lt.t1 >= 1 && lt.t1 < lt.t2 && lt.t2 < lease);
+    }
+}
+
+static void simulate(int jitter)
+{
+    static uint32_t per_sec[LEASE];
+    memset(per_sec, 0, sizeof per_sec);
+    uint32_t lo = UINT32_MAX, hi = 0;
+    for (size_t i = 0; i < CLIENTS; ++i) {
+        struct lease_times lt = lease_renew_times(LEASE, 0, 0, jitter, rnd());
+        EXPECT(lt.t1 < lt.t2 && lt.t2 == 3150);
+        per_sec[lt.t1]++;
+        if (lt.t1 < lo) lo = lt.t1;
+        if (lt.t1 > hi) hi = lt.t1;
+    }
+    uint32_t peak1 = 0, peak10 = 0, win = 0;
+    for (size_t s = 0; s < LEASE; ++s) {
+        if (per_sec[s] > peak1)
+            peak1 = per_sec[s];
+        win += per_sec[s];
+        if (s >= 10)
+            win -= per_sec[s - 10];
+        if (win > peak10)
+            peak10 = win;
+    }
+    uint32_t j = 1800 * (uint32_t)jitter / 100;
+    EXPECT(lo >= 1800 - j && hi <= 1800 + j);
+    printf("  %3d%%  [%4u, %4u]  %6u  %6u\n", jitter, lo, hi, peak1, peak10);
+}
+
+int main(void)
+{
+    test_sanitize();
+    test_jitter_bounds();
+    printf("%d clients, %ds lease at the same moment (T1 1800s):\n",
+           CLIENTS, LEASE);
+    printf("  jitter  T1 range    peak/s  peak/10s\n");
+    static const int jitters[] = { 0, 5, 10, 25, 50 };
+    for (size_t i = 0; i < sizeof jitters / sizeof jitters[0]; ++i)
+        simulate(jitters[i]);
+    return expect_status();
+}
@@ -0,0 +1,232 @@
+/* rexmit-test.c - retransmission schedules under loss
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Checks the arithmetic of the retransmission waits, then plays out the
+// schedule of retransmissions that a client follows when requests to a
+// server on the local segment are lost, both with the RFC 2131 ladder and
+// with --adaptive-retransmit once the server's RTT has been estimated.
+// Without an estimate, --adaptive-retransmit uses the ladder.  All random
+// numbers come from a fixed seed, so the schedules printed are the same
+// on every run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rexmit.h"
+#include "expect.h"
+
+#define MAX_SENDS 8
+
+static uint32_t rnd_state = 2463534242u;
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static void test_estimator(void)
+{
+    long long srtt, rttvar;
+    rexmit_rtt_sample(&srtt, &rttvar, true, 1000);
+    EXPECT(srtt == 1000 && rttvar == 500);
+    // RTO = SRTT + max(G, 4 * RTTVAR), in whole ms.
+    EXPECT(rexmit_rto_ms(srtt, rttvar) == 3);
+    rexmit_rtt_sample(&srtt, &rttvar, false, 1800);
+    EXPECT(srtt == 1100 && rttvar == 575);
+    // The granularity term takes over once the variation is small.
+    for (size_t i = 0; i < 100; ++i)
+        rexmit_rtt_sample(&srtt, &rttvar, false, 1000);
+    EXPECT(rttvar < 250);
+    EXPECT(rexmit_rto_ms(srtt, rttvar) == (srtt + 1000 + 999) / 1000);
+    EXPECT(rexmit_rto_ms(1000, 100) == 2);
+    EXPECT(rexmit_rto_ms(0, 0) == 1);
+}
+
+static void test_waits(void)
+{
+    static const int ladder[] = { 4000, 8000, 16000, 32000, 64000, 64000 };
+    for (size_t n = 0; n < sizeof ladder / sizeof ladder[0]; ++n) {
+        EXPECT(rexmit_ladder_ms(n, 0) == ladder[n]);
+        for (size_t i = 0; i < 1000; ++i) {
+            int w = rexmit_ladder_ms(n, rnd());
+            EXPECT(w >= ladder[n] && w < ladder[n] + 1000);
+        }
+    }
+    for (size_t i = 0; i < 1000; ++i) {
+        long long w = rexmit_renew_ms(rnd());
+        EXPECT(w >= 50000 && w < 70000);
+    }
+    // Twice the RTO with a 200 ms floor, doubling per packet, capped, plus
+    // up to a quarter of jitter, or minus it where plus would pass the cap.
+    EXPECT(rexmit_adaptive_ms(3, 0, 4000, 0) == 200);
+    EXPECT(rexmit_adaptive_ms(3, 2, 16000, 0) == 800);
+    EXPECT(rexmit_adaptive_ms(300, 0, 4000, 0) == 600);
+    EXPECT(rexmit_adaptive_ms(300, 3, 32000, 0) == 4800);
+    EXPECT(rexmit_adaptive_ms(3000, 2, 16000, 0) == 16000);
+    EXPECT(rexmit_adaptive_ms(3, 40, 60000, 0) == 60000);
+    for (size_t i = 0; i < 100000; ++i) {
+        long long rto = 1 + rnd() % 20000, cap = 1000 + rnd() % 64000;
+        size_t n = rnd() % 8;
+        long long w = rexmit_adaptive_ms(rto, n, cap, rnd());
+        long long base = rexmit_adaptive_ms(rto, n, cap, 0);
+        EXPECT(base >= 200 || base == cap);
+        EXPECT(base <= cap || cap < 200);
+        EXPECT(w <= cap);
+        if (base + base / 4 <= cap)
+            EXPECT(w >= base && w <= base + base / 4);
+        else
+            EXPECT(w >= base - base / 4 && w <= cap);
+    }
+}
+
+// How the requests of one exchange fared: sent[i] is the offset of send i
+// in ms and lost[i] whether it was lost.  done is when the answer came,
+// or -1 if the client gave up first.  A renewal that runs into T2 has the
+// time of the switch to rebinding in sent[n].
+struct sched {
+    long long sent[MAX_SENDS + 1];
+    bool lost[MAX_SENDS];
+    int n;
+    long long done;
+};
+
+enum mode { LADDER, ADAPTIVE };
+
+// Sends until a request gets through or limit is reached.  Renewals are
+// retransmitted with the renew wait, and never after rebind_ms.
+static struct sched play(enum mode m, long long rto_ms, bool renew,
+                         long long rebind_ms, const bool *lose, int limit,
+                         long long rtt_ms)
+{
+    struct sched s = { .done = -1 };
+    long long t = 0;
+    for (s.n = 0; s.n < limit; ++s.n) {
+        s.sent[s.n] = t;
+        s.lost[s.n] = lose[s.n];
+        if (!s.lost[s.n]) {
+            s.done = t + rtt_ms;
+            ++s.n;
+            break;
+        }
+        long long w;
+        if (renew) {
+            w = m == ADAPTIVE
+                ? rexmit_adaptive_ms(rto_ms, (size_t)s.n, 60000, rnd())
+                : rexmit_renew_ms(rnd());
+        } else {
+            w = m == ADAPTIVE
+                ? rexmit_adaptive_ms(rto_ms, (size_t)s.n,
+                                     rexmit_ladder_ms((size_t)s.n, 0), rnd())
+                : rexmit_ladder_ms((size_t)s.n, rnd());
+        }
+        if (rebind_ms >= 0 && t + w >= rebind_ms) {
+            s.sent[++s.n] = rebind_ms;
+            break;
+        }
+        t += w;
+    }
+    return s;
+}
+
+static void print_sched(const char *label, const struct sched s[static 1],
+                        bool rebound)
+{
+    printf("    %-9s", label);
+    for (int i = 0; i < s->n; ++i)
+        printf(" +%.3f%s", s->sent[i] / 1000.0, s->lost[i] ? " x" : "");
+    if (rebound)
+        printf(" +%.3f rebinding", s->sent[s->n] / 1000.0);
+    else if (s->done >= 0)
+        printf("  (answer at +%.3f)", s->done / 1000.0);
+    printf("\n");
+}
+
+// Plays one loss pattern both ways.  The adaptive schedule must never get
+// its answer later than the ladder when the RTT is this small.
+static void scenario(const char *name, long long rto_ms, const bool *lose,
+                     int limit)
+{
+    printf("  %s\n", name);
+    struct sched l = play(LADDER, rto_ms, false, -1, lose, limit, 1);
+    struct sched a = play(ADAPTIVE, rto_ms, false, -1, lose, limit, 1);
+    print_sched("ladder", &l, false);
+    print_sched("adaptive", &a, false);
+    EXPECT(l.n == a.n && l.done >= 0 && a.done >= 0);
+    EXPECT(a.done <= l.done);
+}
+
+int main(void)
+{
+    test_estimator();
+    test_waits();
+
+    // Twenty answers from a server on the same segment, RTT 0.6-1.4 ms.
+    long long srtt = 0, rttvar = 0;
+    for (size_t i = 0; i < 20; ++i)
+        rexmit_rtt_sample(&srtt, &rttvar, i == 0, 600 + rnd() % 800);
+    long long rto = rexmit_rto_ms(srtt, rttvar);
+    EXPECT(rto >= 1 && rto <= 5);
+    printf("retransmission schedules, s from the first send, x = lost, "
+           "RTO %lld ms:\n", rto);
+
+    static const bool none[MAX_SENDS];
+    static const bool two[MAX_SENDS] = { true, true };
+    static const bool three[MAX_SENDS] = { true, true, true };
+    scenario("no loss", rto, none, 5);
+    scenario("first 2 DISCOVERs lost", rto, two, 5);
+    scenario("first 3 selecting REQUESTs lost", rto, three, 5);
+
+    for (int seed = 0; seed < 3; ++seed) {
+        bool lose[MAX_SENDS];
+        for (size_t i = 0; i < MAX_SENDS; ++i)
+            lose[i] = rnd() % 100 < 30;
+        lose[MAX_SENDS - 1] = false;
+        char name[64];
+        snprintf(name, sizeof name, "30%% random loss, pattern %d", seed);
+        scenario(name, rto, lose, MAX_SENDS);
+    }
+
+    // A 60s lease: T1 30s, T2 52s.  The renew waits start at T1.
+    printf("  renew of a 60s lease, first 3 renew REQUESTs lost\n");
+    struct sched l = play(LADDER, rto, true, 22000, three, MAX_SENDS, 1);
+    struct sched a = play(ADAPTIVE, rto, true, 22000, three, MAX_SENDS, 1);
+    for (int i = 0; i <= l.n; ++i)
+        l.sent[i] += 30000;
+    for (int i = 0; i < a.n; ++i)
+        a.sent[i] += 30000;
+    a.done += 30000;
+    print_sched("ladder", &l, true);
+    print_sched("adaptive", &a, false);
+    EXPECT(l.done < 0 && a.done >= 0 && a.done < 52000);
+
+    return expect_status();
+}
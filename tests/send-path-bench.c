@@ -0,0 +1,267 @@
+/* send-path-bench.c - cost of a unicast send with and without a cached socket
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replays the syscalls of the unicast send path over loopback, as sockd and
+// send_dhcp_unicast() issue them, in two ways:
+//
+//   fresh:  every send asks a sockd-like child for a new socket, which
+//           creates and binds it and passes it back with SCM_RIGHTS; the
+//           sender then connects, writes and closes it.  This is what ndhc
+//           did before the unicast socket was cached.
+//   cached: every send is a write to one connected socket.
+//
+// Prints packets/sec and the per-send latency distribution of each.  It
+// fails only if a send path stops working, not on any timing.
+//
+// The syscalls are replayed from copies of that code, so this benchmarks
+// the two patterns rather than testing ndhc.  It is only built by "make
+// bench" and ctest doesn't run it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "expect.h"
+
+#define SENDS 20000
+#define PAYLOAD 300     // A REQUEST with the usual options is about this.
+
+static long long lat[SENDS];
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// create_udp_socket() in sockd.c, less the error logging.  SO_BINDTODEVICE
+// needs CAP_NET_RAW; without it that syscall still happens and fails.
+static int sockd_udp_socket(void)
+{
+    static const struct sock_filter drop = BPF_STMT(BPF_RET + BPF_K, 0);
+    static const struct sock_fprog sfp_drop = {
+        .len = 1, .filter = (struct sock_filter *)&drop,
+    };
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+    if (fd < 0)
+        return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+    setsockopt(fd, SOL_SOCKET, SO_DONTROUTE, &opt, sizeof opt);
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof ifr);
+    snprintf(ifr.ifr_name, sizeof ifr.ifr_name, "lo");
+    setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof ifr);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &sfp_drop, sizeof sfp_drop);
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// The sockd side: one request byte in, one socket out, as xfer_fd() does.
+static void sockd_loop(int sk)
+{
+    char c;
+    while (read(sk, &c, 1) == 1) {
+        int fd = sockd_udp_socket();
+        char control[CMSG_SPACE(sizeof fd)];
+        struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof control,
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+        if (fd < 0)
+            msg.msg_controllen = 0;
+        if (sendmsg(sk, &msg, 0) < 0)
+            _exit(EXIT_FAILURE);
+        if (fd >= 0)
+            close(fd);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+// request_sockd_fd() in sockd.c, less the tracing.
+static int request_fd(int sk)
+{
+    char c = 'u';
+    if (write(sk, &c, 1) != 1)
+        return -1;
+    char data[64], control[64];
+    struct iovec iov = { .iov_base = data, .iov_len = sizeof data };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control,
+    };
+    if (recvmsg(sk, &msg, 0) <= 0)
+        return -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, long long total_ns)
+{
+    qsort(lat, SENDS, sizeof lat[0], cmp_ll);
+    printf("  %-7s %9.0f pps  mean %6.2f us  p50 %6.2f us  p99 %7.2f us\n",
+           name, SENDS * 1e9 / total_ns, total_ns / 1e3 / SENDS,
+           lat[SENDS / 2] / 1e3, lat[SENDS * 99 / 100] / 1e3);
+}
+
+// The sink is never read.  Once its queue is full, loopback drops the
+// datagrams, which costs the sender no more than delivering them.
+static int make_sink(struct sockaddr_in sa[static 1])
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0)
+        return -1;
+    *sa = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t sl = sizeof *sa;
+    if (bind(fd, (struct sockaddr *)sa, sizeof *sa) < 0 ||
+        getsockname(fd, (struct sockaddr *)sa, &sl) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void bench_fresh(int sk, const struct sockaddr_in sa[static 1],
+                        const char pkt[static PAYLOAD])
+{
+    int sent = 0;
+    long long t0 = now_ns();
+    for (size_t i = 0; i < SENDS; ++i) {
+        long long s = now_ns();
+        int fd = request_fd(sk);
+        if (fd >= 0) {
+            if (connect(fd, (const struct sockaddr *)sa, sizeof *sa) == 0 &&
+                write(fd, pkt, PAYLOAD) == PAYLOAD)
+                ++sent;
+            close(fd);
+        }
+        lat[i] = now_ns() - s;
+    }
+    report("fresh", now_ns() - t0);
+    EXPECT(sent == SENDS);
+}
+
+static void bench_cached(const struct sockaddr_in sa[static 1],
+                         const char pkt[static PAYLOAD])
+{
+    int sent = 0;
+    int fd = sockd_udp_socket();
+    EXPECT(fd >= 0);
+    if (fd < 0)
+        return;
+    EXPECT(connect(fd, (const struct sockaddr *)sa, sizeof *sa) == 0);
+    long long t0 = now_ns();
+    for (size_t i = 0; i < SENDS; ++i) {
+        long long s = now_ns();
+        if (write(fd, pkt, PAYLOAD) == PAYLOAD)
+            ++sent;
+        lat[i] = now_ns() - s;
+    }
+    report("cached", now_ns() - t0);
+    close(fd);
+    EXPECT(sent == SENDS);
+}
+
+int main(void)
+{
+    int sk[2];
+    struct sockaddr_in sa;
+    char pkt[PAYLOAD];
+    memset(pkt, 0xa5, sizeof pkt);
+    int sink = make_sink(&sa);
+    if (sink < 0 || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sk) < 0) {
+        fprintf(stderr, "cannot create sockets: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        close(sk[0]);
+        sockd_loop(sk[1]);
+    }
+    close(sk[1]);
+
+    printf("unicast send path, %d sends of %d bytes:\n", SENDS, PAYLOAD);
+    bench_fresh(sk[0], &sa, pkt);
+    bench_cached(&sa, pkt);
+
+    close(sk[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    EXPECT(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    close(sink);
+    return expect_status();
+}
@@ -0,0 +1,194 @@
+/* timer-test.c - timer heap ordering test and benchmark
+ *
+ * Copyright (c) 2015 Nicholas J. Kain <njkain at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "timer.h"
+
+// Arms NTIMERS timers at distinct deadlines in random order, moves half of
+// them, and then expires them all, checking that ntimer_next_ts() always
+// yields the earliest remaining deadline.  Then it arms them all again and
+// pops the expired half with ntimer_pop_expired(), which must return them
+// in deadline order and leave the other half in the heap.  The time taken
+// by each phase is printed so that the cost per operation can be compared
+// across changes.
+#define NTIMERS 100000
+
+static struct ntimer timers[NTIMERS];
+static size_t by_ts[2 * NTIMERS];  // Deadline -> index into timers.
+static size_t perm[NTIMERS];
+
+static uint32_t rnd_state = 2463534242u;
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static void shuffle(size_t a[static 1], size_t n)
+{
+    for (size_t i = n - 1; i > 0; --i) {
+        size_t j = rnd() % (i + 1);
+        size_t t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char name[static 1], double t0, size_t ops)
+{
+    double dt = now_ns() - t0;
+    printf("%-8s %7zu ops %9.3f ms %7.1f ns/op\n", name, ops, dt / 1e6,
+           dt / ops);
+}
+
+int main(void)
+{
+    for (size_t i = 0; i < NTIMERS; ++i) {
+        timers[i] = (struct ntimer)NTIMER_INIT;
+        perm[i] = i;
+    }
+
+    // Even deadlines to start with; moved timers take the odd ones.
+    shuffle(perm, NTIMERS);
+    double t0 = now_ns();
+    for (size_t i = 0; i < NTIMERS; ++i)
+        ntimer_arm(&timers[perm[i]], 2 * (long long)i);
+    report("arm", t0, NTIMERS);
+    for (size_t i = 0; i < NTIMERS; ++i)
+        by_ts[timers[i].ts] = i;
+
+    shuffle(perm, NTIMERS);
+    t0 = now_ns();
+    for (size_t i = 0; i < NTIMERS / 2; ++i) {
+        struct ntimer *t = &timers[perm[i]];
+        ntimer_arm(t, 2 * (long long)(rnd() % NTIMERS) + 1);
+    }
+    report("rearm", t0, NTIMERS / 2);
+    // Moved timers can land on the same odd deadline; only the last one to
+    // land there is findable by deadline, so the others are disarmed here.
+    for (size_t i = 0; i < NTIMERS / 2; ++i) {
+        struct ntimer *t = &timers[perm[i]];
+        by_ts[t->ts] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < NTIMERS / 2; ++i) {
+        struct ntimer *t = &timers[perm[i]];
+        if (by_ts[t->ts] == SIZE_MAX)
+            by_ts[t->ts] = (size_t)(t - timers);
+        else
+            ntimer_disarm(t);
+    }
+    for (size_t i = NTIMERS / 2; i < NTIMERS; ++i)
+        by_ts[timers[perm[i]].ts] = perm[i];
+
+    size_t expired = 0;
+    long long last = -1;
+    t0 = now_ns();
+    for (long long ts; (ts = ntimer_next_ts()) >= 0; ++expired) {
+        if (ts < last) {
+            fprintf(stderr, "deadline %lld came after %lld\n", ts, last);
+            return EXIT_FAILURE;
+        }
+        struct ntimer *t = &timers[by_ts[ts]];
+        if (t->ts != ts || t->hidx != 0) {
+            fprintf(stderr, "deadline %lld is not at the heap root\n", ts);
+            return EXIT_FAILURE;
+        }
+        ntimer_disarm(t);
+        last = ts;
+    }
+    report("expire", t0, expired);
+
+    for (size_t i = 0; i < NTIMERS; ++i) {
+        if (timers[i].ts >= 0) {
+            fprintf(stderr, "timer %zu is still armed\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    shuffle(perm, NTIMERS);
+    for (size_t i = 0; i < NTIMERS; ++i) {
+        timers[perm[i]].owner = (uint32_t)perm[i];
+        ntimer_arm(&timers[perm[i]], (long long)i);
+    }
+    size_t popped = 0;
+    t0 = now_ns();
+    for (struct ntimer *t; (t = ntimer_pop_expired(NTIMERS / 2 - 1));
+         ++popped) {
+        // Popped timers keep their deadlines.
+        if (t->ts != (long long)popped || t != &timers[t->owner]) {
+            fprintf(stderr, "popped deadline %lld, wanted %zu\n", t->ts,
+                    popped);
+            return EXIT_FAILURE;
+        }
+    }
+    report("pop", t0, popped);
+    if (popped != NTIMERS / 2 || ntimer_next_ts() != NTIMERS / 2) {
+        fprintf(stderr, "popped %zu timers, next deadline %lld\n", popped,
+                ntimer_next_ts());
+        return EXIT_FAILURE;
+    }
+    // Popped timers can be armed again or disarmed; the disarmed ones
+    // must not come back.
+    size_t left = NTIMERS / 2;
+    for (size_t i = 0; i < NTIMERS; ++i) {
+        if (timers[perm[i]].ts >= NTIMERS / 2)
+            continue;
+        if (i % 2) {
+            ntimer_disarm(&timers[perm[i]]);
+        } else {
+            ntimer_arm(&timers[perm[i]], NTIMERS + (long long)i);
+            ++left;
+        }
+    }
+    last = -1;
+    for (struct ntimer *t; (t = ntimer_pop_expired(2 * NTIMERS)); --left) {
+        if (t->ts < last || (t->ts >= NTIMERS && (t->ts - NTIMERS) % 2)) {
+            fprintf(stderr, "popped deadline %lld after %lld\n", t->ts,
+                    last);
+            return EXIT_FAILURE;
+        }
+        last = t->ts;
+        ntimer_disarm(t);
+    }
+    if (left || ntimer_next_ts() >= 0) {
+        fprintf(stderr, "%zu timers were not popped\n", left);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}